@@ -0,0 +1,179 @@
+/* linkbench.c  :  This program measures the serial link to the
+ * FPGA.  It runs the serial_fpga bench resource for reads and writes
+ * of 1 to 8 registers, sent one at a time, in batches, and pipelined,
+ * at each baud rate given.  The transactions per second and the p50,
+ * p99, and max round trip times in us are printed as CSV so runs can
+ * be compared from release to release.
+ *
+ * Build with: gcc -o linkbench linkbench.c
+ * Be sure hbaserver is running and listening on port 8870
+ *
+ * Usage: linkbench [-b baud,baud,...] [-n count] -c core -r reg
+ *   -b : baud rates to test.  Default is the standard rates from
+ *        1200 to 3000000.  FPGAs before protocol revision 8 only work
+ *        at the rate they were built for.  Later ones and the pty
+ *        emulator switch to each rate with the host.
+ *   -n : transactions per test at 115200 baud.  Scaled with the baud
+ *        rate and never less than 20.  Default 1000.
+ *   -c, -r : the core and first register to use.  There is no
+ *        default.  Writes put back what was there but a live
+ *        register, say a motor or the LEDs, moves while a test runs.
+ * The baud rate is put back as it was at the end.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>    /* for memset */
+#include <arpa/inet.h> /* for inet_addr() */
+
+
+#define MXRSP  1000
+
+static int hbacmd(int fd, char *cmd, char *rsp); // send a command, get the response
+
+static char *allbauds = "1200,1800,2400,4800,9600,19200,38400,57600,"
+                        "115200,230400,460800,500000,576000,921600,"
+                        "1000000,1500000,2000000,3000000";
+
+int main(int argc, char *argv[])
+{
+    int  cmdfd;             // FD for commands to hbaserver
+    struct sockaddr_in skt; // network address for hbaserver
+    int  adrlen;
+    char *bauds = allbauds; // comma separated baud rates to test
+    int  count = 1000;      // transactions per test at 115200
+    int  core = -1;         // core and register to use
+    int  reg = -1;
+    char cmd[MXRSP];
+    char rsp[MXRSP];
+    char *pbaud;
+    char *modes[] = { "single", "batch", "pipe" };
+    int  baud0;             // baud rate to put back at the end
+    int  baud;
+    int  n;
+    int  m;
+    int  w;
+    int  len;
+    int  opt;
+    int  err;               // ==-1 if hbaserver gave an error
+    int  i;
+
+    while ((opt = getopt(argc, argv, "b:n:c:r:")) != -1) {
+        switch (opt) {
+            case 'b' : bauds = optarg; break;
+            case 'n' : count = atoi(optarg); break;
+            case 'c' : core = atoi(optarg); break;
+            case 'r' : reg = atoi(optarg); break;
+            default :
+                fprintf(stderr, "usage: %s [-b baud,baud,...] [-n count] "
+                        "-c core -r reg\n", argv[0]);
+                exit(1);
+        }
+    }
+    if ((core < 0) || (reg < 0)) {
+        fprintf(stderr, "usage: %s [-b baud,baud,...] [-n count] "
+                "-c core -r reg\n", argv[0]);
+        exit(1);
+    }
+
+    // Open connection to hbaserver daemon
+    adrlen = sizeof(struct sockaddr_in);
+    (void) memset((void *) &skt, 0, (size_t) adrlen);
+    skt.sin_family = AF_INET;
+    skt.sin_port = htons(8870);
+    if ((inet_aton("127.0.0.1", &(skt.sin_addr)) == 0) ||
+        ((cmdfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) ||
+        (connect(cmdfd, (struct sockaddr *) &skt, adrlen) < 0)) {
+        printf("Error: unable to connect to hbaserver.\n");
+        exit(-1);
+    }
+
+    if ((hbacmd(cmdfd, "hbaget serial_fpga config\n", rsp) < 0) ||
+        (sscanf(rsp, "%d", &baud0) != 1)) {
+        fprintf(stderr, "Error: unable to get the baud rate: %s", rsp);
+        exit(-1);
+    }
+
+    printf("baud,mode,rw,len,count,errors,tps,p50_us,p99_us,max_us\n");
+    for (pbaud = bauds; pbaud != NULL; pbaud = strchr(pbaud, ',')) {
+        if (*pbaud == ',') {
+            pbaud++;
+        }
+        baud = atoi(pbaud);
+        sprintf(cmd, "hbaset serial_fpga config %d\n", baud);
+        if (hbacmd(cmdfd, cmd, rsp) < 0) {
+            fprintf(stderr, "%d: %s", baud, rsp);
+            continue;
+        }
+        n = (int) (((long long) count * baud) / 115200);
+        n = (n < 20) ? 20 : n;
+        for (m = 0; m < 3; m++) {
+            for (w = 0; w < 2; w++) {
+                for (len = 1; len <= 8; len++) {
+                    sprintf(cmd, "hbaset serial_fpga bench %s %c %d %d %d %d\n",
+                            modes[m], (w) ? 'w' : 'r', len, n, core, reg);
+                    if (hbacmd(cmdfd, cmd, rsp) < 0) {
+                        fprintf(stderr, "%d %s: %s", baud, modes[m], rsp);
+                        continue;
+                    }
+                    // The run goes on in the background.  Poll until done.
+                    do {
+                        usleep(100000);
+                        err = hbacmd(cmdfd, "hbaget serial_fpga bench\n", rsp);
+                    } while ((err == 0) && (strncmp(rsp, "running", 7) == 0));
+                    if (err < 0) {
+                        fprintf(stderr, "%d %s: %s", baud, modes[m], rsp);
+                        continue;
+                    }
+                    // One line of space separated fields to CSV
+                    for (i = 0; rsp[i] != 0; i++) {
+                        if (rsp[i] == ' ') {
+                            rsp[i] = ',';
+                        }
+                    }
+                    printf("%s", rsp);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    sprintf(cmd, "hbaset serial_fpga config %d\n", baud0);
+    (void) hbacmd(cmdfd, cmd, rsp);
+    close(cmdfd);
+    return(0);
+}
+
+/* hbacmd():  Send a command to hbaserver and collect the response up to
+ *     the prompt character '\'.  Returns -1 if the response is an error
+ *     message and 0 otherwise.  Exits if the connection goes down. */
+static int hbacmd(int fd, char *cmd, char *rsp)
+{
+    size_t count;          // number of chars in command to send
+    char   c;              // prompt or response character
+    int    retval;         // return value of read()
+    int    n = 0;          // number of chars in rsp
+
+    count = strlen(cmd);
+    if (write(fd, cmd, count) != (ssize_t) count)
+        exit(1);
+
+    while (1) {
+        retval = read(fd, &c, 1);
+        if (0 >= retval)
+            exit(1);       // did TCP conn go down?
+        else if ('\\' == c)
+            break;         // got a prompt char.  Done with command
+        else if (n < MXRSP - 1)
+            rsp[n++] = c;
+    }
+    rsp[n] = 0;
+    return((strncmp(rsp, "ERROR", 5) == 0) ? -1 : 0);
+}
@@ -48,6 +48,8 @@ int main()
     /* Setup peripherals */
     // XXX sndcmd(cmdfd, "hbaset serial_fpga port /dev/ttyUSB1\n");
     sndcmd(cmdfd, "hbaset hba_sonar ctrl 1\n");
+    // Answer our polls from the sonar interrupts, not the serial link
+    sndcmd(cmdfd, "hbaset hba_sonar maxage 100\n");
     sleep(1);
 
     /* Blink the LEDs */
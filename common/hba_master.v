@@ -24,7 +24,10 @@ module hba_master #
     parameter integer PERIPH_ADDR_WIDTH = 4,
     parameter integer REG_ADDR_WIDTH = 8,
     // Default ADDR_WIDTH = 12
-    parameter integer ADDR_WIDTH = PERIPH_ADDR_WIDTH + REG_ADDR_WIDTH
+    parameter integer ADDR_WIDTH = PERIPH_ADDR_WIDTH + REG_ADDR_WIDTH,
+    // Number of clocks to wait for hba_xferack before giving up
+    // on a transfer.  0 means wait forever.
+    parameter integer XFER_TIMEOUT = 0
 )
 (
     // App interface
@@ -35,6 +38,7 @@ module hba_master #
     input wire app_en_strobe,    // rising edge start state machine
     output reg [DBUS_WIDTH-1:0] app_data_out,
     output reg app_valid_out,    // read or write transfer complete. Assert one clock cycle.
+    output reg app_timeout_out,  // no slave replied.  Asserted with app_valid_out.
 
     // HBA Bus Master Interface
     input wire hba_clk,
@@ -75,6 +79,7 @@ reg [PERIPH_ADDR_WIDTH-1:0] app_core_addr_reg;
 reg [REG_ADDR_WIDTH-1:0] app_reg_addr_reg;
 reg [DBUS_WIDTH:0] app_data_in_reg;
 reg app_rnw_reg;
+reg [15:0] xfer_count;      // clocks spent waiting for hba_xferack
 
 // States
 localparam IDLE         = 0;
@@ -97,6 +102,8 @@ begin
 
         app_data_out <= 0;
         app_valid_out <= 0;
+        app_timeout_out <= 0;
+        xfer_count <= 0;
     end else begin
         case (hba_state)
             IDLE : begin
@@ -105,6 +112,7 @@ begin
                 hba_select_master <= 0;
                 hba_dbus_master <= 0;
                 app_valid_out <= 0;
+                app_timeout_out <= 0;
                 if (app_en_strobe) begin
                     // register the inputs
                     app_core_addr_reg <= app_core_addr;
@@ -121,6 +129,7 @@ begin
                     hba_rnw_master <= app_rnw_reg;
                     hba_dbus_master <= (app_rnw_reg) ? 0 : app_data_in_reg ;
                     hba_select_master <= 1;
+                    xfer_count <= 0;
                     hba_state <= XFER_WAIT;
                 end
             end
@@ -131,6 +140,16 @@ begin
                     app_valid_out <= 1;
                     hba_select_master <= 0;
                     hba_state <= IDLE;
+                end else if ((XFER_TIMEOUT != 0) &&
+                             (xfer_count == XFER_TIMEOUT-1)) begin
+                    // No slave at this address.  Give up.
+                    app_data_out <= 0;
+                    app_valid_out <= 1;
+                    app_timeout_out <= 1;
+                    hba_select_master <= 0;
+                    hba_state <= IDLE;
+                end else begin
+                    xfer_count <= xfer_count + 1;
                 end
             end
             default : begin
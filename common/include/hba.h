@@ -46,10 +46,69 @@
         // HBA protocol defines
 #define HBAERROR_NOSEND   (-1)
 #define HBAERROR_NORECV   (-2)
+#define HBAERROR_NACK     (-3)
 #define HBA_READ_CMD      (0x80)
 #define HBA_WRITE_CMD     (0x00)
-#define HBA_MXPKT         (16)
 #define HBA_ACK           (0xAC)
+#define HBA_NACK          (0x56)
+        // Extended commands use core ID 15 with an op code in place of the
+        // length.  They are followed by core, register, and length bytes.
+        // The FPGA reports support for them in the serial_fpga reg3.
+#define HBA_EXT_COREID    (15)
+#define HBA_EXT_BURST     (0x00)   // op code for a long burst
+#define HBA_EXT_POSTED    (0x01)   // op code for a write with no ACK
+#define HBA_EXT_EXCHANGE  (0x02)   // op code for a write then a read
+#define HBA_EXT_GATHER    (0x03)   // op code for reads from a list of cores
+#define HBA_PROTO_EXT     (1)      // reg3 protocol revision with bursts
+#define HBA_PROTO_POSTED  (2)      // reg3 protocol revision with posted writes
+#define HBA_PROTO_EXCHANGE (3)     // reg3 protocol revision with exchanges
+#define HBA_PROTO_GATHER  (4)      // reg3 protocol revision with gathers
+#define HBA_PROTO_PUSH    (5)      // reg3 protocol revision with push mode
+#define HBA_PROTO_RESYNC  (6)      // reg3 protocol revision with break resync
+#define HBA_PROTO_FRAMED  (7)      // reg3 protocol revision with CRC framing
+#define HBA_PROTO_BAUD    (8)      // reg3 protocol revision with baud switch
+#define HBA_PROTO_COALESCE (9)     // reg3 protocol revision with coalescing
+#define HBA_PROTO_DIRTY   (10)     // reg3 protocol revision with dirty pushes
+#define HBA_PROTO_SNAPSHOT (11)    // reg3 protocol revision with snapshots
+#define HBA_PROTO_REPLAY  (12)     // reg3 protocol revision with a response log
+        // A snapshot copies regN of the sensor cores to regN+HBA_SNAP_OFFSET
+        // on one clock so they can be read without disabling updates.
+#define HBA_SNAP_OFFSET   (8)
+        // In push mode the FPGA sends a frame of marker, core, length, and
+        // up to HBA_PUSH_MXWIN registers when a core interrupts.  A dirty
+        // frame has HBA_PUSH_DIRTY set in the core byte and sends the
+        // core's dirty map followed by only the registers it names.
+#define HBA_PUSH_MARK     (0x50)
+#define HBA_PUSH_MXWIN    (15)
+#define HBA_PUSH_DIRTY    (0x80)
+        // A framed packet that fails its CRC gets this instead of a
+        // response.  The FPGA then drops bytes until a break.
+#define HBA_FRAME_ERR     (0x5E)
+#define HBA_MXBURST       (255)
+        // Largest packet is a burst read:  4 byte header, 4 dummy
+        // bytes for the echoed header, and a dummy byte for each data byte.
+#define HBA_MXPKT         (8 + HBA_MXBURST + 1)
+
+/***************************************************************************
+ *  - Data structures
+ ***************************************************************************/
+    // One transfer in a call to sendrecv_batch().  The packet has the
+    // same format as for sendrecv_pkt() and is overwritten by the response.
+typedef struct
+{
+    uint8_t *pkt;      // packet to send.  Response on return
+    int      count;    // number of bytes to send
+    int      ret;      // number of response bytes or HBAERROR_xxx
+} HBA_XFER;
+
+    // One read in a call to sendrecv_gather().
+typedef struct
+{
+    int      core;     // core to read
+    int      reg;      // first register to read
+    int      count;    // number of registers to read
+    uint8_t *data;     // where to put the registers read
+} HBA_GATHER;
 
 /***************************************************************************
  *  - Functions
@@ -63,9 +63,13 @@
 #define FN_LEDS            "leds"
 #define FN_BUTTONS         "buttons"
 #define FN_INTR            "intr"
+#define FN_COALESCE        "coalesce"
+#define FN_TSTAMP          "tstamp"
 #define RSC_LEDS           0
 #define RSC_BUTTONS        1
 #define RSC_INTR           2
+#define RSC_COALESCE       3
+#define RSC_TSTAMP         4
         // What we are is a ...
 #define PLUGIN_NAME        "hba_basicio"
         // Default led value is zero, all leds off
@@ -74,6 +78,9 @@
 #define HBA_DEFINTR        0
         // Maximum size of input/output string
 #define MX_MSGLEN          120
+        // Largest interrupt coalescing count and time in us
+#define MX_COALCNT         (255)
+#define MX_COALUS          (65535)
 
 
 /**************************************************************
@@ -88,7 +95,14 @@ typedef struct
     int      leds;     // most recent value to display on leds
     int      buttons;  // most recent button state
     int      intr;     // Change at input generates an interrupt
+    int      coalcnt;  // interrupts the FPGA holds for us
+    int      coalus;   // longest the FPGA holds them in us
+    int      tstamp;    // ==1 to add the interrupt edge time to broadcasts
+    long long tedge;    // time in us of the edge for the last values
     int      (*sendrecv_pkt)();  // routine to send data to the FPGA
+    int      (*sendrecv_shadow)(); // routine to write control registers
+    int      (*intr_coalesce)(); // routine to set interrupt coalescing
+    long long (*intr_edge_time)(); // routine to get the interrupt edge time
 } HBA_BASICIO;
 
 
@@ -96,6 +110,7 @@ typedef struct
  *  - Function prototypes
  **************************************************************/
 static void usercmd(int, int, char*, SLOT*, int, int*, char*);
+static int  add_tstamp(HBA_BASICIO *, char *, int);
 extern SLOT Slots[];
 static void core_interrupt();
 
@@ -127,6 +142,10 @@ int Initialize(
     pctx->leds = HBA_DEFLEDS;          // most recent from to/from port
     pctx->buttons = 0xff;              // default no buttons pussed
     pctx->intr = HBA_DEFINTR;          // default interrupt enable
+    pctx->coalcnt = 0;                 // each interrupt comes right away
+    pctx->coalus = 0;
+    pctx->tstamp = 0;                  // broadcasts as before
+    pctx->tedge = 0;
 
     // Register name and private data
     pslot->name = PLUGIN_NAME;
@@ -153,6 +172,18 @@ int Initialize(
     pslot->rsc[RSC_INTR].pgscb = usercmd;
     pslot->rsc[RSC_INTR].uilock = -1;
     pslot->rsc[RSC_INTR].slot = pslot;
+    pslot->rsc[RSC_COALESCE].name = FN_COALESCE;
+    pslot->rsc[RSC_COALESCE].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_COALESCE].bkey = 0;
+    pslot->rsc[RSC_COALESCE].pgscb = usercmd;
+    pslot->rsc[RSC_COALESCE].uilock = -1;
+    pslot->rsc[RSC_COALESCE].slot = pslot;
+    pslot->rsc[RSC_TSTAMP].name = FN_TSTAMP;
+    pslot->rsc[RSC_TSTAMP].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_TSTAMP].bkey = 0;
+    pslot->rsc[RSC_TSTAMP].pgscb = usercmd;
+    pslot->rsc[RSC_TSTAMP].uilock = -1;
+    pslot->rsc[RSC_TSTAMP].slot = pslot;
 
     // The serial_fpga plug-in has a routine to send packets to the FPGA
     // and to return with packet data from the FPGA.  We need to look up
@@ -165,6 +196,14 @@ int Initialize(
     if (errmsg != NULL) {
         return(-1);
     }
+    // Control registers are written through the shadow register file
+    // with 'sendrecv_shadow' so a value the FPGA already has is not sent.
+    dlerror();                  /* Clear any existing error */
+    *(void **) (&(pctx->sendrecv_shadow)) = dlsym(Slots[pctx->parent].handle, "sendrecv_shadow");
+    errmsg = dlerror();         /* check for errors */
+    if (errmsg != NULL) {
+        return(-1);
+    }
 
     // The serial_fpga plug-in has a routine that responds to interrupts.
     // The routine polls the FPGA for its two interrupt pending registers.
@@ -183,6 +222,14 @@ int Initialize(
     }
 
 
+    // The FPGA can hold our interrupts and let them through in groups.
+    // Older serial_fpga plug-ins do not have 'intr_coalesce'.
+    *(void **) (&(pctx->intr_coalesce)) = dlsym(Slots[pctx->parent].handle, "intr_coalesce");
+
+    // Broadcasts can carry the time of the interrupt edge.  Older
+    // serial_fpga plug-ins do not have 'intr_edge_time'.
+    *(void **) (&(pctx->intr_edge_time)) = dlsym(Slots[pctx->parent].handle, "intr_edge_time");
+
     return (0);
 }
 
@@ -206,6 +253,9 @@ void usercmd(
     int       nintr=0;  // new interrupt enable setting for pins
     int       nsd;      // number of bytes sent to FPGA
     int       ret;      // generic call return value
+    int       ncnt;     // new coalescing count
+    int       nus;      // new coalescing time
+    int       ntstamp;  // ==1 to add edge times to broadcasts
     uint8_t   pkt[HBA_MXPKT];  
 
     // Get this instance of the plug-in
@@ -256,7 +306,7 @@ void usercmd(
         pkt[1] = HBA_BASICIO_REG_LEDS;
         pkt[2] = pctx->leds;                     // new value
         pkt[3] = 0;                             // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
@@ -266,6 +316,42 @@ void usercmd(
             return;
         }
     }
+    else if ((cmd == EDSET) && (rscid == RSC_COALESCE)) {
+        ret = sscanf(val, "%d %d", &ncnt, &nus);
+        if ((ret != 2) || (ncnt < 0) || (ncnt > MX_COALCNT) || (nus < 0) ||
+            (nus > MX_COALUS) || (pctx->intr_coalesce == 0)) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        // serial_fpga keeps the setting and sends it again if the
+        // FPGA is reloaded
+        if (pctx->intr_coalesce(pctx->parent, pctx->coreid, ncnt, nus) != 0) {
+            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        pctx->coalcnt = ncnt;
+        pctx->coalus = nus;
+    }
+    else if ((cmd == EDGET) && (rscid == RSC_COALESCE)) {
+        ret = snprintf(buf, *plen, "%d %d\n", pctx->coalcnt, pctx->coalus);
+        *plen = ret;  // (errors are handled in calling routine)
+    }
+    else if ((cmd == EDSET) && (rscid == RSC_TSTAMP)) {
+        ret = sscanf(val, "%d", &ntstamp);
+        if ((ret != 1) || (ntstamp < 0) || (ntstamp > 1) ||
+            ((ntstamp == 1) && (pctx->intr_edge_time == 0))) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        pctx->tstamp = ntstamp;
+    }
+    else if ((cmd == EDGET) && (rscid == RSC_TSTAMP)) {
+        ret = snprintf(buf, *plen, "%d\n", pctx->tstamp);
+        *plen = ret;  // (errors are handled in calling routine)
+    }
     else if ((cmd == EDSET) && (rscid == RSC_INTR)) {
         ret = sscanf(val, "%x", &nintr);
         if ((ret != 1) || (nintr < 0) || (nintr > 0x0f)) {
@@ -281,7 +367,7 @@ void usercmd(
         pkt[1] = HBA_BASICIO_REG_INTR;
         pkt[2] = pctx->intr;                    // new interrupt enable
         pkt[3] = 0;                             // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
@@ -329,15 +415,38 @@ void core_interrupt(void *trans)
         return;
     }
     pctx->buttons = pkt[2];   // first two bytes are echo of header
+    if (pctx->intr_edge_time != 0) {
+        pctx->tedge = pctx->intr_edge_time(pctx->parent);
+    }
 
     // Broadcast button value is any UI is monitoring it
     pslot = pctx->pslot;
     prsc = &(pslot->rsc[RSC_BUTTONS]);
     if (prsc->bkey != 0) {
         slen = snprintf(msg, (MX_MSGLEN -1), "%x\n", pctx->buttons);
+        slen = add_tstamp(pctx, msg, slen);
         bcst_ui(msg, slen, &(prsc->bkey));
     }
 }
 
 
+/**************************************************************
+ * add_tstamp():  - Put the time in us of the interrupt edge at
+ * the end of a broadcast line if the user asked for it.  Returns
+ * the new length of the line.
+ **************************************************************/
+static int add_tstamp(
+    HBA_BASICIO *pctx,     // this peripheral's private info
+    char      *msg,      // the line, ending in a newline
+    int        slen)     // length of the line
+{
+    if ((pctx->tstamp == 0) || (slen <= 0)) {
+        return(slen);
+    }
+    // Replace the newline with the time and a newline
+    return(slen - 1 + snprintf(&(msg[slen - 1]), (MX_MSGLEN - slen),
+                               " %lld\n", pctx->tedge));
+}
+
+
 // end of hba_basicio.c
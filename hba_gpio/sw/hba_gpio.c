@@ -60,9 +60,13 @@
 #define FN_VAL             "val"
 #define FN_DIR             "dir"
 #define FN_INTR            "intr"
+#define FN_COALESCE        "coalesce"
+#define FN_TSTAMP          "tstamp"
 #define RSC_VAL            0
 #define RSC_DIR            1
 #define RSC_INTR           2
+#define RSC_COALESCE       3
+#define RSC_TSTAMP         4
         // What we are is a ...
 #define PLUGIN_NAME        "hba_gpio"
         // Default data direction is zero, is all inputs
@@ -71,6 +75,9 @@
 #define HBA_DEFINTR        0
         // Maximum size of input/output string
 #define MX_MSGLEN          120
+        // Largest interrupt coalescing count and time in us
+#define MX_COALCNT         (255)
+#define MX_COALUS          (65535)
 
 
 /**************************************************************
@@ -85,7 +92,14 @@ typedef struct
     int      val;      // most recent value on gpio pins
     int      dir;      // GPIO data direction. 1==output
     int      intr;     // Change at input generates an interrupt
+    int      coalcnt;  // interrupts the FPGA holds for us
+    int      coalus;   // longest the FPGA holds them in us
+    int      tstamp;    // ==1 to add the interrupt edge time to broadcasts
+    long long tedge;    // time in us of the edge for the last values
     int      (*sendrecv_pkt)();  // routine to send data to the FPGA
+    int      (*sendrecv_shadow)(); // routine to write control registers
+    int      (*intr_coalesce)(); // routine to set interrupt coalescing
+    long long (*intr_edge_time)(); // routine to get the interrupt edge time
 } HBA_GPIO;
 
 
@@ -93,6 +107,7 @@ typedef struct
  *  - Function prototypes
  **************************************************************/
 static void usercmd(int, int, char*, SLOT*, int, int*, char*);
+static int  add_tstamp(HBA_GPIO *, char *, int);
 extern SLOT Slots[];
 static void core_interrupt();
 
@@ -107,6 +122,7 @@ int Initialize(
     HBA_GPIO *pctx;         // our local context
     const char *errmsg;     // error message from dlsym
     void        *reg_intr;  // use this to register and interrupt handler
+    void        *reg_restore; // use this to restore setup registers
 
     // Allocate memory for this plug-in
     pctx = (HBA_GPIO *) malloc(sizeof(HBA_GPIO));
@@ -124,6 +140,10 @@ int Initialize(
     pctx->val = 0;                  // most recent from to/from port
     pctx->dir = HBA_DEFDIR;         // default data direction rate
     pctx->intr = HBA_DEFINTR;       // default interrupt enable
+    pctx->coalcnt = 0;              // each interrupt comes right away
+    pctx->coalus = 0;
+    pctx->tstamp = 0;               // broadcasts as before
+    pctx->tedge = 0;
 
     // Register name and private data
     pslot->name = PLUGIN_NAME;
@@ -150,6 +170,18 @@ int Initialize(
     pslot->rsc[RSC_INTR].pgscb = usercmd;
     pslot->rsc[RSC_INTR].uilock = -1;
     pslot->rsc[RSC_INTR].slot = pslot;
+    pslot->rsc[RSC_COALESCE].name = FN_COALESCE;
+    pslot->rsc[RSC_COALESCE].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_COALESCE].bkey = 0;
+    pslot->rsc[RSC_COALESCE].pgscb = usercmd;
+    pslot->rsc[RSC_COALESCE].uilock = -1;
+    pslot->rsc[RSC_COALESCE].slot = pslot;
+    pslot->rsc[RSC_TSTAMP].name = FN_TSTAMP;
+    pslot->rsc[RSC_TSTAMP].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_TSTAMP].bkey = 0;
+    pslot->rsc[RSC_TSTAMP].pgscb = usercmd;
+    pslot->rsc[RSC_TSTAMP].uilock = -1;
+    pslot->rsc[RSC_TSTAMP].slot = pslot;
 
     // The serial_fpga plug-in has a routine to send packets to the FPGA
     // and to return with packet data from the FPGA.  We need to look up
@@ -162,6 +194,14 @@ int Initialize(
     if (errmsg != NULL) {
         return(-1);
     }
+    // Control registers are written through the shadow register file
+    // with 'sendrecv_shadow' so a value the FPGA already has is not sent.
+    dlerror();                  /* Clear any existing error */
+    *(void **) (&(pctx->sendrecv_shadow)) = dlsym(Slots[pctx->parent].handle, "sendrecv_shadow");
+    errmsg = dlerror();         /* check for errors */
+    if (errmsg != NULL) {
+        return(-1);
+    }
 
     // The serial_fpga plug-in has a routine that responds to interrupts.
     // The routine polls the FPGA for its two interrupt pending registers.
@@ -179,6 +219,23 @@ int Initialize(
         ((void (*)())reg_intr) (pctx->parent, pctx->coreid, &core_interrupt, (void *) pctx);
     }
 
+    // The pin directions and interrupt enables are written again if
+    // the FPGA is reloaded.  Output pin values are not.  Older
+    // serial_fpga plug-ins do not have 'register_shadow_restore'.
+    reg_restore = dlsym(Slots[pctx->parent].handle, "register_shadow_restore");
+    if (reg_restore != (void *) 0) {
+        ((void (*)())reg_restore) (pctx->parent, pctx->coreid, HBA_GPIO_REG_DIR, 1);
+        ((void (*)())reg_restore) (pctx->parent, pctx->coreid, HBA_GPIO_REG_INTR, 1);
+    }
+
+    // The FPGA can hold our interrupts and let them through in groups.
+    // Older serial_fpga plug-ins do not have 'intr_coalesce'.
+    *(void **) (&(pctx->intr_coalesce)) = dlsym(Slots[pctx->parent].handle, "intr_coalesce");
+
+    // Broadcasts can carry the time of the interrupt edge.  Older
+    // serial_fpga plug-ins do not have 'intr_edge_time'.
+    *(void **) (&(pctx->intr_edge_time)) = dlsym(Slots[pctx->parent].handle, "intr_edge_time");
+
     return (0);
 }
 
@@ -201,6 +258,9 @@ void usercmd(
     int       nintr=0;  // new interrupt enable setting for pins
     int       nsd;      // number of bytes sent to FPGA
     int       ret;      // generic call return value
+    int       ncnt;     // new coalescing count
+    int       nus;      // new coalescing time
+    int       ntstamp;  // ==1 to add edge times to broadcasts
     uint8_t   pkt[HBA_MXPKT];  
 
     // Get this instance of the plug-in
@@ -251,7 +311,7 @@ void usercmd(
         pkt[1] = HBA_GPIO_REG_VAL;
         pkt[2] = pctx->val;                     // new value
         pkt[3] = 0;                             // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
@@ -275,7 +335,7 @@ void usercmd(
         pkt[1] = HBA_GPIO_REG_DIR;
         pkt[2] = pctx->dir;                     // new direction
         pkt[3] = 0;                             // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
@@ -284,6 +344,42 @@ void usercmd(
             *plen = ret;
         }
     }
+    else if ((cmd == EDSET) && (rscid == RSC_COALESCE)) {
+        ret = sscanf(val, "%d %d", &ncnt, &nus);
+        if ((ret != 2) || (ncnt < 0) || (ncnt > MX_COALCNT) || (nus < 0) ||
+            (nus > MX_COALUS) || (pctx->intr_coalesce == 0)) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        // serial_fpga keeps the setting and sends it again if the
+        // FPGA is reloaded
+        if (pctx->intr_coalesce(pctx->parent, pctx->coreid, ncnt, nus) != 0) {
+            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        pctx->coalcnt = ncnt;
+        pctx->coalus = nus;
+    }
+    else if ((cmd == EDGET) && (rscid == RSC_COALESCE)) {
+        ret = snprintf(buf, *plen, "%d %d\n", pctx->coalcnt, pctx->coalus);
+        *plen = ret;  // (errors are handled in calling routine)
+    }
+    else if ((cmd == EDSET) && (rscid == RSC_TSTAMP)) {
+        ret = sscanf(val, "%d", &ntstamp);
+        if ((ret != 1) || (ntstamp < 0) || (ntstamp > 1) ||
+            ((ntstamp == 1) && (pctx->intr_edge_time == 0))) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        pctx->tstamp = ntstamp;
+    }
+    else if ((cmd == EDGET) && (rscid == RSC_TSTAMP)) {
+        ret = snprintf(buf, *plen, "%d\n", pctx->tstamp);
+        *plen = ret;  // (errors are handled in calling routine)
+    }
     else if ((cmd == EDSET) && (rscid == RSC_INTR)) {
         ret = sscanf(val, "%x", &nintr);
         if ((ret != 1) || (nintr < 0) || (nintr > 0x0f)) {
@@ -299,7 +395,7 @@ void usercmd(
         pkt[1] = HBA_GPIO_REG_INTR;
         pkt[2] = pctx->intr;                    // new interrupt enable
         pkt[3] = 0;                             // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
@@ -346,15 +442,38 @@ void core_interrupt(void *trans)
         return;
     }
     pctx->val = pkt[2];   // first two bytes are echo of header
+    if (pctx->intr_edge_time != 0) {
+        pctx->tedge = pctx->intr_edge_time(pctx->parent);
+    }
 
     // Broadcast value if any UI is monitoring it
     pslot = pctx->pslot;
     prsc = &(pslot->rsc[RSC_VAL]);
     if (prsc->bkey != 0) {
         slen = snprintf(msg, (MX_MSGLEN -1), "%x\n", pctx->val);
+        slen = add_tstamp(pctx, msg, slen);
         bcst_ui(msg, slen, &(prsc->bkey));
     }
 }
 
 
+/**************************************************************
+ * add_tstamp():  - Put the time in us of the interrupt edge at
+ * the end of a broadcast line if the user asked for it.  Returns
+ * the new length of the line.
+ **************************************************************/
+static int add_tstamp(
+    HBA_GPIO  *pctx,     // this peripheral's private info
+    char      *msg,      // the line, ending in a newline
+    int        slen)     // length of the line
+{
+    if ((pctx->tstamp == 0) || (slen <= 0)) {
+        return(slen);
+    }
+    // Replace the newline with the time and a newline
+    return(slen - 1 + snprintf(&(msg[slen - 1]), (MX_MSGLEN - slen),
+                               " %lld\n", pctx->tedge));
+}
+
+
 // end of hba_gpio.c
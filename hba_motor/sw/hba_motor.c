@@ -110,6 +110,7 @@ typedef struct
     int      motor0;   // most recent motor0 value
     int      motor1;   // most recent motor. value
     int      (*sendrecv_pkt)();  // routine to send data to the FPGA
+    int      (*sendrecv_shadow)(); // routine to write control registers
 } HBA_MOTOR;
 
 
@@ -186,6 +187,14 @@ int Initialize(
     if (errmsg != NULL) {
         return(-1);
     }
+    // Control registers are written through the shadow register file
+    // with 'sendrecv_shadow' so a value the FPGA already has is not sent.
+    dlerror();                  /* Clear any existing error */
+    *(void **) (&(pctx->sendrecv_shadow)) = dlsym(Slots[pctx->parent].handle, "sendrecv_shadow");
+    errmsg = dlerror();         /* check for errors */
+    if (errmsg != NULL) {
+        return(-1);
+    }
 
     return (0);
 }
@@ -283,7 +292,7 @@ void usercmd(
         pkt[1] = HBA_MOTOR_REG_MODE;
         pkt[2] = pctx->mode;                     // new value
         pkt[3] = 0;                             // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
@@ -314,7 +323,7 @@ void usercmd(
         pkt[1] = HBA_MOTOR_REG_MOTOR0;
         pkt[2] = pctx->motor0;                     // new value
         pkt[3] = 0;                             // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
@@ -345,7 +354,7 @@ void usercmd(
         pkt[1] = HBA_MOTOR_REG_MOTOR1;
         pkt[2] = pctx->motor1;                     // new value
         pkt[3] = 0;                             // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
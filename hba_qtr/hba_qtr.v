@@ -66,6 +66,7 @@ module hba_qtr #
     input wire hba_select,      // Transfer in progress.
     input wire [ADDR_WIDTH-1:0] hba_abus, // The input address bus.
     input wire [DBUS_WIDTH-1:0] hba_dbus,  // The input data bus.
+    input wire hba_snapshot,    // Copy live registers to the snapshot registers.
 
     output wire [DBUS_WIDTH-1:0] hba_dbus_slave,   // The output data bus.
     output wire hba_xferack_slave,     // Acknowledge transfer requested. 
@@ -93,10 +94,17 @@ wire [DBUS_WIDTH-1:0] reg_ctrl;  // reg0: Control register
 wire [DBUS_WIDTH-1:0] reg_qtr0_in;  // reg1: qtr0 value
 wire [DBUS_WIDTH-1:0] reg_qtr1_in;  // reg2: qtr1 value
 
+// reg1 and reg2 as the host reads them.  hba_snapshot copies them
+// to reg9 and reg10.
+wire [DBUS_WIDTH-1:0] reg_qtr0;
+wire [DBUS_WIDTH-1:0] reg_qtr1;
+
 wire [DBUS_WIDTH-1:0] reg_period;  // reg3: Trigger period
 
 wire [DBUS_WIDTH-1:0] reg_thresh;  // reg4: max_threshold
 
+wire [DBUS_WIDTH-1:0] reg_dirty_in;  // reg5: Dirty map
+
 // Enables writing to slave registers.
 wire slv_wr_en;
 
@@ -122,14 +130,25 @@ wire intr_type = reg_ctrl[2];
 // Emergency Stop enable
 wire estop_en = reg_ctrl[3] && (intr_type==INTR_TYPE_THRESH);
 
-// Combine the two address banks.
+// Combine the three address banks.
 wire [DBUS_WIDTH-1:0] hba_dbus_slave0;
 wire [DBUS_WIDTH-1:0] hba_dbus_slave1;
+wire [DBUS_WIDTH-1:0] hba_dbus_slave2;
 wire hba_xferack_slave0;
 wire hba_xferack_slave1;
+wire hba_xferack_slave2;
 
-assign hba_dbus_slave = hba_dbus_slave0 | hba_dbus_slave1;
-assign hba_xferack_slave = hba_xferack_slave0 | hba_xferack_slave1;
+assign hba_dbus_slave = hba_dbus_slave0 | hba_dbus_slave1 | hba_dbus_slave2;
+assign hba_xferack_slave = hba_xferack_slave0 | hba_xferack_slave1 |
+                           hba_xferack_slave2;
+
+// Dirty map.  Bit N is set when regN has changed since the map was
+// last read.  Reading the map clears the bits it returned.
+wire [3:0] dirty0;
+assign reg_dirty_in = {4'b0000, dirty0};
+wire dirty_rd = hba_xferack_slave1 & hba_rnw &
+                (hba_abus[REG_ADDR_WIDTH-1:0] == 5);
+wire [3:0] dirty_clr = (dirty_rd) ? hba_dbus_slave1[3:0] : 4'b0000;
 
 /*
 *****************************
@@ -160,8 +179,8 @@ hba_reg_bank #
 
     // Access to registgers
     .slv_reg0(reg_ctrl),
-    //.slv_reg1(),  
-    //.slv_reg2(),
+    .slv_reg1(reg_qtr0),
+    .slv_reg2(reg_qtr1),
     .slv_reg3(reg_period),
 
     // writeable registers
@@ -170,7 +189,10 @@ hba_reg_bank #
 
     .slv_wr_en(slv_wr_en),   // Assert to set slv_reg? <= slv_reg?_in
     .slv_wr_mask(4'b0110),    // 0010, means reg1,reg2 is writeable.
-    .slv_autoclr_mask(4'b0000)    // No autoclear
+    .slv_autoclr_mask(4'b0000),    // No autoclear
+
+    .slv_dirty(dirty0),
+    .slv_dirty_clr(dirty_clr)
 );
 
 hba_reg_bank #
@@ -197,16 +219,46 @@ hba_reg_bank #
 
     // Access to registgers
     .slv_reg0(reg_thresh),    // reg4: reg_thresh (cross for interrupt)
-    //.slv_reg1(),    // reg5: min_theshold (< interrupt)
+    //.slv_reg1(),
     //.slv_reg2(),
     //.slv_reg3(),
 
     // writeable registers
-    //.slv_reg1_in(reg_qtr0_in),
-    //.slv_reg2_in(reg_qtr1_in),
+    .slv_reg1_in(reg_dirty_in),  // reg5: dirty map
+
+    .slv_wr_en(1'b1),   // Follow the dirty bits every clock
+    .slv_wr_mask(4'b0010),    // 0010, means reg5 is writeable.
+    .slv_autoclr_mask(4'b0000)    // No autoclear
+);
+
+hba_reg_bank #
+(
+    .DBUS_WIDTH(DBUS_WIDTH),
+    .PERIPH_ADDR_WIDTH(PERIPH_ADDR_WIDTH),
+    .REG_ADDR_WIDTH(REG_ADDR_WIDTH),
+    .PERIPH_ADDR(PERIPH_ADDR),
+    .REG_OFFSET(8)
+) hba_reg_bank_inst2
+(
+    // HBA Bus Slave Interface
+    .hba_clk(hba_clk),
+    .hba_reset(hba_reset),
+    .hba_rnw(hba_rnw),         // 1=Read from register. 0=Write to register.
+    .hba_select(hba_select),      // Transfer in progress.
+    .hba_abus(hba_abus), // The input address bus.
+    .hba_dbus(hba_dbus),  // The input data bus.
+
+    .hba_dbus_slave(hba_dbus_slave2),   // The output data bus.
+    .hba_xferack_slave(hba_xferack_slave2),     // Acknowledge transfer requested. 
+                                    // Asserted when request has been completed. 
+                                    // Must be zero when inactive.
+
+    // writeable registers
+    .slv_reg1_in(reg_qtr0),  // reg9: snapshot of reg1
+    .slv_reg2_in(reg_qtr1),  // reg10: snapshot of reg2
 
-    .slv_wr_en(1'b0),   // No writable registers
-    .slv_wr_mask(4'b0000),    // 0000, no writable registers
+    .slv_wr_en(hba_snapshot),   // Copy on the snapshot strobe
+    .slv_wr_mask(4'b0110),    // 0110, means reg9,reg10 is writeable.
     .slv_autoclr_mask(4'b0000)    // No autoclear
 );
 
@@ -8,6 +8,7 @@
  *    qtr       -  Read the QTR values
  *    period    -  Sets the trigger period.
  *    thresh    -  Value change across this thresh cause an interrupt.
+ *    maxage    -  Read from the last interrupt if this recent, in ms
  */
 
 /*
@@ -57,6 +58,7 @@
 #include <sys/types.h>
 #include <limits.h>              // for PATH_MAX
 #include <termios.h>
+#include <time.h>
 #include <dlfcn.h>
 #include "eedd.h"
 #include "hba.h"
@@ -73,16 +75,23 @@
 #define HBA_QTR_REG_QTR1    (2)
 #define HBA_QTR_REG_PERIOD  (3)
 #define HBA_QTR_REG_THRESH  (4)
+#define HBA_QTR_REG_DIRTY   (5)
         // resource names and numbers
 #define FN_CTRL         "ctrl"
 #define FN_QTR          "qtr"
 #define FN_PERIOD       "period"
 #define FN_THRESH       "thresh"
+#define FN_MAXAGE       "maxage"
+#define FN_COALESCE     "coalesce"
+#define FN_TSTAMP       "tstamp"
 
 #define RSC_CTRL        0
 #define RSC_QTR         1
 #define RSC_PERIOD      2
 #define RSC_THRESH      3
+#define RSC_MAXAGE      4
+#define RSC_COALESCE    5
+#define RSC_TSTAMP      6
 
         // What we are is a ...
 #define PLUGIN_NAME        "hba_qtr"
@@ -90,6 +99,11 @@
 #define HBA_DEFVAL        0
         // Maximum size of input/output string
 #define MX_MSGLEN          120
+        // Largest interrupt coalescing count and time in us
+#define MX_COALCNT         (255)
+#define MX_COALUS          (65535)
+        // Longest maxage in ms
+#define MX_MAXAGE          (60000)
 
 
 /**************************************************************
@@ -106,7 +120,17 @@ typedef struct
     int      qtr1;      // most recent qtr1 value
     int      period;    // the trigger period, resolution 50ms.
     int      thresh;    // Interrupt threshold
+    int      maxage;    // use the interrupt values if this recent, in ms
+    long long tintr;    // time in ms of the last interrupt values
+    int      coalcnt;   // interrupts the FPGA holds for us
+    int      coalus;    // longest the FPGA holds them in us
+    int      tstamp;    // ==1 to add the interrupt edge time to broadcasts
+    long long tedge;    // time in us of the edge for the last values
     int      (*sendrecv_pkt)();  // routine to send data to the FPGA
+    int      (*sendrecv_shadow)(); // routine to write control registers
+    int      (*intr_coalesce)(); // routine to set interrupt coalescing
+    long long (*intr_edge_time)(); // routine to get the interrupt edge time
+    int      (*sendrecv_async)(); // routine to queue data for the FPGA
 } HBA_QTR;
 
 
@@ -114,8 +138,12 @@ typedef struct
  *  - Function prototypes
  **************************************************************/
 static void usercmd(int, int, char*, SLOT*, int, int*, char*);
+static int  add_tstamp(HBA_QTR *, char *, int);
 extern SLOT Slots[];
 static void core_interrupt();
+static void intr_done(void *, int, uint8_t *);
+static int  fresh(HBA_QTR *);
+static long long now_ms(void);
 
 
 /**************************************************************
@@ -128,6 +156,9 @@ int Initialize(
     HBA_QTR *pctx;  // our local context
     const char *errmsg; // error message from dlsym
     void        *reg_intr;  // use this to register and interrupt handler
+    void        *reg_push;  // use this to register a push window
+    void        *reg_dirty; // use this to push only changed registers
+    void        *reg_restore; // use this to restore setup registers
 
     // Allocate memory for this plug-in
     pctx = (HBA_QTR *) malloc(sizeof(HBA_QTR));
@@ -147,6 +178,12 @@ int Initialize(
     pctx->qtr1 = HBA_DEFVAL;       // default qtr1 value.
     pctx->period = HBA_DEFVAL;     // default period value.
     pctx->thresh = HBA_DEFVAL;     // default thresh value.
+    pctx->maxage = 0;              // always read the FPGA
+    pctx->tintr = 0;               // no interrupt yet
+    pctx->coalcnt = 0;             // each interrupt comes right away
+    pctx->coalus = 0;
+    pctx->tstamp = 0;              // broadcasts as before
+    pctx->tedge = 0;
 
     // Register name and private data
     pslot->name = PLUGIN_NAME;
@@ -177,6 +214,24 @@ int Initialize(
     pslot->rsc[RSC_PERIOD].uilock = -1;
 
     pslot->rsc[RSC_THRESH].slot = pslot;
+    pslot->rsc[RSC_MAXAGE].name = FN_MAXAGE;
+    pslot->rsc[RSC_MAXAGE].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_MAXAGE].bkey = 0;
+    pslot->rsc[RSC_MAXAGE].pgscb = usercmd;
+    pslot->rsc[RSC_MAXAGE].uilock = -1;
+    pslot->rsc[RSC_MAXAGE].slot = pslot;
+    pslot->rsc[RSC_COALESCE].name = FN_COALESCE;
+    pslot->rsc[RSC_COALESCE].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_COALESCE].bkey = 0;
+    pslot->rsc[RSC_COALESCE].pgscb = usercmd;
+    pslot->rsc[RSC_COALESCE].uilock = -1;
+    pslot->rsc[RSC_COALESCE].slot = pslot;
+    pslot->rsc[RSC_TSTAMP].name = FN_TSTAMP;
+    pslot->rsc[RSC_TSTAMP].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_TSTAMP].bkey = 0;
+    pslot->rsc[RSC_TSTAMP].pgscb = usercmd;
+    pslot->rsc[RSC_TSTAMP].uilock = -1;
+    pslot->rsc[RSC_TSTAMP].slot = pslot;
     pslot->rsc[RSC_THRESH].name = FN_THRESH;
     pslot->rsc[RSC_THRESH].flags = IS_READABLE | IS_WRITABLE;
     pslot->rsc[RSC_THRESH].bkey = 0;
@@ -194,6 +249,21 @@ int Initialize(
     if (errmsg != NULL) {
         return(-1);
     }
+    // Control registers are written through the shadow register file
+    // with 'sendrecv_shadow' so a value the FPGA already has is not sent.
+    dlerror();                  /* Clear any existing error */
+    *(void **) (&(pctx->sendrecv_shadow)) = dlsym(Slots[pctx->parent].handle, "sendrecv_shadow");
+    errmsg = dlerror();         /* check for errors */
+    if (errmsg != NULL) {
+        return(-1);
+    }
+    // The interrupt handler queues its read with 'sendrecv_async'
+    dlerror();                  /* Clear any existing error */
+    *(void **) (&(pctx->sendrecv_async)) = dlsym(Slots[pctx->parent].handle, "sendrecv_async");
+    errmsg = dlerror();         /* check for errors */
+    if (errmsg != NULL) {
+        return(-1);
+    }
 
     // The serial_fpga plug-in has a routine that responds to interrupts.
     // The routine polls the FPGA for its two interrupt pending registers.
@@ -211,6 +281,37 @@ int Initialize(
         ((void (*)())reg_intr) (pctx->parent, pctx->coreid, &core_interrupt, (void *) pctx);
     }
 
+    // In push mode the FPGA sends the registers with the interrupt.
+    // Tell serial_fpga which registers intr_done() wants.
+    reg_push = dlsym(Slots[pctx->parent].handle, "register_push_window");
+    if (reg_push != (void *) 0) {
+        ((void (*)())reg_push) (pctx->parent, pctx->coreid, HBA_QTR_REG_QTR0, 2, &intr_done);
+    }
+
+    // The FPGA can leave out the window registers that have not changed
+    // since the last push.  Older serial_fpga plug-ins do not have
+    // 'register_push_dirty'.
+    reg_dirty = dlsym(Slots[pctx->parent].handle, "register_push_dirty");
+    if ((reg_push != (void *) 0) && (reg_dirty != (void *) 0)) {
+        ((void (*)())reg_dirty) (pctx->parent, pctx->coreid, HBA_QTR_REG_DIRTY);
+    }
+
+    // The setup registers are written again if the FPGA is reloaded.
+    // Older serial_fpga plug-ins do not have 'register_shadow_restore'.
+    reg_restore = dlsym(Slots[pctx->parent].handle, "register_shadow_restore");
+    if (reg_restore != (void *) 0) {
+        ((void (*)())reg_restore) (pctx->parent, pctx->coreid, HBA_QTR_REG_CTRL, 1);
+        ((void (*)())reg_restore) (pctx->parent, pctx->coreid, HBA_QTR_REG_PERIOD, 2);
+    }
+
+    // The FPGA can hold our interrupts and let them through in groups.
+    // Older serial_fpga plug-ins do not have 'intr_coalesce'.
+    *(void **) (&(pctx->intr_coalesce)) = dlsym(Slots[pctx->parent].handle, "intr_coalesce");
+
+    // Broadcasts can carry the time of the interrupt edge.  Older
+    // serial_fpga plug-ins do not have 'intr_edge_time'.
+    *(void **) (&(pctx->intr_edge_time)) = dlsym(Slots[pctx->parent].handle, "intr_edge_time");
+
     return (0);
 }
 
@@ -231,6 +332,9 @@ void usercmd(
     int       nval=0;   // new value for a register
     int       nsd;      // number of bytes sent to FPGA
     int       ret;      // generic call return value
+    int       ncnt;     // new coalescing count
+    int       nus;      // new coalescing time
+    int       ntstamp;  // ==1 to add edge times to broadcasts
     uint8_t   pkt[HBA_MXPKT];
 
     // Get this instance of the plug-in
@@ -256,7 +360,7 @@ void usercmd(
         pkt[1] = HBA_QTR_REG_CTRL;
         pkt[2] = pctx->ctrl;                     // new value
         pkt[3] = 0;                             // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
@@ -267,6 +371,10 @@ void usercmd(
     } else if ((cmd == EDGET) && (rscid == RSC_CTRL)) {
         ret = snprintf(buf, *plen, "%x\n", pctx->ctrl);
         *plen = ret;  // (errors are handled in calling routine)
+    } else if ((cmd == EDGET) && (rscid == RSC_QTR) && fresh(pctx)) {
+        // The last interrupt is recent enough.  No need to ask the FPGA.
+        ret = snprintf(buf, *plen, "%02x %02x\n", pctx->qtr0, pctx->qtr1);
+        *plen = ret;  // (errors are handled in calling routine)
     } else if ((cmd == EDGET) && (rscid == RSC_QTR)) {
         // Read both qtr0 and qtr1 values. 2 registers in all
         pkt[0] = HBA_READ_CMD | ((2 -1) << 4) | pctx->coreid;
@@ -310,7 +418,7 @@ void usercmd(
         pkt[1] = HBA_QTR_REG_PERIOD;
         pkt[2] = pctx->period;                     // new value
         pkt[3] = 0;                             // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
@@ -341,7 +449,7 @@ void usercmd(
         pkt[1] = HBA_QTR_REG_THRESH;
         pkt[2] = pctx->thresh;                     // new value
         pkt[3] = 0;                                // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
@@ -352,6 +460,49 @@ void usercmd(
     } else if ((cmd == EDGET) && (rscid == RSC_THRESH)) {
         ret = snprintf(buf, *plen, "%x\n", pctx->thresh);
         *plen = ret;  // (errors are handled in calling routine)
+    } else if ((cmd == EDSET) && (rscid == RSC_COALESCE)) {
+        ret = sscanf(val, "%d %d", &ncnt, &nus);
+        if ((ret != 2) || (ncnt < 0) || (ncnt > MX_COALCNT) || (nus < 0) ||
+            (nus > MX_COALUS) || (pctx->intr_coalesce == 0)) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        // serial_fpga keeps the setting and sends it again if the
+        // FPGA is reloaded
+        if (pctx->intr_coalesce(pctx->parent, pctx->coreid, ncnt, nus) != 0) {
+            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        pctx->coalcnt = ncnt;
+        pctx->coalus = nus;
+    } else if ((cmd == EDGET) && (rscid == RSC_COALESCE)) {
+        ret = snprintf(buf, *plen, "%d %d\n", pctx->coalcnt, pctx->coalus);
+        *plen = ret;  // (errors are handled in calling routine)
+    } else if ((cmd == EDSET) && (rscid == RSC_TSTAMP)) {
+        ret = sscanf(val, "%d", &ntstamp);
+        if ((ret != 1) || (ntstamp < 0) || (ntstamp > 1) ||
+            ((ntstamp == 1) && (pctx->intr_edge_time == 0))) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        pctx->tstamp = ntstamp;
+    } else if ((cmd == EDGET) && (rscid == RSC_TSTAMP)) {
+        ret = snprintf(buf, *plen, "%d\n", pctx->tstamp);
+        *plen = ret;  // (errors are handled in calling routine)
+    } else if ((cmd == EDSET) && (rscid == RSC_MAXAGE)) {
+        ret = sscanf(val, "%d", &nval);
+        if ((ret != 1) || (nval < 0) || (nval > MX_MAXAGE)) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;
+            return;
+        }
+        pctx->maxage = nval;
+    } else if ((cmd == EDGET) && (rscid == RSC_MAXAGE)) {
+        ret = snprintf(buf, *plen, "%d\n", pctx->maxage);
+        *plen = ret;  // (errors are handled in calling routine)
     }
 
     // Nothing to do here if edcat.  That is handled in the UI code
@@ -366,14 +517,7 @@ void usercmd(
 void core_interrupt(void *trans)
 {
     HBA_QTR     *pctx;       // this peripheral's private info
-    SLOT        *pslot;      // This instance of the serial plug-in
-    RSC         *prsc;       // pointer to this slot's counts resource
-    int          nsd;        // number of bytes sent to FPGA
     uint8_t      pkt[HBA_MXPKT];  
-    char         msg[MX_MSGLEN * 3 +1]; // text to send.  +1 for newline
-    int          slen;       // length of text to output
-    int          newqtr0;
-    int          newqtr1;
 
     // get pointers to this instance of the plug-in and its slot
     pctx = (HBA_QTR *) trans; // transparent data is our context
@@ -387,13 +531,40 @@ void core_interrupt(void *trans)
     pkt[4] = 0;                     // dummy byte (qtr0)
     pkt[5] = 0;                     // dummy byte (qtr1)
 
-    nsd = pctx->sendrecv_pkt(pctx->parent, 6, pkt);
+    // The values are broadcast from intr_done() when they arrive
+    if (pctx->sendrecv_async(pctx->parent, 6, pkt, intr_done, trans) < 0) {
+        edlog("Error reading values from QTR");
+    }
+}
+
+
+/**************************************************************
+ * intr_done():  - the registers read by core_interrupt() are in
+ **************************************************************/
+static void intr_done(
+    void        *trans,      // our context (==*HBA_QTR)
+    int          nsd,        // number of bytes received from FPGA
+    uint8_t     *pkt)        // the response
+{
+    HBA_QTR     *pctx;       // this peripheral's private info
+    SLOT        *pslot;      // This instance of the serial plug-in
+    RSC         *prsc;       // pointer to this slot's counts resource
+    char         msg[MX_MSGLEN * 3 +1]; // text to send.  +1 for newline
+    int          slen;       // length of text to output
+    int          newqtr0;
+    int          newqtr1;
+
+    pctx = (HBA_QTR *) trans; // transparent data is our context
+
     // We sent header + four bytes so the sendrecv return value should be 4
     if (nsd != 4) {
         // error reading value from QTR port
         edlog("Error reading values from QTR");
         return;
     }
+    if (pctx->intr_edge_time != 0) {
+        pctx->tedge = pctx->intr_edge_time(pctx->parent);
+    }
     newqtr0 = pkt[2];   // first two bytes are echo of header
     newqtr1 = pkt[3];   // first two bytes are echo of header
 
@@ -403,11 +574,57 @@ void core_interrupt(void *trans)
         prsc = &(pslot->rsc[RSC_QTR]);
         if (prsc->bkey != 0) {
             slen = snprintf(msg, (MX_MSGLEN -1), "%02x %02x\n", newqtr0, newqtr1);
+            slen = add_tstamp(pctx, msg, slen);
             bcst_ui(msg, slen, &(prsc->bkey));
         }
     }
     pctx->qtr0 = newqtr0;
     pctx->qtr1 = newqtr1;
+    pctx->tintr = now_ms();
+}
+
+
+/**************************************************************
+ * fresh():  - Returns 1 if the values from the last interrupt are
+ * no older than maxage ms.  Reads can then be answered without
+ * asking the FPGA.
+ **************************************************************/
+static int fresh(
+    HBA_QTR  *pctx)      // our private info
+{
+    return((pctx->maxage > 0) && (pctx->tintr != 0) &&
+           ((now_ms() - pctx->tintr) <= pctx->maxage));
+}
+
+
+/**************************************************************
+ * now_ms():  - The monotonic time in ms
+ **************************************************************/
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((ts.tv_sec * 1000LL) + (ts.tv_nsec / 1000000));
+}
+
+
+/**************************************************************
+ * add_tstamp():  - Put the time in us of the interrupt edge at
+ * the end of a broadcast line if the user asked for it.  Returns
+ * the new length of the line.
+ **************************************************************/
+static int add_tstamp(
+    HBA_QTR   *pctx,     // this peripheral's private info
+    char      *msg,      // the line, ending in a newline
+    int        slen)     // length of the line
+{
+    if ((pctx->tstamp == 0) || (slen <= 0)) {
+        return(slen);
+    }
+    // Replace the newline with the time and a newline
+    return(slen - 1 + snprintf(&(msg[slen - 1]), (MX_MSGLEN - slen),
+                               " %lld\n", pctx->tedge));
 }
 
 
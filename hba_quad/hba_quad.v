@@ -11,7 +11,9 @@
 * updates before reading the encoder values.  Then re-enable
 * encoder updates after the values are read.  The encoder
 * counts will still be updated internally only the updating
-* to the register bank is disabled.
+* to the register bank is disabled.  Or pulse hba_snapshot and
+* read the copies in reg9 to reg14, which are all taken on
+* the same clock.
 *
 * See the README.md for information about the register interface.
 *
@@ -67,6 +69,7 @@ module hba_quad #
     input wire hba_select,      // Transfer in progress.
     input wire [ADDR_WIDTH-1:0] hba_abus, // The input address bus.
     input wire [DBUS_WIDTH-1:0] hba_dbus,  // The input data bus.
+    input wire hba_snapshot,    // Copy live registers to the snapshot registers.
 
     output wire [DBUS_WIDTH-1:0] hba_dbus_slave,   // The output data bus.
     output wire hba_xferack_slave,     // Acknowledge transfer requested. 
@@ -100,6 +103,21 @@ wire [DBUS_WIDTH-1:0] reg_quad0_hi_in;  // reg2: Upper 8-bit of quad0
 wire [DBUS_WIDTH-1:0] reg_quad1_low_in; // reg3: Lower 8-bits of quad1
 wire [DBUS_WIDTH-1:0] reg_quad1_hi_in;  // reg4: Upper 8-bit of quad1
 
+// reg1 to reg6 as the host reads them.  hba_snapshot copies them
+// to reg9 to reg14.
+wire [DBUS_WIDTH-1:0] reg_quad0_low;
+wire [DBUS_WIDTH-1:0] reg_quad0_hi;
+wire [DBUS_WIDTH-1:0] reg_quad1_low;
+wire [DBUS_WIDTH-1:0] reg_quad1_hi;
+wire [DBUS_WIDTH-1:0] reg_speed_left;
+wire [DBUS_WIDTH-1:0] reg_speed_right;
+
+// reg9 to reg11 share a bank with the dirty map, which is written
+// every clock, so they hold their value until the strobe.
+wire [DBUS_WIDTH-1:0] reg_snap1;
+wire [DBUS_WIDTH-1:0] reg_snap2;
+wire [DBUS_WIDTH-1:0] reg_snap3;
+
 
 // Enables writing to slave registers.
 wire slv_wr_en;
@@ -137,9 +155,26 @@ wire right_dir;
 wire [DBUS_WIDTH-1:0] hba_dbus_slave1;
 wire hba_xferack_slave1;
 
-// Combine the two address banks.
-assign hba_dbus_slave = hba_dbus_slave0 | hba_dbus_slave1;
-assign hba_xferack_slave = hba_xferack_slave0 | hba_xferack_slave1;
+// Dirty map and snapshots
+wire [DBUS_WIDTH-1:0] hba_dbus_slave2;
+wire hba_xferack_slave2;
+wire [DBUS_WIDTH-1:0] hba_dbus_slave3;
+wire hba_xferack_slave3;
+
+// Combine the four address banks.
+assign hba_dbus_slave = hba_dbus_slave0 | hba_dbus_slave1 |
+                        hba_dbus_slave2 | hba_dbus_slave3;
+assign hba_xferack_slave = hba_xferack_slave0 | hba_xferack_slave1 |
+                           hba_xferack_slave2 | hba_xferack_slave3;
+
+// reg8: Dirty map.  Bit N is set when regN has changed since the map
+// was last read.  Reading the map clears the bits it returned.
+wire [3:0] dirty0;
+wire [3:0] dirty1;
+wire [DBUS_WIDTH-1:0] reg_dirty_in = {dirty1, dirty0};
+wire dirty_rd = hba_xferack_slave2 & hba_rnw &
+                (hba_abus[REG_ADDR_WIDTH-1:0] == 8);
+wire [DBUS_WIDTH-1:0] dirty_clr = (dirty_rd) ? hba_dbus_slave2 : 0;
 
 wire enc_reset = hba_reset | reg_reset_pos_edge;
 
@@ -175,9 +210,9 @@ hba_reg_bank #
 
     // Access to registgers
     .slv_reg0(reg_ctrl),
-    //.slv_reg1(),
-    //.slv_reg2(),
-    //.slv_reg3(),
+    .slv_reg1(reg_quad0_low),
+    .slv_reg2(reg_quad0_hi),
+    .slv_reg3(reg_quad1_low),
 
     // writeable registers
     .slv_reg1_in(reg_quad0_low_in),
@@ -186,7 +221,10 @@ hba_reg_bank #
 
     .slv_wr_en(slv_wr_en),   // Assert to set slv_reg? <= slv_reg?_in
     .slv_wr_mask(4'b1110),    // reg 1,2,3 writable by this module
-    .slv_autoclr_mask(4'b0000)    // No autoclear
+    .slv_autoclr_mask(4'b0000),    // No autoclear
+
+    .slv_dirty(dirty0),
+    .slv_dirty_clr(dirty_clr[3:0])
 );
 
 hba_reg_bank #
@@ -212,9 +250,9 @@ hba_reg_bank #
                                     // Must be zero when inactive.
 
     // Access to registgers
-    //.slv_reg0(),
-    //.slv_reg1(reg_rate_ms),
-    //.slv_reg2(),
+    .slv_reg0(reg_quad1_hi),     // reg4
+    .slv_reg1(reg_speed_left),   // reg5
+    .slv_reg2(reg_speed_right),  // reg6
     .slv_reg3(reg_rate_ms), // reg7
 
     // writeable registers
@@ -225,6 +263,79 @@ hba_reg_bank #
 
     .slv_wr_en(slv_wr_en),   // Assert to set slv_reg? <= slv_reg?_in
     .slv_wr_mask(4'b0111),    // reg0,1,2 writable by this module
+    .slv_autoclr_mask(4'b0000),    // no autoclear
+
+    .slv_dirty(dirty1),
+    .slv_dirty_clr(dirty_clr[7:4])
+);
+
+hba_reg_bank #
+(
+    .DBUS_WIDTH(DBUS_WIDTH),
+    .PERIPH_ADDR_WIDTH(PERIPH_ADDR_WIDTH),
+    .REG_ADDR_WIDTH(REG_ADDR_WIDTH),
+    .PERIPH_ADDR(PERIPH_ADDR),
+    .REG_OFFSET(8)
+) hba_reg_bank_inst2
+(
+    // HBA Bus Slave Interface
+    .hba_clk(hba_clk),
+    .hba_reset(hba_reset),
+    .hba_rnw(hba_rnw),         // 1=Read from register. 0=Write to register.
+    .hba_select(hba_select),      // Transfer in progress.
+    .hba_abus(hba_abus), // The input address bus.
+    .hba_dbus(hba_dbus),  // The input data bus.
+
+    .hba_dbus_slave(hba_dbus_slave2),   // The output data bus.
+    .hba_xferack_slave(hba_xferack_slave2),     // Acknowledge transfer requested. 
+                                    // Asserted when request has been completed. 
+                                    // Must be zero when inactive.
+
+    // Access to registgers
+    .slv_reg1(reg_snap1),   // reg9
+    .slv_reg2(reg_snap2),   // reg10
+    .slv_reg3(reg_snap3),   // reg11
+
+    // writeable registers
+    .slv_reg0_in(reg_dirty_in), // reg8
+    .slv_reg1_in(hba_snapshot ? reg_quad0_low : reg_snap1),  // reg9
+    .slv_reg2_in(hba_snapshot ? reg_quad0_hi : reg_snap2),   // reg10
+    .slv_reg3_in(hba_snapshot ? reg_quad1_low : reg_snap3),  // reg11
+
+    .slv_wr_en(1'b1),   // Follow the dirty bits every clock
+    .slv_wr_mask(4'b1111),    // reg8 to reg11 writable by this module
+    .slv_autoclr_mask(4'b0000)    // no autoclear
+);
+
+hba_reg_bank #
+(
+    .DBUS_WIDTH(DBUS_WIDTH),
+    .PERIPH_ADDR_WIDTH(PERIPH_ADDR_WIDTH),
+    .REG_ADDR_WIDTH(REG_ADDR_WIDTH),
+    .PERIPH_ADDR(PERIPH_ADDR),
+    .REG_OFFSET(12)
+) hba_reg_bank_inst3
+(
+    // HBA Bus Slave Interface
+    .hba_clk(hba_clk),
+    .hba_reset(hba_reset),
+    .hba_rnw(hba_rnw),         // 1=Read from register. 0=Write to register.
+    .hba_select(hba_select),      // Transfer in progress.
+    .hba_abus(hba_abus), // The input address bus.
+    .hba_dbus(hba_dbus),  // The input data bus.
+
+    .hba_dbus_slave(hba_dbus_slave3),   // The output data bus.
+    .hba_xferack_slave(hba_xferack_slave3),     // Acknowledge transfer requested. 
+                                    // Asserted when request has been completed. 
+                                    // Must be zero when inactive.
+
+    // writeable registers
+    .slv_reg0_in(reg_quad1_hi),     // reg12
+    .slv_reg1_in(reg_speed_left),   // reg13
+    .slv_reg2_in(reg_speed_right),  // reg14
+
+    .slv_wr_en(hba_snapshot),   // Copy on the snapshot strobe
+    .slv_wr_mask(4'b0111),    // reg12,13,14 writable by this module
     .slv_autoclr_mask(4'b0000)    // no autoclear
 );
 
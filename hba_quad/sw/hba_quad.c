@@ -8,6 +8,7 @@
  *    enc0      -  Reads 16-bit left encoder value
  *    enc1      -  Reads 16-bit right encoder value
  *    enc       -  Reads left and right encoder values
+ *    maxage    -  Read from the last interrupt if this recent, in ms
  */
 
 /*
@@ -54,6 +55,7 @@
 #include <sys/types.h>
 #include <limits.h>              // for PATH_MAX
 #include <termios.h>
+#include <time.h>
 #include <dlfcn.h>
 #include "eedd.h"
 #include "hba.h"
@@ -73,6 +75,7 @@
 #define HBA_QUAD_REG_SPEED_LEFT (5)
 #define HBA_QUAD_REG_SPEED_RIGHT (6)
 #define HBA_QUAD_REG_SPEED_PERIOD (7)
+#define HBA_QUAD_REG_DIRTY      (8)
         // resource names and numbers
 #define FN_CTRL         "ctrl"
 #define FN_ENC0         "enc0"
@@ -81,6 +84,9 @@
 #define FN_RESET        "reset"
 #define FN_SPEED_PERIOD "speed_period"
 #define FN_SPEED        "speed"
+#define FN_MAXAGE       "maxage"
+#define FN_COALESCE     "coalesce"
+#define FN_TSTAMP       "tstamp"
 
 #define RSC_CTRL        0
 #define RSC_ENC0        1
@@ -89,6 +95,9 @@
 #define RSC_RESET       4
 #define RSC_SPEED_PERIOD 5
 #define RSC_SPEED       6
+#define RSC_MAXAGE      7
+#define RSC_COALESCE    8
+#define RSC_TSTAMP      9
 
         // What we are is a ...
 #define PLUGIN_NAME        "hba_quad"
@@ -96,6 +105,11 @@
 #define HBA_DEFVAL        0
         // Maximum size of input/output string
 #define MX_MSGLEN          120
+        // Largest interrupt coalescing count and time in us
+#define MX_COALCNT         (255)
+#define MX_COALUS          (65535)
+        // Longest maxage in ms
+#define MX_MAXAGE          (60000)
 
 
 /**************************************************************
@@ -113,7 +127,19 @@ typedef struct
     int      speed_period; // period in ms
     int      speed_left;   // most recent speed_left value
     int      speed_right;  // most recent speed_right value
+    int      maxage;    // use the interrupt values if this recent, in ms
+    long long tintr;    // time in ms of the last interrupt values
+    int      coalcnt;   // interrupts the FPGA holds for us
+    int      coalus;    // longest the FPGA holds them in us
+    int      tstamp;    // ==1 to add the interrupt edge time to broadcasts
+    long long tedge;    // time in us of the edge for the last values
     int      (*sendrecv_pkt)();  // routine to send data to the FPGA
+    int      (*sendrecv_shadow)(); // routine to write control registers
+    int      (*intr_coalesce)(); // routine to set interrupt coalescing
+    long long (*intr_edge_time)(); // routine to get the interrupt edge time
+    int      (*sendrecv_async)(); // routine to queue data for the FPGA
+    int      (*sendrecv_batch)(); // routine to send several packets at once
+    int      (*sendrecv_snapshot)(); // routine to read registers on one clock
 } HBA_QUAD;
 
 
@@ -121,8 +147,13 @@ typedef struct
  *  - Function prototypes
  **************************************************************/
 static void usercmd(int, int, char*, SLOT*, int, int*, char*);
+static int  add_tstamp(HBA_QUAD *, char *, int);
 extern SLOT Slots[];
 static void core_interrupt();
+static void intr_done(void *, int, uint8_t *);
+static int  quad_read(HBA_QUAD *, int, int, int, uint8_t *);
+static int  fresh(HBA_QUAD *);
+static long long now_ms(void);
 
 
 /**************************************************************
@@ -135,6 +166,9 @@ int Initialize(
     HBA_QUAD   *pctx;      // our local context
     const char *errmsg;    // error message from dlsym
     void       *reg_intr;  // use this to register and interrupt handler
+    void       *reg_push;  // use this to register a push window
+    void       *reg_dirty; // use this to push only changed registers
+    void       *reg_restore; // use this to restore setup registers
 
     // Allocate memory for this plug-in
     pctx = (HBA_QUAD *) malloc(sizeof(HBA_QUAD));
@@ -155,6 +189,12 @@ int Initialize(
     pctx->speed_period = HBA_DEFVAL; // default speed_period value.
     pctx->speed_left = HBA_DEFVAL;   // default speed_left value.
     pctx->speed_right = HBA_DEFVAL;  // default speed_right value.
+    pctx->maxage = 0;                // always read the FPGA
+    pctx->tintr = 0;                 // no interrupt yet
+    pctx->coalcnt = 0;               // each interrupt comes right away
+    pctx->coalus = 0;
+    pctx->tstamp = 0;                // broadcasts as before
+    pctx->tedge = 0;
 
     // Register name and private data
     pslot->name = PLUGIN_NAME;
@@ -205,6 +245,24 @@ int Initialize(
     pslot->rsc[RSC_SPEED].pgscb = usercmd;
     pslot->rsc[RSC_SPEED].uilock = -1;
     pslot->rsc[RSC_SPEED].slot = pslot;
+    pslot->rsc[RSC_MAXAGE].name = FN_MAXAGE;
+    pslot->rsc[RSC_MAXAGE].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_MAXAGE].bkey = 0;
+    pslot->rsc[RSC_MAXAGE].pgscb = usercmd;
+    pslot->rsc[RSC_MAXAGE].uilock = -1;
+    pslot->rsc[RSC_MAXAGE].slot = pslot;
+    pslot->rsc[RSC_COALESCE].name = FN_COALESCE;
+    pslot->rsc[RSC_COALESCE].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_COALESCE].bkey = 0;
+    pslot->rsc[RSC_COALESCE].pgscb = usercmd;
+    pslot->rsc[RSC_COALESCE].uilock = -1;
+    pslot->rsc[RSC_COALESCE].slot = pslot;
+    pslot->rsc[RSC_TSTAMP].name = FN_TSTAMP;
+    pslot->rsc[RSC_TSTAMP].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_TSTAMP].bkey = 0;
+    pslot->rsc[RSC_TSTAMP].pgscb = usercmd;
+    pslot->rsc[RSC_TSTAMP].uilock = -1;
+    pslot->rsc[RSC_TSTAMP].slot = pslot;
 
     // The serial_fpga plug-in has a routine to send packets to the FPGA
     // and to return with packet data from the FPGA.  We need to look up
@@ -217,6 +275,28 @@ int Initialize(
     if (errmsg != NULL) {
         return(-1);
     }
+    // Control registers are written through the shadow register file
+    // with 'sendrecv_shadow' so a value the FPGA already has is not sent.
+    dlerror();                  /* Clear any existing error */
+    *(void **) (&(pctx->sendrecv_shadow)) = dlsym(Slots[pctx->parent].handle, "sendrecv_shadow");
+    errmsg = dlerror();         /* check for errors */
+    if (errmsg != NULL) {
+        return(-1);
+    }
+    // The interrupt handler queues its read with 'sendrecv_async'
+    dlerror();                  /* Clear any existing error */
+    *(void **) (&(pctx->sendrecv_async)) = dlsym(Slots[pctx->parent].handle, "sendrecv_async");
+    errmsg = dlerror();         /* check for errors */
+    if (errmsg != NULL) {
+        return(-1);
+    }
+    // The encoder reads send their packets together with 'sendrecv_batch'
+    dlerror();                  /* Clear any existing error */
+    *(void **) (&(pctx->sendrecv_batch)) = dlsym(Slots[pctx->parent].handle, "sendrecv_batch");
+    errmsg = dlerror();         /* check for errors */
+    if (errmsg != NULL) {
+        return(-1);
+    }
 
     // The serial_fpga plug-in has a routine that responds to interrupts.
     // The routine polls the FPGA for its two interrupt pending registers.
@@ -234,6 +314,42 @@ int Initialize(
         ((void (*)())reg_intr) (pctx->parent, pctx->coreid, &core_interrupt, (void *) pctx);
     }
 
+    // In push mode the FPGA sends the registers with the interrupt.
+    // Tell serial_fpga which registers intr_done() wants.
+    reg_push = dlsym(Slots[pctx->parent].handle, "register_push_window");
+    if (reg_push != (void *) 0) {
+        ((void (*)())reg_push) (pctx->parent, pctx->coreid, HBA_QUAD_REG_ENC0_LSB, 6, &intr_done);
+    }
+
+    // The FPGA can leave out the window registers that have not changed
+    // since the last push.  Older serial_fpga plug-ins do not have
+    // 'register_push_dirty'.
+    reg_dirty = dlsym(Slots[pctx->parent].handle, "register_push_dirty");
+    if ((reg_push != (void *) 0) && (reg_dirty != (void *) 0)) {
+        ((void (*)())reg_dirty) (pctx->parent, pctx->coreid, HBA_QUAD_REG_DIRTY);
+    }
+
+    // The setup registers are written again if the FPGA is reloaded.
+    // Older serial_fpga plug-ins do not have 'register_shadow_restore'.
+    reg_restore = dlsym(Slots[pctx->parent].handle, "register_shadow_restore");
+    if (reg_restore != (void *) 0) {
+        ((void (*)())reg_restore) (pctx->parent, pctx->coreid, HBA_QUAD_REG_CTRL, 1);
+        ((void (*)())reg_restore) (pctx->parent, pctx->coreid, HBA_QUAD_REG_SPEED_PERIOD, 1);
+    }
+
+    // The FPGA can hold our interrupts and let them through in groups.
+    // Older serial_fpga plug-ins do not have 'intr_coalesce'.
+    *(void **) (&(pctx->intr_coalesce)) = dlsym(Slots[pctx->parent].handle, "intr_coalesce");
+
+    // Broadcasts can carry the time of the interrupt edge.  Older
+    // serial_fpga plug-ins do not have 'intr_edge_time'.
+    *(void **) (&(pctx->intr_edge_time)) = dlsym(Slots[pctx->parent].handle, "intr_edge_time");
+
+    // The FPGA can copy the encoder registers on one clock so they can
+    // be read without disabling updates.  Older serial_fpga plug-ins do
+    // not have 'sendrecv_snapshot'.
+    *(void **) (&(pctx->sendrecv_snapshot)) = dlsym(Slots[pctx->parent].handle, "sendrecv_snapshot");
+
     return (0);
 }
 
@@ -254,6 +370,9 @@ void usercmd(
     int       nval=0;   // new value for a register
     int       nsd;      // number of bytes sent to FPGA
     int       ret;      // generic call return value
+    int       ncnt;     // new coalescing count
+    int       nus;      // new coalescing time
+    int       ntstamp;  // ==1 to add edge times to broadcasts
     uint8_t   pkt[HBA_MXPKT];
     int       newenc0;
     int       newenc1;
@@ -284,7 +403,7 @@ void usercmd(
         pkt[1] = HBA_QUAD_REG_CTRL;
         pkt[2] = pctx->ctrl;                     // new value
         pkt[3] = 0;                             // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
@@ -296,31 +415,15 @@ void usercmd(
         // XXX ret = snprintf(buf, *plen, "%x\n", pctx->ctrl);
         ret = snprintf(buf, *plen, "%d\n", pctx->ctrl);
         *plen = ret;  // (errors are handled in calling routine)
+    } else if ((cmd == EDGET) && (rscid == RSC_ENC0) && fresh(pctx)) {
+        // The last interrupt is recent enough.  No need to ask the FPGA.
+        ret = snprintf(buf, *plen, "%d\n", pctx->enc0);
+        *plen = ret;  // (errors are handled in calling routine)
     } else if ((cmd == EDGET) && (rscid == RSC_ENC0)) {
-
-        // Disable left encoder updates
-        pkt[0] = HBA_WRITE_CMD | ((1 -1) << 4) | pctx->coreid;
-        pkt[1] = HBA_QUAD_REG_CTRL;
-        pkt[2] = pctx->ctrl & 0xfe;     // bit0 (en left enc) set to 0.
-        pkt[3] = 0;                     // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
-        // We did a write so the sendrecv return value should be 1
-        // and the returned byte should be an ACK
-        if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
-            // error writing value from QUAD port
-            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
-            *plen = ret;
-        }
-
-        // Read value in FPGA ENC0 value register
-        pkt[0] = HBA_READ_CMD | ((2 -1) << 4) | pctx->coreid;
-        pkt[1] = HBA_QUAD_REG_ENC0_LSB;
-        pkt[2] = 0;                     // (cmd)
-        pkt[3] = 0;                     // (reg)
-        pkt[4] = 0;                     // (quadrature low)
-        pkt[5] = 0;                     // (quadrature high)
-        nsd = pctx->sendrecv_pkt(pctx->parent, 6, pkt);
-        // We sent header + two bytes so the sendrecv return value should be 4
+        // Read value in FPGA ENC0 value register with the left
+        // encoder updates disabled.  bit0 (en left enc) set to 0.
+        nsd = quad_read(pctx, 0xfe, HBA_QUAD_REG_ENC0_LSB, 2, pkt);
+        // We sent header + two bytes so the return value should be 4
         if (nsd != 4) {
             // error reading enc0 from QUAD port
             ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
@@ -329,116 +432,48 @@ void usercmd(
         else {
             // Got the values.  Print and send to user
             // First two bytes are echoed header.
-            // XXX pctx->enc0 = (pkt[3]<<8) | pkt[2];   // Reconstruct 16-bit value.
             newenc0 = (pkt[3]<<8) | pkt[2];   // Reconstruct 16-bit value.
             if (newenc0 >= 0x8000) {
                 newenc0 = newenc0 - 0x10000;
             }
             pctx->enc0 = newenc0;   // Reconstruct 16-bit value.
 
-            // XXX ret = snprintf(buf, *plen, "%04x\n", pctx->enc0);
             ret = snprintf(buf, *plen, "%d\n", pctx->enc0);
             *plen = ret;  // (errors are handled in calling routine)
         }
-
-        // Put the control back the way it was.
-        pkt[0] = HBA_WRITE_CMD | ((1 -1) << 4) | pctx->coreid;
-        pkt[1] = HBA_QUAD_REG_CTRL;
-        pkt[2] = pctx->ctrl;
-        pkt[3] = 0;                     // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
-        // We did a write so the sendrecv return value should be 1
-        // and the returned byte should be an ACK
-        if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
-            // error writing value from QUAD port
-            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
-            *plen = ret;
-        }
+    } else if ((cmd == EDGET) && (rscid == RSC_ENC1) && fresh(pctx)) {
+        ret = snprintf(buf, *plen, "%d\n", pctx->enc1);
+        *plen = ret;  // (errors are handled in calling routine)
     } else if ((cmd == EDGET) && (rscid == RSC_ENC1)) {
-        // Disable right encoder updates
-        pkt[0] = HBA_WRITE_CMD | ((1 -1) << 4) | pctx->coreid;
-        pkt[1] = HBA_QUAD_REG_CTRL;
-        pkt[2] = pctx->ctrl & 0xfd;     // bit1 (en right enc) set to 0.
-        pkt[3] = 0;                     // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
-        // We did a write so the sendrecv return value should be 1
-        // and the returned byte should be an ACK
-        if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
-            // error writing value from QUAD port
-            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
-            *plen = ret;
-        }
-
-        // Read value in FPGA ENC1 value register
-        pkt[0] = HBA_READ_CMD | ((2 -1) << 4) | pctx->coreid;
-        pkt[1] = HBA_QUAD_REG_ENC1_LSB;
-        pkt[2] = 0;                     // (cmd)
-        pkt[3] = 0;                     // (reg)
-        pkt[4] = 0;                     // (quadrature low)
-        pkt[5] = 0;                     // (quadrature high)
-        nsd = pctx->sendrecv_pkt(pctx->parent, 6, pkt);
-        // We sent header + two bytes so the sendrecv return value should be 4
+        // Read value in FPGA ENC1 value register with the right
+        // encoder updates disabled.  bit1 (en right enc) set to 0.
+        nsd = quad_read(pctx, 0xfd, HBA_QUAD_REG_ENC1_LSB, 2, pkt);
+        // We sent header + two bytes so the return value should be 4
         if (nsd != 4) {
             // error reading enc1 from QUAD port
-            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
             *plen = ret;
         }
         else {
             // Got the values.  Print and send to user
             // First two bytes are echoed header.
-            // XXX pctx->enc1 = (pkt[3]<<8) | pkt[2];   // Reconstruct 16-bit value.
             newenc1 = (pkt[3]<<8) | pkt[2];   // Reconstruct 16-bit value.
             if (newenc1 >= 0x8000) {
                 newenc1 = newenc1 - 0x10000;
             }
             pctx->enc1 = newenc1;   // Reconstruct 16-bit value.
 
-
-            // XXX ret = snprintf(buf, *plen, "%04x\n", pctx->enc1);
             ret = snprintf(buf, *plen, "%d\n", pctx->enc1);
             *plen = ret;  // (errors are handled in calling routine)
         }
-
-        // Put the control back the way it was.
-        pkt[0] = HBA_WRITE_CMD | ((1 -1) << 4) | pctx->coreid;
-        pkt[1] = HBA_QUAD_REG_CTRL;
-        pkt[2] = pctx->ctrl;
-        pkt[3] = 0;                     // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
-        // We did a write so the sendrecv return value should be 1
-        // and the returned byte should be an ACK
-        if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
-            // error writing value from QUAD port
-            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
-            *plen = ret;
-        }
+    } else if ((cmd == EDGET) && (rscid == RSC_ENC) && fresh(pctx)) {
+        ret = snprintf(buf, *plen, "%d %d\n", pctx->enc0, pctx->enc1);
+        *plen = ret;  // (errors are handled in calling routine)
     } else if ((cmd == EDGET) && (rscid == RSC_ENC)) {
-
-        // Disable both encoder updates
-        pkt[0] = HBA_WRITE_CMD | ((1 -1) << 4) | pctx->coreid;
-        pkt[1] = HBA_QUAD_REG_CTRL;
-        pkt[2] = pctx->ctrl & 0xfc;     // Both encoders updates disabled
-        pkt[3] = 0;                     // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
-        // We did a write so the sendrecv return value should be 1
-        // and the returned byte should be an ACK
-        if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
-            // error writing value from QUAD port
-            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
-            *plen = ret;
-        }
-
-        // Read both enc0 and enc1 values.  4 registers in all
-        pkt[0] = HBA_READ_CMD | ((4 -1) << 4) | pctx->coreid;
-        pkt[1] = HBA_QUAD_REG_ENC0_LSB;
-        pkt[2] = 0;                     // (cmd)
-        pkt[3] = 0;                     // (reg)
-        pkt[4] = 0;                     // (quadrature low)
-        pkt[5] = 0;                     // (quadrature high)
-        pkt[6] = 0;                     // (quadrature low)
-        pkt[7] = 0;                     // (quadrature high)
-        nsd = pctx->sendrecv_pkt(pctx->parent, 8, pkt);
-        // We sent 2 byte header + siz bytes so the sendrecv return value should be 6
+        // Read both enc0 and enc1 values.  4 registers in all.
+        // Both encoders updates disabled while reading.
+        nsd = quad_read(pctx, 0xfc, HBA_QUAD_REG_ENC0_LSB, 4, pkt);
+        // We sent 2 byte header + six bytes so the return value should be 6
         if (nsd != 6) {
             // error reading enc1 from QUAD port
             ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
@@ -447,8 +482,6 @@ void usercmd(
         else {
             // Got the values.  Print and send to user
             // First two bytes are echoed header.
-            //XXX pctx->enc0 = (pkt[3]<<8) | pkt[2];   // Reconstruct enc0 16-bit value.
-            //XXX pctx->enc1 = (pkt[5]<<8) | pkt[4];   // Reconstruct enc1 16-bit value.
             newenc0= (pkt[3]<<8) | pkt[2];   // Reconstruct enc0 16-bit value.
             newenc1 = (pkt[5]<<8) | pkt[4];   // Reconstruct enc1 16-bit value.
             if (newenc0 >= 0x8000) {
@@ -460,25 +493,17 @@ void usercmd(
             pctx->enc0 = newenc0;   // Reconstruct enc0 16-bit value.
             pctx->enc1 = newenc1;   // Reconstruct enc1 16-bit value.
 
-            // XXX ret = snprintf(buf, *plen, "%04x %04x\n", pctx->enc0, pctx->enc1);
             ret = snprintf(buf, *plen, "%d %d\n", pctx->enc0, pctx->enc1);
             *plen = ret;  // (errors are handled in calling routine)
         }
-
-        // Put the control back the way it was.
-        pkt[0] = HBA_WRITE_CMD | ((1 -1) << 4) | pctx->coreid;
-        pkt[1] = HBA_QUAD_REG_CTRL;
-        pkt[2] = pctx->ctrl;
-        pkt[3] = 0;                     // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
-        // We did a write so the sendrecv return value should be 1
-        // and the returned byte should be an ACK
-        if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
-            // error writing value from QUAD port
-            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
-            *plen = ret;
-        }
     } else if ((cmd == EDSET) && (rscid == RSC_RESET)) {
+        // The counts from the last interrupt are no good now
+        pctx->tintr = 0;
+
+        // The encoders reset on the rising edge of bit 3 so both
+        // writes must reach the FPGA.  They do not go through the
+        // shadow, which would drop the first.
+
         // Set bit 3 for encoder reset
         pctx->ctrl = pctx->ctrl | 0x08;
 
@@ -532,7 +557,7 @@ void usercmd(
         pkt[1] = HBA_QUAD_REG_SPEED_PERIOD;
         pkt[2] = pctx->speed_period;                     // new value
         pkt[3] = 0;                             // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
@@ -543,31 +568,14 @@ void usercmd(
     } else if ((cmd == EDGET) && (rscid == RSC_SPEED_PERIOD)) {
         ret = snprintf(buf, *plen, "%d\n", pctx->speed_period);
         *plen = ret;  // (errors are handled in calling routine)
+    } else if ((cmd == EDGET) && (rscid == RSC_SPEED) && fresh(pctx)) {
+        ret = snprintf(buf, *plen, "%d %d\n", pctx->speed_left, pctx->speed_right);
+        *plen = ret;  // (errors are handled in calling routine)
     } else if ((cmd == EDGET) && (rscid == RSC_SPEED)) {
-
-        // Disable both encoder updates
-        pkt[0] = HBA_WRITE_CMD | ((1 -1) << 4) | pctx->coreid;
-        pkt[1] = HBA_QUAD_REG_CTRL;
-        pkt[2] = pctx->ctrl & 0xfc;     // Both encoders updates disabled
-        pkt[3] = 0;                     // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
-        // We did a write so the sendrecv return value should be 1
-        // and the returned byte should be an ACK
-        if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
-            // error writing value from QUAD port
-            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
-            *plen = ret;
-        }
-
         // Read both speed_left and speed_right values.  2 registers in all
-        pkt[0] = HBA_READ_CMD | ((2 -1) << 4) | pctx->coreid;
-        pkt[1] = HBA_QUAD_REG_SPEED_LEFT;
-        pkt[2] = 0;                     // (cmd)
-        pkt[3] = 0;                     // (reg)
-        pkt[4] = 0;                     // (speed left)
-        pkt[5] = 0;                     // (speed right)
-        nsd = pctx->sendrecv_pkt(pctx->parent, 6, pkt);
-        // We sent 2 byte header + siz bytes so the sendrecv return value should be 4
+        // Both encoders updates disabled while reading.
+        nsd = quad_read(pctx, 0xfc, HBA_QUAD_REG_SPEED_LEFT, 2, pkt);
+        // We sent 2 byte header + four bytes so the return value should be 4
         if (nsd != 4) {
             // error reading speed_left from QUAD port
             ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
@@ -576,8 +584,6 @@ void usercmd(
         else {
             // Got the values.  Print and send to user
             // First two bytes are echoed header.
-            // XXX pctx->speed_left  = pkt[2];   // speed_left value
-            // XXX pctx->speed_right = pkt[3];   // speed_right value
             new_speed_left  = pkt[2];   // speed_left value
             new_speed_right = pkt[3];   // speed_right value
             if (new_speed_left >= 0x80) {
@@ -589,25 +595,53 @@ void usercmd(
             pctx->speed_left  = new_speed_left;   // speed_left value
             pctx->speed_right = new_speed_right;   // speed_right value
 
-            // XXX ret = snprintf(buf, *plen, "%04x %04x\n", pctx->enc0, pctx->enc1);
             ret = snprintf(buf, *plen, "%d %d\n", pctx->speed_left, pctx->speed_right);
             *plen = ret;  // (errors are handled in calling routine)
         }
-
-        // Put the control back the way it was.
-        pkt[0] = HBA_WRITE_CMD | ((1 -1) << 4) | pctx->coreid;
-        pkt[1] = HBA_QUAD_REG_CTRL;
-        pkt[2] = pctx->ctrl;
-        pkt[3] = 0;                     // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
-        // We did a write so the sendrecv return value should be 1
-        // and the returned byte should be an ACK
-        if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
-            // error writing value from QUAD port
+    } else if ((cmd == EDSET) && (rscid == RSC_COALESCE)) {
+        ret = sscanf(val, "%d %d", &ncnt, &nus);
+        if ((ret != 2) || (ncnt < 0) || (ncnt > MX_COALCNT) || (nus < 0) ||
+            (nus > MX_COALUS) || (pctx->intr_coalesce == 0)) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        // serial_fpga keeps the setting and sends it again if the
+        // FPGA is reloaded
+        if (pctx->intr_coalesce(pctx->parent, pctx->coreid, ncnt, nus) != 0) {
             ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        pctx->coalcnt = ncnt;
+        pctx->coalus = nus;
+    } else if ((cmd == EDGET) && (rscid == RSC_COALESCE)) {
+        ret = snprintf(buf, *plen, "%d %d\n", pctx->coalcnt, pctx->coalus);
+        *plen = ret;  // (errors are handled in calling routine)
+    } else if ((cmd == EDSET) && (rscid == RSC_TSTAMP)) {
+        ret = sscanf(val, "%d", &ntstamp);
+        if ((ret != 1) || (ntstamp < 0) || (ntstamp > 1) ||
+            ((ntstamp == 1) && (pctx->intr_edge_time == 0))) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        pctx->tstamp = ntstamp;
+    } else if ((cmd == EDGET) && (rscid == RSC_TSTAMP)) {
+        ret = snprintf(buf, *plen, "%d\n", pctx->tstamp);
+        *plen = ret;  // (errors are handled in calling routine)
+    } else if ((cmd == EDSET) && (rscid == RSC_MAXAGE)) {
+        ret = sscanf(val, "%d", &nval);
+        if ((ret != 1) || (nval < 0) || (nval > MX_MAXAGE)) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
             *plen = ret;
+            return;
         }
-    } 
+        pctx->maxage = nval;
+    } else if ((cmd == EDGET) && (rscid == RSC_MAXAGE)) {
+        ret = snprintf(buf, *plen, "%d\n", pctx->maxage);
+        *plen = ret;  // (errors are handled in calling routine)
+    }
 
     // Nothing to do here if edcat.  That is handled in the UI code
 
@@ -615,28 +649,134 @@ void usercmd(
 }
 
 
+/**************************************************************
+ * quad_read():  - Read nreg registers starting at reg with the
+ * ctrl register masked by mask while the read is done.  An FPGA with
+ * snapshots copies the registers on one clock and the copies are
+ * read with no change to ctrl.  Otherwise the disable write and the
+ * read go as one exchange packet, followed in the same batch by the
+ * write that puts ctrl back.  An FPGA without the exchange command
+ * gets the disable, read, and re-enable as three packets.  Returns the byte count for the read, or -1 if any part
+ * fails.  The response is left in pkt with the echoed header first.
+ **************************************************************/
+static int quad_read(
+    HBA_QUAD  *pctx,     // hba_quad private info
+    int        mask,     // ctrl bits to keep during the read
+    int        reg,      // first register to read
+    int        nreg,     // number of registers to read
+    uint8_t   *pkt)      // buffer for the packet and response
+{
+    HBA_XFER   xfer[3];  // disable, read, and re-enable
+    HBA_GATHER snap;     // the read of the snapshot
+    uint8_t    xchg[16]; // packet to disable encoder updates and read
+    uint8_t    dis[4];   // packet to disable encoder updates
+    uint8_t    ena[4];   // packet to put the control back
+    int        ret;
+    int        i;
+
+    // Read the snapshot if the FPGA takes them
+    if (pctx->sendrecv_snapshot != 0) {
+        snap.core = pctx->coreid;
+        snap.reg = reg;
+        snap.count = nreg;
+        snap.data = &(pkt[2]);
+        ret = pctx->sendrecv_snapshot(pctx->parent, 1, &snap);
+        if (ret == nreg) {
+            // Give the caller the same response as for a plain read
+            pkt[0] = HBA_READ_CMD | ((nreg -1) << 4) | pctx->coreid;
+            pkt[1] = reg;
+            return(nreg + 2);
+        }
+        if (ret != HBAERROR_NOSEND) {
+            return(-1);
+        }
+    }
+
+    // Put the control back the way it was.
+    ena[0] = HBA_WRITE_CMD | ((1 -1) << 4) | pctx->coreid;
+    ena[1] = HBA_QUAD_REG_CTRL;
+    ena[2] = pctx->ctrl;
+    ena[3] = 0;                     // dummy for the ack
+
+    // Disable encoder updates and read the registers in one exchange
+    xchg[0] = HBA_READ_CMD | (HBA_EXT_EXCHANGE << 4) | HBA_EXT_COREID;
+    xchg[1] = pctx->coreid;
+    xchg[2] = HBA_QUAD_REG_CTRL;
+    xchg[3] = 1;                    // one byte to write
+    xchg[4] = pctx->ctrl & mask;
+    xchg[5] = reg;
+    xchg[6] = nreg;
+    for (i = 0; i < nreg + 1; i++) {
+        xchg[i + 7] = 0;            // dummy bytes (ack, data)
+    }
+    xfer[0].pkt = xchg;
+    xfer[0].count = nreg + 8;
+    xfer[1].pkt = ena;
+    xfer[1].count = 4;
+
+    ret = pctx->sendrecv_batch(pctx->parent, 2, xfer);
+    if (ret == 2) {
+        // The ACK for the disable comes before the data
+        if ((xfer[0].ret != nreg + 1) || (xchg[0] != HBA_ACK) ||
+            (xfer[1].ret != 1) || (ena[0] != HBA_ACK)) {
+            return(-1);
+        }
+        // Give the caller the same response as for a plain read
+        pkt[0] = HBA_READ_CMD | ((nreg -1) << 4) | pctx->coreid;
+        pkt[1] = reg;
+        memcpy(&(pkt[2]), &(xchg[1]), nreg);
+        return(nreg + 2);
+    }
+    if (ret != HBAERROR_NOSEND) {
+        return(-1);
+    }
+
+    // The FPGA does not have the exchange command.  Disable encoder updates
+    dis[0] = HBA_WRITE_CMD | ((1 -1) << 4) | pctx->coreid;
+    dis[1] = HBA_QUAD_REG_CTRL;
+    dis[2] = pctx->ctrl & mask;
+    dis[3] = 0;                     // dummy for the ack
+    xfer[0].pkt = dis;
+    xfer[0].count = 4;
+
+    // Read the registers
+    pkt[0] = HBA_READ_CMD | ((nreg -1) << 4) | pctx->coreid;
+    pkt[1] = reg;
+    for (i = 0; i < nreg + 2; i++) {
+        pkt[i + 2] = 0;             // dummy bytes (cmd, reg, data)
+    }
+    xfer[1].pkt = pkt;
+    xfer[1].count = nreg + 4;
+
+    // and re-enable
+    xfer[2].pkt = ena;
+    xfer[2].count = 4;
+
+    if (pctx->sendrecv_batch(pctx->parent, 3, xfer) != 3) {
+        return(-1);
+    }
+    // We did two writes so the returned byte for each should be an ACK
+    if ((xfer[0].ret != 1) || (dis[0] != HBA_ACK) ||
+        (xfer[2].ret != 1) || (ena[0] != HBA_ACK)) {
+        return(-1);
+    }
+    return(xfer[1].ret);
+}
+
+
 /**************************************************************
  * core_interrupt():  - interrupt handler for this peripheral
  **************************************************************/
 void core_interrupt(void *trans)
 {
     HBA_QUAD    *pctx;       // this peripheral's private info
-    SLOT        *pslot;      // This instance of the serial plug-in
-    RSC         *prsc;       // pointer to this slot's counts resource
-    int          nsd;        // number of bytes sent to FPGA
     uint8_t      pkt[HBA_MXPKT];
-    char         msg[MX_MSGLEN * 3 +1]; // text to send.  +1 for newline
-    int          slen;       // length of text to output
-    int          newenc0;
-    int          newenc1;
-    int          new_speed_left;
-    int          new_speed_right;
 
     // get pointers to this instance of the plug-in and its slot
     pctx = (HBA_QUAD *) trans; // transparent data is our context
 
     // Read value in quadrature registers
-    // Read four bytes offset by -1 (4 -1)
+    // Read six bytes offset by -1 (6 -1)
     pkt[0] = HBA_READ_CMD | ((6 -1) << 4) | pctx->coreid;
     pkt[1] = HBA_QUAD_REG_ENC0_LSB;
     pkt[2] = 0;                     // dummy byte (cmd)
@@ -648,7 +788,32 @@ void core_interrupt(void *trans)
     pkt[8] = 0;                     // dummy byte (q0 speed)
     pkt[9] = 0;                     // dummy byte (q1 speed)
 
-    nsd = pctx->sendrecv_pkt(pctx->parent, 10, pkt);
+    // The values are broadcast from intr_done() when they arrive
+    if (pctx->sendrecv_async(pctx->parent, 10, pkt, intr_done, trans) < 0) {
+        edlog("Error reading value from quadrature");
+    }
+}
+
+
+/**************************************************************
+ * intr_done():  - the registers read by core_interrupt() are in
+ **************************************************************/
+static void intr_done(
+    void        *trans,      // our context (==*HBA_QUAD)
+    int          nsd,        // number of bytes received from FPGA
+    uint8_t     *pkt)        // the response
+{
+    HBA_QUAD    *pctx;       // this peripheral's private info
+    SLOT        *pslot;      // This instance of the serial plug-in
+    RSC         *prsc;       // pointer to this slot's counts resource
+    char         msg[MX_MSGLEN * 3 +1]; // text to send.  +1 for newline
+    int          slen;       // length of text to output
+    int          newenc0;
+    int          newenc1;
+    int          new_speed_left;
+    int          new_speed_right;
+
+    pctx = (HBA_QUAD *) trans; // transparent data is our context
 
     // We sent header + eight bytes so the sendrecv return value should be 8
     if (nsd != 8) {
@@ -656,6 +821,9 @@ void core_interrupt(void *trans)
         edlog("Error reading value from quadrature");
         return;
     }
+    if (pctx->intr_edge_time != 0) {
+        pctx->tedge = pctx->intr_edge_time(pctx->parent);
+    }
     newenc0 = (pkt[3]<<8) | pkt[2];   // Reconstruct 16-bit value.
     newenc1 = (pkt[5]<<8) | pkt[4];   // Reconstruct 16-bit value.
 
@@ -681,8 +849,8 @@ void core_interrupt(void *trans)
     if (newenc0 != pctx->enc0) {
         prsc = &(pslot->rsc[RSC_ENC0]);
         if (prsc->bkey != 0) {
-            // XXX slen = snprintf(msg, (MX_MSGLEN -1), "%04x\n", newenc0);
             slen = snprintf(msg, (MX_MSGLEN -1), "%d\n", newenc0);
+            slen = add_tstamp(pctx, msg, slen);
             bcst_ui(msg, slen, &(prsc->bkey));
         }
     }
@@ -690,8 +858,8 @@ void core_interrupt(void *trans)
     if (newenc1 != pctx->enc1) {
         prsc = &(pslot->rsc[RSC_ENC1]);
         if (prsc->bkey != 0) {
-            // XXX slen = snprintf(msg, (MX_MSGLEN -1), "%04x\n", newenc1);
             slen = snprintf(msg, (MX_MSGLEN -1), "%d\n", newenc1);
+            slen = add_tstamp(pctx, msg, slen);
             bcst_ui(msg, slen, &(prsc->bkey));
         }
     }
@@ -699,8 +867,8 @@ void core_interrupt(void *trans)
     if ((newenc0 != pctx->enc0) || (newenc1 != pctx->enc1) ) {
         prsc = &(pslot->rsc[RSC_ENC]);
         if (prsc->bkey != 0) {
-            // XXX slen = snprintf(msg, (MX_MSGLEN -1), "%04x %04x\n", newenc0, newenc1);
             slen = snprintf(msg, (MX_MSGLEN -1), "%d %d\n", newenc0, newenc1);
+            slen = add_tstamp(pctx, msg, slen);
             bcst_ui(msg, slen, &(prsc->bkey));
         }
     }
@@ -709,6 +877,7 @@ void core_interrupt(void *trans)
         prsc = &(pslot->rsc[RSC_SPEED]);
         if (prsc->bkey != 0) {
             slen = snprintf(msg, (MX_MSGLEN -1), "%d %d\n", new_speed_left, new_speed_right);
+            slen = add_tstamp(pctx, msg, slen);
             bcst_ui(msg, slen, &(prsc->bkey));
         }
     }
@@ -716,6 +885,51 @@ void core_interrupt(void *trans)
     pctx->enc1 = newenc1;
     pctx->speed_left = new_speed_left;
     pctx->speed_right = new_speed_right;
+    pctx->tintr = now_ms();
+}
+
+
+/**************************************************************
+ * fresh():  - Returns 1 if the values from the last interrupt are
+ * no older than maxage ms.  Reads can then be answered without
+ * asking the FPGA.
+ **************************************************************/
+static int fresh(
+    HBA_QUAD  *pctx)      // our private info
+{
+    return((pctx->maxage > 0) && (pctx->tintr != 0) &&
+           ((now_ms() - pctx->tintr) <= pctx->maxage));
+}
+
+
+/**************************************************************
+ * now_ms():  - The monotonic time in ms
+ **************************************************************/
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((ts.tv_sec * 1000LL) + (ts.tv_nsec / 1000000));
+}
+
+
+/**************************************************************
+ * add_tstamp():  - Put the time in us of the interrupt edge at
+ * the end of a broadcast line if the user asked for it.  Returns
+ * the new length of the line.
+ **************************************************************/
+static int add_tstamp(
+    HBA_QUAD  *pctx,     // this peripheral's private info
+    char      *msg,      // the line, ending in a newline
+    int        slen)     // length of the line
+{
+    if ((pctx->tstamp == 0) || (slen <= 0)) {
+        return(slen);
+    }
+    // Replace the newline with the time and a newline
+    return(slen - 1 + snprintf(&(msg[slen - 1]), (MX_MSGLEN - slen),
+                               " %lld\n", pctx->tedge));
 }
 
 
@@ -70,7 +70,10 @@ module hba_reg_bank #
 
     input wire slv_wr_en,           // Assert to set slv_reg? <= slv_reg?_in
     input wire [3:0] slv_wr_mask,   // 0001, means reg0 is writeable. etc
-    input wire [3:0] slv_autoclr_mask   // 0001, means reg0 is cleared when read
+    input wire [3:0] slv_autoclr_mask,  // 0001, means reg0 is cleared when read
+
+    output reg [3:0] slv_dirty,     // 0001, means reg0 changed by slv_wr_en
+    input wire [3:0] slv_dirty_clr  // 0001, means clear slv_dirty[0]
 );
 
 /*
@@ -93,6 +96,11 @@ wire addr_hit_clear = ~hba_select | hba_xferack_slave;
 
 reg addr_hit;
 
+// Registers the parent core is writing with a new value.
+wire [3:0] slv_changed = {4{slv_wr_en}} & slv_wr_mask &
+    {(slv_reg3_in != slv_reg3), (slv_reg2_in != slv_reg2),
+     (slv_reg1_in != slv_reg1), (slv_reg0_in != slv_reg0)};
+
 
 /*
 *****************************
@@ -113,6 +121,19 @@ begin
     end
 end
 
+// Dirty bits.  A bit is set when the parent core writes a new value
+// to its register and stays set until the parent clears it, usually
+// when the host reads a map of the dirty bits.  A change in the same
+// clock as the clear keeps the bit set.
+always @ (posedge hba_clk)
+begin
+    if (hba_reset) begin
+        slv_dirty <= 0;
+    end else begin
+        slv_dirty <= (slv_dirty & ~slv_dirty_clr) | slv_changed;
+    end
+end
+
 // state machine
 reg [7:0] regbank_state;
 
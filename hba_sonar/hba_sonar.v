@@ -76,6 +76,7 @@ module hba_sonar #
     input wire hba_select,      // Transfer in progress.
     input wire [ADDR_WIDTH-1:0] hba_abus, // The input address bus.
     input wire [DBUS_WIDTH-1:0] hba_dbus,  // The input data bus.
+    input wire hba_snapshot,    // Copy live registers to the snapshot registers.
 
     output wire [DBUS_WIDTH-1:0] hba_dbus_slave,   // The output data bus.
     output wire hba_xferack_slave,     // Acknowledge transfer requested. 
@@ -102,10 +103,17 @@ wire [DBUS_WIDTH-1:0] reg_ctrl;  // reg0: Control register
 wire [DBUS_WIDTH-1:0] reg_sonar0_in;  // reg1: Sonar0 value
 wire [DBUS_WIDTH-1:0] reg_sonar1_in;  // reg2: Sonar1 value
 
+// reg1 and reg2 as the host reads them.  hba_snapshot copies them
+// to reg9 and reg10.
+wire [DBUS_WIDTH-1:0] reg_sonar0;
+wire [DBUS_WIDTH-1:0] reg_sonar1;
+
 wire [DBUS_WIDTH-1:0] reg_delay0;  // reg3: Sonar0 trigger delay
 wire [DBUS_WIDTH-1:0] reg_delay1;  // reg4: Sonar1 trigger delay
 wire [DBUS_WIDTH-1:0] reg_period;  // reg5: Trigger period
 
+wire [DBUS_WIDTH-1:0] reg_dirty_in;  // reg7: Dirty map
+
 // Enables writing to slave registers.
 wire slv_wr_en;
 
@@ -124,6 +132,26 @@ assign sonar0_en = reg_ctrl[0];
 wire sonar1_en;
 assign sonar1_en = reg_ctrl[1];
 
+// Combine the three address banks.
+wire [DBUS_WIDTH-1:0] hba_dbus_slave0;
+wire [DBUS_WIDTH-1:0] hba_dbus_slave1;
+wire [DBUS_WIDTH-1:0] hba_dbus_slave2;
+wire hba_xferack_slave0;
+wire hba_xferack_slave1;
+wire hba_xferack_slave2;
+
+assign hba_dbus_slave = hba_dbus_slave0 | hba_dbus_slave1 | hba_dbus_slave2;
+assign hba_xferack_slave = hba_xferack_slave0 | hba_xferack_slave1 |
+                           hba_xferack_slave2;
+
+// Dirty map.  Bit N is set when regN has changed since the map was
+// last read.  Reading the map clears the bits it returned.
+wire [3:0] dirty0;
+assign reg_dirty_in = {4'b0000, dirty0};
+wire dirty_rd = hba_xferack_slave1 & hba_rnw &
+                (hba_abus[REG_ADDR_WIDTH-1:0] == 7);
+wire [3:0] dirty_clr = (dirty_rd) ? hba_dbus_slave1[3:0] : 4'b0000;
+
 /*
 *****************************
 * Instantiation
@@ -136,7 +164,7 @@ hba_reg_bank #
     .PERIPH_ADDR_WIDTH(PERIPH_ADDR_WIDTH),
     .REG_ADDR_WIDTH(REG_ADDR_WIDTH),
     .PERIPH_ADDR(PERIPH_ADDR)
-) hba_reg_bank_inst
+) hba_reg_bank_inst0
 (
     // HBA Bus Slave Interface
     .hba_clk(hba_clk),
@@ -146,15 +174,15 @@ hba_reg_bank #
     .hba_abus(hba_abus), // The input address bus.
     .hba_dbus(hba_dbus),  // The input data bus.
 
-    .hba_dbus_slave(hba_dbus_slave),   // The output data bus.
-    .hba_xferack_slave(hba_xferack_slave),     // Acknowledge transfer requested. 
+    .hba_dbus_slave(hba_dbus_slave0),   // The output data bus.
+    .hba_xferack_slave(hba_xferack_slave0),     // Acknowledge transfer requested. 
                                     // Asserted when request has been completed. 
                                     // Must be zero when inactive.
 
     // Access to registgers
     .slv_reg0(reg_ctrl),
-    //.slv_reg1(),  
-    //.slv_reg2(),
+    .slv_reg1(reg_sonar0),
+    .slv_reg2(reg_sonar1),
     
     // TODO : Add these later
     // XXX .slv_reg3(reg_delay0),
@@ -167,6 +195,72 @@ hba_reg_bank #
 
     .slv_wr_en(slv_wr_en),   // Assert to set slv_reg? <= slv_reg?_in
     .slv_wr_mask(4'b0110),    // 0010, means reg1,reg2 is writeable.
+    .slv_autoclr_mask(4'b0000),    // No autoclear
+
+    .slv_dirty(dirty0),
+    .slv_dirty_clr(dirty_clr)
+);
+
+hba_reg_bank #
+(
+    .DBUS_WIDTH(DBUS_WIDTH),
+    .PERIPH_ADDR_WIDTH(PERIPH_ADDR_WIDTH),
+    .REG_ADDR_WIDTH(REG_ADDR_WIDTH),
+    .PERIPH_ADDR(PERIPH_ADDR),
+    .REG_OFFSET(4)
+) hba_reg_bank_inst1
+(
+    // HBA Bus Slave Interface
+    .hba_clk(hba_clk),
+    .hba_reset(hba_reset),
+    .hba_rnw(hba_rnw),         // 1=Read from register. 0=Write to register.
+    .hba_select(hba_select),      // Transfer in progress.
+    .hba_abus(hba_abus), // The input address bus.
+    .hba_dbus(hba_dbus),  // The input data bus.
+
+    .hba_dbus_slave(hba_dbus_slave1),   // The output data bus.
+    .hba_xferack_slave(hba_xferack_slave1),     // Acknowledge transfer requested. 
+                                    // Asserted when request has been completed. 
+                                    // Must be zero when inactive.
+
+    // reg4 to reg6 are left for the trigger delays and period
+
+    // writeable registers
+    .slv_reg3_in(reg_dirty_in),  // reg7: dirty map
+
+    .slv_wr_en(1'b1),   // Follow the dirty bits every clock
+    .slv_wr_mask(4'b1000),    // 1000, means reg7 is writeable.
+    .slv_autoclr_mask(4'b0000)    // No autoclear
+);
+
+hba_reg_bank #
+(
+    .DBUS_WIDTH(DBUS_WIDTH),
+    .PERIPH_ADDR_WIDTH(PERIPH_ADDR_WIDTH),
+    .REG_ADDR_WIDTH(REG_ADDR_WIDTH),
+    .PERIPH_ADDR(PERIPH_ADDR),
+    .REG_OFFSET(8)
+) hba_reg_bank_inst2
+(
+    // HBA Bus Slave Interface
+    .hba_clk(hba_clk),
+    .hba_reset(hba_reset),
+    .hba_rnw(hba_rnw),         // 1=Read from register. 0=Write to register.
+    .hba_select(hba_select),      // Transfer in progress.
+    .hba_abus(hba_abus), // The input address bus.
+    .hba_dbus(hba_dbus),  // The input data bus.
+
+    .hba_dbus_slave(hba_dbus_slave2),   // The output data bus.
+    .hba_xferack_slave(hba_xferack_slave2),     // Acknowledge transfer requested. 
+                                    // Asserted when request has been completed. 
+                                    // Must be zero when inactive.
+
+    // writeable registers
+    .slv_reg1_in(reg_sonar0),  // reg9: snapshot of reg1
+    .slv_reg2_in(reg_sonar1),  // reg10: snapshot of reg2
+
+    .slv_wr_en(hba_snapshot),   // Copy on the snapshot strobe
+    .slv_wr_mask(4'b0110),    // 0110, means reg9,reg10 is writeable.
     .slv_autoclr_mask(4'b0000)    // No autoclear
 );
 
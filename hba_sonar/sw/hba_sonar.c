@@ -7,6 +7,7 @@
  *    ctrl    -  Enables/Disables sonars
  *    sonar0  -  Read the last sonar0 value.
  *    sonar1  -  Read the last sonar1 value.
+ *    maxage  -  Read from the last interrupt if this recent, in ms
  */
 
 /*
@@ -47,6 +48,7 @@
 #include <sys/types.h>
 #include <limits.h>              // for PATH_MAX
 #include <termios.h>
+#include <time.h>
 #include <dlfcn.h>
 #include "eedd.h"
 #include "hba.h"
@@ -61,19 +63,31 @@
 #define HBA_SONAR_REG_CTRL    (0)
 #define HBA_SONAR_REG_SONAR0  (1)
 #define HBA_SONAR_REG_SONAR1  (2)
+#define HBA_SONAR_REG_DIRTY   (7)
         // resource names and numbers
 #define FN_CTRL           "ctrl"
 #define FN_SONAR0         "sonar0"
 #define FN_SONAR1         "sonar1"
+#define FN_MAXAGE         "maxage"
+#define FN_COALESCE       "coalesce"
+#define FN_TSTAMP         "tstamp"
 #define RSC_CTRL          0
 #define RSC_SONAR0        1
 #define RSC_SONAR1        2
+#define RSC_MAXAGE        3
+#define RSC_COALESCE      4
+#define RSC_TSTAMP        5
         // What we are is a ...
 #define PLUGIN_NAME        "hba_sonar"
         // Default value is zero, sonars disabled
 #define HBA_DEFCTRL        0
         // Maximum size of input/output string
 #define MX_MSGLEN          120
+        // Largest interrupt coalescing count and time in us
+#define MX_COALCNT         (255)
+#define MX_COALUS          (65535)
+        // Longest maxage in ms
+#define MX_MAXAGE          (60000)
 
 
 /**************************************************************
@@ -88,7 +102,17 @@ typedef struct
     int      ctrl;     // most recent value to display on ctrl
     int      sonar0;   // most recent sonar0 value
     int      sonar1;   // most recent sonar1 value
+    int      maxage;   // use the interrupt values if this recent, in ms
+    long long tintr;   // time in ms of the last interrupt values
+    int      coalcnt;  // interrupts the FPGA holds for us
+    int      coalus;   // longest the FPGA holds them in us
+    int      tstamp;    // ==1 to add the interrupt edge time to broadcasts
+    long long tedge;    // time in us of the edge for the last values
     int      (*sendrecv_pkt)();  // routine to send data to the FPGA
+    int      (*sendrecv_shadow)(); // routine to write control registers
+    int      (*intr_coalesce)(); // routine to set interrupt coalescing
+    long long (*intr_edge_time)(); // routine to get the interrupt edge time
+    int      (*sendrecv_async)(); // routine to queue data for the FPGA
 } HBA_SONAR;
 
 
@@ -96,8 +120,12 @@ typedef struct
  *  - Function prototypes
  **************************************************************/
 static void usercmd(int, int, char*, SLOT*, int, int*, char*);
+static int  add_tstamp(HBA_SONAR *, char *, int);
 extern SLOT Slots[];
 static void core_interrupt();
+static void intr_done(void *, int, uint8_t *);
+static int  fresh(HBA_SONAR *);
+static long long now_ms(void);
 
 
 /**************************************************************
@@ -110,6 +138,9 @@ int Initialize(
     HBA_SONAR *pctx;  // our local context
     const char *errmsg; // error message from dlsym
     void        *reg_intr;  // use this to register and interrupt handler
+    void        *reg_push;  // use this to register a push window
+    void        *reg_dirty; // use this to push only changed registers
+    void        *reg_restore; // use this to restore setup registers
 
     // Allocate memory for this plug-in
     pctx = (HBA_SONAR *) malloc(sizeof(HBA_SONAR));
@@ -127,6 +158,12 @@ int Initialize(
     pctx->ctrl = HBA_DEFCTRL;        // most recent from to/from port
     pctx->sonar0 = 0;                // default sonar0 value.
     pctx->sonar1 = 0;                // default sonar1 value.
+    pctx->maxage = 0;                // always read the FPGA
+    pctx->tintr = 0;                 // no interrupt yet
+    pctx->coalcnt = 0;               // each interrupt comes right away
+    pctx->coalus = 0;
+    pctx->tstamp = 0;                // broadcasts as before
+    pctx->tedge = 0;
 
     // Register name and private data
     pslot->name = PLUGIN_NAME;
@@ -153,6 +190,24 @@ int Initialize(
     pslot->rsc[RSC_SONAR1].pgscb = usercmd;
     pslot->rsc[RSC_SONAR1].uilock = -1;
     pslot->rsc[RSC_SONAR1].slot = pslot;
+    pslot->rsc[RSC_MAXAGE].name = FN_MAXAGE;
+    pslot->rsc[RSC_MAXAGE].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_MAXAGE].bkey = 0;
+    pslot->rsc[RSC_MAXAGE].pgscb = usercmd;
+    pslot->rsc[RSC_MAXAGE].uilock = -1;
+    pslot->rsc[RSC_MAXAGE].slot = pslot;
+    pslot->rsc[RSC_COALESCE].name = FN_COALESCE;
+    pslot->rsc[RSC_COALESCE].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_COALESCE].bkey = 0;
+    pslot->rsc[RSC_COALESCE].pgscb = usercmd;
+    pslot->rsc[RSC_COALESCE].uilock = -1;
+    pslot->rsc[RSC_COALESCE].slot = pslot;
+    pslot->rsc[RSC_TSTAMP].name = FN_TSTAMP;
+    pslot->rsc[RSC_TSTAMP].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_TSTAMP].bkey = 0;
+    pslot->rsc[RSC_TSTAMP].pgscb = usercmd;
+    pslot->rsc[RSC_TSTAMP].uilock = -1;
+    pslot->rsc[RSC_TSTAMP].slot = pslot;
 
     // The serial_fpga plug-in has a routine to send packets to the FPGA
     // and to return with packet data from the FPGA.  We need to look up
@@ -165,6 +220,21 @@ int Initialize(
     if (errmsg != NULL) {
         return(-1);
     }
+    // Control registers are written through the shadow register file
+    // with 'sendrecv_shadow' so a value the FPGA already has is not sent.
+    dlerror();                  /* Clear any existing error */
+    *(void **) (&(pctx->sendrecv_shadow)) = dlsym(Slots[pctx->parent].handle, "sendrecv_shadow");
+    errmsg = dlerror();         /* check for errors */
+    if (errmsg != NULL) {
+        return(-1);
+    }
+    // The interrupt handler queues its read with 'sendrecv_async'
+    dlerror();                  /* Clear any existing error */
+    *(void **) (&(pctx->sendrecv_async)) = dlsym(Slots[pctx->parent].handle, "sendrecv_async");
+    errmsg = dlerror();         /* check for errors */
+    if (errmsg != NULL) {
+        return(-1);
+    }
 
     // The serial_fpga plug-in has a routine that responds to interrupts.
     // The routine polls the FPGA for its two interrupt pending registers.
@@ -182,6 +252,36 @@ int Initialize(
         ((void (*)())reg_intr) (pctx->parent, pctx->coreid, &core_interrupt, (void *) pctx);
     }
 
+    // In push mode the FPGA sends the registers with the interrupt.
+    // Tell serial_fpga which registers intr_done() wants.
+    reg_push = dlsym(Slots[pctx->parent].handle, "register_push_window");
+    if (reg_push != (void *) 0) {
+        ((void (*)())reg_push) (pctx->parent, pctx->coreid, HBA_SONAR_REG_SONAR0, 2, &intr_done);
+    }
+
+    // The FPGA can leave out the window registers that have not changed
+    // since the last push.  Older serial_fpga plug-ins do not have
+    // 'register_push_dirty'.
+    reg_dirty = dlsym(Slots[pctx->parent].handle, "register_push_dirty");
+    if ((reg_push != (void *) 0) && (reg_dirty != (void *) 0)) {
+        ((void (*)())reg_dirty) (pctx->parent, pctx->coreid, HBA_SONAR_REG_DIRTY);
+    }
+
+    // The setup registers are written again if the FPGA is reloaded.
+    // Older serial_fpga plug-ins do not have 'register_shadow_restore'.
+    reg_restore = dlsym(Slots[pctx->parent].handle, "register_shadow_restore");
+    if (reg_restore != (void *) 0) {
+        ((void (*)())reg_restore) (pctx->parent, pctx->coreid, HBA_SONAR_REG_CTRL, 1);
+    }
+
+    // The FPGA can hold our interrupts and let them through in groups.
+    // Older serial_fpga plug-ins do not have 'intr_coalesce'.
+    *(void **) (&(pctx->intr_coalesce)) = dlsym(Slots[pctx->parent].handle, "intr_coalesce");
+
+    // Broadcasts can carry the time of the interrupt edge.  Older
+    // serial_fpga plug-ins do not have 'intr_edge_time'.
+    *(void **) (&(pctx->intr_edge_time)) = dlsym(Slots[pctx->parent].handle, "intr_edge_time");
+
     return (0);
 }
 
@@ -200,8 +300,12 @@ void usercmd(
 {
     HBA_SONAR *pctx;     // hba_sonar private info
     int       nctrl=0;   // new ctrl value for SONAR pins
+    int       nval;      // new maxage
     int       nsd;       // number of bytes sent to FPGA
     int       ret;       // generic call return value
+    int       ncnt;     // new coalescing count
+    int       nus;      // new coalescing time
+    int       ntstamp;  // ==1 to add edge times to broadcasts
     uint8_t   pkt[HBA_MXPKT];
 
     // Get this instance of the plug-in
@@ -222,7 +326,7 @@ void usercmd(
         pkt[1] = HBA_SONAR_REG_CTRL;
         pkt[2] = pctx->ctrl;                     // new value
         pkt[3] = 0;                             // dummy for the ack
-        nsd = pctx->sendrecv_pkt(pctx->parent, 4, pkt);
+        nsd = pctx->sendrecv_shadow(pctx->parent, 4, pkt);
         // We did a write so the sendrecv return value should be 1
         // and the returned byte should be an ACK
         if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
@@ -233,6 +337,10 @@ void usercmd(
     } else if ((cmd == EDGET) && (rscid == RSC_CTRL)) {
         ret = snprintf(buf, *plen, "%x\n", pctx->ctrl);
         *plen = ret;  // (errors are handled in calling routine)
+    } else if ((cmd == EDGET) && (rscid == RSC_SONAR0) && fresh(pctx)) {
+        // The last interrupt is recent enough.  No need to ask the FPGA.
+        ret = snprintf(buf, *plen, "%02x\n", pctx->sonar0);
+        *plen = ret;  // (errors are handled in calling routine)
     } else if ((cmd == EDGET) && (rscid == RSC_SONAR0)) {
         // Read value in FPGA SONAR0 value register
         pkt[0] = HBA_READ_CMD | ((1 -1) << 4) | pctx->coreid;
@@ -253,6 +361,9 @@ void usercmd(
             ret = snprintf(buf, *plen, "%02x\n", pctx->sonar0);
             *plen = ret;  // (errors are handled in calling routine)
         }
+    } else if ((cmd == EDGET) && (rscid == RSC_SONAR1) && fresh(pctx)) {
+        ret = snprintf(buf, *plen, "%02x\n", pctx->sonar1);
+        *plen = ret;  // (errors are handled in calling routine)
     } else if ((cmd == EDGET) && (rscid == RSC_SONAR1)) {
         // Read value in FPGA SONAR1 value register
         pkt[0] = HBA_READ_CMD | ((1 -1) << 4) | pctx->coreid;
@@ -273,6 +384,49 @@ void usercmd(
             ret = snprintf(buf, *plen, "%02x\n", pctx->sonar1);
             *plen = ret;  // (errors are handled in calling routine)
         }
+    } else if ((cmd == EDSET) && (rscid == RSC_COALESCE)) {
+        ret = sscanf(val, "%d %d", &ncnt, &nus);
+        if ((ret != 2) || (ncnt < 0) || (ncnt > MX_COALCNT) || (nus < 0) ||
+            (nus > MX_COALUS) || (pctx->intr_coalesce == 0)) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        // serial_fpga keeps the setting and sends it again if the
+        // FPGA is reloaded
+        if (pctx->intr_coalesce(pctx->parent, pctx->coreid, ncnt, nus) != 0) {
+            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        pctx->coalcnt = ncnt;
+        pctx->coalus = nus;
+    } else if ((cmd == EDGET) && (rscid == RSC_COALESCE)) {
+        ret = snprintf(buf, *plen, "%d %d\n", pctx->coalcnt, pctx->coalus);
+        *plen = ret;  // (errors are handled in calling routine)
+    } else if ((cmd == EDSET) && (rscid == RSC_TSTAMP)) {
+        ret = sscanf(val, "%d", &ntstamp);
+        if ((ret != 1) || (ntstamp < 0) || (ntstamp > 1) ||
+            ((ntstamp == 1) && (pctx->intr_edge_time == 0))) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;  // (errors are handled in calling routine)
+            return;
+        }
+        pctx->tstamp = ntstamp;
+    } else if ((cmd == EDGET) && (rscid == RSC_TSTAMP)) {
+        ret = snprintf(buf, *plen, "%d\n", pctx->tstamp);
+        *plen = ret;  // (errors are handled in calling routine)
+    } else if ((cmd == EDSET) && (rscid == RSC_MAXAGE)) {
+        ret = sscanf(val, "%d", &nval);
+        if ((ret != 1) || (nval < 0) || (nval > MX_MAXAGE)) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;
+            return;
+        }
+        pctx->maxage = nval;
+    } else if ((cmd == EDGET) && (rscid == RSC_MAXAGE)) {
+        ret = snprintf(buf, *plen, "%d\n", pctx->maxage);
+        *plen = ret;  // (errors are handled in calling routine)
     }
 
     // Nothing to do here if edcat.  That is handled in the UI code
@@ -287,14 +441,7 @@ void usercmd(
 void core_interrupt(void *trans)
 {
     HBA_SONAR   *pctx;       // this peripheral's private info
-    SLOT        *pslot;      // This instance of the serial plug-in
-    RSC         *prsc;       // pointer to this slot's counts resource
-    int          nsd;        // number of bytes sent to FPGA
     uint8_t      pkt[HBA_MXPKT];  
-    char         msg[MX_MSGLEN * 3 +1]; // text to send.  +1 for newline
-    int          slen;       // length of text to output
-    int          new0;
-    int          new1;
 
     // get pointers to this instance of the plug-in and its slot
     pctx = (HBA_SONAR *) trans; // transparent data is our context
@@ -308,13 +455,40 @@ void core_interrupt(void *trans)
     pkt[4] = 0;                     // dummy byte (echo0)
     pkt[5] = 0;                     // dummy byte (echo1)
 
-    nsd = pctx->sendrecv_pkt(pctx->parent, 6, pkt);
+    // The values are broadcast from intr_done() when they arrive
+    if (pctx->sendrecv_async(pctx->parent, 6, pkt, intr_done, trans) < 0) {
+        edlog("Error reading value from SONAR");
+    }
+}
+
+
+/**************************************************************
+ * intr_done():  - the registers read by core_interrupt() are in
+ **************************************************************/
+static void intr_done(
+    void        *trans,      // our context (==*HBA_SONAR)
+    int          nsd,        // number of bytes received from FPGA
+    uint8_t     *pkt)        // the response
+{
+    HBA_SONAR   *pctx;       // this peripheral's private info
+    SLOT        *pslot;      // This instance of the serial plug-in
+    RSC         *prsc;       // pointer to this slot's counts resource
+    char         msg[MX_MSGLEN * 3 +1]; // text to send.  +1 for newline
+    int          slen;       // length of text to output
+    int          new0;
+    int          new1;
+
+    pctx = (HBA_SONAR *) trans; // transparent data is our context
+
     // We sent header + four bytes so the sendrecv return value should be 4
     if (nsd != 4) {
         // error reading value from SONAR port
         edlog("Error reading value from SONAR");
         return;
     }
+    if (pctx->intr_edge_time != 0) {
+        pctx->tedge = pctx->intr_edge_time(pctx->parent);
+    }
     new0 = pkt[2];   // first two bytes are echo of header
     new1 = pkt[3];
 
@@ -324,6 +498,7 @@ void core_interrupt(void *trans)
         prsc = &(pslot->rsc[RSC_SONAR0]);
         if (prsc->bkey != 0) {
             slen = snprintf(msg, (MX_MSGLEN -1), "%x\n", new0);
+            slen = add_tstamp(pctx, msg, slen);
             bcst_ui(msg, slen, &(prsc->bkey));
         }
     }
@@ -333,11 +508,57 @@ void core_interrupt(void *trans)
         prsc = &(pslot->rsc[RSC_SONAR1]);
         if (prsc->bkey != 0) {
             slen = snprintf(msg, (MX_MSGLEN -1), "%x\n", new1);
+            slen = add_tstamp(pctx, msg, slen);
             bcst_ui(msg, slen, &(prsc->bkey));
         }
     }
     pctx->sonar0 = new0;
     pctx->sonar1 = new1;
+    pctx->tintr = now_ms();
+}
+
+
+/**************************************************************
+ * fresh():  - Returns 1 if the values from the last interrupt are
+ * no older than maxage ms.  Reads can then be answered without
+ * asking the FPGA.
+ **************************************************************/
+static int fresh(
+    HBA_SONAR  *pctx)      // our private info
+{
+    return((pctx->maxage > 0) && (pctx->tintr != 0) &&
+           ((now_ms() - pctx->tintr) <= pctx->maxage));
+}
+
+
+/**************************************************************
+ * now_ms():  - The monotonic time in ms
+ **************************************************************/
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((ts.tv_sec * 1000LL) + (ts.tv_nsec / 1000000));
+}
+
+
+/**************************************************************
+ * add_tstamp():  - Put the time in us of the interrupt edge at
+ * the end of a broadcast line if the user asked for it.  Returns
+ * the new length of the line.
+ **************************************************************/
+static int add_tstamp(
+    HBA_SONAR *pctx,     // this peripheral's private info
+    char      *msg,      // the line, ending in a newline
+    int        slen)     // length of the line
+{
+    if ((pctx->tstamp == 0) || (slen <= 0)) {
+        return(slen);
+    }
+    // Replace the newline with the time and a newline
+    return(slen - 1 + snprintf(&(msg[slen - 1]), (MX_MSGLEN - slen),
+                               " %lld\n", pctx->tedge));
 }
 
 
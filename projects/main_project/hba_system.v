@@ -123,6 +123,9 @@ assign slave_estop[1:0] = 0;
 // hba_qtr -> slave_estop[2]
 assign slave_estop[15:3] = 0;
 
+// Snapshot strobe from serial_fpga to the cores
+wire hba_snapshot;
+
 // Slot 0
 wire [DBUS_WIDTH-1:0] hba_dbus_slave0;   // The output data bus.
 
@@ -179,6 +182,9 @@ serial_fpga #
     // Interrupts from slaves
     .slave_interrupt(slave_interrupt),
 
+    // Snapshot strobe to the cores
+    .hba_snapshot(hba_snapshot),
+
     // HBA Bus Slave Interface
     .hba_clk(clk),
     .hba_reset(reset),
@@ -246,6 +252,7 @@ hba_qtr #
     .hba_select(hba_select),      // Transfer in progress.
     .hba_abus(hba_abus), // The input address bus.
     .hba_dbus(hba_dbus),  // The input data bus.
+    .hba_snapshot(hba_snapshot),    // Copy to the snapshot registers.
 
     .hba_dbus_slave(hba_dbus_slave2),   // The output data bus.
     .hba_xferack_slave(hba_xferack_slave[2]),     // Acknowledge transfer requested. 
@@ -305,6 +312,7 @@ hba_sonar #
     .hba_select(hba_select),      // Transfer in progress.
     .hba_abus(hba_abus), // The input address bus.
     .hba_dbus(hba_dbus),  // The input data bus.
+    .hba_snapshot(hba_snapshot),    // Copy to the snapshot registers.
 
     .hba_dbus_slave(hba_dbus_slave4),   // The output data bus.
     .hba_xferack_slave(hba_xferack_slave[4]),     // Acknowledge transfer requested. 
@@ -335,6 +343,7 @@ hba_quad #
     .hba_select(hba_select),      // Transfer in progress.
     .hba_abus(hba_abus), // The input address bus.
     .hba_dbus(hba_dbus),  // The input data bus.
+    .hba_snapshot(hba_snapshot),    // Copy to the snapshot registers.
 
     .hba_dbus_slave(hba_dbus_slave5),   // The output data bus.
     .hba_xferack_slave(hba_xferack_slave[5]),     // Acknowledge transfer requested. 
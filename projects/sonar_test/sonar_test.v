@@ -91,6 +91,9 @@ wire [15:0] slave_interrupt;
 assign slave_interrupt[0] = 0;
 assign slave_interrupt[15:2] = 0;
 
+// Snapshot strobe from serial_fpga to the cores
+wire hba_snapshot;
+
 // Slot 0
 wire hba_xferack_slave0;   // Asserted when request has been completed.
 wire [DBUS_WIDTH-1:0] hba_dbus_slave0;   // The output data bus.
@@ -137,6 +140,9 @@ serial_fpga #
     // Interrupts from slaves
     .slave_interrupt(slave_interrupt),
 
+    // Snapshot strobe to the cores
+    .hba_snapshot(hba_snapshot),
+
     // HBA Bus Slave Interface
     .hba_clk(clk),
     .hba_reset(reset),
@@ -175,6 +181,7 @@ hba_sonar #
     .hba_select(hba_select),      // Transfer in progress.
     .hba_abus(hba_abus), // The input address bus.
     .hba_dbus(hba_dbus),  // The input data bus.
+    .hba_snapshot(hba_snapshot),    // Copy to the snapshot registers.
 
     .hba_dbus_slave(hba_dbus_slave1),   // The output data bus.
     .hba_xferack_slave(hba_xferack_slave[1]),     // Acknowledge transfer requested. 
@@ -212,6 +212,7 @@ hba_qtr #
     .hba_select(hba_select),      // Transfer in progress.
     .hba_abus(hba_abus), // The input address bus.
     .hba_dbus(hba_dbus),  // The input data bus.
+    .hba_snapshot(1'b0),    // No snapshot strobe without serial_fpga.
 
     .hba_dbus_slave(hba_dbus_slave2),   // The output data bus.
     .hba_xferack_slave(hba_xferack_slave[2]),     // Acknowledge transfer requested. 
@@ -269,6 +270,7 @@ hba_sonar #
     .hba_select(hba_select),      // Transfer in progress.
     .hba_abus(hba_abus), // The input address bus.
     .hba_dbus(hba_dbus),  // The input data bus.
+    .hba_snapshot(1'b0),    // No snapshot strobe without serial_fpga.
 
     .hba_dbus_slave(hba_dbus_slave4),   // The output data bus.
     .hba_xferack_slave(hba_xferack_slave[4]),     // Acknowledge transfer requested. 
@@ -6,6 +6,30 @@
 * a waits to receive a character before 
 * asserting done.
 *
+* Received characters are kept in a small FIFO
+* so none are lost while the FPGA pushes an
+* unsolicited frame with the push port.  Push
+* characters are sent without waiting for a
+* received character.
+*
+* Characters to send go in a second FIFO that
+* feeds the uart.  A write is done as soon as
+* the character is queued so the next bus
+* access runs while the uart shifts this one
+* out.  Back to back packets from the host
+* then go at the full line rate.
+*
+* Flush throws away the received characters,
+* any character being waited on, and the
+* characters not yet sent.  It is used to
+* resync with the host after a break.
+*
+* A CRC-8 (polynomial 0x07) is kept of the
+* characters read with serial_rd and of the
+* characters sent with serial_wr.  The first
+* character read while crc_start is high
+* starts both over.
+*
 * Status: In development
 *
 * Author : Brandon Blodget
@@ -17,10 +41,19 @@
 // Force error when implicit net has no type.
 // `default_nettype none
 
-module send_recv
+module send_recv #
+(
+    // Must be a power of 2
+    parameter integer RX_FIFO_DEPTH = 32,
+    parameter integer TX_FIFO_DEPTH = 32
+)
 (
     input wire clk,
     input wire reset,
+    input wire flush,           // Drop received characters.  Back to IDLE.
+    input wire crc_start,       // Next character read starts a new CRC
+    output reg [7:0] rx_crc,    // CRC of characters read with serial_rd
+    output reg [7:0] tx_crc,    // CRC of characters sent with serial_wr
 
     // control interface
     input wire [7:0] serial_tx_data,
@@ -29,6 +62,13 @@ module send_recv
     output reg serial_valid,
     output reg [7:0] serial_rx_data,
 
+    // push interface.  Send without waiting for a character.
+    input wire [7:0] push_data,
+    input wire push_wr,
+    output reg push_ack,        // push_data taken.  Assert one clock cycle.
+    output wire rx_empty,       // No received characters are waiting.
+    output wire tx_empty,       // All characters are out of the uart.
+
     // TX uart interface
     output reg [7:0] tx_data,
     output reg tx_wr_strobe,
@@ -40,67 +80,216 @@ module send_recv
     output reg rx_rd_strobe
 );
 
+localparam FIFO_BITS = $clog2(RX_FIFO_DEPTH);
+localparam TX_BITS = $clog2(TX_FIFO_DEPTH);
+
 reg [7:0] serial_tx_data_reg;
 reg [2:0] send_recv_state;
+reg rd_only;                    // READ_CHAR is for serial_rd
+
+// CRC-8, polynomial x^8 + x^2 + x + 1, MSB first
+function [7:0] crc8;
+    input [7:0] crc;
+    input [7:0] data;
+    integer b;
+    reg [7:0] c;
+    begin
+        c = crc ^ data;
+        for (b = 0; b < 8; b = b + 1) begin
+            c = c[7] ? ((c << 1) ^ 8'h07) : (c << 1);
+        end
+        crc8 = c;
+    end
+endfunction
+
+// RX FIFO
+reg [7:0] rx_fifo [0:RX_FIFO_DEPTH-1];
+reg [FIFO_BITS-1:0] rx_wr_ptr;
+reg [FIFO_BITS-1:0] rx_rd_ptr;
+reg [FIFO_BITS:0] rx_count;
+reg rx_push;
+reg rx_pop;
+
+assign rx_empty = (rx_count == 0);
+
+// TX FIFO.  Written here and read into tx_data one
+// character at a time as the uart is ready for it.
+reg [7:0] tx_fifo [0:TX_FIFO_DEPTH-1];
+reg [TX_BITS-1:0] tx_wr_ptr;
+reg [TX_BITS-1:0] tx_rd_ptr;
+reg [TX_BITS:0] tx_count;
+reg tx_push;
+reg tx_pop;
+wire tx_room;
+
+// The count lags a write by a clock so leave a spare place
+assign tx_room = (tx_count < TX_FIFO_DEPTH - 1);
+assign tx_empty = (tx_count == 0) && !tx_push && !tx_wr_strobe && !tx_busy;
 
 // States
 localparam IDLE         = 0;
 localparam WRITE_CHAR   = 1;
 localparam READ_CHAR    = 2;
 
+// Move characters from the uart into the FIFO as they arrive
 always @ (posedge clk)
 begin
     if (reset) begin
-        send_recv_state <= 0;
-        tx_wr_strobe <= 0;
         rx_rd_strobe <= 0;
+        rx_wr_ptr <= 0;
+        rx_push <= 0;
+    end else begin
+        rx_rd_strobe <= 0;
+        rx_push <= 0;
+        if (rx_valid && !rx_rd_strobe &&
+            (flush || (rx_count != RX_FIFO_DEPTH))) begin
+            // Keep the uart empty while flushing
+            if (!flush) begin
+                rx_fifo[rx_wr_ptr] <= rx_data;
+                rx_wr_ptr <= rx_wr_ptr + 1;
+                rx_push <= 1;
+            end
+            rx_rd_strobe <= 1;
+        end
+        if (flush) begin
+            rx_wr_ptr <= 0;
+        end
+    end
+end
+
+// Number of characters in the FIFO
+always @ (posedge clk)
+begin
+    if (reset || flush) begin
+        rx_count <= 0;
+    end else begin
+        if (rx_push && !rx_pop) begin
+            rx_count <= rx_count + 1;
+        end else if (rx_pop && !rx_push) begin
+            rx_count <= rx_count - 1;
+        end
+    end
+end
+
+// Number of characters in the TX FIFO
+always @ (posedge clk)
+begin
+    if (reset || flush) begin
+        tx_count <= 0;
+    end else begin
+        if (tx_push && !tx_pop) begin
+            tx_count <= tx_count + 1;
+        end else if (tx_pop && !tx_push) begin
+            tx_count <= tx_count - 1;
+        end
+    end
+end
+
+// Move characters from the TX FIFO to the uart
+always @ (posedge clk)
+begin
+    if (reset || flush) begin
+        tx_rd_ptr <= 0;
+        tx_wr_strobe <= 0;
+        tx_pop <= 0;
+        tx_data <= 0;
+    end else begin
+        tx_wr_strobe <= 0;
+        tx_pop <= 0;
+        if ((tx_count != 0) && !tx_busy && !tx_wr_strobe && !tx_pop) begin
+            tx_data <= tx_fifo[tx_rd_ptr];
+            tx_rd_ptr <= tx_rd_ptr + 1;
+            tx_wr_strobe <= 1;
+            tx_pop <= 1;
+        end
+    end
+end
+
+always @ (posedge clk)
+begin
+    if (reset) begin
+        send_recv_state <= 0;
         serial_valid <= 0;
         serial_tx_data_reg <= 0;
-        tx_data <= 0;
         serial_rx_data <= 0;
+        tx_wr_ptr <= 0;
+        tx_push <= 0;
+        rx_rd_ptr <= 0;
+        rx_pop <= 0;
+        push_ack <= 0;
+        rd_only <= 0;
+        rx_crc <= 0;
+        tx_crc <= 0;
     end else begin
+        rx_pop <= 0;
+        push_ack <= 0;
+        tx_push <= 0;
         case (send_recv_state)
             IDLE : begin
-                tx_wr_strobe <= 0;
-                rx_rd_strobe <= 0;
                 serial_valid <= 0;
 
                 if (serial_wr) begin
                     // Write then read
                     serial_tx_data_reg <= serial_tx_data;
+                    rd_only <= 0;
                     send_recv_state <= WRITE_CHAR;
                 end
 
                 if (serial_rd) begin
                     // Read only
+                    rd_only <= 1;
                     send_recv_state <= READ_CHAR;
                 end
             end
             WRITE_CHAR : begin
-                // Send the char
-                if (!tx_busy) begin
-                    tx_data <= serial_tx_data_reg;
-                    tx_wr_strobe <= 1;
+                // Queue the char.  Wait out a push character.
+                if (tx_room && !tx_push) begin
+                    tx_fifo[tx_wr_ptr] <= serial_tx_data_reg;
+                    tx_wr_ptr <= tx_wr_ptr + 1;
+                    tx_push <= 1;
+                    tx_crc <= crc8(tx_crc, serial_tx_data_reg);
                     send_recv_state <= READ_CHAR;
                 end
             end
             READ_CHAR : begin
-                tx_wr_strobe <= 0;
                 // Wait for reception of char to proceed
-                if (rx_valid) begin
+                if ((rx_count != 0) && !rx_pop) begin
                     // Received a byte
-                    rx_rd_strobe <= 1;
+                    rx_pop <= 1;
+                    rx_rd_ptr <= rx_rd_ptr + 1;
                     serial_valid <= 1;
-                    serial_rx_data <= rx_data;
+                    serial_rx_data <= rx_fifo[rx_rd_ptr];
                     send_recv_state <= IDLE;
+                    if (rd_only && crc_start) begin
+                        rx_crc <= crc8(8'h00, rx_fifo[rx_rd_ptr]);
+                        tx_crc <= 0;
+                    end else if (rd_only) begin
+                        rx_crc <= crc8(rx_crc, rx_fifo[rx_rd_ptr]);
+                    end
                 end
             end
             default : begin
                 send_recv_state <= IDLE;
             end
         endcase
+
+        // Push characters are queued when we are not sending a reply
+        if (push_wr && !push_ack && tx_room && !tx_push &&
+            (send_recv_state != WRITE_CHAR)) begin
+            tx_fifo[tx_wr_ptr] <= push_data;
+            tx_wr_ptr <= tx_wr_ptr + 1;
+            tx_push <= 1;
+            push_ack <= 1;
+        end
+
+        if (flush) begin
+            send_recv_state <= IDLE;
+            serial_valid <= 0;
+            rx_rd_ptr <= 0;
+            tx_wr_ptr <= 0;
+            tx_push <= 0;
+        end
     end
 end
 
 endmodule
-
@@ -49,6 +49,8 @@ module serial_fpga #
     parameter integer PERIPH_ADDR_WIDTH = 4,
     parameter integer REG_ADDR_WIDTH = 8,
     parameter integer PERIPH_ADDR = 0,
+    // Clocks to wait for a slave before counting a bus error
+    parameter integer BUS_TIMEOUT = 256,
     // Default ADDR_WIDTH = 12
     parameter integer ADDR_WIDTH = PERIPH_ADDR_WIDTH + REG_ADDR_WIDTH
 )
@@ -61,6 +63,10 @@ module serial_fpga #
     // Interrupts  from slave
     input wire [15:0] slave_interrupt,
 
+    // Snapshot strobe to the cores.  Pulses for one clock when the
+    // host writes reg17.
+    output reg hba_snapshot,
+
     // HBA Bus Slave Interface
     input wire hba_clk,
     input wire hba_reset,
@@ -109,6 +115,7 @@ reg app_rnw;
 reg app_en_strobe;    // rising edge start state machine
 wire [DBUS_WIDTH-1:0] app_data_out;
 wire app_valid_out;    // read or write transfer complete. Assert one clock cycle.
+wire app_timeout_out;  // no slave replied to the transfer
 
 // send_recv UI
 reg [7:0] serial_tx_data;
@@ -130,6 +137,85 @@ reg [DBUS_WIDTH-1:0] reg_intr1_in;
 
 wire [DBUS_WIDTH-1:0] reg_rate_ms;
 
+// reg3 reads back the protocol revision
+wire [DBUS_WIDTH-1:0] bank_dbus_slave;
+wire bank_xferack_slave;
+wire rev_hit;
+
+// Second register bank.  reg4 to reg7.
+wire [DBUS_WIDTH-1:0] bank1_dbus_slave;
+wire bank1_xferack_slave;
+reg slv1_wr_en;
+
+// reg4: Number of bus errors and NACKs since last read
+wire [DBUS_WIDTH-1:0] reg_errors;
+reg [DBUS_WIDTH-1:0] reg_errors_in;
+
+// reg5: Link control.  bit0 turns on push mode.  bit1 turns on
+// CRC framing.
+wire [DBUS_WIDTH-1:0] reg_link;
+
+// reg6 and reg7: Push window setup.  reg6 has the core in 7:4 and the
+// number of registers in 3:0.  Writing the first register to reg7 sets
+// the window for that core.
+wire [DBUS_WIDTH-1:0] reg_win_sel;
+wire [DBUS_WIDTH-1:0] reg_win_reg;
+
+// Third register bank.  reg8 to reg11.
+wire [DBUS_WIDTH-1:0] bank2_dbus_slave;
+wire bank2_xferack_slave;
+
+// reg8 to reg10: Baud rate to switch to, low byte first.  Writing
+// reg11 makes the switch.
+wire [DBUS_WIDTH-1:0] reg_baud0;
+wire [DBUS_WIDTH-1:0] reg_baud1;
+wire [DBUS_WIDTH-1:0] reg_baud2;
+wire [DBUS_WIDTH-1:0] reg_baud_sw;
+
+// Fourth register bank.  reg12 to reg15.
+wire [DBUS_WIDTH-1:0] bank3_dbus_slave;
+wire bank3_xferack_slave;
+
+// reg12 to reg15: Interrupt coalescing.  reg12 has the core in 3:0,
+// reg13 the count, and reg14 and reg15 the time in us, low byte
+// first.  Writing reg15 sets them for that core.
+wire [DBUS_WIDTH-1:0] reg_coal_sel;
+wire [DBUS_WIDTH-1:0] reg_coal_cnt;
+wire [DBUS_WIDTH-1:0] reg_coal_us0;
+wire [DBUS_WIDTH-1:0] reg_coal_us1;
+
+// Fifth register bank.  reg16 to reg19.
+wire [DBUS_WIDTH-1:0] bank4_dbus_slave;
+wire bank4_xferack_slave;
+
+// reg16: Dirty map register.  Writing it makes the push window of the
+// core in reg6 a dirty window.  reg17: Writing it pulses hba_snapshot.
+// reg18 and reg19 are unused.
+wire [DBUS_WIDTH-1:0] reg_dirty_reg;
+
+// Interrupts from the cores once they have been coalesced
+reg [15:0] coal_fire;
+
+// Baud rate of the uart.  BAUD until the host switches it.
+reg [31:0] baud_rate;
+
+// Break on io_rxd.  Resets the parser.  A long break also puts the
+// baud rate back to BAUD.
+reg link_break;
+reg long_break;
+
+// CRC framing.  send_recv keeps the CRCs.
+wire crc_start;
+wire [7:0] rx_crc;
+wire [7:0] tx_crc;
+
+// push interface to send_recv
+reg [7:0] push_data;
+reg push_wr;
+wire push_ack;
+wire rx_empty;
+wire tx_empty;
+
 /*
 ****************************
 * Instantiations
@@ -142,7 +228,7 @@ buart # (
     // inputs
    .clk(hba_clk),
    .resetq(~hba_reset),
-   .baud(BAUD),    // [31:0] max = 32'd921600
+   .baud(baud_rate),    // [31:0]
    .rx(io_rxd),            // recv wire
    .rd(uart0_rd),    // read strobe
    .wr(uart0_wr),   // write strobe
@@ -159,6 +245,10 @@ send_recv send_recv_inst
 (
     .clk(hba_clk),
     .reset(hba_reset),
+    .flush(link_break),
+    .crc_start(crc_start),
+    .rx_crc(rx_crc),
+    .tx_crc(tx_crc),
 
     // control interface
     .serial_tx_data(serial_tx_data), // [7:0]
@@ -167,6 +257,13 @@ send_recv send_recv_inst
     .serial_valid(serial_valid),
     .serial_rx_data(serial_rx_data),
 
+    // push interface
+    .push_data(push_data), // [7:0]
+    .push_wr(push_wr),
+    .push_ack(push_ack),
+    .rx_empty(rx_empty),
+    .tx_empty(tx_empty),
+
     // TX uart interface
     .tx_data(tx_data), // [7:0]
     .tx_wr_strobe(uart0_wr),
@@ -182,7 +279,8 @@ hba_master #
 (
     .DBUS_WIDTH(DBUS_WIDTH),
     .PERIPH_ADDR_WIDTH(PERIPH_ADDR_WIDTH),
-    .REG_ADDR_WIDTH(REG_ADDR_WIDTH)
+    .REG_ADDR_WIDTH(REG_ADDR_WIDTH),
+    .XFER_TIMEOUT(BUS_TIMEOUT)
 ) hba_master_inst
 (
     // App interface
@@ -193,6 +291,7 @@ hba_master #
     .app_en_strobe(app_en_strobe),  // rising edge start state machine
     .app_data_out(app_data_out),
     .app_valid_out(app_valid_out),  // read or write transfer complete. Assert one clock cycle.
+    .app_timeout_out(app_timeout_out),  // no slave replied.
 
     // HBA Bus Master Interface
     .hba_clk(hba_clk),
@@ -223,8 +322,8 @@ hba_reg_bank #
     .hba_abus(hba_abus), // The input address bus.
     .hba_dbus(hba_dbus),  // The input data bus.
 
-    .hba_dbus_slave(hba_dbus_slave),   // The output data bus.
-    .hba_xferack_slave(hba_xferack_slave),     // Acknowledge transfer requested. 
+    .hba_dbus_slave(bank_dbus_slave),   // The output data bus.
+    .hba_xferack_slave(bank_xferack_slave),     // Acknowledge transfer requested. 
                                     // Asserted when request has been completed. 
                                     // Must be zero when inactive.
 
@@ -242,6 +341,129 @@ hba_reg_bank #
     .slv_autoclr_mask(4'b011)   // 0011, Enable clearing when read
 );
 
+hba_reg_bank #
+(
+    .DBUS_WIDTH(DBUS_WIDTH),
+    .PERIPH_ADDR_WIDTH(PERIPH_ADDR_WIDTH),
+    .REG_ADDR_WIDTH(REG_ADDR_WIDTH),
+    .PERIPH_ADDR(PERIPH_ADDR),
+    .REG_OFFSET(4)
+) hba_reg_bank1_inst
+(
+    // HBA Bus Slave Interface
+    .hba_clk(hba_clk),
+    .hba_reset(hba_reset),
+    .hba_rnw(hba_rnw),         // 1=Read from register. 0=Write to register.
+    .hba_select(hba_select),      // Transfer in progress.
+    .hba_abus(hba_abus), // The input address bus.
+    .hba_dbus(hba_dbus),  // The input data bus.
+
+    .hba_dbus_slave(bank1_dbus_slave),   // The output data bus.
+    .hba_xferack_slave(bank1_xferack_slave),     // Acknowledge transfer requested.
+
+    // Access to registgers
+    .slv_reg0(reg_errors),        // read access
+    .slv_reg0_in(reg_errors_in),  // write access
+
+    .slv_reg1(reg_link),          // Link control
+    .slv_reg2(reg_win_sel),       // Push window core and length
+    .slv_reg3(reg_win_reg),       // Push window first register
+
+    .slv_wr_en(slv1_wr_en),
+    .slv_wr_mask(4'b0001),      // 0001, Enable writes to reg4.
+    .slv_autoclr_mask(4'b0001)  // 0001, Clear reg4 when read
+);
+
+hba_reg_bank #
+(
+    .DBUS_WIDTH(DBUS_WIDTH),
+    .PERIPH_ADDR_WIDTH(PERIPH_ADDR_WIDTH),
+    .REG_ADDR_WIDTH(REG_ADDR_WIDTH),
+    .PERIPH_ADDR(PERIPH_ADDR),
+    .REG_OFFSET(8)
+) hba_reg_bank2_inst
+(
+    // HBA Bus Slave Interface
+    .hba_clk(hba_clk),
+    .hba_reset(hba_reset),
+    .hba_rnw(hba_rnw),         // 1=Read from register. 0=Write to register.
+    .hba_select(hba_select),      // Transfer in progress.
+    .hba_abus(hba_abus), // The input address bus.
+    .hba_dbus(hba_dbus),  // The input data bus.
+
+    .hba_dbus_slave(bank2_dbus_slave),   // The output data bus.
+    .hba_xferack_slave(bank2_xferack_slave),     // Acknowledge transfer requested.
+
+    // Access to registgers
+    .slv_reg0(reg_baud0),         // Baud rate [7:0]
+    .slv_reg1(reg_baud1),         // Baud rate [15:8]
+    .slv_reg2(reg_baud2),         // Baud rate [23:16]
+    .slv_reg3(reg_baud_sw),       // Switch baud rate
+
+    .slv_wr_en(1'b0),           // No write.
+    .slv_wr_mask(4'b0000),
+    .slv_autoclr_mask(4'b0000)
+);
+
+hba_reg_bank #
+(
+    .DBUS_WIDTH(DBUS_WIDTH),
+    .PERIPH_ADDR_WIDTH(PERIPH_ADDR_WIDTH),
+    .REG_ADDR_WIDTH(REG_ADDR_WIDTH),
+    .PERIPH_ADDR(PERIPH_ADDR),
+    .REG_OFFSET(12)
+) hba_reg_bank3_inst
+(
+    // HBA Bus Slave Interface
+    .hba_clk(hba_clk),
+    .hba_reset(hba_reset),
+    .hba_rnw(hba_rnw),         // 1=Read from register. 0=Write to register.
+    .hba_select(hba_select),      // Transfer in progress.
+    .hba_abus(hba_abus), // The input address bus.
+    .hba_dbus(hba_dbus),  // The input data bus.
+
+    .hba_dbus_slave(bank3_dbus_slave),   // The output data bus.
+    .hba_xferack_slave(bank3_xferack_slave),     // Acknowledge transfer requested.
+
+    // Access to registgers
+    .slv_reg0(reg_coal_sel),      // Coalescing core
+    .slv_reg1(reg_coal_cnt),      // Coalescing count
+    .slv_reg2(reg_coal_us0),      // Coalescing time [7:0]
+    .slv_reg3(reg_coal_us1),      // Coalescing time [15:8]
+
+    .slv_wr_en(1'b0),           // No write.
+    .slv_wr_mask(4'b0000),
+    .slv_autoclr_mask(4'b0000)
+);
+
+hba_reg_bank #
+(
+    .DBUS_WIDTH(DBUS_WIDTH),
+    .PERIPH_ADDR_WIDTH(PERIPH_ADDR_WIDTH),
+    .REG_ADDR_WIDTH(REG_ADDR_WIDTH),
+    .PERIPH_ADDR(PERIPH_ADDR),
+    .REG_OFFSET(16)
+) hba_reg_bank4_inst
+(
+    // HBA Bus Slave Interface
+    .hba_clk(hba_clk),
+    .hba_reset(hba_reset),
+    .hba_rnw(hba_rnw),         // 1=Read from register. 0=Write to register.
+    .hba_select(hba_select),      // Transfer in progress.
+    .hba_abus(hba_abus), // The input address bus.
+    .hba_dbus(hba_dbus),  // The input data bus.
+
+    .hba_dbus_slave(bank4_dbus_slave),   // The output data bus.
+    .hba_xferack_slave(bank4_xferack_slave),     // Acknowledge transfer requested.
+
+    // Access to registgers
+    .slv_reg0(reg_dirty_reg),     // Dirty map register
+
+    .slv_wr_en(1'b0),           // No write.
+    .slv_wr_mask(4'b0000),
+    .slv_autoclr_mask(4'b0000)
+);
+
 
 /*
 ****************************
@@ -249,21 +471,231 @@ hba_reg_bank #
 ****************************
 */
 
+// Protocol revision.  Read back in reg3 so the host knows
+// which commands it can use.  Old bitstreams read back 0.
+//   1 : Extended commands.  Long bursts.
+//   2 : Posted writes.  Bus timeout.  Error count in reg4.
+//   3 : Exchange command.  A write then a read in one packet.
+//   4 : Gather command.  Reads from a list of cores in one packet.
+//   5 : Push mode.  Gather echoes its command byte.
+//   6 : A break on the serial line resets the parser.
+//   7 : CRC framing with sequence numbers.
+//   8 : Baud rate switch in reg8 to reg11.
+//   9 : Per-core interrupt coalescing in reg12 to reg15.
+//  10 : Dirty push windows in reg16.
+//  11 : Snapshot strobe in reg17.
+//  12 : Framed packets sent again get their logged response.
+localparam PROTOCOL_REV     = 8'd12;
+
+// Extended commands
+localparam EXT_CORE_ADDR        = 4'hF;
+localparam EXT_OP_BURST         = 3'd0;
+localparam EXT_OP_POSTED        = 3'd1;
+localparam EXT_OP_EXCHANGE      = 3'd2;
+localparam EXT_OP_GATHER        = 3'd3;
+
+// Combine the five register banks.  Reads of reg3 return the
+// protocol revision instead of the (unused) bank register.
+assign hba_xferack_slave = bank_xferack_slave | bank1_xferack_slave |
+    bank2_xferack_slave | bank3_xferack_slave | bank4_xferack_slave;
+assign rev_hit = bank_xferack_slave & hba_rnw &
+    (hba_abus[REG_ADDR_WIDTH-1:0] == 3);
+assign hba_dbus_slave = rev_hit ? PROTOCOL_REV :
+    (bank_dbus_slave | bank1_dbus_slave | bank2_dbus_slave |
+     bank3_dbus_slave | bank4_dbus_slave);
+
+// Push windows.  One per core.  A dirty window has the register
+// of the core's dirty map in win_map.
+reg [7:0] win_reg [0:15];
+reg [3:0] win_len [0:15];
+reg [7:0] win_map [0:15];
+reg [15:0] win_dirty;
+wire win_wr;
+wire dirty_wr;
+wire link_wr;
+
+// A write of reg7 sets the window of the core in reg6
+assign win_wr = bank1_xferack_slave & ~hba_rnw &
+    (hba_abus[REG_ADDR_WIDTH-1:0] == 7);
+
+// A write of reg5 starts a new run of sequence numbers
+assign link_wr = bank1_xferack_slave & ~hba_rnw &
+    (hba_abus[REG_ADDR_WIDTH-1:0] == 5);
+
+// A write of reg16 makes it a dirty window
+assign dirty_wr = bank4_xferack_slave & ~hba_rnw &
+    (hba_abus[REG_ADDR_WIDTH-1:0] == 16);
+
+// A write of reg17 has every core copy its live registers to its
+// snapshot registers on the same clock
+always @ (posedge hba_clk)
+begin
+    if (hba_reset) begin
+        hba_snapshot <= 0;
+    end else begin
+        hba_snapshot <= bank4_xferack_slave & ~hba_rnw &
+            (hba_abus[REG_ADDR_WIDTH-1:0] == 17);
+    end
+end
+
+integer w;
+always @ (posedge hba_clk)
+begin
+    if (hba_reset) begin
+        for (w = 0; w < 16; w = w + 1) begin
+            win_len[w] <= 0;
+        end
+        win_dirty <= 0;
+    end else if (win_wr) begin
+        win_reg[reg_win_sel[7:4]] <= hba_dbus;
+        win_len[reg_win_sel[7:4]] <= reg_win_sel[3:0];
+        win_dirty[reg_win_sel[7:4]] <= 0;
+    end else if (dirty_wr) begin
+        win_map[reg_win_sel[7:4]] <= hba_dbus;
+        win_dirty[reg_win_sel[7:4]] <= 1;
+    end
+end
+
+// Break detect.  The host holds the line low for more than two
+// characters to get the parser back to IDLE after it has lost
+// its place in the byte stream.  The break is counted in bit times
+// at the current baud rate.  A break of more than 100 ms is a long
+// break.  It puts the baud rate back to BAUD so a host that has
+// lost track of the rate can always get back in.
+localparam BREAK_BITS = 20;
+localparam LONG_BREAK_CLKS = CLK_FREQUENCY / 10;
+localparam LONG_BREAK_BITS = $clog2(LONG_BREAK_CLKS + 1);
+reg [4:0] break_count;
+reg [LONG_BREAK_BITS-1:0] long_count;
+reg [1:0] rxd_sync;
+wire bit_tick;
+
+baudgen # (
+    .CLKFREQ(CLK_FREQUENCY)
+) break_baudgen (
+   .clk(hba_clk),
+   .resetq(~hba_reset),
+   .baud(baud_rate),
+   .restart(rxd_sync[1]),
+   .ser_clk(bit_tick)
+);
+
+always @ (posedge hba_clk)
+begin
+    if (hba_reset) begin
+        rxd_sync <= 2'b11;
+        break_count <= 0;
+        long_count <= 0;
+        link_break <= 0;
+        long_break <= 0;
+    end else begin
+        rxd_sync <= {rxd_sync[0], io_rxd};
+        long_break <= 0;
+        if (rxd_sync[1]) begin
+            break_count <= 0;
+            long_count <= 0;
+            link_break <= 0;
+        end else begin
+            if (break_count == BREAK_BITS) begin
+                link_break <= 1;
+            end else if (bit_tick) begin
+                break_count <= break_count + 1;
+            end
+            if (long_count == LONG_BREAK_CLKS - 1) begin
+                long_break <= 1;
+            end
+            if (long_count != LONG_BREAK_CLKS) begin
+                long_count <= long_count + 1;
+            end
+        end
+    end
+end
+
+// Push frames start with this marker.  No response to a command
+// starts with it so the host can tell a frame from a response.
+localparam PUSH_MARK        = 8'h50;
+
+// Set in the core byte of a dirty push frame
+localparam PUSH_DIRTY       = 8'h80;
+
+// Sent in place of a response when a framed packet fails its CRC.
+// Everything after it is dropped until the host sends a break.
+localparam FRAME_ERR        = 8'h5E;
+
 // Serial Interface State Machine.
-reg [3:0] serial_state;
+reg [5:0] serial_state;
 
 reg [7:0] cmd_byte;
 reg [7:0] regaddr_byte;
-reg [3:0] transfer_num;
+reg [7:0] core_byte;     // Extended commands only
+reg [7:0] len_byte;      // Extended commands only
+reg [7:0] transfer_num;
+reg [PERIPH_ADDR_WIDTH-1:0] core_sel;
+reg xact_err;            // A bus error in this transaction
+reg xchg_rd;             // Exchange command is in its read half
+reg [7:0] desc_num;      // Gather descriptors still to read
+reg [15:0] push_pend;    // Interrupts still to push
+reg [3:0] push_core;     // Lowest core in push_pend
+reg dirty_on;            // This push sends only the dirty registers
+reg [7:0] dirty_map;     // Dirty registers in the window
+reg [3:0] dirty_cnt;     // Number of bits set in dirty_map
+wire [7:0] win_mask;     // Registers in the window
+reg pend_valid;          // A command byte arrived during a push
+reg [7:0] pend_byte;
+wire push_go;
+wire push_state;
+wire bus_busy;
+reg err_strobe;          // Count one error
+reg frame_on;            // This packet has a CRC and sequence number
+reg replay;              // Writing the checked data to the bus
+reg [7:0] seq_byte;      // Sequence number of a framed packet
+reg [7:0] widx;          // Index into wbuf
+reg [7:0] wbuf [0:255];  // Write data of a framed packet
+reg [7:0] wbuf_q;        // wbuf[widx]
+
+// The responses of the last four framed packets are kept.  The host
+// sets bit 7 of the sequence number when it sends a packet again.  If
+// the packet with that number was run, its logged response is sent
+// and the packet is not run a second time.  Read data is logged and
+// writes keep only their ACK or NACK.  The echoed header comes from
+// the packet itself.
+reg rlog_on;             // This packet's response goes in the log
+reg dup;                 // Answer this packet from the log
+reg [7:0] rlog [0:1023]; // Read data, 256 bytes for each packet
+reg [7:0] rlog_q;        // rlog[{rlog_slot, widx}]
+reg [6:0] rlog_seq [0:3]; // Sequence number of each packet
+reg [3:0] rlog_ok;       // The packet ran to the end
+reg [3:0] rlog_err;      // The packet was NACKed
+wire [1:0] rlog_slot;
+wire rlog_hit;
 
 wire rnw_bit;
 wire [2:0] num_bytes_bits;
 wire [3:0] core_addr_bits;
+wire ext_bit;
+wire [2:0] ext_op_bits;
+wire xchg_bit;
+wire gather_bit;
+wire xfer_rnw;
 
 assign rnw_bit = cmd_byte[7];
 assign num_bytes_bits = cmd_byte[6:4];
 assign core_addr_bits = cmd_byte[3:0];
 
+// Core address 15 is reserved.  It marks an extended command
+// with the op code in place of the number of bytes.
+assign ext_bit = (core_addr_bits == EXT_CORE_ADDR);
+assign ext_op_bits = cmd_byte[6:4];
+
+// An exchange is a write followed by a read of the same core.
+// The write half runs as a write even though rnw is set.
+assign xchg_bit = ext_bit && (ext_op_bits == EXT_OP_EXCHANGE);
+assign xfer_rnw = xchg_bit ? xchg_rd : rnw_bit;
+
+// A gather is a list of (core, reg, length) reads.  The host sends
+// the dummy bytes for each read right after its descriptor.
+assign gather_bit = ext_bit && (ext_op_bits == EXT_OP_GATHER);
+
 // States
 localparam IDLE                     = 0;
 localparam REG_ADDR                 = 1;
@@ -275,6 +707,87 @@ localparam HBA_WAIT                 = 6;
 localparam HBA_WAIT2                = 7;
 localparam ACK                      = 8;
 localparam DONE                     = 9;
+localparam EXT_CORE                 = 10;
+localparam EXT_LEN                  = 11;
+localparam ECHO_CORE                = 12;
+localparam ECHO_LEN                 = 13;
+localparam NACK                     = 14;
+localparam XCHG_RAD                 = 15;
+localparam XCHG_LEN                 = 16;
+localparam GATHER_CORE              = 17;
+localparam GATHER_RAD               = 18;
+localparam GATHER_LEN               = 19;
+localparam GATHER_ECHO              = 20;
+localparam PUSH_START               = 21;
+localparam PUSH_INTR0               = 22;
+localparam PUSH_INTR1               = 23;
+localparam PUSH_SEL                 = 24;
+localparam PUSH_MARK_S              = 25;
+localparam PUSH_CORE                = 26;
+localparam PUSH_LEN                 = 27;
+localparam PUSH_SETUP               = 28;
+localparam PUSH_WAIT                = 29;
+localparam PUSH_DATA                = 30;
+localparam FRAME_SEQ                = 31;
+localparam FRAME_CRC                = 32;
+localparam FRAME_REPLAY             = 33;
+localparam FRAME_RSEQ               = 34;
+localparam FRAME_RCRC               = 35;
+localparam FRAME_LOST               = 36;
+localparam PUSH_MAP                 = 37;
+localparam PUSH_MAPW                = 38;
+localparam PUSH_MAPB                = 39;
+
+// Push when on, there is something to send, and the link is quiet
+assign push_go = reg_link[0] && (io_intr || (push_pend != 0)) &&
+    rx_empty && !serial_valid && !pend_valid;
+assign push_state = ((serial_state >= PUSH_START) &&
+    (serial_state <= PUSH_DATA)) || (serial_state >= PUSH_MAP);
+
+// A packet sent again that was run before
+assign rlog_slot = seq_byte[1:0];
+assign rlog_hit = seq_byte[7] && rlog_ok[rlog_slot] &&
+    (rlog_seq[rlog_slot] == seq_byte[6:0]);
+
+// A new CRC starts with each command byte
+assign crc_start = (serial_state == IDLE) || push_state;
+
+// The write data of a framed packet is held here until its CRC
+// has been checked.
+always @ (posedge hba_clk)
+begin
+    wbuf_q <= wbuf[widx];
+    rlog_q <= rlog[{rlog_slot, widx}];
+end
+
+// A bus transfer is under way.  A break waits for it to finish.
+assign bus_busy = (serial_state == HBA_WAIT) ||
+    (serial_state == PUSH_INTR0) || (serial_state == PUSH_INTR1) ||
+    (serial_state == PUSH_WAIT) || (serial_state == PUSH_MAPW);
+
+// Lowest pending core.  Core 0 is us and is never pushed.
+integer k;
+always @ (*)
+begin
+    push_core = 0;
+    for (k = 15; k > 0; k = k - 1) begin
+        if (push_pend[k]) begin
+            push_core = k;
+        end
+    end
+end
+
+// Dirty windows cover reg0 to reg7.  Bit N of the map is regN.
+assign win_mask = (~(8'hff << transfer_num)) << regaddr_byte;
+
+integer b;
+always @ (*)
+begin
+    dirty_cnt = 0;
+    for (b = 0; b < 8; b = b + 1) begin
+        dirty_cnt = dirty_cnt + dirty_map[b];
+    end
+end
 
 // rnw values
 localparam RPI_WRITE            = 0;
@@ -290,7 +803,29 @@ begin
         serial_state <= IDLE;
         cmd_byte <= 0;
         regaddr_byte <= 0;
+        core_byte <= 0;
+        len_byte <= 0;
         transfer_num <= 0;
+        core_sel <= 0;
+        xact_err <= 0;
+        xchg_rd <= 0;
+        desc_num <= 0;
+        push_pend <= 0;
+        dirty_on <= 0;
+        dirty_map <= 0;
+        push_data <= 0;
+        push_wr <= 0;
+        pend_valid <= 0;
+        pend_byte <= 0;
+        err_strobe <= 0;
+        frame_on <= 0;
+        replay <= 0;
+        seq_byte <= 0;
+        widx <= 0;
+        rlog_on <= 0;
+        dup <= 0;
+        rlog_ok <= 0;
+        rlog_err <= 0;
 
         app_core_addr <= 0;
         app_reg_addr <= 0;
@@ -303,18 +838,80 @@ begin
         serial_rd <= 0;
 
     end else begin
+        // default
+        err_strobe <= 0;
+
+        // Keep a command byte that arrives while we push
+        if (push_state && serial_valid) begin
+            pend_valid <= 1;
+            pend_byte <= serial_rx_data;
+        end
+
         case (serial_state)
             IDLE : begin
                 serial_wr <= 0;
                 transfer_num <= 0;
                 app_en_strobe <= 0;
+                xact_err <= 0;
+                xchg_rd <= 0;
+                replay <= 0;
+                widx <= 0;
+                rlog_on <= 0;
+                dup <= 0;
 
                 // Read the cmd_byte
+                if (serial_valid || pend_valid) begin
+                    serial_rd <= 0;
+                    pend_valid <= 0;
+                    frame_on <= reg_link[1];
+                    cmd_byte <= (pend_valid) ? pend_byte : serial_rx_data;
+                    if (((pend_valid) ? pend_byte[3:0] : serial_rx_data[3:0]) ==
+                        EXT_CORE_ADDR) begin
+                        serial_state <= EXT_CORE;
+                    end else begin
+                        serial_state <= REG_ADDR;
+                    end
+                end else if (push_go) begin
+                    // Send an interrupt to the host
+                    serial_rd <= 0;
+                    serial_state <= PUSH_START;
+                end else begin
+                    serial_rd <= 1;
+                end
+            end
+            EXT_CORE : begin
+                // Read the core byte of an extended command
                 serial_rd <= 1;
                 if (serial_valid) begin
                     serial_rd <= 0;
-                    cmd_byte <= serial_rx_data;
-                    serial_state <= REG_ADDR;
+                    core_byte <= serial_rx_data;
+                    core_sel <= serial_rx_data[3:0];
+                    if (frame_on && ((ext_op_bits == EXT_OP_EXCHANGE) ||
+                        (ext_op_bits == EXT_OP_GATHER) ||
+                        ((ext_op_bits == EXT_OP_POSTED) && (rnw_bit == RPI_READ)) ||
+                        (ext_op_bits > EXT_OP_GATHER))) begin
+                        // Not framed, or unknown.  The length of the
+                        // rest of the packet is not known so treat it
+                        // as a bad frame.  Drop everything until the
+                        // host sends a break.
+                        err_strobe <= 1;
+                        push_data <= FRAME_ERR;
+                        push_wr <= 1;
+                        serial_state <= FRAME_LOST;
+                    end else if ((ext_op_bits == EXT_OP_GATHER) && (rnw_bit == RPI_READ)) begin
+                        // Number of descriptors in place of the core
+                        desc_num <= serial_rx_data;
+                        serial_state <= GATHER_ECHO;
+                    end else if ((ext_op_bits == EXT_OP_BURST) ||
+                        ((ext_op_bits == EXT_OP_POSTED) && (rnw_bit == RPI_WRITE)) ||
+                        ((ext_op_bits == EXT_OP_EXCHANGE) && (rnw_bit == RPI_READ))) begin
+                        serial_state <= REG_ADDR;
+                    end else begin
+                        // Unknown op code.  The rest of the packet is
+                        // dropped after the NACK.
+                        err_strobe <= 1;
+                        serial_state <= NACK;
+                    end
                 end
             end
             REG_ADDR : begin
@@ -322,9 +919,32 @@ begin
                 serial_rd <= 1;
                 if (serial_valid) begin
                     serial_rd <= 0;
-                    transfer_num <= num_bytes_bits + 1;
                     regaddr_byte <= serial_rx_data;
-                    if (rnw_bit == RPI_READ) begin
+                    if (ext_bit) begin
+                        serial_state <= EXT_LEN;
+                    end else begin
+                        core_sel <= core_addr_bits;
+                        transfer_num <= num_bytes_bits + 1;
+                        if ((rnw_bit == RPI_READ) && frame_on) begin
+                            serial_state <= FRAME_SEQ;
+                        end else if (rnw_bit == RPI_READ) begin
+                            serial_state <= ECHO_CMD;
+                        end else begin
+                            serial_state <= HBA_SETUP;
+                        end
+                    end
+                end
+            end
+            EXT_LEN : begin
+                // Read the length byte of an extended command
+                serial_rd <= 1;
+                if (serial_valid) begin
+                    serial_rd <= 0;
+                    len_byte <= serial_rx_data;
+                    transfer_num <= serial_rx_data;
+                    if ((xfer_rnw == RPI_READ) && frame_on) begin
+                        serial_state <= FRAME_SEQ;
+                    end else if (xfer_rnw == RPI_READ) begin
                         serial_state <= ECHO_CMD;
                     end else begin
                         serial_state <= HBA_SETUP;
@@ -335,6 +955,19 @@ begin
                 // Echo back the command
                 serial_tx_data <= cmd_byte;
                 serial_wr <= 1;
+                if (serial_valid) begin
+                    serial_wr <= 0;
+                    if (ext_bit) begin
+                        serial_state <= ECHO_CORE;
+                    end else begin
+                        serial_state <= ECHO_RAD;
+                    end
+                end
+            end
+            ECHO_CORE : begin
+                // Echo back the core byte of an extended command
+                serial_tx_data <= core_byte;
+                serial_wr <= 1;
                 if (serial_valid) begin
                     serial_wr <= 0;
                     serial_state <= ECHO_RAD;
@@ -344,6 +977,19 @@ begin
                 // Echo back the Reg ADdr
                 serial_tx_data <= regaddr_byte;
                 serial_wr <= 1;
+                if (serial_valid) begin
+                    serial_wr <= 0;
+                    if (ext_bit) begin
+                        serial_state <= ECHO_LEN;
+                    end else begin
+                        serial_state <= HBA_SETUP;
+                    end
+                end
+            end
+            ECHO_LEN : begin
+                // Echo back the length byte of an extended command
+                serial_tx_data <= len_byte;
+                serial_wr <= 1;
                 if (serial_valid) begin
                     serial_wr <= 0;
                     serial_state <= HBA_SETUP;
@@ -356,26 +1002,67 @@ begin
 
                 // Done with Transfer?
                 if (transfer_num == 0) begin
-                    if (rnw_bit == RPI_READ) begin
+                    if (frame_on && !replay && (xfer_rnw == RPI_WRITE)) begin
+                        // Have all of the write data.  Check the CRC
+                        // before writing it to the bus.
+                        serial_state <= FRAME_SEQ;
+                    end else if (xchg_bit && (xchg_rd == 0)) begin
+                        // Write half of an exchange is done.
+                        // Get the read half.
+                        serial_state <= XCHG_RAD;
+                    end else if (gather_bit) begin
+                        // Next descriptor, or ACK if that was the last
+                        if (desc_num == 0) begin
+                            serial_state <= ACK;
+                        end else begin
+                            serial_state <= GATHER_CORE;
+                        end
+                    end else if (ext_bit && (ext_op_bits == EXT_OP_POSTED)) begin
+                        // No ACK for a posted write.
+                        // Errors are counted in reg4.
+                        if (rlog_on) begin
+                            rlog_ok[rlog_slot] <= 1;
+                        end
                         serial_state <= DONE;
+                    end else if (xfer_rnw == RPI_READ) begin
+                        // No ACK for a read
+                        serial_state <= (frame_on) ? FRAME_RSEQ : DONE;
                     end else begin
                         // Send ACK for a write
                         serial_state <= ACK;
                     end
+                end else if (frame_on && !replay && (xfer_rnw == RPI_WRITE)) begin
+                    // Framed write.  Keep the data until the CRC
+                    // has been checked.
+                    transfer_num <= transfer_num - 1;
+                    serial_rd <= 1;
+                    serial_state <= HBA_SERIAL_READ;
                 end else begin
                     // Dec the transfer_num
                     transfer_num <= transfer_num - 1;
 
                     // Setup the hba_master core
-                    app_core_addr <= core_addr_bits;
+                    app_core_addr <= core_sel;
                     app_reg_addr <= regaddr_byte;
-                    app_rnw <= rnw_bit;
+                    app_rnw <= xfer_rnw;
 
                     // Auto increment the register address
                     regaddr_byte <= regaddr_byte + 1;
 
                     // Serial Op
-                    if (rnw_bit == RPI_WRITE) begin
+                    if (replay) begin
+                        // checked data of a framed write
+                        app_data_in <= wbuf_q;
+                        widx <= widx + 1;
+                        app_en_strobe <= 1;
+                        serial_state <= HBA_WAIT;
+                    end else if (dup) begin
+                        // logged read data of a packet sent again
+                        serial_tx_data <= rlog_q;
+                        serial_wr <= 1;
+                        widx <= widx + 1;
+                        serial_state <= HBA_WAIT2;
+                    end else if (xfer_rnw == RPI_WRITE) begin
                         // read from serial, then write to hba
                         serial_rd <= 1;
                         serial_state <= HBA_SERIAL_READ;
@@ -388,7 +1075,12 @@ begin
 
             end
             HBA_SERIAL_READ : begin
-                if (serial_valid) begin
+                if (serial_valid && frame_on) begin
+                    serial_rd <= 0;
+                    wbuf[widx] <= serial_rx_data;
+                    widx <= widx + 1;
+                    serial_state <= HBA_SETUP;
+                end else if (serial_valid) begin
                     serial_rd <= 0;
                     app_data_in <= serial_rx_data;
                     app_en_strobe <= 1;
@@ -399,9 +1091,18 @@ begin
                 app_en_strobe <= 0;
                 // Wait for hba bus to finish
                 if (app_valid_out) begin
-                    if (rnw_bit == RPI_WRITE) begin
+                    if (app_timeout_out) begin
+                        // No slave at this address
+                        xact_err <= 1;
+                        err_strobe <= 1;
+                    end
+                    if (xfer_rnw == RPI_WRITE) begin
                         serial_state <= HBA_SETUP;
                     end else begin
+                        if (rlog_on) begin
+                            rlog[{rlog_slot, widx}] <= app_data_out;
+                            widx <= widx + 1;
+                        end
                         // Send read data over serial
                         serial_tx_data <= app_data_out;
                         serial_wr <= 1;
@@ -416,13 +1117,309 @@ begin
                 end
             end
             ACK : begin
-                serial_tx_data <= ACK_CHAR;
+                // NACK if any of the writes, or any of the
+                // reads of a gather, failed
+                serial_tx_data <= (xact_err) ? NACK_CHAR : ACK_CHAR;
+                serial_wr <= 1;
+                if (serial_valid) begin
+                    serial_wr <= 0;
+                    if (xchg_bit && (xchg_rd == 0)) begin
+                        // The read data of an exchange follows
+                        // the ACK for its writes.
+                        xchg_rd <= 1;
+                        transfer_num <= len_byte;
+                        serial_state <= HBA_SETUP;
+                    end else begin
+                        serial_state <= (frame_on) ? FRAME_RSEQ : DONE;
+                    end
+                end
+            end
+            XCHG_RAD : begin
+                // Read the regAddr byte for the read half of an exchange
+                serial_rd <= 1;
+                if (serial_valid) begin
+                    serial_rd <= 0;
+                    regaddr_byte <= serial_rx_data;
+                    serial_state <= XCHG_LEN;
+                end
+            end
+            XCHG_LEN : begin
+                // Read the length byte for the read half of an exchange
+                serial_rd <= 1;
+                if (serial_valid) begin
+                    serial_rd <= 0;
+                    len_byte <= serial_rx_data;
+                    serial_state <= ACK;
+                end
+            end
+            GATHER_ECHO : begin
+                // Echo back the command so a push frame can not be
+                // mistaken for the start of the reply
+                serial_tx_data <= cmd_byte;
+                serial_wr <= 1;
+                if (serial_valid) begin
+                    serial_wr <= 0;
+                    if (desc_num == 0) begin
+                        serial_state <= ACK;
+                    end else begin
+                        serial_state <= GATHER_CORE;
+                    end
+                end
+            end
+            GATHER_CORE : begin
+                // Read the core byte of a gather descriptor
+                serial_rd <= 1;
+                if (serial_valid) begin
+                    serial_rd <= 0;
+                    core_sel <= serial_rx_data[3:0];
+                    desc_num <= desc_num - 1;
+                    serial_state <= GATHER_RAD;
+                end
+            end
+            GATHER_RAD : begin
+                // Read the regAddr byte of a gather descriptor
+                serial_rd <= 1;
+                if (serial_valid) begin
+                    serial_rd <= 0;
+                    regaddr_byte <= serial_rx_data;
+                    serial_state <= GATHER_LEN;
+                end
+            end
+            GATHER_LEN : begin
+                // Read the length byte of a gather descriptor
+                serial_rd <= 1;
+                if (serial_valid) begin
+                    serial_rd <= 0;
+                    transfer_num <= serial_rx_data;
+                    serial_state <= HBA_SETUP;
+                end
+            end
+            PUSH_START : begin
+                // Read the interrupt registers unless some are left
+                // from the last push
+                if (push_pend == 0) begin
+                    app_core_addr <= PERIPH_ADDR;
+                    app_reg_addr <= 0;
+                    app_rnw <= RPI_READ;
+                    app_en_strobe <= 1;
+                    serial_state <= PUSH_INTR0;
+                end else begin
+                    serial_state <= PUSH_SEL;
+                end
+            end
+            PUSH_INTR0 : begin
+                app_en_strobe <= 0;
+                if (app_valid_out) begin
+                    push_pend[7:0] <= app_data_out;
+                    app_reg_addr <= 1;
+                    app_en_strobe <= 1;
+                    serial_state <= PUSH_INTR1;
+                end
+            end
+            PUSH_INTR1 : begin
+                app_en_strobe <= 0;
+                if (app_valid_out) begin
+                    push_pend[15:8] <= app_data_out;
+                    serial_state <= PUSH_SEL;
+                end
+            end
+            PUSH_SEL : begin
+                // Push the lowest pending core.  The rest go after
+                // the host has had a chance to send.
+                push_pend[0] <= 0;
+                if (push_pend[15:1] == 0) begin
+                    serial_state <= IDLE;
+                end else begin
+                    push_pend[push_core] <= 0;
+                    core_sel <= push_core;
+                    regaddr_byte <= win_reg[push_core];
+                    transfer_num <= win_len[push_core];
+                    dirty_on <= win_dirty[push_core];
+                    if (win_dirty[push_core]) begin
+                        serial_state <= PUSH_MAP;
+                    end else begin
+                        push_data <= PUSH_MARK;
+                        push_wr <= 1;
+                        serial_state <= PUSH_MARK_S;
+                    end
+                end
+            end
+            PUSH_MAP : begin
+                // Read the dirty map.  The read clears it in the core.
+                app_core_addr <= core_sel;
+                app_reg_addr <= win_map[core_sel];
+                app_rnw <= RPI_READ;
+                app_en_strobe <= 1;
+                serial_state <= PUSH_MAPW;
+            end
+            PUSH_MAPW : begin
+                app_en_strobe <= 0;
+                if (app_valid_out) begin
+                    dirty_map <= app_data_out & win_mask;
+                    push_data <= PUSH_MARK;
+                    push_wr <= 1;
+                    serial_state <= PUSH_MARK_S;
+                end
+            end
+            PUSH_MARK_S : begin
+                if (push_ack) begin
+                    push_data <= (dirty_on) ? (PUSH_DIRTY | core_sel) :
+                                 core_sel;
+                    serial_state <= PUSH_CORE;
+                end
+            end
+            PUSH_CORE : begin
+                if (push_ack) begin
+                    push_data <= (dirty_on) ? (dirty_cnt + 1) : transfer_num;
+                    serial_state <= PUSH_LEN;
+                end
+            end
+            PUSH_LEN : begin
+                if (push_ack) begin
+                    if (dirty_on) begin
+                        push_data <= dirty_map;
+                        serial_state <= PUSH_MAPB;
+                    end else begin
+                        push_wr <= 0;
+                        serial_state <= PUSH_SETUP;
+                    end
+                end
+            end
+            PUSH_MAPB : begin
+                if (push_ack) begin
+                    push_wr <= 0;
+                    serial_state <= PUSH_SETUP;
+                end
+            end
+            PUSH_SETUP : begin
+                // Read the window and send it.  A dirty window skips
+                // the registers that have not changed.
+                if (transfer_num == 0) begin
+                    serial_state <= IDLE;
+                end else if (dirty_on && !dirty_map[regaddr_byte[2:0]]) begin
+                    transfer_num <= transfer_num - 1;
+                    regaddr_byte <= regaddr_byte + 1;
+                end else begin
+                    transfer_num <= transfer_num - 1;
+                    app_core_addr <= core_sel;
+                    app_reg_addr <= regaddr_byte;
+                    app_rnw <= RPI_READ;
+                    regaddr_byte <= regaddr_byte + 1;
+                    app_en_strobe <= 1;
+                    serial_state <= PUSH_WAIT;
+                end
+            end
+            PUSH_WAIT : begin
+                app_en_strobe <= 0;
+                if (app_valid_out) begin
+                    push_data <= app_data_out;
+                    push_wr <= 1;
+                    serial_state <= PUSH_DATA;
+                end
+            end
+            PUSH_DATA : begin
+                if (push_ack) begin
+                    push_wr <= 0;
+                    serial_state <= PUSH_SETUP;
+                end
+            end
+            NACK : begin
+                // The bytes after an unknown op code can not be told
+                // from commands.  Drop them until the host sends a
+                // break.
+                serial_tx_data <= NACK_CHAR;
+                serial_wr <= 1;
+                if (serial_valid) begin
+                    serial_wr <= 0;
+                    serial_state <= FRAME_LOST;
+                end
+            end
+            FRAME_SEQ : begin
+                // Read the sequence number of a framed packet
+                serial_rd <= 1;
+                if (serial_valid) begin
+                    serial_rd <= 0;
+                    seq_byte <= serial_rx_data;
+                    serial_state <= FRAME_CRC;
+                end
+            end
+            FRAME_CRC : begin
+                // Read the CRC.  The CRC of a packet with its own
+                // CRC on the end is zero.
+                serial_rd <= 1;
+                if (serial_valid) begin
+                    serial_rd <= 0;
+                    if (rx_crc != 0) begin
+                        // Tell the host now.  Drop everything
+                        // until it sends a break.
+                        err_strobe <= 1;
+                        push_data <= FRAME_ERR;
+                        push_wr <= 1;
+                        serial_state <= FRAME_LOST;
+                    end else if (rlog_hit) begin
+                        // Sent again after a damaged response.  Answer
+                        // from the log without running it again.
+                        dup <= 1;
+                        xact_err <= rlog_err[rlog_slot];
+                        if (xfer_rnw == RPI_READ) begin
+                            serial_state <= ECHO_CMD;
+                        end else if (ext_bit && (ext_op_bits == EXT_OP_POSTED)) begin
+                            serial_state <= DONE;
+                        end else begin
+                            serial_state <= ACK;
+                        end
+                    end else if (xfer_rnw == RPI_READ) begin
+                        rlog_on <= 1;
+                        rlog_ok[rlog_slot] <= 0;
+                        rlog_seq[rlog_slot] <= seq_byte[6:0];
+                        serial_state <= ECHO_CMD;
+                    end else begin
+                        rlog_on <= 1;
+                        rlog_ok[rlog_slot] <= 0;
+                        rlog_seq[rlog_slot] <= seq_byte[6:0];
+                        // Write the checked data to the bus
+                        replay <= 1;
+                        widx <= 0;
+                        transfer_num <= (ext_bit) ? len_byte : (num_bytes_bits + 1);
+                        serial_state <= FRAME_REPLAY;
+                    end
+                end
+            end
+            FRAME_REPLAY : begin
+                // Wait for wbuf_q to get wbuf[0]
+                serial_state <= HBA_SETUP;
+            end
+            FRAME_RSEQ : begin
+                // The packet is done.  Log how it went.
+                if (rlog_on) begin
+                    rlog_ok[rlog_slot] <= 1;
+                    rlog_err[rlog_slot] <= xact_err;
+                end
+                // Echo the sequence number after the response
+                serial_tx_data <= seq_byte;
+                serial_wr <= 1;
+                if (serial_valid) begin
+                    serial_wr <= 0;
+                    serial_state <= FRAME_RCRC;
+                end
+            end
+            FRAME_RCRC : begin
+                // CRC of the response and the sequence number
+                serial_tx_data <= tx_crc;
                 serial_wr <= 1;
                 if (serial_valid) begin
                     serial_wr <= 0;
                     serial_state <= DONE;
                 end
             end
+            FRAME_LOST : begin
+                // Drop bytes until a break puts us back in IDLE.  A
+                // bad frame or an unknown command ends up here.
+                if (push_ack) begin
+                    push_wr <= 0;
+                end
+                serial_rd <= 1;
+            end
             DONE : begin
                 if (!serial_valid) begin
                     serial_state <= IDLE;
@@ -432,6 +1429,52 @@ begin
                 serial_state <= IDLE;
             end
         endcase
+
+        // A new run of sequence numbers.  Forget the old ones.
+        if (link_wr) begin
+            rlog_ok <= 0;
+        end
+
+        // Back to IDLE on a break.  Interrupts not yet pushed
+        // are kept.
+        if (link_break && !bus_busy) begin
+            serial_state <= IDLE;
+            serial_wr <= 0;
+            serial_rd <= 0;
+            push_wr <= 0;
+            pend_valid <= 0;
+            app_en_strobe <= 0;
+        end
+    end
+end
+
+// Baud rate switch.  A write of reg11 switches to the rate in reg8
+// to reg10, or back to BAUD if the value written is zero.  The
+// switch waits until the ACK for the write has gone out so the host
+// gets it at the old rate.  The host waits for the ACK and then
+// switches too.
+wire baud_wr;
+reg baud_pend;
+
+assign baud_wr = bank2_xferack_slave & ~hba_rnw &
+    (hba_abus[REG_ADDR_WIDTH-1:0] == 11);
+
+always @ (posedge hba_clk)
+begin
+    if (hba_reset || long_break) begin
+        baud_rate <= BAUD;
+        baud_pend <= 0;
+    end else if (baud_wr) begin
+        baud_pend <= 1;
+    end else if (baud_pend && (serial_state == IDLE) && tx_empty &&
+                 !push_wr && rx_empty) begin
+        baud_pend <= 0;
+        // A rate of zero would stop the uart.  Keep the old rate.
+        if (reg_baud_sw == 0) begin
+            baud_rate <= BAUD;
+        end else if ({reg_baud2, reg_baud1, reg_baud0} != 0) begin
+            baud_rate <= {8'h00, reg_baud2, reg_baud1, reg_baud0};
+        end
     end
 end
 
@@ -461,6 +1504,88 @@ begin
     end
 end
 
+// Interrupt coalescing.  Each core can hold its interrupts until it
+// has raised coal_cnt of them or until coal_us us after the first,
+// whichever comes first.  A count of 0 leaves only the time and a
+// time of 0 leaves only the count.  With both 0, or a count of 1,
+// an interrupt sets its flag right away as it always has.
+localparam ONE_US_COUNT = ( CLK_FREQUENCY / 1_000_000 );
+localparam US_BITS = $clog2(ONE_US_COUNT + 1);
+reg [US_BITS-1:0] count_to_1us;
+reg us_tick;
+reg [7:0] coal_cnt [0:15];
+reg [15:0] coal_us [0:15];
+reg [7:0] coal_evs [0:15];    // interrupts held
+reg [15:0] coal_left [0:15];  // us until the held interrupts fire
+wire coal_wr;
+
+// A write of reg15 sets the coalescing of the core in reg12
+assign coal_wr = bank3_xferack_slave & ~hba_rnw &
+    (hba_abus[REG_ADDR_WIDTH-1:0] == 15);
+
+always @ (posedge hba_clk)
+begin
+    if (hba_reset) begin
+        count_to_1us <= 0;
+        us_tick <= 0;
+    end else begin
+        us_tick <= 0;
+        count_to_1us <= count_to_1us + 1;
+        if (count_to_1us == (ONE_US_COUNT-1)) begin
+            count_to_1us <= 0;
+            us_tick <= 1;
+        end
+    end
+end
+
+integer c;
+always @ (posedge hba_clk)
+begin
+    if (hba_reset) begin
+        coal_fire <= 0;
+        for (c = 0; c < 16; c = c + 1) begin
+            coal_cnt[c] <= 0;
+            coal_us[c] <= 0;
+            coal_evs[c] <= 0;
+            coal_left[c] <= 0;
+        end
+    end else begin
+        for (c = 0; c < 16; c = c + 1) begin
+            coal_fire[c] <= 0;
+            if (slave_interrupt[c]) begin
+                if (((coal_cnt[c] <= 1) && (coal_us[c] == 0)) ||
+                    ((coal_cnt[c] != 0) && ((coal_evs[c] + 1) >= coal_cnt[c]))) begin
+                    coal_fire[c] <= 1;
+                    coal_evs[c] <= 0;
+                end else begin
+                    if (coal_evs[c] == 0) begin
+                        coal_left[c] <= coal_us[c];
+                    end
+                    if (coal_evs[c] != 8'hff) begin
+                        coal_evs[c] <= coal_evs[c] + 1;
+                    end
+                end
+            end else if (us_tick && (coal_evs[c] != 0) && (coal_us[c] != 0)) begin
+                if (coal_left[c] <= 1) begin
+                    coal_fire[c] <= 1;
+                    coal_evs[c] <= 0;
+                end else begin
+                    coal_left[c] <= coal_left[c] - 1;
+                end
+            end
+        end
+        // A new setting lets go of anything held
+        if (coal_wr) begin
+            coal_cnt[reg_coal_sel[3:0]] <= reg_coal_cnt;
+            coal_us[reg_coal_sel[3:0]] <= {hba_dbus, reg_coal_us0};
+            if (coal_evs[reg_coal_sel[3:0]] != 0) begin
+                coal_fire[reg_coal_sel[3:0]] <= 1;
+                coal_evs[reg_coal_sel[3:0]] <= 0;
+            end
+        end
+    end
+end
+
 // Set the HBA interrupt registers
 integer i;
 always @ (posedge hba_clk)
@@ -486,11 +1611,11 @@ begin
 
         for (i=0; i <8; i=i+1)
         begin
-            if (slave_interrupt[i]) begin
+            if (coal_fire[i]) begin
                 reg_intr0_in[i] <= 1'b1;
                 slv_wr_en <= 1;
             end
-            if (slave_interrupt[i+8]) begin
+            if (coal_fire[i+8]) begin
                 reg_intr1_in[i] <= 1'b1;
                 slv_wr_en <= 1;
             end
@@ -498,5 +1623,21 @@ begin
     end
 end
 
+// Count bus errors and NACKs in reg4.  The count sticks
+// at its max value and is cleared when read.
+always @ (posedge hba_clk)
+begin
+    if (hba_reset) begin
+        slv1_wr_en <= 0;
+        reg_errors_in <= 0;
+    end else begin
+        slv1_wr_en <= 0;
+        if (err_strobe && (reg_errors != {DBUS_WIDTH{1'b1}})) begin
+            reg_errors_in <= reg_errors + 1;
+            slv1_wr_en <= 1;
+        end
+    end
+end
+
 endmodule
 
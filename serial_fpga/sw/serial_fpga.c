@@ -5,10 +5,15 @@
  *
  *  Resources:
  *    port   -  full path to serial port (/dev/serial0)
- *    config -  baudrate in range of 1200 to 921000
- *    intrr_pin -  which pin to monitor as an interrupt
+ *    config -  baudrate in range of 1200 to 4000000
+ *    intrr_pin -  which pin to monitor as an interrupt, or push
  *    rawin  -  Received characters displayed in hex
  *    rawout -  Characters to send to serial port
+ *    intrr_rate -  max interrupt rate in Hz
+ *    posted -  send writes without waiting for an ACK
+ *    framing - CRC and sequence number on each packet
+ *    bench  -  time reads and writes of the FPGA link
+ *    stats  -  link statistics and the packet trace
  */
 
 /*
@@ -36,9 +41,11 @@
 #include <sys/types.h>
 #include <limits.h>              // for PATH_MAX
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h> 
 #include <linux/serial.h>
+#include <linux/gpio.h>
 #include "eedd.h"
 #include "hba.h"
 #include "readme.h"
@@ -52,6 +59,19 @@
 #define HBA_SF_REG_INTR0       (0)
 #define HBA_SF_REG_INTR1       (1)
 #define HBA_SF_REG_RATE        (2)
+#define HBA_SF_REG_PROTO       (3)
+#define HBA_SF_REG_ERRORS      (4)
+#define HBA_SF_REG_LINK        (5)
+#define HBA_SF_REG_WINSEL      (6)
+#define HBA_SF_REG_WINREG      (7)
+#define HBA_SF_REG_BAUD0       (8)
+#define HBA_SF_REG_BAUDSW      (11)
+#define HBA_SF_REG_COALSEL     (12)
+#define HBA_SF_REG_DIRTY       (16)
+#define HBA_SF_REG_SNAP        (17)
+        // link control bits in reg5
+#define HBA_SF_LINK_PUSH       (0x01)
+#define HBA_SF_LINK_FRAMED     (0x02)
         // resource names and numbers
 #define FN_PORT            "port"
 #define FN_CONFIG          "config"
@@ -59,49 +79,330 @@
 #define FN_RAWIN           "rawin"
 #define FN_RAWOUT          "rawout"
 #define FN_INTRRT          "intrr_rate"
+#define FN_POSTED          "posted"
+#define FN_FRAMING         "framing"
+#define FN_BENCH           "bench"
+#define FN_STATS           "stats"
 #define RSC_PORT           0
 #define RSC_CONFIG         1
 #define RSC_INTRRP         2
 #define RSC_RAWIN          3
 #define RSC_RAWOUT         4
 #define RSC_INTRRT         5
+#define RSC_POSTED         6
+#define RSC_FRAMING        7
+#define RSC_BENCH          8
+#define RSC_STATS          9
         // What we are is a ...
 #define PLUGIN_NAME        "serial_fpga"
         // Default serial port
 #define DEFDEV             "/dev/serial0"
         // Default baudrate
 #define DEFBAUD            115200
-        // Default interrupt GPIO pin
+        // Highest baudrate.  Rates with no Bxxx constant are set with
+        // termios2.
+#define MX_BAUD            4000000
+        // A break this long in ms puts the FPGA back at the baudrate
+        // it was built for.  The FPGA wants more than 100 ms.
+#define LONG_BREAK         (150)
+        // Default interrupt GPIO pin and the gpiochip tried for it
+        // before the sysfs GPIO interface
 #define HBA_DEF_INTR      (25)
+#define DEF_GPIOCHIP      "/dev/gpiochip0"
+        // Most edge events read from a gpiochip line at once, and the
+        // number the kernel holds for us
+#define MX_GPIOEV         (16)
+#define GPIOEV_QLEN       (64)
+        // Max number of transactions queued for the FPGA
+#define MX_XACT            (32)
+        // Max number of packets on the wire awaiting a response.  This
+        // is also the most transfers allowed in one sendrecv_batch().
+#define MX_INFLIGHT        (16)
+        // Response timeout in ms on top of the time to send the
+        // bytes on the wire.  Covers USB serial latency.
+#define XACT_SLACK         (20)
+        // A break is this many bit times, and at least BREAK_MIN us.
+        // The FPGA resyncs on a break of more than 20 bit times.
+#define BREAK_BITS         (30)
+#define BREAK_MIN          (1000)
+        // Number of times to send a framed packet before giving up
+#define FRAME_TRIES        (3)
+        // Framed packets on the wire.  The FPGA logs the responses
+        // of this many so they are not run twice if sent again.
+#define FRAME_WIN          (4)
+        // Read the FPGA error count after this many posted writes
+#define POSTED_CHECK       (64)
+        // Size of the receive ring
+#define MX_RXRING          (1024)
+        // Max number of push frames handled in one pass of the parser
+#define MX_PUSHQ           (16)
+        // Poll period in ms of an interrupt pin given as a file path
+#define INTR_POLL_MS       (10)
+        // Most transactions in one run of the link benchmark
+#define MX_BENCH           (100000)
+        // Benchmark modes
+#define BENCH_SINGLE       (0)
+#define BENCH_BATCH        (1)
+#define BENCH_PIPE         (2)
+        // Max length of a benchmark result line
+#define MX_BENCHRES        (200)
+        // Buckets in the round trip time histogram.  Bucket n counts
+        // times from 2^n to 2^(n+1) us.  The last one has the rest.
+#define STAT_NBUCKET       (16)
+        // Default period in ms of the stats broadcast
+#define STAT_PERIOD        (1000)
+        // Packet trace ring.  Number of records and bytes kept of each.
+#define TRACE_NREC         (1024)
+#define TRACE_MXDATA       (64)
+        // Trace record types.  The first byte of each packet in the
+        // pcapng file.
+#define TR_TX              (0)    // packet bytes to the FPGA
+#define TR_RX              (1)    // bytes from the FPGA
+#define TR_INTR            (2)    // interrupt pin went high
+#define TR_PUSH            (3)    // pushed interrupt frame
+#define TR_TIMEOUT         (4)    // response timeout
+#define TR_BREAK           (5)    // break sent to resync
+#define TR_FRAMEERR        (6)    // framing error, packets sent again
+        // pcapng link type of the trace.  LINKTYPE_USER0
+#define TRACE_LINKTYPE     (147)
+        // Shadow register file.  Registers per core and the flags
+        // kept for each register.
+#define SHADOW_NREG        (256)
+#define SH_CACHED          (0x01) // written with sendrecv_shadow()
+#define SH_SYNCED          (0x02) // the FPGA has the shadow value
+#define SH_SENT            (0x04) // on its way to the FPGA, not yet ACKed
+#define SH_RESTORE         (0x08) // written again when the port is opened
+        // Most clean registers sent to join two dirty runs in one
+        // burst.  A new packet costs a header and an ACK.
+#define SHADOW_GAP         (3)
+        // Interrupt rate governor.  It looks at the link every
+        // GOV_PERIOD ms and keeps GOV_HEADROOM percent of it free for
+        // commands unless told otherwise.  The rate goes up about a
+        // quarter each period the link is GOV_SLACK percent under its
+        // target.  The last GOV_NLOG rate changes are kept.
+#define GOV_PERIOD         (250)
+#define GOV_HEADROOM       (30)
+#define GOV_SLACK          (10)
+#define GOV_NLOG           (8)
+#define GOV_MINHZ          (4)
+#define GOV_MAXHZ          (1000)
+#define GOV_MXMS           (1000 / GOV_MINHZ)
 
 
 
 /**************************************************************
  *  - Data structures
  **************************************************************/
+        // The kernel termios with the baudrate as a number.  It is not
+        // in the C library headers and asm/termbits.h clashes with
+        // termios.h so it is given here.  The ioctl numbers come with
+        // sys/ioctl.h.
+#ifndef BOTHER
+#define BOTHER             0010000
+struct termios2
+{
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t     c_line;
+    cc_t     c_cc[19];
+    speed_t  c_ispeed;
+    speed_t  c_ospeed;
+};
+#endif
+
     // Per core information kept by this module
 typedef struct
 {
     void    (*intr_hndlr) ();    // interrupt handler
     void     *trans;             // data to pass transparently to handler 
+    void    (*push_done) ();     // gets the pushed registers in push mode
+    int       push_reg;          // first register pushed
+    int       push_nreg;         // number of registers pushed
+    int       push_map;          // register with the dirty map, 0 for none
+    uint8_t   push_last[HBA_PUSH_MXWIN]; // window as of the last push
+    uint8_t   shadow[SHADOW_NREG];  // last value written to each register
+    uint8_t   shflags[SHADOW_NREG]; // SH_xxx for each register
+    int       coalcnt;           // interrupts the FPGA holds, 0 for none
+    int       coalus;            // longest the FPGA holds them in us
+    unsigned long nintr;         // interrupts taken from this core
+    unsigned long gvintr;        // nintr at the last governor period
 } COREINFO;
 
+    // A transaction for the FPGA.  Transactions are sent in the order
+    // they are queued and the FPGA answers them in that same order.
+typedef struct
+{
+    uint8_t  pkt[HBA_MXPKT];     // packet to send.  Response on completion
+    int      count;              // number of bytes to send
+    int      expectrd;           // number of bytes expected in response
+    int      rdsofar;            // number of response bytes received
+    int      posted;             // ==1 if sent as a posted write
+    int      framed;             // ==1 if sent with a CRC and sequence number
+    int      rxlen;              // number of bytes expected on the wire
+    uint8_t  seq;                // sequence number if framed, bit 7 if sent again
+    int      ntry;               // number of times sent
+    uint8_t  cmd;                // command byte.  pkt gets the response
+    int      core;               // core addressed, for the statistics
+    long long tsent;             // time in us when first sent
+    uint8_t  rsp[HBA_MXPKT + 2]; // framed response.  pkt is kept to resend
+    void    (*done) ();          // completion callback
+    void     *trans;             // data to pass transparently to callback
+} XACT;
+
+    // Link statistics for one core
+typedef struct
+{
+    unsigned long xacts;         // transactions completed or failed
+    unsigned long txbytes;       // packet bytes sent
+    unsigned long rxbytes;       // response bytes received
+    unsigned long timeouts;      // no response
+    unsigned long nacks;         // NACK for a write
+    unsigned long shorts;        // response started but did not finish
+    unsigned long skipped;       // shadow writes not sent, no change
+} CORESTAT;
+
+    // Link statistics since the last reset
+typedef struct
+{
+    CORESTAT  core[NCORE];
+    unsigned long txbytes;       // bytes written to the port
+    unsigned long rxbytes;       // bytes read from the port
+    unsigned long hist[STAT_NBUCKET]; // round trip times
+    long long t0;                // time in us of the last reset
+} LINKSTAT;
+
+    // One record in the packet trace
+typedef struct
+{
+    long long us;                // time in us since the epoch
+    uint8_t   type;              // TR_xxx
+    int       len;               // number of bytes in the event
+    uint8_t   data[TRACE_MXDATA]; // first bytes of the event
+} TRACEREC;
+
+    // One interrupt rate change made by the governor
+typedef struct
+{
+    long long us;                // time in us since the epoch
+    int       busy;              // percent of the link in use
+    int       irate;             // interrupts per second
+    int       from;              // old rate in hz
+    int       to;                // new rate in hz
+} GOVREC;
+
+    // A shadow write on its way to the FPGA.  The registers are
+    // marked SH_SYNCED when it is ACKed.
+typedef struct
+{
+    void     *pctx;              // the SERPORT that sent it
+    int       core;              // core written
+    int       reg;               // first register written
+    int       n;                 // number of registers written
+} SHWRITE;
+
+    // State for a caller of sendrecv_pkt() waiting on its transaction
+typedef struct
+{
+    uint8_t  *buff;              // caller's buffer for the response
+    int       ret;               // return value for sendrecv_pkt()
+    int       done;              // set to 1 on completion
+} SYNCWAIT;
+
+    // One transaction of the link benchmark
+typedef struct
+{
+    long long t0;                // time sent in us
+    int       us;                // round trip time in us
+    int       ret;               // response bytes or HBAERROR_xxx
+    uint8_t   ack;               // last byte of the response
+    void     *prun;              // the BENCHRUN it is part of
+} BENCHX;
+
+    // A run of the link benchmark.  It goes on from the completion
+    // callbacks so the event loop keeps running.
+typedef struct
+{
+    void     *pctx;              // our SERPORT
+    int       mode;              // BENCH_SINGLE, BENCH_BATCH, or BENCH_PIPE
+    char      rw;                // r or w
+    int       len;               // registers per transaction
+    int       hdr;               // bytes in the response header
+    int       count;             // number of transactions
+    int       nsent;             // number queued so far
+    int       ndone;             // number completed
+    int       busy;              // ==1 while bench_next() is queueing
+    uint8_t   tmpl[HBA_MXPKT];   // the packet to send each time
+    int       tlen;              // bytes in tmpl
+    long long t0;                // start of the run in us
+    BENCHX   *px;                // the transactions
+} BENCHRUN;
+
     // All state info for an instance of an hba_serial_fpga peripheral
 typedef struct
 {
     void    *pslot;    // handle to plug-in's's slot info
     int      baud;     // baudrate
+    int      basebaud; // baudrate the FPGA was built for
     void    *ptimer;   // timer with callback to bcast state
     char     port[PATH_MAX]; // full path to serial port node
     int      spfd;     // serial port File Descriptor (=-1 if closed)
-    uint8_t  rawinc[MX_MSGLEN];  // data from fpga to host
-    int      inidx;    // index into rawinc
+    uint8_t  rxring[MX_RXRING];  // data from fpga to host
+    int      rxhead;   // index of oldest byte in rxring
+    int      rxcount;  // number of bytes in rxring
     uint8_t  rawoutc[MX_MSGLEN];  // data from host to fpga
     int      outidx;   // index into rawoutc
     int      intrrp;   // interrupt input gpio
+    char     intrpath[PATH_MAX]; // interrupt value file if not a gpio
+    char     intrchip[PATH_MAX]; // gpiochip given for the pin, if any
     int      irfd;     // interrupt pin file descriptor (-1 if closed)
+    int      ircdev;   // ==1 if irfd is a gpiochip line request
+    long long tedge;   // time in us of the last interrupt edge
+    void    *irtimer;  // poll timer for an interrupt value file
     int      intrrt;   // interrupt rate in hz
+    int      ratems;   // ms between interrupts in the FPGA rate register
     COREINFO coreinfo[NCORE];
+    XACT     xact[MX_XACT];   // ring of queued transactions
+    int      xhead;    // index of oldest transaction in xact
+    int      nxact;    // number of transactions in the queue
+    int      ninflt;   // number of queued transactions sent to the FPGA
+    int      nackbrk;  // ==1 to send a break once the wire is empty
+    void    *pxtimer;  // response timeout timer
+    int      intrbusy; // ==1 while reading the interrupt registers
+    int      intrpend; // ==1 if an edge came in while intrbusy
+    SHWRITE  shw[MX_XACT]; // ring of shadow writes on their way
+    int      shwnext;  // next record to use in shw
+    int      protorev; // protocol revision of the FPGA (0 if old)
+    int      posted;   // ==1 to send writes as posted writes
+    int      nposted;  // posted writes since the last error check
+    int      perrs;    // errors reported by the FPGA in posted mode
+    int      push;     // ==1 if the FPGA pushes interrupts to us
+    uint8_t  pframe[3 + HBA_PUSH_MXWIN]; // push frame being received
+    int      npframe;  // number of bytes in pframe
+    int      framed;   // ==1 if packets have a CRC and sequence number
+    uint8_t  seq;      // sequence number of the next framed packet, 0 to 127
+    int      nfretry;  // number of framing errors since turned on
+    char     benchres[MX_BENCHRES]; // result of the last benchmark run
+    BENCHRUN *pbench;  // the benchmark being run, null if none
+    LINKSTAT stats;    // link statistics
+    LINKSTAT statlast; // link statistics at the last broadcast
+    int      statms;   // stats broadcast period in ms, 0 for none
+    void    *stimer;   // stats broadcast timer
+    TRACEREC trace[TRACE_NREC]; // ring of recent link events
+    int      trnext;   // next record to write in trace
+    int      trcount;  // number of records in trace
+    int      gvon;     // ==1 if the governor sets the interrupt rate
+    int      gvroom;   // percent of the link to keep for commands
+    void    *gvtimer;  // governor period timer
+    unsigned long gvtx; // link bytes sent at the last period
+    unsigned long gvrx; // link bytes received at the last period
+    int      gvbusy;   // percent of the link in use last period
+    int      gvirate;  // interrupts per second last period
+    int      gvcore[NCORE]; // interrupts per second of each core
+    GOVREC   gvlog[GOV_NLOG]; // ring of recent rate changes
+    int      gvnext;   // next record to write in gvlog
+    int      gvcount;  // number of records in gvlog
 } SERPORT;
 
 
@@ -109,12 +410,88 @@ typedef struct
  *  - Function prototypes and external references
  **************************************************************/
 int sendrecv_pkt(int parent, int count, uint8_t *buff);
+int sendrecv_async(int parent, int count, uint8_t *buff, void (*)(), void *);
+int sendrecv_batch(int parent, int nxfer, HBA_XFER *pxfer);
+int sendrecv_exchange(int parent, int core, int wreg, int wlen, uint8_t *wdata,
+                      int rreg, int rlen, uint8_t *rsp);
+int sendrecv_gather(int parent, int ndesc, HBA_GATHER *pdesc);
+int sendrecv_snapshot(int parent, int ndesc, HBA_GATHER *pdesc);
+int sendrecv_shadow(int parent, int count, uint8_t *buff);
+int sendrecv_shadow_batch(int parent, int nxfer, HBA_XFER *pxfer);
+int intr_coalesce(int parent, int core, int count, int us);
 static void getevents(int, void *);
 static void usercmd(int, int, char*, SLOT*, int, int*, char*);
 static int  portconfig(SERPORT *pctx);
 static int  gpioconfig(int pin);
+static int  gpiocdev(char *chip, int line);
+long long   intr_edge_time(int parent);
+static int  intrconfig(SERPORT *pctx);
+static void intrclose(SERPORT *pctx);
+static void intr_poll(void *, void *);
+static void getproto(SERPORT *pctx);
+static int  baud_other(int, int);
+static int  baud_switch(SERPORT *, int);
+static void link_reset(SERPORT *);
+static int  pkt_rsplen(SERPORT *, int, uint8_t *);
+static int  rw_pkt(int, int, int, int, uint8_t *, uint8_t *);
+static int  post_pkt(XACT *, int, uint8_t *);
+static int  get_perrs(SERPORT *, int);
+static void perrs_done(void *, int, uint8_t *);
 static void do_interrupt(int fd, void *pctx);
+static void intr_done(void *, int, uint8_t *);
+static void intr_read(SERPORT *);
+static int  queue_xact(SERPORT *, int, uint8_t *, void (*)(), void *);
+static void send_xacts(SERPORT *);
+static void fail_xacts(SERPORT *, int, int);
+static void rx_parse(SERPORT *);
+static int  rx_take(SERPORT *, uint8_t *, int);
+static void rx_sniff(SERPORT *, uint8_t *, int);
+static void rx_flush(SERPORT *);
+static void rx_wait(SERPORT *);
+static void xact_timer(SERPORT *);
+static int  xact_tmo(SERPORT *);
+static void rx_resync(SERPORT *);
+static int  frame_pkt(SERPORT *, XACT *, uint8_t *);
+static int  frame_check(XACT *);
+static void frame_retry(SERPORT *);
+static uint8_t crc8(uint8_t, uint8_t *, int);
+static int  link_ctl(SERPORT *, int);
+static void xact_timeout(void *, void *);
+static void sync_done(void *, int, uint8_t *);
+static void batch_done(void *, int, uint8_t *);
 void        register_interupt_handler(int parent, int, void (*)());
+void        register_push_window(int parent, int, int, int, void (*)());
+void        register_push_dirty(int parent, int, int);
+void        register_shadow_restore(int parent, int, int, int);
+static int  push_config(SERPORT *, int);
+static int  win_config(SERPORT *, int);
+static int  coal_config(SERPORT *, int);
+static void intr_inband(SERPORT *);
+static void push_frame(SERPORT *, uint8_t *);
+static int  bench_run(SERPORT *, char *);
+static void bench_next(BENCHRUN *);
+static void bench_done(void *, int, uint8_t *);
+static void bench_end(BENCHRUN *);
+static int  bench_cmp(const void *, const void *);
+static long long now_us(void);
+static long long epoch_us(void);
+static void stat_xact(SERPORT *, XACT *, int);
+static int  stat_print(SERPORT *, char *, int);
+static void stat_bcst(void *, void *);
+static void stat_reset(SERPORT *);
+static int  rate_config(SERPORT *, int);
+static void gov_start(SERPORT *);
+static void gov_tick(void *, void *);
+static int  gov_print(SERPORT *, char *, int);
+static void trace_add(SERPORT *, int, uint8_t *, int);
+static void trace_at(SERPORT *, int, uint8_t *, int, long long);
+static int  trace_write(SERPORT *, char *);
+static int  shadow_flush(SERPORT *, int);
+static int  shadow_parse(int, uint8_t *, int *, int *, int *, int *);
+static void shadow_wait(SERPORT *, int, int, int);
+static void shadow_done(void *, int, uint8_t *);
+static void shadow_learn(SERPORT *, int, uint8_t *);
+static void shadow_replay(SERPORT *);
 extern SLOT Slots[];
 extern int  DebugMode;
 extern int  ForegroundMode;
@@ -140,14 +517,51 @@ int Initialize(
     // Init our SERPORT structure
     pctx->pslot = pslot;       // this instance of serial_fpga
     pctx->baud = DEFBAUD;      // default baud rate
-    pctx->inidx = 0;           // no bytes in input buffer
+    pctx->basebaud = DEFBAUD;
+    pctx->rxhead = 0;          // no bytes in input buffer
+    pctx->rxcount = 0;
     pctx->outidx = 0;          // no bytes in output buffer
     pctx->spfd = -1;           // port is not yet open
     (void) strncpy(pctx->port, DEFDEV, PATH_MAX);
     // no default for the interrupt pin. 
     pctx->intrrp = HBA_DEF_INTR;  // interrupt gpio
     pctx->intrrt = 0;             // 0 rate indicates no delay.
+    pctx->ratems = 0;
+    pctx->intrpath[0] = (char) 0; // pin is a GPIO
+    pctx->intrchip[0] = (char) 0; // on the default gpiochip or sysfs
     pctx->irfd = -1;           // interrupt pin file descriptor (-1 if closed)
+    pctx->ircdev = 0;
+    pctx->tedge = 0;
+    pctx->irtimer = (void *) 0;
+    pctx->xhead = 0;           // transaction queue is empty
+    pctx->nxact = 0;
+    pctx->ninflt = 0;
+    pctx->nackbrk = 0;
+    pctx->pxtimer = (void *) 0;
+    pctx->intrbusy = 0;
+    pctx->intrpend = 0;
+    pctx->shwnext = 0;         // no shadow writes on their way
+    pctx->protorev = 0;        // no extended commands until we ask
+    pctx->posted = 0;          // wait for an ACK on every write
+    pctx->nposted = 0;
+    pctx->perrs = 0;
+    pctx->push = 0;            // interrupts come in on the GPIO pin
+    pctx->npframe = 0;
+    pctx->framed = 0;          // no CRC on packets
+    pctx->seq = 0;
+    pctx->nfretry = 0;
+    pctx->benchres[0] = (char) 0;  // no benchmark run yet
+    pctx->pbench = (BENCHRUN *) 0;
+    stat_reset(pctx);
+    pctx->statms = STAT_PERIOD;
+    pctx->trnext = 0;          // trace is empty
+    pctx->trcount = 0;
+    pctx->gvon = 0;            // interrupt rate set by the user
+    pctx->gvroom = GOV_HEADROOM;
+    pctx->gvtimer = (void *) 0;
+    pctx->gvnext = 0;
+    pctx->gvcount = 0;
+    memset(pctx->coreinfo, 0, sizeof(pctx->coreinfo));
 
     // Register name and private data
     pslot->name = PLUGIN_NAME;
@@ -187,23 +601,46 @@ int Initialize(
     pslot->rsc[RSC_RAWIN].uilock = -1;
     pslot->rsc[RSC_RAWIN].slot = pslot;
     pslot->rsc[RSC_INTRRT].name = FN_INTRRT;
-    pslot->rsc[RSC_INTRRT].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_INTRRT].flags = IS_READABLE | IS_WRITABLE | CAN_BROADCAST;
     pslot->rsc[RSC_INTRRT].bkey = 0;
     pslot->rsc[RSC_INTRRT].pgscb = usercmd;
     pslot->rsc[RSC_INTRRT].uilock = -1;
     pslot->rsc[RSC_INTRRT].slot = pslot;
+    pslot->rsc[RSC_POSTED].name = FN_POSTED;
+    pslot->rsc[RSC_POSTED].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_POSTED].bkey = 0;
+    pslot->rsc[RSC_POSTED].pgscb = usercmd;
+    pslot->rsc[RSC_POSTED].uilock = -1;
+    pslot->rsc[RSC_POSTED].slot = pslot;
+    pslot->rsc[RSC_FRAMING].name = FN_FRAMING;
+    pslot->rsc[RSC_FRAMING].flags = IS_READABLE | IS_WRITABLE;
+    pslot->rsc[RSC_FRAMING].bkey = 0;
+    pslot->rsc[RSC_FRAMING].pgscb = usercmd;
+    pslot->rsc[RSC_FRAMING].uilock = -1;
+    pslot->rsc[RSC_FRAMING].slot = pslot;
+    pslot->rsc[RSC_BENCH].name = FN_BENCH;
+    pslot->rsc[RSC_BENCH].flags = IS_READABLE | IS_WRITABLE | CAN_BROADCAST;
+    pslot->rsc[RSC_BENCH].bkey = 0;
+    pslot->rsc[RSC_BENCH].pgscb = usercmd;
+    pslot->rsc[RSC_BENCH].uilock = -1;
+    pslot->rsc[RSC_BENCH].slot = pslot;
+    pslot->rsc[RSC_STATS].name = FN_STATS;
+    pslot->rsc[RSC_STATS].flags = IS_READABLE | IS_WRITABLE | CAN_BROADCAST;
+    pslot->rsc[RSC_STATS].bkey = 0;
+    pslot->rsc[RSC_STATS].pgscb = usercmd;
+    pslot->rsc[RSC_STATS].uilock = -1;
+    pslot->rsc[RSC_STATS].slot = pslot;
 
     pctx->ptimer = (void *) 0;
+    pctx->stimer = add_timer(ED_PERIODIC, pctx->statms, stat_bcst, (void *) pctx);
 
     // try to open and register the serial port
     (void) portconfig(pctx);  // void since there is no ui
+    getproto(pctx);
 
     // try to allocate the default interrupt gpio pin
-    pctx->irfd = gpioconfig(pctx->intrrp);
-    if (pctx->irfd >= 0) {       // config succeeded?
-        // Add fd to exception list for select()
-        add_fd(pctx->irfd, ED_EXCEPT, do_interrupt, (void *) pctx);
-    }
+    (void) intrconfig(pctx);
+    intr_inband(pctx);
 
     return (0);
 }
@@ -228,9 +665,8 @@ static void usercmd(
     int      tmp;      // used in parsing raw input
     int      intrpin;  // new interrupt GPIO pin
     int      intrrate; // new interrupt rate in hz
-    int      intrrt_ms; // new interrupt rate in ms
-    int      nsd;      // number of bytes sent to FPGA
-    uint8_t  pkt[HBA_MXPKT];
+    int      nposted;  // new posted write mode
+    int      nframed;  // new framing mode
 
     // Get this instance of the plug-in
     pctx = (SERPORT *) pslot->priv;
@@ -245,13 +681,133 @@ static void usercmd(
         *plen = ret;  // (errors are handled in calling routine)
     }
     else if ((cmd == EDGET) && (rscid == RSC_INTRRP)) {
-        ret = snprintf(buf, *plen, "%d\n", pctx->intrrp);
+        if (pctx->push) {
+            ret = snprintf(buf, *plen, "push\n");
+        }
+        else if (pctx->intrpath[0]) {
+            ret = snprintf(buf, *plen, "%s\n", pctx->intrpath);
+        }
+        else if (pctx->intrchip[0]) {
+            ret = snprintf(buf, *plen, "%s:%d\n", pctx->intrchip, pctx->intrrp);
+        }
+        else {
+            ret = snprintf(buf, *plen, "%d\n", pctx->intrrp);
+        }
         *plen = ret;  // (errors are handled in calling routine)
     }
     else if ((cmd == EDGET) && (rscid == RSC_INTRRT)) {
-        ret = snprintf(buf, *plen, "%d\n", pctx->intrrt);
+        if (pctx->gvon) {
+            ret = gov_print(pctx, buf, *plen);
+        }
+        else {
+            ret = snprintf(buf, *plen, "%d\n", pctx->intrrt);
+        }
+        *plen = ret;  // (errors are handled in calling routine)
+    }
+    else if ((cmd == EDGET) && (rscid == RSC_POSTED)) {
+        // Collect any errors the FPGA has seen since the last check
+        if (pctx->posted && (get_perrs(pctx, 1) < 0)) {
+            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
+            *plen = ret;
+            return;
+        }
+        ret = snprintf(buf, *plen, "%d %d\n", pctx->posted, pctx->perrs);
+        *plen = ret;  // (errors are handled in calling routine)
+    }
+    else if ((cmd == EDSET) && (rscid == RSC_POSTED)) {
+        ret = sscanf(val, "%d", &nposted);
+        if ((ret != 1) || (nposted < 0) || (nposted > 1) ||
+            ((nposted == 1) && (pctx->protorev < HBA_PROTO_POSTED))) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;
+            return;
+        }
+        // Clear the error count in the FPGA and here when turned on
+        if ((nposted == 1) && (pctx->posted == 0)) {
+            (void) get_perrs(pctx, 1);
+            pctx->perrs = 0;
+            pctx->nposted = 0;
+        }
+        pctx->posted = nposted;
+    }
+    else if ((cmd == EDGET) && (rscid == RSC_FRAMING)) {
+        ret = snprintf(buf, *plen, "%d %d\n", pctx->framed, pctx->nfretry);
+        *plen = ret;  // (errors are handled in calling routine)
+    }
+    else if ((cmd == EDSET) && (rscid == RSC_FRAMING)) {
+        ret = sscanf(val, "%d", &nframed);
+        if ((ret != 1) || (nframed < 0) || (nframed > 1) ||
+            ((nframed == 1) && (pctx->protorev < HBA_PROTO_FRAMED))) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;
+            return;
+        }
+        if (link_ctl(pctx, ((pctx->push) ? HBA_SF_LINK_PUSH : 0) |
+                           ((nframed) ? HBA_SF_LINK_FRAMED : 0)) < 0) {
+            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
+            *plen = ret;
+            return;
+        }
+        // Count retries from when framing is turned on
+        if (nframed) {
+            pctx->nfretry = 0;
+        }
+    }
+    else if ((cmd == EDGET) && (rscid == RSC_BENCH)) {
+        if (pctx->pbench != (BENCHRUN *) 0) {
+            ret = snprintf(buf, *plen, "running %d %d\n",
+                           pctx->pbench->ndone, pctx->pbench->count);
+        }
+        else {
+            ret = snprintf(buf, *plen, "%s", pctx->benchres);
+        }
         *plen = ret;  // (errors are handled in calling routine)
     }
+    else if ((cmd == EDSET) && (rscid == RSC_BENCH)) {
+        ret = bench_run(pctx, val);
+        if (ret == -1) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;
+            return;
+        }
+        else if (ret < 0) {
+            ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
+            *plen = ret;
+            return;
+        }
+    }
+    else if ((cmd == EDGET) && (rscid == RSC_STATS)) {
+        *plen = stat_print(pctx, buf, *plen);
+    }
+    else if ((cmd == EDSET) && (rscid == RSC_STATS)) {
+        if (strncmp(val, "reset", 5) == 0) {
+            stat_reset(pctx);
+        }
+        else if (strncmp(val, "trace ", 6) == 0) {
+            if (trace_write(pctx, &(val[6])) < 0) {
+                ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+                *plen = ret;
+                return;
+            }
+        }
+        else {
+            ret = sscanf(val, "%d", &tmp);
+            if ((ret != 1) || ((tmp != 0) && (tmp < 10))) {
+                ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+                *plen = ret;
+                return;
+            }
+            if (pctx->stimer) {
+                del_timer(pctx->stimer);
+                pctx->stimer = (void *) 0;
+            }
+            pctx->statms = tmp;
+            pctx->statlast = pctx->stats;
+            if (tmp) {
+                pctx->stimer = add_timer(ED_PERIODIC, tmp, stat_bcst, (void *) pctx);
+            }
+        }
+    }
     else if ((cmd == EDSET) && (rscid == RSC_PORT)) {
         // Val has the new port path.  Just copy it.
         (void) strncpy(pctx->port, val, PATH_MAX);
@@ -263,6 +819,8 @@ static void usercmd(
             close(pctx->spfd);
             pctx->spfd = -1;
         }
+        rx_flush(pctx);
+        fail_xacts(pctx, pctx->nxact, HBAERROR_NOSEND);
         // now open and register the new port
         ret = portconfig(pctx);
         if (ret < 0) {
@@ -270,6 +828,11 @@ static void usercmd(
             *plen = ret;
             return;
         }
+        getproto(pctx);
+        intr_inband(pctx);
+        // The FPGA may have been reset or loaded again.  Put back
+        // what the plug-ins wrote.
+        shadow_replay(pctx);
     }
     else if ((cmd == EDSET) && (rscid == RSC_CONFIG)) {
         ret = sscanf(val, "%d", &nbaud);
@@ -278,20 +841,79 @@ static void usercmd(
             *plen = ret;
             return;
         }
-        if ((nbaud != 1200) && (nbaud != 1800) && (nbaud != 2400) &&
-            (nbaud != 4800) && (nbaud != 9600) && (nbaud != 19200) &&
-            (nbaud != 38400) && (nbaud != 57600) && (nbaud != 115200) &&
-            (nbaud != 230400) && (nbaud != 460800) && (nbaud != 500000) &&
-            (nbaud != 576000) && (nbaud != 921600))
-        {
+        if ((nbaud < 1200) || (nbaud > MX_BAUD)) {
             ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
             *plen = ret;
             return;
         }
 
-        // record the new baudrate and reconfigure serial port
-        pctx->baud = nbaud;
-        portconfig(pctx);
+        // An FPGA that can change its rate switches with us.  Others
+        // run at the rate they were built for and only the port changes.
+        if ((pctx->spfd >= 0) && (pctx->protorev >= HBA_PROTO_BAUD)) {
+            if (baud_switch(pctx, nbaud) < 0) {
+                ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
+                *plen = ret;
+                return;
+            }
+        }
+        else {
+            // record the new baudrate and reconfigure serial port
+            pctx->baud = nbaud;
+            pctx->basebaud = nbaud;
+            if (pctx->spfd >= 0) {
+                portconfig(pctx);
+            }
+        }
+    }
+    else if ((cmd == EDSET) && (rscid == RSC_INTRRP) &&
+             (strncmp(val, "push", 4) == 0)) {
+        // The FPGA sends interrupts and their registers over the
+        // serial link.  No need for the GPIO pin.
+        if ((pctx->protorev < HBA_PROTO_PUSH) || (push_config(pctx, 1) < 0)) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;
+            return;
+        }
+        intrclose(pctx);
+    }
+    else if ((cmd == EDSET) && (rscid == RSC_INTRRP) &&
+             ((pbyte = strrchr(val, ':')) != (char *) 0)) {
+        // A line on a gpiochip given as chip:line.  A chip name with
+        // no path is in /dev.
+        ret = sscanf(&(pbyte[1]), "%d", &intrpin);
+        tmp = (int) (pbyte - val);
+        if ((ret != 1) || (intrpin < 0) || (intrpin > 1000) || (tmp == 0) ||
+            (tmp + 6 > PATH_MAX)) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;
+            return;
+        }
+        (void) snprintf(pctx->intrchip, PATH_MAX, "%s%.*s",
+                        (val[0] == '/') ? "" : "/dev/", tmp, val);
+        pctx->intrrp = intrpin;
+        pctx->intrpath[0] = (char) 0;
+        if (pctx->push) {
+            (void) push_config(pctx, 0);
+        }
+        if (intrconfig(pctx) < 0) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;
+            return;
+        }
+    }
+    else if ((cmd == EDSET) && (rscid == RSC_INTRRP) && (val[0] == '/')) {
+        // A file that reads '1' when the FPGA wants service, such as
+        // the fake GPIO of an FPGA emulator.  It is polled.
+        (void) snprintf(pctx->intrpath, sizeof(pctx->intrpath), "%s", val);
+        pctx->intrchip[0] = (char) 0;
+        if (pctx->push) {
+            (void) push_config(pctx, 0);
+        }
+        if (intrconfig(pctx) < 0) {
+            ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+            *plen = ret;
+            return;
+        }
     }
     else if ((cmd == EDSET) && (rscid == RSC_INTRRP)) {
         ret = sscanf(val, "%d", &intrpin);
@@ -301,73 +923,68 @@ static void usercmd(
             return;
         }
         pctx->intrrp = intrpin;
-        // close and unregister the old port
-        if (pctx->irfd >= 0) {
-            del_fd(pctx->irfd);
-            close(pctx->irfd);
-            pctx->irfd = -1;
+        pctx->intrpath[0] = (char) 0;
+        pctx->intrchip[0] = (char) 0;
+        // Back to the GPIO pin if we were in push mode
+        if (pctx->push) {
+            (void) push_config(pctx, 0);
         }
-        pctx->irfd = gpioconfig(pctx->intrrp);
-        if (pctx->irfd < 0) {       // config failed?
+        // close the old pin and open the new one
+        if (intrconfig(pctx) < 0) {       // config failed?
             ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
             *plen = ret;
             return;
         }
-        // Add fd to exception list for select()
-        add_fd(pctx->irfd, ED_EXCEPT, do_interrupt, (void *) pctx);
     }
     else if ((cmd == EDSET) && (rscid == RSC_INTRRT)) {
+        // "auto [headroom]" hands the rate to the governor
+        if (strncmp(val, "auto", 4) == 0) {
+            ret = sscanf(&(val[4]), "%d", &tmp);
+            if (ret != 1) {
+                tmp = GOV_HEADROOM;
+            }
+            if ((tmp < GOV_SLACK) || (tmp > 90)) {
+                ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
+                *plen = ret;
+                return;
+            }
+            pctx->gvroom = tmp;
+            gov_start(pctx);
+            return;
+        }
         ret = sscanf(val, "%d", &intrrate);
-        if ((ret != 1) || (intrrate < 4) || (intrrate > 1000)) {
+        if ((ret != 1) || (intrrate < GOV_MINHZ) || (intrrate > GOV_MAXHZ)) {
             ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
             *plen = ret;
             return;
         }
 
-        // Convert hz to ms
-        if (intrrate < 4) {
-            intrrt_ms = 0;
-        } 
-        else if (intrrate > 1000) {
-            intrrt_ms = 255;
-        }
-        else {
-            intrrt_ms = ((int)((1.0/intrrate)*1000)) & 0xff;
+        // A rate from the user turns the governor off
+        if (pctx->gvtimer) {
+            del_timer(pctx->gvtimer);
+            pctx->gvtimer = (void *) 0;
         }
-
-        // record the new data value
-        // XXX pctx->intrrt = intrrt_ms;    // in ms
-        pctx->intrrt = intrrate;    // in hz
+        pctx->gvon = 0;
 
         // Send new value to the FPGA serial_fpga rate register(reg2)
-        pkt[0] = HBA_WRITE_CMD | ((1 -1) << 4) | HBA_SERIAL_FPGA_COREID;
-        pkt[1] = HBA_SF_REG_RATE;
-        pkt[2] = intrrt_ms;                     // new value
-        pkt[3] = 0;                             // dummy for the ack
-
-        nsd = sendrecv_pkt(pslot->slot_id, 4, pkt);
-        // We did a write so the sendrecv return value should be 1
-        // and the returned byte should be an ACK
-        if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
+        pctx->intrrt = intrrate;    // in hz
+        if (rate_config(pctx, (1000 / intrrate) & 0xff) < 0) {
             // error writing value from SERIAL_FPGA port
             ret = snprintf(buf, *plen, E_NORSP, pslot->rsc[rscid].name);
             *plen = ret;
         }
 
-        // close and unregister the old port
-        if (pctx->irfd >= 0) {
-            del_fd(pctx->irfd);
-            close(pctx->irfd);
-            pctx->irfd = -1;
+        // The rate applies to pushed interrupts too.  No GPIO pin then.
+        if (pctx->push) {
+            return;
         }
-        pctx->irfd = gpioconfig(pctx->intrrp);
-        if (pctx->irfd < 0) {       // config failed?
+
+        // close and reopen the pin
+        if (intrconfig(pctx) < 0) {       // config failed?
             ret = snprintf(buf, *plen, E_BDVAL, pslot->rsc[rscid].name);
             *plen = ret;
             return;
         }
-        // Add fd to exception list for select()
-        add_fd(pctx->irfd, ED_EXCEPT, do_interrupt, (void *) pctx);
     }
     else if ((cmd == EDSET) && (rscid == RSC_RAWOUT)) {
         // User has given us a line of space separated 8-bit hex values.
@@ -413,44 +1030,47 @@ static void getevents(
     void     *cb_data)       // callback date (==*SERPORT)
 {
     SERPORT  *pctx;          // our context
-    SLOT     *pslot;         // This instance of the serial plug-in
-    RSC      *prsc;          // pointer to this slot's counts resource
+    int       tail;          // where new bytes go in the ring
     int       nrd;           // number of bytes read
-    char      msg[MX_MSGLEN * 3 +1]; // text to send.  +1 for newline
-    int       slen;          // length of text to output
-    int       i;             // to walk the input buffer
-
 
     pctx = (SERPORT *) cb_data;
-    pslot = pctx->pslot;
-
-    // Read from the serial port and output the data if anyone is
-    // watching the rawin resource.  See if an interrupt is registered
-    // for the (implied) slot in the packet.  If there's a handler then
-    // forward the packet to the slot's interrupt handler.
 
-    nrd = read(pctx->spfd, pctx->rawinc, MX_MSGLEN);
+    // This is the only reader of the serial port.  Bytes go into the
+    // receive ring and are parsed from there.  Read into the space
+    // up to the end of the ring.  The rest is picked up next time.
+    tail = (pctx->rxhead + pctx->rxcount) % MX_RXRING;
+    if (pctx->rxcount == MX_RXRING) {
+        nrd = 0;
+    }
+    else if (tail >= pctx->rxhead) {
+        nrd = MX_RXRING - tail;
+    }
+    else {
+        nrd = pctx->rxhead - tail;
+    }
+    if (nrd == 0) {
+        rx_parse(pctx);
+        return;
+    }
+    nrd = read(pctx->spfd, &(pctx->rxring[tail]), nrd);
 
     // shutdown manager conn on error or on zero bytes read */
     if ((nrd <= 0) && (errno != EAGAIN)) {
         close(pctx->spfd);
         del_fd(pctx->spfd);
         pctx->spfd = -1;
+        rx_flush(pctx);
+        fail_xacts(pctx, pctx->nxact, HBAERROR_NORECV);
         return;
     }
-
-    // Broadcast characters if any UI are monitoring it.
-    // '3' because each input byte prints as 'xx '.
-    prsc = &(pslot->rsc[RSC_RAWIN]);  // events resource
-    if (prsc->bkey != 0) {
-        for(i = 0 ; i < nrd ; i++) {
-            sprintf(&msg[i * 3],"%02x ", pctx->rawinc[i]);
-        }
-        sprintf(&msg[i * 3], "\n");
-        slen = (i * 3) + 1;
-        bcst_ui(msg, slen, &(prsc->bkey));
-        prompt(prsc->uilock);
+    if (nrd <= 0) {
+        return;
     }
+    trace_add(pctx, TR_RX, &(pctx->rxring[tail]), nrd);
+    pctx->rxcount += nrd;
+    pctx->stats.rxbytes += nrd;
+
+    rx_parse(pctx);
     return;
 }
 
@@ -463,6 +1083,8 @@ static int portconfig(SERPORT *pctx)
 {
     struct termios tbuf;        // termios structure for port
     speed_t baudrate;           // baudrate for cfsetospeed
+    int     other = 0;          // ==1 if no Bxxx for the baudrate
+    int     newfd = 0;          // ==1 if the port was just opened
     struct serial_struct serial; // for low latency
 
     if (pctx->spfd < 0) {
@@ -470,6 +1092,7 @@ static int portconfig(SERPORT *pctx)
         if (pctx->spfd < 0) {
             return(pctx->spfd);
         }
+        newfd = 1;
     }
 
     // Get baudrate
@@ -488,6 +1111,11 @@ static int portconfig(SERPORT *pctx)
         case 500000 : baudrate = B500000; break;
         case 576000 : baudrate = B576000; break;
         case 921600 : baudrate = B921600; break;
+        case 1000000 : baudrate = B1000000; break;
+        case 1500000 : baudrate = B1500000; break;
+        case 2000000 : baudrate = B2000000; break;
+        case 3000000 : baudrate = B3000000; break;
+        default : baudrate = B38400; other = 1; break;
     }
 
     // Port is open and spfd is valid.  Configure the port.
@@ -498,8 +1126,12 @@ static int portconfig(SERPORT *pctx)
     tbuf.c_cc[VMIN] = 1;        /* character-by-character input */
     tbuf.c_cc[VTIME] = 0;       /* no delay waiting for characters */
     int actions = TCSANOW;
-    if (tcsetattr(pctx->spfd, actions, &tbuf) < 0) {
+    if ((tcsetattr(pctx->spfd, actions, &tbuf) < 0) ||
+        (other && (baud_other(pctx->spfd, pctx->baud) < 0))) {
         edlog(M_BADPORT, pctx->spfd, strerror(errno));
+        if (newfd == 0) {
+            del_fd(pctx->spfd);
+        }
         close(pctx->spfd);
         pctx->spfd = -1;
         return(pctx->spfd);
@@ -511,11 +1143,268 @@ static int portconfig(SERPORT *pctx)
     ioctl(pctx->spfd, TIOCSSERIAL, &serial);
 
     // add callback for received characters
-    add_fd(pctx->spfd, ED_READ, getevents, (void *) pctx);
+    if (newfd) {
+        add_fd(pctx->spfd, ED_READ, getevents, (void *) pctx);
+    }
     return(pctx->spfd);
 }
 
 
+/* getproto() : Read the protocol revision from reg3 of serial_fpga.
+ * Older FPGA images read back zero.  Extended commands are refused
+ * until the FPGA says it has them.  An FPGA left with framing on
+ * from an earlier run does not answer an unframed read so try again
+ * with framing.  An FPGA left at another baudrate does not answer
+ * either way so put it back at the rate it was built for and try
+ * both again.
+ */
+static void getproto(SERPORT *pctx)
+{
+    SLOT         *pslot;        // our SLOT
+    int           nrd;          // number of bytes received
+    int           framed;       // ==1 if we want framing
+    int           pass;         // ==1 on the framed try
+    int           i;
+    uint8_t       pkt[HBA_MXPKT];
+
+    pslot = pctx->pslot;
+    framed = pctx->framed;
+    pctx->framed = 0;
+    pctx->protorev = 0;
+    if (pctx->spfd < 0) {
+        return;
+    }
+
+    for (pass = 0; pass < 4; pass++) {
+        if (pass == 2) {
+            link_reset(pctx);
+            pctx->framed = 0;
+        }
+        //  (1-1) is # byte to read -1
+        pkt[0] = HBA_READ_CMD | ((1 -1) << 4) | HBA_SERIAL_FPGA_COREID;
+        pkt[1] = HBA_SF_REG_PROTO;
+        pkt[2] = 0;                     // dummy byte (cmd)
+        pkt[3] = 0;                     // dummy byte (reg)
+        pkt[4] = 0;                     // dummy byte (rev)
+        nrd = sendrecv_pkt(pslot->slot_id, 5, pkt);
+        // We sent header + one byte so the sendrecv return value should be 3
+        if (nrd == 3) {
+            pctx->protorev = pkt[2];
+            break;
+        }
+        // Break the FPGA out of a bad frame and try it framed
+        pctx->protorev = HBA_PROTO_FRAMED;
+        rx_resync(pctx);
+        pctx->framed = 1;
+    }
+    if (nrd != 3) {
+        pctx->protorev = 0;
+        pctx->framed = 0;
+    }
+
+    // Put the FPGA link control back the way we want it.  It may be
+    // left in push mode from an earlier run.
+    if (pctx->protorev >= HBA_PROTO_PUSH) {
+        (void) push_config(pctx, pctx->push);
+    }
+    else if (pctx->push) {
+        edlog("FPGA on %s has no push mode", pctx->port);
+        pctx->push = 0;
+    }
+    if ((pctx->protorev < HBA_PROTO_FRAMED) && framed) {
+        edlog("FPGA on %s has no framing", pctx->port);
+    }
+    else if ((framed != pctx->framed) || framed) {
+        // The write also clears the FPGA's log of framed responses
+        // from an earlier run.
+        (void) link_ctl(pctx, ((pctx->push) ? HBA_SF_LINK_PUSH : 0) |
+                              ((framed) ? HBA_SF_LINK_FRAMED : 0));
+    }
+
+    // Put back the interrupt coalescing the plug-ins asked for
+    for (i = 1; (pctx->protorev >= HBA_PROTO_COALESCE) && (i < NCORE); i++) {
+        if (pctx->coreinfo[i].coalcnt || pctx->coreinfo[i].coalus) {
+            (void) coal_config(pctx, i);
+        }
+    }
+}
+
+
+/* baud_other() : Set a baudrate that has no Bxxx constant.  The C
+ * library termios has no field for the rate so use the kernel's
+ * termios2 with BOTHER.  Returns 0 on success and -1 on error.
+ */
+static int baud_other(
+    int           fd,           // the serial port
+    int           baud)         // the baudrate
+{
+    struct termios2 tbuf2;
+
+    if (ioctl(fd, TCGETS2, &tbuf2) < 0) {
+        return(-1);
+    }
+    tbuf2.c_cflag &= ~CBAUD;
+    tbuf2.c_cflag |= BOTHER;
+    tbuf2.c_ispeed = baud;
+    tbuf2.c_ospeed = baud;
+    return((ioctl(fd, TCSETS2, &tbuf2) < 0) ? -1 : 0);
+}
+
+
+/* baud_switch() : Change the baudrate of the FPGA and then the port.
+ * The new rate goes in reg8 to reg10 and the write of reg11 tells
+ * the FPGA to switch once it has sent the ACK.  Nothing else may be
+ * on the wire so the queue is drained first and pushes are stopped
+ * until the switch is done.  Returns 0 on success and -1 on error.
+ */
+static int baud_switch(
+    SERPORT      *pctx,         // our local info
+    int           nbaud)        // the new baudrate
+{
+    SLOT         *pslot;        // our SLOT
+    uint8_t       pkt[HBA_MXPKT];
+    int           ret;
+
+    pslot = pctx->pslot;
+
+    while ((pctx->nxact != 0) && (pctx->spfd >= 0)) {
+        rx_wait(pctx);
+    }
+    if (pctx->push &&
+        (link_ctl(pctx, (pctx->framed) ? HBA_SF_LINK_FRAMED : 0) < 0)) {
+        return(-1);
+    }
+
+    pkt[0] = HBA_WRITE_CMD | ((4 -1) << 4) | HBA_SERIAL_FPGA_COREID;
+    pkt[1] = HBA_SF_REG_BAUD0;
+    pkt[2] = nbaud & 0xff;
+    pkt[3] = (nbaud >> 8) & 0xff;
+    pkt[4] = (nbaud >> 16) & 0xff;
+    pkt[5] = 1;                         // switch
+    pkt[6] = 0;                         // dummy for the ack
+    ret = sendrecv_pkt(pslot->slot_id, 7, pkt);
+    if ((ret != 1) || (pkt[0] != HBA_ACK)) {
+        getproto(pctx);                 // puts push mode back
+        return(-1);
+    }
+
+    // The FPGA has switched by the time the ACK is in.  If it does
+    // not answer at the new rate getproto() puts both sides back at
+    // the rate the FPGA was built for.
+    (void) tcdrain(pctx->spfd);
+    pctx->baud = nbaud;
+    if (portconfig(pctx) < 0) {
+        return(-1);
+    }
+    getproto(pctx);
+    if ((pctx->baud != nbaud) || (pctx->protorev < HBA_PROTO_BAUD)) {
+        edlog("FPGA on %s did not switch to %d baud", pctx->port, nbaud);
+        return(-1);
+    }
+    return(0);
+}
+
+
+/* link_reset() : Send a long break to put the FPGA back at the
+ * baudrate it was built for and set the port to that rate.  Older
+ * FPGAs see a break as a zero byte at most.
+ */
+static void link_reset(
+    SERPORT      *pctx)         // our local info
+{
+    if (pctx->spfd < 0) {
+        return;
+    }
+    (void) tcflush(pctx->spfd, TCIOFLUSH);
+    if (ioctl(pctx->spfd, TIOCSBRK) == 0) {
+        usleep(LONG_BREAK * 1000);
+        (void) ioctl(pctx->spfd, TIOCCBRK);
+        usleep(BREAK_MIN);
+    }
+    if (pctx->baud != pctx->basebaud) {
+        pctx->baud = pctx->basebaud;
+        (void) portconfig(pctx);
+    }
+    (void) tcflush(pctx->spfd, TCIFLUSH);
+    rx_flush(pctx);
+}
+
+
+/* intrconfig() : Close the old interrupt pin and open the new one.
+ * A GPIO pin is watched by select().  A file given by path is not
+ * a GPIO so select() never sees an edge on it and it is polled
+ * instead.  Returns 0 on success and -1 on failure.
+ */
+static int intrconfig(SERPORT *pctx)
+{
+    intrclose(pctx);
+    if (pctx->intrpath[0]) {
+        pctx->irfd = open(pctx->intrpath, (O_RDONLY), 0);
+        if (pctx->irfd < 0) {
+            edlog("Unable to open %s", pctx->intrpath);
+            return(-1);
+        }
+        pctx->irtimer = add_timer(ED_PERIODIC, INTR_POLL_MS, intr_poll,
+                                  (void *) pctx);
+        return(0);
+    }
+
+    // Edges on a gpiochip line come to us as events with the time
+    // the kernel saw them.  A pin given only by number is looked for
+    // on the default gpiochip and then in sysfs.
+    pctx->irfd = gpiocdev((pctx->intrchip[0]) ? pctx->intrchip : DEF_GPIOCHIP,
+                          pctx->intrrp);
+    if (pctx->irfd >= 0) {
+        pctx->ircdev = 1;
+        add_fd(pctx->irfd, ED_READ, do_interrupt, (void *) pctx);
+        return(0);
+    }
+    if (pctx->intrchip[0]) {
+        return(-1);
+    }
+    pctx->irfd = gpioconfig(pctx->intrrp);
+    if (pctx->irfd < 0) {
+        return(-1);
+    }
+    // Add fd to exception list for select()
+    add_fd(pctx->irfd, ED_EXCEPT, do_interrupt, (void *) pctx);
+    return(0);
+}
+
+
+/* intrclose() : Close and unregister the interrupt pin */
+static void intrclose(SERPORT *pctx)
+{
+    // A polled file has a timer instead of a select() entry
+    if (pctx->irtimer != (void *) 0) {
+        del_timer(pctx->irtimer);
+        pctx->irtimer = (void *) 0;
+    }
+    else if (pctx->irfd >= 0) {
+        del_fd(pctx->irfd);
+    }
+    if (pctx->irfd >= 0) {
+        close(pctx->irfd);
+        pctx->irfd = -1;
+    }
+    pctx->ircdev = 0;
+}
+
+
+/* intr_poll() : Check an interrupt pin given as a file path */
+static void intr_poll(
+    void         *timer,        // the poll timer
+    void         *cb_data)      // callback data (==*SERPORT)
+{
+    SERPORT      *pctx;         // our local info
+
+    pctx = (SERPORT *) cb_data;
+    if (pctx->irfd >= 0) {
+        do_interrupt(pctx->irfd, (void *) pctx);
+    }
+}
+
+
 /* Open and configure the gpio port for interrupts.   Return opened
  * file descriptor on success and -1 on failure.
  */
@@ -577,19 +1466,77 @@ static int gpioconfig(int pin)
 } 
 
 
-/* sendrecv_pkt() : Send a packet to the FPGA.  Wait for the
- * response.  Write packet receive one byte in response and read
- * packets receive two less than the number of bytes sent.
- *     Input is the number of bytes to send and a pointer to a buffer
- * with the bytes to send.  The buffer does not need to be null terminated.
- *     On return the buffer is filled with the response bytes.
- * The return value is the number of bytes sent on success and a negative
- * error code on error.  Errors include:
- *  HBAERROR_NOSEND : unable to send the data
- *  HBAERROR_NORECV : unable to read the response
- *     This routine is typically called from a driver plug-in to send
- * a read or write command to the FPGA.  It may be called from within
- * serial_fpga itself for initialization and to help process interrupts.
+/* gpiocdev() : Request a line of a gpiochip as an input with events
+ * on the rising edge.  This uses the GPIO character device in place
+ * of sysfs.  There is no export to wait on and the kernel queues the
+ * edges with a timestamp so none are lost in a burst.  Returns the
+ * line request file descriptor, or -1 if the chip or line can not be
+ * had.
+ */
+static int gpiocdev(
+    char         *chip,         // path to the gpiochip
+    int           line)         // line offset on the chip
+{
+    struct gpio_v2_line_request req;
+    int           chfd;         // fd of the gpiochip
+
+    if ((line < 0) || (line > 1000)) {
+        return(-1);
+    }
+    chfd = open(chip, (O_RDWR | O_CLOEXEC), 0);
+    if (chfd < 0) {
+        return(-1);
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = line;
+    req.num_lines = 1;
+    req.event_buffer_size = GPIOEV_QLEN;
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING;
+    (void) snprintf(req.consumer, sizeof(req.consumer), "%s", PLUGIN_NAME);
+    if (ioctl(chfd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+        edlog("Unable to get line %d of %s: %s", line, chip, strerror(errno));
+        close(chfd);
+        return(-1);
+    }
+    // The line request stands on its own
+    close(chfd);
+    (void) fcntl(req.fd, F_SETFL, O_NONBLOCK);
+    return(req.fd);
+}
+
+
+/* intr_edge_time() : Plug-ins call this from their interrupt handler
+ * to get the time in us since the epoch of the most recent interrupt.
+ * A gpiochip line gives the time the kernel saw the edge.  Otherwise
+ * it is when serial_fpga saw the pin, the file, or the pushed frame.
+ */
+long long intr_edge_time(
+    int           parent)       // Slot number of parent
+{
+    SERPORT      *pctx;         // our local info
+
+    pctx = (SERPORT *) Slots[parent].priv;
+    return(pctx->tedge);
+}
+
+
+/* sendrecv_pkt() : Send a packet to the FPGA.  Wait for the
+ * response.  Write packet receive one byte in response and read
+ * packets receive two less than the number of bytes sent.
+ *     Input is the number of bytes to send and a pointer to a buffer
+ * with the bytes to send.  The buffer does not need to be null terminated.
+ *     On return the buffer is filled with the response bytes.
+ * The return value is the number of bytes received on success and a
+ * negative error code on error.  Errors include:
+ *  HBAERROR_NOSEND : unable to send the data
+ *  HBAERROR_NORECV : unable to read the response
+ *     This routine is typically called from a driver plug-in to send
+ * a read or write command to the FPGA.  It may be called from within
+ * serial_fpga itself for initialization and to help process interrupts.
+ * The packet is queued behind any transactions already submitted with
+ * sendrecv_async() and the responses for those are processed while we
+ * wait for ours.
  */
 int sendrecv_pkt(
     int            parent,      // Slot number of parent,
@@ -598,106 +1545,2441 @@ int sendrecv_pkt(
 {
     SERPORT      *pctx;         // our local info
     SLOT         *pslot;        // our SLOT
-    int           sntcount1;    // return from first call to write()
-    int           sntcount2;    // return from second call to write()
-    int           expectrd;     // number of bytes expected in FPGA response
-    int           rdcount;      // return from read()
-    int           rdsofar = 0;  // number of characters we've read so far
-    fd_set        rdfs;         // read FDs for select()
-    struct timeval select_tv;   // timeout for select()
-    int           sret;         // select() return value
+    SYNCWAIT      sw;           // where the completion is recorded
+    int           ret;
+
+    pctx = (SERPORT *) Slots[parent].priv;
+    pslot = pctx->pslot;
+
+    if (strncmp(PLUGIN_NAME, pslot->name, strlen(PLUGIN_NAME)) != 0) {
+        edlog("Wanted %s in Slot %i.  Exiting...\n", PLUGIN_NAME, parent);
+        exit(1);
+    }
+
+    // Sanity check. Valid count.  Non-null buffer.  Port open.
+    if ((count <= 0) || (count > HBA_MXPKT) || (buff == (uint8_t *) 0) ||
+        (pctx->spfd < 0)) {
+        return(HBAERROR_NOSEND);
+    }
+
+    // Wait for room in the transaction queue
+    while ((pctx->nxact == MX_XACT) && (pctx->spfd >= 0)) {
+        rx_wait(pctx);
+    }
+
+    sw.buff = buff;
+    sw.ret = HBAERROR_NORECV;
+    sw.done = 0;
+    ret = queue_xact(pctx, count, buff, sync_done, (void *) &sw);
+    if (ret < 0) {
+        return(ret);
+    }
+    send_xacts(pctx);
+
+    // Process responses until ours is in
+    while (sw.done == 0) {
+        rx_wait(pctx);
+    }
+    return(sw.ret);
+}
+
+
+/* sendrecv_async() : Queue a packet for the FPGA and return without
+ * waiting for the response.  The packet format is the same as for
+ * sendrecv_pkt().  Up to MX_INFLIGHT packets are kept on the wire at
+ * once and the rest wait in a queue of MX_XACT transactions.
+ *     When the response arrives, or on error, the completion callback
+ * is invoked as
+ *     done(trans, ret, rsp)
+ * where ret is the number of response bytes or one of the negative
+ * error codes of sendrecv_pkt(), and rsp points to the response bytes.
+ * The rsp buffer belongs to serial_fpga and is only valid for the
+ * duration of the callback.  The done callback may be null.
+ *     The return value is zero if the packet was queued and
+ * HBAERROR_NOSEND if the port is closed or the queue is full.
+ */
+int sendrecv_async(
+    int            parent,      // Slot number of parent,
+    int            count,       // num bytes to send
+    uint8_t       *buff,        // pointer to first char to send
+    void         (*done)(),     // completion callback
+    void          *trans)       // transparently pass this to callback
+{
+    SERPORT      *pctx;         // our local info
+    SLOT         *pslot;        // our SLOT
+
+    pctx = (SERPORT *) Slots[parent].priv;
+    pslot = pctx->pslot;
+
+    if (strncmp(PLUGIN_NAME, pslot->name, strlen(PLUGIN_NAME)) != 0) {
+        edlog("Wanted %s in Slot %i.  Exiting...\n", PLUGIN_NAME, parent);
+        exit(1);
+    }
+
+    // Sanity check. Valid count.  Non-null buffer.  Port open.
+    if ((count <= 0) || (count > HBA_MXPKT) || (buff == (uint8_t *) 0) ||
+        (pctx->spfd < 0)) {
+        return(HBAERROR_NOSEND);
+    }
+
+    if (queue_xact(pctx, count, buff, done, trans) < 0) {
+        return(HBAERROR_NOSEND);
+    }
+    send_xacts(pctx);
+    return(0);
+}
+
+
+/* sendrecv_batch() : Send several packets to the FPGA with one write()
+ * and wait for all of the responses.  Each transfer has a packet in the
+ * same format as for sendrecv_pkt().  On return each packet holds its
+ * response and each ret field holds the number of response bytes or a
+ * negative error code.  Up to MX_INFLIGHT transfers can be in a batch.
+ *     The return value is the number of transfers that completed, or
+ * HBAERROR_NOSEND if the batch could not be queued.  Callers should
+ * still check for an ACK in the response to each write.
+ */
+int sendrecv_batch(
+    int            parent,      // Slot number of parent,
+    int            nxfer,       // number of transfers in pxfer
+    HBA_XFER      *pxfer)       // the transfers
+{
+    SERPORT      *pctx;         // our local info
+    SLOT         *pslot;        // our SLOT
+    int           nok;          // number of completed transfers
+    int           i;
+
+    pctx = (SERPORT *) Slots[parent].priv;
+    pslot = pctx->pslot;
+
+    if (strncmp(PLUGIN_NAME, pslot->name, strlen(PLUGIN_NAME)) != 0) {
+        edlog("Wanted %s in Slot %i.  Exiting...\n", PLUGIN_NAME, parent);
+        exit(1);
+    }
+
+    // Sanity check. Valid number of transfers.  Port open.
+    if ((nxfer <= 0) || (nxfer > MX_INFLIGHT) || (pxfer == (HBA_XFER *) 0) ||
+        (pctx->spfd < 0)) {
+        return(HBAERROR_NOSEND);
+    }
+    // Valid count and non-null buffer in each transfer.  Refuse the
+    // whole batch if the FPGA can not take one of the packets so that
+    // the caller can try again another way.  A ret of zero marks the
+    // transfer as not yet complete.
+    for (i = 0; i < nxfer; i++) {
+        if ((pxfer[i].count <= 0) || (pxfer[i].count > HBA_MXPKT) ||
+            (pxfer[i].pkt == (uint8_t *) 0) ||
+            (pkt_rsplen(pctx, pxfer[i].count, pxfer[i].pkt) < 0)) {
+            return(HBAERROR_NOSEND);
+        }
+        pxfer[i].ret = 0;
+    }
+
+    // Wait for room for the whole batch in the transaction queue
+    while ((pctx->nxact + nxfer > MX_XACT) && (pctx->spfd >= 0)) {
+        rx_wait(pctx);
+    }
+
+    // Queue all of the transfers before sending so that they go
+    // out together.
+    for (i = 0; i < nxfer; i++) {
+        if (queue_xact(pctx, pxfer[i].count, pxfer[i].pkt, batch_done,
+                       (void *) &(pxfer[i])) < 0) {
+            pxfer[i].ret = HBAERROR_NOSEND;
+        }
+    }
+    send_xacts(pctx);
+
+    // Process responses until all of ours are in
+    nok = 0;
+    for (i = 0; i < nxfer; i++) {
+        while (pxfer[i].ret == 0) {
+            rx_wait(pctx);
+        }
+        if (pxfer[i].ret > 0) {
+            nok++;
+        }
+    }
+    return(nok);
+}
+
+
+/* sendrecv_exchange() : Write wlen registers of a core starting at
+ * wreg and then read rlen registers of the same core starting at rreg.
+ * The write data is in wdata.  On return rsp has the ACK (or NACK) for
+ * the writes followed by the rlen bytes read, so rsp needs room for
+ * rlen+1 bytes.  The return value is the number of bytes in rsp or a
+ * negative error code as for sendrecv_pkt().
+ *     An FPGA with the exchange command does this as one packet with
+ * one response.  An older FPGA gets a write and a read sent together
+ * with sendrecv_batch().
+ */
+int sendrecv_exchange(
+    int            parent,      // Slot number of parent,
+    int            core,        // core to write then read
+    int            wreg,        // first register to write
+    int            wlen,        // number of registers to write
+    uint8_t       *wdata,       // data to write
+    int            rreg,        // first register to read
+    int            rlen,        // number of registers to read
+    uint8_t       *rsp)         // ACK and read data on return
+{
+    SERPORT      *pctx;         // our local info
+    SLOT         *pslot;        // our SLOT
+    uint8_t       pkt[HBA_MXPKT]; // exchange packet and response
+    uint8_t       wpkt[HBA_MXPKT]; // write packet for an older FPGA
+    HBA_XFER      xfer[2];      // write and read for an older FPGA
+    int           count;        // num bytes in the exchange packet
+    int           ret;
+
+    pctx = (SERPORT *) Slots[parent].priv;
+    pslot = pctx->pslot;
+
+    if (strncmp(PLUGIN_NAME, pslot->name, strlen(PLUGIN_NAME)) != 0) {
+        edlog("Wanted %s in Slot %i.  Exiting...\n", PLUGIN_NAME, parent);
+        exit(1);
+    }
+
+    // Sanity check.  Valid core and lengths.  Non-null buffers.
+    if ((core < 0) || (core >= HBA_EXT_COREID) || (wlen < 0) ||
+        (wlen > HBA_MXBURST) || (rlen < 0) || (rlen > HBA_MXBURST) ||
+        ((wlen > 0) && (wdata == (uint8_t *) 0)) || (rsp == (uint8_t *) 0)) {
+        return(HBAERROR_NOSEND);
+    }
+
+    count = wlen + rlen + 7;
+    if ((pctx->protorev >= HBA_PROTO_EXCHANGE) && (pctx->framed == 0) &&
+        (count <= HBA_MXPKT)) {
+        pkt[0] = HBA_READ_CMD | (HBA_EXT_EXCHANGE << 4) | HBA_EXT_COREID;
+        pkt[1] = core;
+        pkt[2] = wreg;
+        pkt[3] = wlen;
+        if (wlen > 0) {
+            memcpy(&(pkt[4]), wdata, wlen);
+        }
+        pkt[wlen + 4] = rreg;
+        pkt[wlen + 5] = rlen;
+        memset(&(pkt[wlen + 6]), 0, (rlen + 1));  // dummies for ACK and data
+        ret = sendrecv_pkt(parent, count, pkt);
+        if (ret > 0) {
+            memcpy(rsp, pkt, ret);
+        }
+        return(ret);
+    }
+
+    // No exchange command.  Send the write and read back to back.
+    xfer[0].pkt = wpkt;
+    xfer[0].count = rw_pkt(0, core, wreg, wlen, wdata, wpkt);
+    xfer[1].pkt = pkt;
+    xfer[1].count = rw_pkt(1, core, rreg, rlen, (uint8_t *) 0, pkt);
+    ret = sendrecv_batch(parent, 2, xfer);
+    if (ret != 2) {
+        return((ret < 0) ? ret : HBAERROR_NORECV);
+    }
+    // Drop the echoed header of the read
+    rsp[0] = wpkt[0];
+    memcpy(&(rsp[1]), &(pkt[xfer[1].ret - rlen]), rlen);
+    return(rlen + 1);
+}
+
+
+/* sendrecv_gather() : Read registers from several cores in one round
+ * trip.  Each descriptor gives a core, its first register, the number
+ * of registers to read, and where to put them.  The return value is
+ * the total number of bytes read on success or a negative error code
+ * as for sendrecv_pkt().  HBAERROR_NACK means the data is in place
+ * but one of the cores did not answer and its registers read as zero.
+ *     An FPGA with the gather command does this as one packet.  An
+ * older FPGA gets one read per descriptor sent with sendrecv_batch().
+ * Up to MX_INFLIGHT descriptors are allowed.
+ */
+int sendrecv_gather(
+    int            parent,      // Slot number of parent,
+    int            ndesc,       // number of descriptors
+    HBA_GATHER    *pdesc)       // the reads to do
+{
+    SERPORT      *pctx;         // our local info
+    SLOT         *pslot;        // our SLOT
+    uint8_t       pkt[HBA_MXPKT]; // gather packet and response
+    uint8_t       rpkt[MX_INFLIGHT][HBA_MXPKT]; // reads for an older FPGA
+    HBA_XFER      xfer[MX_INFLIGHT]; // transfers for an older FPGA
+    int           count;        // num bytes in the gather packet
+    int           total;        // total number of registers to read
+    int           echo;         // ==1 if the FPGA echoes the command
+    int           ret;
+    int           i;
+
+    pctx = (SERPORT *) Slots[parent].priv;
+    pslot = pctx->pslot;
+
+    if (strncmp(PLUGIN_NAME, pslot->name, strlen(PLUGIN_NAME)) != 0) {
+        edlog("Wanted %s in Slot %i.  Exiting...\n", PLUGIN_NAME, parent);
+        exit(1);
+    }
+
+    // Sanity check.  Valid number of descriptors, cores, and counts.
+    if ((ndesc <= 0) || (ndesc > MX_INFLIGHT) || (pdesc == (HBA_GATHER *) 0)) {
+        return(HBAERROR_NOSEND);
+    }
+    // Newer FPGAs echo the command byte after the descriptor count
+    echo = (pctx->protorev >= HBA_PROTO_PUSH) ? 1 : 0;
+    count = 3 + echo;                   // command, ndesc, and ACK dummy
+    total = 0;
+    for (i = 0; i < ndesc; i++) {
+        if ((pdesc[i].core < 0) || (pdesc[i].core >= HBA_EXT_COREID) ||
+            (pdesc[i].count <= 0) || (pdesc[i].count > HBA_MXBURST) ||
+            (pdesc[i].data == (uint8_t *) 0)) {
+            return(HBAERROR_NOSEND);
+        }
+        count += 3 + pdesc[i].count;
+        total += pdesc[i].count;
+    }
+
+    if ((pctx->protorev >= HBA_PROTO_GATHER) && (pctx->framed == 0) &&
+        (count <= HBA_MXPKT)) {
+        // Each descriptor is followed by a dummy byte for each register
+        pkt[0] = HBA_READ_CMD | (HBA_EXT_GATHER << 4) | HBA_EXT_COREID;
+        pkt[1] = ndesc;
+        count = 2;
+        if (echo) {
+            pkt[count++] = 0;           // dummy for the echo
+        }
+        for (i = 0; i < ndesc; i++) {
+            pkt[count++] = pdesc[i].core;
+            pkt[count++] = pdesc[i].reg;
+            pkt[count++] = pdesc[i].count;
+            memset(&(pkt[count]), 0, pdesc[i].count);
+            count += pdesc[i].count;
+        }
+        pkt[count++] = 0;               // dummy for the ack
+        ret = sendrecv_pkt(parent, count, pkt);
+        if (ret != (total + echo + 1)) {
+            return((ret < 0) ? ret : HBAERROR_NORECV);
+        }
+        // The data comes back in descriptor order then an ACK
+        count = echo;
+        for (i = 0; i < ndesc; i++) {
+            memcpy(pdesc[i].data, &(pkt[count]), pdesc[i].count);
+            count += pdesc[i].count;
+        }
+        return((pkt[count] == HBA_ACK) ? total : HBAERROR_NACK);
+    }
+
+    // No gather command.  Send the reads back to back.
+    for (i = 0; i < ndesc; i++) {
+        xfer[i].pkt = rpkt[i];
+        xfer[i].count = rw_pkt(1, pdesc[i].core, pdesc[i].reg,
+                               pdesc[i].count, (uint8_t *) 0, rpkt[i]);
+    }
+    ret = sendrecv_batch(parent, ndesc, xfer);
+    if (ret != ndesc) {
+        return((ret < 0) ? ret : HBAERROR_NORECV);
+    }
+    // Drop the echoed header of each read
+    for (i = 0; i < ndesc; i++) {
+        memcpy(pdesc[i].data, &(rpkt[i][xfer[i].ret - pdesc[i].count]),
+               pdesc[i].count);
+    }
+    return(total);
+}
+
+
+/* sendrecv_snapshot() : Read registers from several cores as they
+ * all were on one clock.  The descriptors are as for sendrecv_gather()
+ * and name the live registers, which must be in registers 1 to 7.  A
+ * write of the serial_fpga snapshot register has every core copy
+ * regN to regN+HBA_SNAP_OFFSET on the same clock.  The copies are
+ * then gathered.  The write is queued ahead of the gather so both go
+ * out in one round trip.  The return value is as for sendrecv_gather(),
+ * or HBAERROR_NOSEND if the FPGA can not take snapshots.  Callers
+ * should then fall back to reading the live registers.
+ */
+int sendrecv_snapshot(
+    int            parent,      // Slot number of parent,
+    int            ndesc,       // number of descriptors
+    HBA_GATHER    *pdesc)       // the reads to do
+{
+    SERPORT      *pctx;         // our local info
+    SLOT         *pslot;        // our SLOT
+    HBA_GATHER    snap[MX_INFLIGHT]; // the reads of the copies
+    uint8_t       pkt[4];       // the snapshot write
+    SYNCWAIT      sw;           // where the write completion is recorded
+    int           ret;
+    int           i;
+
+    pctx = (SERPORT *) Slots[parent].priv;
+    pslot = pctx->pslot;
+
+    if (strncmp(PLUGIN_NAME, pslot->name, strlen(PLUGIN_NAME)) != 0) {
+        edlog("Wanted %s in Slot %i.  Exiting...\n", PLUGIN_NAME, parent);
+        exit(1);
+    }
+
+    // Sanity check.  FPGA has snapshots.  Registers have copies.
+    if ((ndesc <= 0) || (ndesc > MX_INFLIGHT) || (pdesc == (HBA_GATHER *) 0) ||
+        (pctx->protorev < HBA_PROTO_SNAPSHOT) || (pctx->spfd < 0)) {
+        return(HBAERROR_NOSEND);
+    }
+    for (i = 0; i < ndesc; i++) {
+        if ((pdesc[i].reg < 1) || (pdesc[i].count <= 0) ||
+            (pdesc[i].reg + pdesc[i].count > HBA_SNAP_OFFSET)) {
+            return(HBAERROR_NOSEND);
+        }
+        snap[i] = pdesc[i];
+        snap[i].reg += HBA_SNAP_OFFSET;
+    }
+
+    // Wait for room in the transaction queue
+    while ((pctx->nxact == MX_XACT) && (pctx->spfd >= 0)) {
+        rx_wait(pctx);
+    }
+
+    // Queue the write.  The gather sends it.
+    pkt[0] = HBA_WRITE_CMD | ((1 -1) << 4) | HBA_SERIAL_FPGA_COREID;
+    pkt[1] = HBA_SF_REG_SNAP;
+    pkt[2] = 1;
+    pkt[3] = 0;                     // dummy for the ack
+    sw.buff = pkt;
+    sw.ret = HBAERROR_NORECV;
+    sw.done = 0;
+    ret = queue_xact(pctx, 4, pkt, sync_done, (void *) &sw);
+    if (ret < 0) {
+        return(ret);
+    }
+    ret = sendrecv_gather(parent, ndesc, snap);
+
+    // The write was ahead of the gather so it is usually in by now
+    send_xacts(pctx);
+    while (sw.done == 0) {
+        rx_wait(pctx);
+    }
+    if ((sw.ret != 1) || (pkt[0] != HBA_ACK)) {
+        return((sw.ret < 0) ? sw.ret : HBAERROR_NACK);
+    }
+    return(ret);
+}
+
+
+/* sendrecv_shadow() : Write registers through the shadow register
+ * file.  The packet is a regular or long burst write in the same
+ * format as for sendrecv_pkt() and the response is the same single
+ * ACK or NACK byte.  The values written are kept in the shadow.  A
+ * write that changes nothing the FPGA has is not sent at all.  The
+ * registers that did change go out with any others of the core still
+ * waiting, joined into as few bursts as possible, and the call waits
+ * for the FPGA to answer.  Use sendrecv_shadow_batch() to have several
+ * writes joined.
+ *     Only registers that can be written twice with the same value
+ * and no side effect should be written this way.  Other packets are
+ * passed to sendrecv_pkt().
+ */
+int sendrecv_shadow(
+    int            parent,      // Slot number of parent,
+    int            count,       // num bytes to send / receive
+    uint8_t       *buff)        // pointer to first char to send
+{
+    HBA_XFER      xfer;         // the write as a batch of one
+    int           core;         // core written
+    int           reg;          // first register written
+    int           n;            // number of registers written
+    int           hdr;          // number of header bytes
+    int           ret;
+
+    if ((count <= 1) || (count > HBA_MXPKT) || (buff == (uint8_t *) 0)) {
+        return(HBAERROR_NOSEND);
+    }
+    // Only regular and long burst writes go through the shadow
+    if (shadow_parse(count, buff, &core, &reg, &n, &hdr) != 0) {
+        return(sendrecv_pkt(parent, count, buff));
+    }
+
+    xfer.pkt = buff;
+    xfer.count = count;
+    ret = sendrecv_shadow_batch(parent, 1, &xfer);
+    if (ret < 0) {
+        return(ret);
+    }
+    return(xfer.ret);
+}
+
+
+/* sendrecv_shadow_batch() : Write registers through the shadow
+ * register file as for sendrecv_shadow() but for several writes at
+ * once.  All of the writes go into the shadow before any is sent so
+ * that the changed registers of each core are joined into as few
+ * bursts as possible.  The call returns when the FPGA has answered
+ * them all.  Each packet must be a regular or long burst write and
+ * gets the ACK or NACK for its registers in its first byte.  The
+ * return value and the ret fields are as for sendrecv_batch().
+ */
+int sendrecv_shadow_batch(
+    int            parent,      // Slot number of parent,
+    int            nxfer,       // number of writes in pxfer
+    HBA_XFER      *pxfer)       // the writes
+{
+    SERPORT      *pctx;         // our local info
+    SLOT         *pslot;        // our SLOT
+    COREINFO     *pci;          // shadow of the core written
+    int           core;         // core written
+    int           reg;          // first register written
+    int           n;            // number of registers written
+    int           hdr;          // number of header bytes
+    int           ndirty;       // registers of a write to send
+    int           cores = 0;    // bit set for each core to flush
+    int           err[NCORE];   // error from the flush of each core
+    int           nok = 0;      // number of writes that completed
     int           i;
+    int           j;
+
+    pctx = (SERPORT *) Slots[parent].priv;
+    pslot = pctx->pslot;
+
+    if (strncmp(PLUGIN_NAME, pslot->name, strlen(PLUGIN_NAME)) != 0) {
+        edlog("Wanted %s in Slot %i.  Exiting...\n", PLUGIN_NAME, parent);
+        exit(1);
+    }
+
+    // Sanity check.  Valid writes.  Port open.
+    if ((nxfer <= 0) || (pxfer == (HBA_XFER *) 0) || (pctx->spfd < 0)) {
+        return(HBAERROR_NOSEND);
+    }
+    for (i = 0; i < nxfer; i++) {
+        if ((pxfer[i].pkt == (uint8_t *) 0) || (pxfer[i].count <= 1) ||
+            (pxfer[i].count > HBA_MXPKT) ||
+            (shadow_parse(pxfer[i].count, pxfer[i].pkt, &core, &reg, &n,
+                          &hdr) != 0)) {
+            return(HBAERROR_NOSEND);
+        }
+    }
+
+    // Registers with a new value, or one the FPGA may not have, are
+    // dirty until they are ACKed.  A write with nothing dirty is done.
+    for (i = 0; i < nxfer; i++) {
+        (void) shadow_parse(pxfer[i].count, pxfer[i].pkt, &core, &reg, &n,
+                            &hdr);
+        pci = &(pctx->coreinfo[core]);
+        ndirty = 0;
+        for (j = reg; j < reg + n; j++) {
+            if (((pci->shflags[j] & SH_SYNCED) == 0) ||
+                (pci->shadow[j] != pxfer[i].pkt[hdr + j - reg])) {
+                pci->shadow[j] = pxfer[i].pkt[hdr + j - reg];
+                pci->shflags[j] = SH_CACHED | (pci->shflags[j] & SH_RESTORE);
+                ndirty++;
+            }
+        }
+        if (ndirty == 0) {
+            pctx->stats.core[core].skipped++;
+        }
+        cores |= (ndirty != 0) ? (1 << core) : 0;
+    }
+
+    for (core = 0; core < NCORE; core++) {
+        err[core] = ((cores & (1 << core)) != 0) ? shadow_flush(pctx, core) : 0;
+    }
+
+    // Wait for the answers.  Registers refused by the FPGA are dropped
+    // from the shadow.
+    for (i = 0; i < nxfer; i++) {
+        (void) shadow_parse(pxfer[i].count, pxfer[i].pkt, &core, &reg, &n,
+                            &hdr);
+        shadow_wait(pctx, core, reg, n);
+        pci = &(pctx->coreinfo[core]);
+        pxfer[i].ret = 1;
+        pxfer[i].pkt[0] = HBA_ACK;
+        for (j = reg; j < reg + n; j++) {
+            if ((pci->shflags[j] & SH_CACHED) == 0) {
+                pxfer[i].pkt[0] = HBA_NACK;
+            }
+            else if (((pci->shflags[j] & SH_SYNCED) == 0) &&
+                     (pxfer[i].pkt[0] == HBA_ACK)) {
+                pxfer[i].ret = (err[core] < 0) ? err[core] : HBAERROR_NORECV;
+            }
+        }
+        if (pxfer[i].ret > 0) {
+            nok++;
+        }
+    }
+    return(nok);
+}
+
+
+/* shadow_parse() : Get the core, first register, register count, and
+ * header length of a write that can go through the shadow.  Returns 0
+ * if it can and -1 if not.
+ */
+static int shadow_parse(
+    int            count,       // num bytes in the packet
+    uint8_t       *buff,        // the packet
+    int           *pcore,       // core written
+    int           *preg,        // first register written
+    int           *pn,          // number of registers written
+    int           *phdr)        // number of header bytes
+{
+    if ((buff[0] & HBA_READ_CMD) != 0) {
+        return(-1);
+    }
+    if ((buff[0] & 0x0f) != HBA_EXT_COREID) {
+        *pcore = buff[0] & 0x0f;
+        *preg = buff[1];
+        *pn = ((buff[0] >> 4) & 0x07) + 1;
+        *phdr = 2;
+    }
+    else if ((((buff[0] >> 4) & 0x07) == HBA_EXT_BURST) && (count > 4)) {
+        *pcore = buff[1] & 0x0f;
+        *preg = buff[2];
+        *pn = buff[3];
+        *phdr = 4;
+    }
+    else {
+        return(-1);
+    }
+    if ((count != (*phdr + *pn + 1)) || (*pn == 0) ||
+        (*preg + *pn > SHADOW_NREG) || (*pcore == HBA_EXT_COREID)) {
+        return(-1);
+    }
+    return(0);
+}
+
+
+/* shadow_flush() : Queue the dirty shadow registers of a core for
+ * the FPGA.  A run of dirty registers is sent as one write.  Runs with
+ * a few clean registers between them are joined since it is cheaper
+ * to write the clean ones again than to send another header and wait
+ * on another ACK.  All of the writes go out together and shadow_done()
+ * gets the responses.  Registers stay dirty until ACKed so a failed
+ * write is tried again on the next flush.  Returns the number of
+ * writes queued or a negative error code.
+ */
+static int shadow_flush(
+    SERPORT      *pctx,         // our local info
+    int           core)         // core to flush
+{
+    COREINFO     *pci;          // shadow of the core
+    SHWRITE      *psw;          // record of one write
+    uint8_t       pkt[HBA_MXPKT]; // one write
+    int           count;        // number of bytes in pkt
+    int           nsent = 0;    // number of writes queued
+    int           err = 0;      // error from queue_xact()
+    int           end;          // one past the last dirty register of a run
+    int           mxrun;        // most registers in one write
+    int           r;
+    int           i;
+
+    pci = &(pctx->coreinfo[core]);
+    mxrun = (pctx->protorev >= HBA_PROTO_EXT) ? HBA_MXBURST : 8;
+    for (r = 0; r < SHADOW_NREG; r++) {
+        if ((pci->shflags[r] & (SH_CACHED | SH_SYNCED | SH_SENT)) !=
+            SH_CACHED) {
+            continue;
+        }
+        // Extend the run over dirty registers and short gaps of
+        // clean ones.  Stop at a register not in the shadow.
+        end = r + 1;
+        for (i = r + 1; (i < SHADOW_NREG) && (i - r < mxrun) &&
+                        (i - end <= SHADOW_GAP); i++) {
+            if ((pci->shflags[i] & SH_CACHED) == 0) {
+                break;
+            }
+            if ((pci->shflags[i] & (SH_SYNCED | SH_SENT)) == 0) {
+                end = i + 1;
+            }
+        }
+
+        while ((pctx->nxact == MX_XACT) && (pctx->spfd >= 0)) {
+            rx_wait(pctx);
+        }
+        psw = &(pctx->shw[pctx->shwnext]);
+        psw->pctx = (void *) pctx;
+        psw->core = core;
+        psw->reg = r;
+        psw->n = end - r;
+        count = rw_pkt(0, core, r, end - r, &(pci->shadow[r]), pkt);
+        err = queue_xact(pctx, count, pkt, shadow_done, (void *) psw);
+        if (err < 0) {
+            break;
+        }
+        pctx->shwnext = (pctx->shwnext + 1) % MX_XACT;
+        for (i = r; i < end; i++) {
+            pci->shflags[i] |= SH_SENT;
+        }
+        nsent++;
+        r = end - 1;
+    }
+    if (nsent > 0) {
+        send_xacts(pctx);
+    }
+    return((err < 0) ? err : nsent);
+}
+
+
+/* shadow_wait() : Process responses until none of n registers of a
+ * core starting at reg is on its way to the FPGA.
+ */
+static void shadow_wait(
+    SERPORT      *pctx,         // our local info
+    int           core,         // core written
+    int           reg,          // first register
+    int           n)            // number of registers
+{
+    COREINFO     *pci;          // shadow of the core
+    int           i;
+
+    pci = &(pctx->coreinfo[core]);
+    for (i = reg; i < reg + n; i++) {
+        while ((pci->shflags[i] & SH_SENT) && (pctx->nxact > 0)) {
+            rx_wait(pctx);
+        }
+    }
+}
+
+
+/* shadow_done() : The response to a shadow write is in.  Mark the
+ * registers that have not changed since as synced.  Registers in a
+ * write the FPGA refused are dropped, and the registers of a write
+ * that was lost stay dirty to be sent with the next flush.
+ */
+static void shadow_done(
+    void         *trans,        // the write (==*SHWRITE)
+    int           nrc,          // number of bytes received
+    uint8_t      *pkt)          // the response
+{
+    SHWRITE      *psw;          // the write
+    SERPORT      *pctx;         // our local info
+    COREINFO     *pci;          // shadow of the core written
+    int           i;
+
+    psw = (SHWRITE *) trans;
+    pctx = (SERPORT *) psw->pctx;
+    pci = &(pctx->coreinfo[psw->core]);
+
+    for (i = psw->reg; i < psw->reg + psw->n; i++) {
+        if ((nrc > 0) && (pkt[nrc - 1] == HBA_ACK)) {
+            if (pci->shflags[i] & SH_SENT) {
+                pci->shflags[i] = SH_CACHED | SH_SYNCED |
+                                  (pci->shflags[i] & SH_RESTORE);
+            }
+        }
+        else if (nrc > 0) {
+            // Refused.  No use keeping registers the core does not have.
+            pci->shflags[i] &= SH_RESTORE;
+        }
+        else {
+            pci->shflags[i] &= ~SH_SENT;
+        }
+    }
+}
+
+
+/* shadow_learn() : Keep the shadow in step with writes that do not
+ * go through sendrecv_shadow().  A shadow register written by another
+ * path takes the new value and is marked dirty since we can not know
+ * yet that the write worked.
+ */
+static void shadow_learn(
+    SERPORT      *pctx,         // our local info
+    int           count,        // num bytes to send
+    uint8_t      *buff)         // the packet
+{
+    COREINFO     *pci;          // shadow of the core written
+    int           op;           // op code of an extended command
+    int           core;         // core written
+    int           reg;          // first register written
+    int           n;            // number of registers written
+    int           hdr;          // number of header bytes
+    int           i;
+
+    if ((buff[0] & HBA_READ_CMD) != 0) {
+        // Reads leave the registers alone.  An exchange starts with
+        // a write.
+        op = (buff[0] >> 4) & 0x07;
+        if (((buff[0] & 0x0f) != HBA_EXT_COREID) || (op != HBA_EXT_EXCHANGE)) {
+            return;
+        }
+    }
+    if ((buff[0] & 0x0f) != HBA_EXT_COREID) {
+        core = buff[0] & 0x0f;
+        reg = buff[1];
+        n = ((buff[0] >> 4) & 0x07) + 1;
+        hdr = 2;
+    }
+    else {
+        op = (buff[0] >> 4) & 0x07;
+        if ((count < 4) ||
+            ((op != HBA_EXT_BURST) && (op != HBA_EXT_EXCHANGE))) {
+            return;
+        }
+        core = buff[1] & 0x0f;
+        reg = buff[2];
+        n = buff[3];
+        hdr = 4;
+    }
+    if ((core == HBA_EXT_COREID) || (hdr + n > count)) {
+        return;
+    }
+
+    pci = &(pctx->coreinfo[core]);
+    for (i = 0; (i < n) && (reg + i < SHADOW_NREG); i++) {
+        if (pci->shflags[reg + i] & SH_CACHED) {
+            pci->shadow[reg + i] = buff[hdr + i];
+            pci->shflags[reg + i] = SH_CACHED |
+                                    (pci->shflags[reg + i] & SH_RESTORE);
+        }
+    }
+}
+
+
+/* shadow_replay() : Write the shadow registers that plug-ins marked
+ * with register_shadow_restore() to the FPGA.  This puts back the
+ * setup of the cores after the FPGA is reset or loaded again.  Other
+ * registers, such as motor speeds, are dropped from the shadow so
+ * that nothing starts moving without a new command, and their next
+ * write is sent whatever its value.
+ */
+static void shadow_replay(
+    SERPORT      *pctx)         // our local info
+{
+    COREINFO     *pci;
+    int           nsent = 0;    // number of writes sent
+    int           nbad = 0;     // number of registers not restored
+    int           ret;
+    int           core;
+    int           r;
+
+    if (pctx->spfd < 0) {
+        return;
+    }
+    for (core = 0; core < NCORE; core++) {
+        pci = &(pctx->coreinfo[core]);
+        for (r = 0; r < SHADOW_NREG; r++) {
+            if ((pci->shflags[r] & (SH_CACHED | SH_RESTORE)) ==
+                (SH_CACHED | SH_RESTORE)) {
+                pci->shflags[r] = SH_CACHED | SH_RESTORE;
+            }
+            else {
+                pci->shflags[r] &= SH_RESTORE;
+            }
+        }
+        ret = shadow_flush(pctx, core);
+        if (ret < 0) {
+            edlog("Unable to restore the registers of core %d on %s", core,
+                  pctx->port);
+            continue;
+        }
+        nsent += ret;
+    }
+    for (core = 0; core < NCORE; core++) {
+        pci = &(pctx->coreinfo[core]);
+        shadow_wait(pctx, core, 0, SHADOW_NREG);
+        for (r = 0; r < SHADOW_NREG; r++) {
+            if ((pci->shflags[r] & (SH_CACHED | SH_SYNCED)) == SH_CACHED) {
+                nbad++;
+            }
+        }
+    }
+    if (nsent > 0) {
+        edlog("Restored the shadow registers on %s in %d writes", pctx->port,
+              nsent);
+    }
+    if (nbad > 0) {
+        edlog("%d shadow registers on %s were not restored", nbad,
+              pctx->port);
+    }
+}
+
+
+/* rw_pkt() : Build a read or write packet for n registers of a core.
+ * A regular command is used when it can hold n registers and a long
+ * burst otherwise.  Returns the number of bytes in the packet.
+ */
+static int rw_pkt(
+    int            rnw,         // ==1 for a read
+    int            core,        // core to access
+    int            reg,         // first register
+    int            n,           // number of registers
+    uint8_t       *data,        // data for a write
+    uint8_t       *pkt)         // where to build the packet
+{
+    int            hdr;         // number of header bytes
+
+    if ((n >= 1) && (n <= 8)) {
+        pkt[0] = ((rnw) ? HBA_READ_CMD : HBA_WRITE_CMD) | ((n -1) << 4) | core;
+        pkt[1] = reg;
+        hdr = 2;
+    }
+    else {
+        pkt[0] = ((rnw) ? HBA_READ_CMD : HBA_WRITE_CMD) |
+                 (HBA_EXT_BURST << 4) | HBA_EXT_COREID;
+        pkt[1] = core;
+        pkt[2] = reg;
+        pkt[3] = n;
+        hdr = 4;
+    }
+    if (rnw) {
+        // Dummies for the echoed header and the data
+        memset(&(pkt[hdr]), 0, (hdr + n));
+        return(hdr + hdr + n);
+    }
+    memcpy(&(pkt[hdr]), data, n);
+    pkt[hdr + n] = 0;                   // dummy for the ack
+    return(hdr + n + 1);
+}
+
+
+/* queue_xact() : Add a transaction to the tail of the queue.  The
+ * caller sends it with send_xacts().  Returns zero on success and
+ * HBAERROR_NOSEND if the queue is full.
+ */
+static int queue_xact(
+    SERPORT      *pctx,         // our local info
+    int           count,        // num bytes to send
+    uint8_t      *buff,         // pointer to first char to send
+    void        (*done)(),      // completion callback
+    void         *trans)        // transparently pass this to callback
+{
+    XACT         *px;           // the new transaction
+    int           rsplen;       // expected number of response bytes
+
+    if (pctx->nxact == MX_XACT) {
+        return(HBAERROR_NOSEND);
+    }
+
+    rsplen = pkt_rsplen(pctx, count, buff);
+    if (rsplen < 0) {
+        return(rsplen);
+    }
+
+    px = &(pctx->xact[(pctx->xhead + pctx->nxact) % MX_XACT]);
+    shadow_learn(pctx, count, buff);
+    // In posted mode writes go out with no ACK.  They are complete
+    // once they are sent.
+    if ((pctx->posted != 0) && (pctx->protorev >= HBA_PROTO_POSTED) &&
+        ((HBA_READ_CMD & buff[0]) == 0) && (post_pkt(px, count, buff) == 0)) {
+        px->expectrd = 0;
+        px->posted = 1;
+    }
+    else {
+        memcpy(px->pkt, buff, count);
+        px->count = count;
+        px->expectrd = rsplen;
+        px->posted = 0;
+    }
+    px->rdsofar = 0;
+    px->framed = 0;
+    px->ntry = 0;
+    px->cmd = px->pkt[0];
+    px->tsent = 0;
+    // Gathers read from several cores and count as the extended core
+    px->core = buff[0] & 0x0f;
+    if ((px->core == HBA_EXT_COREID) && (count > 1) &&
+        (((buff[0] >> 4) & 0x07) != HBA_EXT_GATHER)) {
+        px->core = buff[1] & 0x0f;
+    }
+    px->done = done;
+    px->trans = trans;
+    pctx->nxact++;
+
+    return(0);
+}
+
+
+/* pkt_rsplen() : Return the number of response bytes to expect
+ * for a packet, or HBAERROR_NOSEND if the FPGA can not take it.
+ */
+static int pkt_rsplen(
+    SERPORT      *pctx,         // our local info
+    int           count,        // num bytes to send
+    uint8_t      *buff)         // pointer to first char to send
+{
+    int           len;          // length byte of an extended command
+    int           rlen;         // read length of an exchange
+    int           idx;          // index of a gather descriptor
+    int           i;
+
+    // Expect response to have one byte for a write and two less than the
+    // write count for a read.
+    if ((buff[0] & 0x0f) != HBA_EXT_COREID) {
+        return((HBA_READ_CMD & buff[0]) ? (count -2) : 1);
+    }
+
+    // Extended commands.  An older FPGA would hang waiting on a
+    // core 15 that is not there so only send them if it has them.
+    if ((pctx->protorev < HBA_PROTO_EXT) || (count < 4)) {
+        return(HBAERROR_NOSEND);
+    }
+    // The FPGA takes its length from the packet.  The count has to
+    // agree with it or we will lose our place in the byte stream.
+    len = buff[3];
+    if (((buff[0] >> 4) & 0x07) == HBA_EXT_EXCHANGE) {
+        // Write data, then the read register and length.  The response
+        // is the ACK for the writes followed by the read data.
+        if ((pctx->protorev < HBA_PROTO_EXCHANGE) || pctx->framed ||
+            ((HBA_READ_CMD & buff[0]) == 0) || (count < (len + 7))) {
+            return(HBAERROR_NOSEND);
+        }
+        rlen = buff[len + 5];
+        return((count == (len + rlen + 7)) ? (rlen + 1) : HBAERROR_NOSEND);
+    }
+    if (((buff[0] >> 4) & 0x07) == HBA_EXT_GATHER) {
+        // Walk the descriptors.  Each is followed by its dummy bytes.
+        // The response is the echoed command on newer FPGAs, the data
+        // for each descriptor, then an ACK.
+        if ((pctx->protorev < HBA_PROTO_GATHER) || pctx->framed ||
+            ((HBA_READ_CMD & buff[0]) == 0)) {
+            return(HBAERROR_NOSEND);
+        }
+        idx = (pctx->protorev >= HBA_PROTO_PUSH) ? 3 : 2;
+        rlen = idx - 2;
+        for (i = 0; i < buff[1]; i++) {
+            if ((idx + 3) > count) {
+                return(HBAERROR_NOSEND);
+            }
+            rlen += buff[idx + 2];
+            idx += 3 + buff[idx + 2];
+        }
+        return((count == (idx + 1)) ? (rlen + 1) : HBAERROR_NOSEND);
+    }
+    if (((buff[0] >> 4) & 0x07) != HBA_EXT_BURST) {
+        return(HBAERROR_NOSEND);
+    }
+    // Reads echo the four header bytes.  Writes get an ACK.
+    if (HBA_READ_CMD & buff[0]) {
+        return((count == (len + 8)) ? (count -4) : HBAERROR_NOSEND);
+    }
+    return((count == (len + 5)) ? 1 : HBAERROR_NOSEND);
+}
+
+
+/* post_pkt() : Convert a write packet into a posted write in the
+ * transaction.  Returns zero on success and -1 if the packet is not
+ * a write that can be posted.
+ */
+static int post_pkt(
+    XACT         *px,           // where to put the posted write
+    int           count,        // num bytes in the write packet
+    uint8_t      *buff)         // the write packet
+{
+    int           len;          // number of data bytes
+
+    if ((buff[0] & 0x0f) != HBA_EXT_COREID) {
+        // Regular write.  Header, data, and a dummy for the ACK.
+        len = ((buff[0] >> 4) & 0x07) + 1;
+        if (count != (len + 3)) {
+            return(-1);
+        }
+        px->pkt[0] = HBA_WRITE_CMD | (HBA_EXT_POSTED << 4) | HBA_EXT_COREID;
+        px->pkt[1] = buff[0] & 0x0f;            // core
+        px->pkt[2] = buff[1];                   // register
+        px->pkt[3] = len;
+        memcpy(&(px->pkt[4]), &(buff[2]), len);
+    }
+    else {
+        // Long burst write.  Same header with a new op code.
+        len = buff[3];
+        if ((((buff[0] >> 4) & 0x07) != HBA_EXT_BURST) || (count != (len + 5))) {
+            return(-1);
+        }
+        memcpy(px->pkt, buff, (len + 4));
+        px->pkt[0] = HBA_WRITE_CMD | (HBA_EXT_POSTED << 4) | HBA_EXT_COREID;
+    }
+    // No dummy byte since there is no ACK
+    px->count = len + 4;
+    return(0);
+}
+
+
+/* send_xacts() : Write queued packets to the serial port until
+ * MX_INFLIGHT, or FRAME_WIN if framed, are awaiting a response.
+ * Nothing is sent while a break is due after a NACK.  All of the packets that can
+ * go are gathered into one write() to save on system calls and on
+ * gaps between the packets on the wire.  A write error fails all
+ * of the queued transactions.
+ */
+static void send_xacts(
+    SERPORT      *pctx)         // our local info
+{
+    XACT         *px;           // transaction to send
+    uint8_t       obuf[MX_INFLIGHT * (HBA_MXPKT + 4)]; // packets to send
+    int           olen;         // number of bytes in obuf
+    int           plen;         // number of bytes in this packet
+    int           nsend;        // number of packets in obuf
+    int           nsent;        // number of bytes written so far
+    int           sntcount;     // return from write()
+    int           ntry;         // number of writes that sent nothing
+    long long     now;          // time of the write in us
+    int           i;
+
+    olen = 0;
+    nsend = 0;
+    while ((pctx->nackbrk == 0) &&
+           ((pctx->ninflt + nsend) < ((pctx->framed) ? FRAME_WIN : MX_INFLIGHT)) &&
+           ((pctx->ninflt + nsend) < pctx->nxact)) {
+        px = &(pctx->xact[(pctx->xhead + pctx->ninflt + nsend) % MX_XACT]);
+        px->framed = pctx->framed;
+        if (px->framed) {
+            plen = frame_pkt(pctx, px, &(obuf[olen]));
+        }
+        else {
+            memcpy(&(obuf[olen]), px->pkt, px->count);
+            plen = px->count;
+            px->rxlen = px->expectrd;
+        }
+        px->ntry++;
+        trace_add(pctx, TR_TX, &(obuf[olen]), plen);
+
+        // Print pkt if debug mode and running in foreground
+        if ((DebugMode != 0) && (ForegroundMode != 0)) {
+            printf(">> ");
+            for (i = 0; i < plen; i++)
+                printf("%02x ", obuf[olen + i]);
+            printf("\n");
+        }
+        olen += plen;
+        nsend++;
+    }
+    if (nsend == 0) {
+        return;
+    }
+    if (pctx->spfd < 0) {
+        fail_xacts(pctx, pctx->nxact, HBAERROR_NOSEND);
+        return;
+    }
+
+    // send data out the serial port.  On a partial send or if we need
+    // to try again, pause then try again.  No retry on a second write
+    // in a row that sends nothing.
+    nsent = 0;
+    ntry = 0;
+    while (nsent < olen) {
+        sntcount = write(pctx->spfd, &(obuf[nsent]), (olen - nsent));
+        if ((sntcount < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+            break;
+        }
+        if (sntcount > 0) {
+            nsent += sntcount;
+            ntry = 0;
+            continue;
+        }
+        if (ntry++ > 0) {
+            break;
+        }
+        usleep(1000);
+    }
+    if (nsent != olen) {
+        edlog("error writing to serial port in serial_fpga");
+        fail_xacts(pctx, pctx->nxact, HBAERROR_NOSEND);
+        return;
+    }
+    pctx->stats.txbytes += olen;
+    now = now_us();
+    for (i = 0; i < nsend; i++) {
+        px = &(pctx->xact[(pctx->xhead + pctx->ninflt + i) % MX_XACT]);
+        if (px->tsent == 0) {
+            px->tsent = now;
+        }
+    }
+    pctx->ninflt += nsend;
+
+    // Start the response timer if it is not already running
+    if ((pctx->ninflt > 0) && (pctx->pxtimer == (void *) 0)) {
+        xact_timer(pctx);
+    }
+
+    // Posted writes have no response.  Complete them if they are next.
+    if ((pctx->ninflt > 0) && (pctx->xact[pctx->xhead].rxlen == 0)) {
+        rx_parse(pctx);
+    }
+}
+
+
+/* rx_parse() : Parse the bytes in the receive ring.  The FPGA answers
+ * in order so bytes go to the oldest transaction on the wire.  A push
+ * frame can come in where a response would start.  Bytes that belong
+ * to neither are unsolicited and go to the rawin resource.  With
+ * framing on, a response that fails its check or a frame error from
+ * the FPGA sends the packets on the wire again.
+ *     Completion callbacks are invoked after the bytes are parsed so
+ * that a callback that sends and waits on another packet sees the
+ * bytes in the order they arrived.  Anything left in the ring after
+ * the callbacks is parsed on the next pass.
+ */
+static void rx_parse(
+    SERPORT      *pctx)         // our local info
+{
+    XACT          done[MX_INFLIGHT]; // transactions completed
+    int           ndone;        // number of completed transactions
+    uint8_t       frames[MX_PUSHQ][3 + HBA_PUSH_MXWIN]; // pushed frames
+    int           nframes;      // number of pushed frames
+    uint8_t       raw[MX_MSGLEN]; // unsolicited bytes
+    int           nraw;         // number of unsolicited bytes
+    int           nused;        // number of bytes taken from the ring
+    int           ferr;         // ==1 on a framing error
+    uint8_t      *prx;          // where the head's response goes
+    XACT         *px;           // transaction at head of queue
+    int           n;
+    int           i;
+
+    do {
+        ndone = 0;
+        nframes = 0;
+        nraw = 0;
+        nused = 0;
+        ferr = 0;
+        while ((ndone < MX_INFLIGHT) && (nframes < MX_PUSHQ) &&
+               (nraw < MX_MSGLEN)) {
+            px = &(pctx->xact[pctx->xhead]);
+
+            // A framed packet that failed its CRC gets a frame error
+            // in place of its response.  It is never the first byte of
+            // a response or of a push frame.
+            if ((pctx->npframe == 0) && (pctx->rxcount > 0) &&
+                (pctx->rxring[pctx->rxhead] == HBA_FRAME_ERR) &&
+                (((pctx->ninflt == 0) && pctx->framed) ||
+                 ((pctx->ninflt > 0) && px->framed && (px->rdsofar == 0)))) {
+                // The resync drops it and anything after it
+                ferr = 1;
+                break;
+            }
+
+            // In push mode a frame can come in where a response would
+            // start.  No response starts with the frame marker.
+            if ((pctx->npframe == 0) && pctx->push && (pctx->rxcount > 0) &&
+                (pctx->rxring[pctx->rxhead] == HBA_PUSH_MARK) &&
+                ((pctx->ninflt == 0) || ((px->rdsofar == 0) && (px->expectrd > 0)))) {
+                nused += rx_take(pctx, pctx->pframe, 1);
+                pctx->npframe = 1;
+            }
+            if (pctx->npframe > 0) {
+                if (pctx->rxcount == 0) {
+                    break;
+                }
+                // Header first, then the registers
+                n = (pctx->npframe < 3) ? 1 : (3 + pctx->pframe[2] - pctx->npframe);
+                n = rx_take(pctx, &(pctx->pframe[pctx->npframe]), n);
+                pctx->npframe += n;
+                nused += n;
+                if ((pctx->npframe == 3) && (pctx->pframe[2] > HBA_PUSH_MXWIN)) {
+                    edlog("Bad push frame from FPGA");
+                    pctx->npframe = 0;
+                    continue;
+                }
+                if ((pctx->npframe >= 3) && (pctx->npframe == (3 + pctx->pframe[2]))) {
+                    memcpy(frames[nframes], pctx->pframe, pctx->npframe);
+                    nframes++;
+                    pctx->npframe = 0;
+                }
+                continue;
+            }
+
+            if (pctx->ninflt == 0) {
+                if (pctx->rxcount == 0) {
+                    break;
+                }
+                nused += rx_take(pctx, &(raw[nraw]), 1);
+                nraw++;
+                continue;
+            }
+            if (px->rdsofar < px->rxlen) {
+                if (pctx->rxcount == 0) {
+                    break;
+                }
+                prx = (px->framed) ? px->rsp : px->pkt;
+                n = rx_take(pctx, &(prx[px->rdsofar]), px->rxlen - px->rdsofar);
+                px->rdsofar += n;
+                nused += n;
+            }
+            if (px->rdsofar == px->rxlen) {
+                if (px->framed && (px->rxlen > 0)) {
+                    if (frame_check(px) < 0) {
+                        ferr = 1;
+                        break;
+                    }
+                    memcpy(px->pkt, px->rsp, px->expectrd);
+                }
+                // An FPGA that does not know an extended command
+                // NACKs it and drops what follows until a break.
+                // A NACKed write looks the same so break after both.
+                if (((px->cmd & 0x0f) == HBA_EXT_COREID) && !px->framed &&
+                    (px->expectrd == 1) && (px->pkt[0] == HBA_NACK) &&
+                    (pctx->protorev >= HBA_PROTO_RESYNC)) {
+                    pctx->nackbrk = 1;
+                }
+                if (px->posted) {
+                    // Tell the caller it was ACKed.  Errors are
+                    // picked up later from the FPGA error count.
+                    px->pkt[0] = HBA_ACK;
+                    px->expectrd = 1;
+                    pctx->nposted++;
+                }
+                done[ndone] = *px;
+                ndone++;
+                pctx->xhead = (pctx->xhead + 1) % MX_XACT;
+                pctx->nxact--;
+                pctx->ninflt--;
+            }
+        }
+
+        // Bytes arrived so restart the timer.  Check for posted write
+        // errors every so often.  Fill the wire again.
+        if (ferr) {
+            frame_retry(pctx);
+        }
+        else if ((nused > 0) || (ndone > 0)) {
+            xact_timer(pctx);
+        }
+        if ((pctx->nposted >= POSTED_CHECK) && (pctx->nxact < MX_XACT)) {
+            pctx->nposted = 0;
+            (void) get_perrs(pctx, 0);
+        }
+        if (pctx->nackbrk && (pctx->ninflt == 0)) {
+            rx_resync(pctx);
+        }
+        send_xacts(pctx);
+
+        for (i = 0; i < ndone; i++) {
+            // Print pkt if debug mode and running in foreground
+            if ((DebugMode != 0) && (ForegroundMode != 0)) {
+                printf("<< ");
+                for (n = 0; n < done[i].expectrd; n++)
+                    printf("%02x ", done[i].pkt[n]);
+                printf("\n");
+            }
+            stat_xact(pctx, &(done[i]), done[i].expectrd);
+            if (done[i].done) {
+                (done[i].done) (done[i].trans, done[i].expectrd, done[i].pkt);
+            }
+        }
+        for (i = 0; i < nframes; i++) {
+            push_frame(pctx, frames[i]);
+        }
+        rx_sniff(pctx, raw, nraw);
+    } while ((pctx->rxcount > 0) && ((ndone + nframes + nraw) > 0));
+}
+
+
+/* rx_take() : Take up to n bytes from the receive ring.  Returns the
+ * number of bytes taken.
+ */
+static int rx_take(
+    SERPORT      *pctx,         // our local info
+    uint8_t      *buf,          // where to put the bytes
+    int           n)            // max number of bytes to take
+{
+    int           i;
+
+    n = (n < pctx->rxcount) ? n : pctx->rxcount;
+    for (i = 0; i < n; i++) {
+        buf[i] = pctx->rxring[pctx->rxhead];
+        pctx->rxhead = (pctx->rxhead + 1) % MX_RXRING;
+    }
+    pctx->rxcount -= n;
+    return(n);
+}
+
+
+/* rx_sniff() : Broadcast unsolicited bytes if any UI are monitoring
+ * the rawin resource.
+ */
+static void rx_sniff(
+    SERPORT      *pctx,         // our local info
+    uint8_t      *raw,          // the unsolicited bytes
+    int           nraw)         // number of bytes in raw
+{
+    SLOT         *pslot;        // This instance of the serial plug-in
+    RSC          *prsc;         // the rawin resource
+    char          msg[MX_MSGLEN * 3 +1]; // text to send.  +1 for newline
+    int           slen;         // length of text to output
+    int           i;
+
+    pslot = pctx->pslot;
+    prsc = &(pslot->rsc[RSC_RAWIN]);
+    if ((prsc->bkey == 0) || (nraw == 0)) {
+        return;
+    }
+    // '3' because each input byte prints as 'xx '.
+    for (i = 0 ; i < nraw ; i++) {
+        sprintf(&msg[i * 3],"%02x ", raw[i]);
+    }
+    sprintf(&msg[i * 3], "\n");
+    slen = (i * 3) + 1;
+    bcst_ui(msg, slen, &(prsc->bkey));
+    prompt(prsc->uilock);
+}
+
+
+/* rx_flush() : Drop the bytes in the receive ring and any partial
+ * push frame.
+ */
+static void rx_flush(
+    SERPORT      *pctx)         // our local info
+{
+    pctx->rxhead = 0;
+    pctx->rxcount = 0;
+    pctx->npframe = 0;
+}
+
+
+/* fail_xacts() : Remove the oldest nfail transactions from the queue
+ * and invoke their callbacks with the error code.
+ */
+static void fail_xacts(
+    SERPORT      *pctx,         // our local info
+    int           nfail,        // number of transactions to fail
+    int           err)          // error code to give callbacks
+{
+    XACT          failed[MX_XACT]; // the removed transactions
+    int           i;
+
+    nfail = (nfail < pctx->nxact) ? nfail : pctx->nxact;
+    for (i = 0; i < nfail; i++) {
+        failed[i] = pctx->xact[pctx->xhead];
+        pctx->xhead = (pctx->xhead + 1) % MX_XACT;
+    }
+    pctx->nxact -= nfail;
+    pctx->ninflt = (nfail < pctx->ninflt) ? (pctx->ninflt - nfail) : 0;
+
+    xact_timer(pctx);
+    send_xacts(pctx);
+
+    for (i = 0; i < nfail; i++) {
+        stat_xact(pctx, &(failed[i]), err);
+        if (failed[i].done) {
+            (failed[i].done) (failed[i].trans, err, failed[i].pkt);
+        }
+    }
+}
+
+
+/* rx_wait() : Wait for and process bytes from the FPGA.  This is used
+ * by callers that block on a response.  A timeout fails the
+ * transactions on the wire.
+ */
+static void rx_wait(
+    SERPORT      *pctx)         // our local info
+{
+    fd_set        rdfs;         // read FDs for select()
+    struct timeval select_tv;   // timeout for select()
+    int           sret;         // select() return value
+    int           tmo;          // timeout in ms
+
+    if (pctx->spfd < 0) {
+        fail_xacts(pctx, pctx->nxact, HBAERROR_NORECV);
+        return;
+    }
+
+    tmo = xact_tmo(pctx);
+    select_tv.tv_sec = tmo / 1000;
+    select_tv.tv_usec = (tmo % 1000) * 1000;
+    FD_ZERO(&rdfs);
+    FD_SET(pctx->spfd, &rdfs);
+    sret = select((pctx->spfd + 1), &rdfs, (fd_set *) 0, (fd_set *) 0, &select_tv);
+    if (sret < 0) {
+        // select error -- bail out on all but EINTR
+        if (errno != EINTR) {
+            edlog("Failure in select() call");
+            exit(-1);
+        }
+    }
+    else if (sret == 0) {
+        // timeout waiting for the response
+        xact_timeout((void *) 0, (void *) pctx);
+    }
+    else if (FD_ISSET(pctx->spfd, &rdfs)) {
+        getevents(pctx->spfd, (void *) pctx);
+    }
+}
+
+
+/* xact_timer() : (Re)start the response timer if there are packets
+ * on the wire and stop it if there are none.
+ */
+static void xact_timer(
+    SERPORT      *pctx)         // our local info
+{
+    if (pctx->pxtimer != (void *) 0) {
+        del_timer(pctx->pxtimer);
+        pctx->pxtimer = (void *) 0;
+    }
+    if (pctx->ninflt > 0) {
+        pctx->pxtimer = add_timer(ED_ONESHOT, xact_tmo(pctx), xact_timeout,
+                                  (void *) pctx);
+    }
+}
+
+
+/* xact_tmo() : Return how long in ms to wait for the next byte from
+ * the FPGA.  The worst case is that every byte on the wire and a
+ * push frame go before it, so allow the time to send them at our
+ * baud rate plus some slack.
+ */
+static int xact_tmo(
+    SERPORT      *pctx)         // our local info
+{
+    int           nbytes;       // bytes that may go before the response
+    XACT         *px;           // a transaction on the wire
+    int           i;
+
+    nbytes = 3 + HBA_PUSH_MXWIN;
+    for (i = 0; i < pctx->ninflt; i++) {
+        px = &(pctx->xact[(pctx->xhead + i) % MX_XACT]);
+        // Framing adds a sequence number and CRC each way
+        nbytes += px->count + ((px->framed) ? 4 : 0);
+    }
+    // 10 bits per byte with the start and stop bits
+    return(((nbytes * 10 * 1000) / pctx->baud) + 1 + XACT_SLACK);
+}
+
+
+/* xact_timeout() : No response from the FPGA.  Drop any partial
+ * response and fail the transactions on the wire, or send them
+ * again if framing is on.  Also called from rx_wait() with a null
+ * timer.
+ */
+static void xact_timeout(
+    void         *timer,        // the expired timer (null if none)
+    void         *cb_data)      // callback data (==*SERPORT)
+{
+    SERPORT      *pctx;         // our local info
+
+    pctx = (SERPORT *) cb_data;
+    if (timer != (void *) 0) {
+        // one-shot timers are freed when they expire
+        pctx->pxtimer = (void *) 0;
+    }
+    if (pctx->ninflt == 0) {
+        return;
+    }
+
+    edlog("timeout reading from serial port in serial_fpga");
+    trace_add(pctx, TR_TIMEOUT, (uint8_t *) 0, 0);
+    if (pctx->xact[pctx->xhead].framed) {
+        frame_retry(pctx);
+        return;
+    }
+    rx_resync(pctx);
+    fail_xacts(pctx, pctx->ninflt, HBAERROR_NORECV);
+}
+
+
+/* rx_resync() : Get back in step with the FPGA after a lost or extra
+ * byte.  Bytes not yet sent or read are dropped.  An FPGA with the
+ * break resync also gets a break to put its parser back to idle.
+ * Bytes the FPGA sends before it sees the break are dropped too.
+ */
+static void rx_resync(
+    SERPORT      *pctx)         // our local info
+{
+    int           brkus;        // length of the break in us
+
+    if (pctx->spfd >= 0) {
+        (void) tcflush(pctx->spfd, TCIOFLUSH);
+        if (pctx->protorev >= HBA_PROTO_RESYNC) {
+            trace_add(pctx, TR_BREAK, (uint8_t *) 0, 0);
+            brkus = (BREAK_BITS * 1000000) / pctx->baud;
+            brkus = (brkus > BREAK_MIN) ? brkus : BREAK_MIN;
+            if (ioctl(pctx->spfd, TIOCSBRK) == 0) {
+                usleep(brkus);
+                (void) ioctl(pctx->spfd, TIOCCBRK);
+                usleep(brkus);
+            }
+        }
+        (void) tcflush(pctx->spfd, TCIFLUSH);
+    }
+    pctx->nackbrk = 0;
+    rx_flush(pctx);
+}
+
+
+/* frame_pkt() : Put a framed copy of a packet in buf and return its
+ * length.  The header and any write data are followed by a sequence
+ * number and a CRC-8 of the bytes before it.  The response gets the
+ * same sequence number and CRC on its end so there are two more
+ * dummy bytes to pace them.  Posted writes have no response.  A
+ * packet sent again keeps its sequence number with bit 7 set so the
+ * FPGA can answer from its log if it ran the packet the first time.
+ */
+static int frame_pkt(
+    SERPORT      *pctx,         // our local info
+    XACT         *px,           // the packet to frame
+    uint8_t      *buf)          // where to put the framed packet
+{
+    int           ninfo;        // number of header and data bytes
+
+    ninfo = px->count - px->expectrd;
+    memcpy(buf, px->pkt, ninfo);
+    if (px->ntry == 0) {
+        px->seq = pctx->seq;
+        pctx->seq = (pctx->seq + 1) & 0x7f;
+    }
+    else if (pctx->protorev >= HBA_PROTO_REPLAY) {
+        px->seq |= 0x80;
+    }
+    buf[ninfo] = px->seq;
+    buf[ninfo + 1] = crc8(0, buf, ninfo + 1);
+    px->rxlen = (px->expectrd > 0) ? (px->expectrd + 2) : 0;
+    memset(&(buf[ninfo + 2]), 0, px->rxlen);
+    return(ninfo + 2 + px->rxlen);
+}
+
+
+/* frame_check() : Check the sequence number and CRC on the end of a
+ * framed response.  Returns 0 if good and -1 if not.
+ */
+static int frame_check(
+    XACT         *px)           // transaction with a full response
+{
+    if ((px->rsp[px->rxlen - 2] != px->seq) ||
+        (crc8(0, px->rsp, px->rxlen) != 0)) {
+        return(-1);
+    }
+    return(0);
+}
+
+
+/* frame_retry() : A framed packet or its response was damaged or
+ * lost.  Resync with a break and send the damaged packet and those
+ * after it again in order.  Those before it are done.  Give up on
+ * them if the oldest has been sent FRAME_TRIES times.  The FPGA
+ * answers the ones it already ran from its log.  FPGAs before
+ * protocol revision 12 have no log and run them again.
+ */
+static void frame_retry(
+    SERPORT      *pctx)         // our local info
+{
+    int           i;
+
+    trace_add(pctx, TR_FRAMEERR, (uint8_t *) 0, 0);
+    rx_resync(pctx);
+    pctx->nfretry++;
+    if (pctx->ninflt == 0) {
+        // A posted write.  The FPGA counts it as an error.
+        return;
+    }
+    if (pctx->xact[pctx->xhead].ntry >= FRAME_TRIES) {
+        edlog("framing errors on %s in serial_fpga", pctx->port);
+        fail_xacts(pctx, pctx->ninflt, HBAERROR_NORECV);
+        return;
+    }
+    for (i = 0; i < pctx->ninflt; i++) {
+        pctx->xact[(pctx->xhead + i) % MX_XACT].rdsofar = 0;
+    }
+    pctx->ninflt = 0;
+    send_xacts(pctx);
+}
+
+
+/* crc8() : Add n bytes to a CRC-8 with polynomial x^8 + x^2 + x + 1,
+ * MSB first.  This matches send_recv.v in the FPGA.
+ */
+static uint8_t crc8(
+    uint8_t       crc,          // CRC so far
+    uint8_t      *buf,          // bytes to add
+    int           n)            // number of bytes in buf
+{
+    int           i;
+    int           b;
+
+    for (i = 0; i < n; i++) {
+        crc ^= buf[i];
+        for (b = 0; b < 8; b++) {
+            crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+        }
+    }
+    return(crc);
+}
+
+
+/* sync_done() : Completion callback for sendrecv_pkt().  Copy the
+ * response to the caller's buffer.
+ */
+static void sync_done(
+    void         *trans,        // the caller's SYNCWAIT
+    int           ret,          // number of bytes or error code
+    uint8_t      *rsp)          // the response bytes
+{
+    SYNCWAIT     *psw;
+
+    psw = (SYNCWAIT *) trans;
+    if (ret > 0) {
+        memcpy(psw->buff, rsp, ret);
+    }
+    psw->ret = ret;
+    psw->done = 1;
+}
+
+
+/* get_perrs() : Read and clear the error count in the FPGA and add
+ * it to the posted write error total.  If wait is zero the read is
+ * just queued.  Returns negative on error.
+ */
+static int get_perrs(
+    SERPORT      *pctx,         // our local info
+    int           wait)         // ==1 to wait for the count
+{
+    SLOT         *pslot;        // our SLOT
+    int           nrd;          // number of bytes received
+    uint8_t       pkt[HBA_MXPKT];
+
+    pslot = pctx->pslot;
+
+    //  (1-1) is # byte to read -1
+    pkt[0] = HBA_READ_CMD | ((1 -1) << 4) | HBA_SERIAL_FPGA_COREID;
+    pkt[1] = HBA_SF_REG_ERRORS;
+    pkt[2] = 0;                     // dummy byte (cmd)
+    pkt[3] = 0;                     // dummy byte (reg)
+    pkt[4] = 0;                     // dummy byte (errors)
+
+    if (wait == 0) {
+        return(queue_xact(pctx, 5, pkt, perrs_done, (void *) pctx));
+    }
+    nrd = sendrecv_pkt(pslot->slot_id, 5, pkt);
+    perrs_done((void *) pctx, nrd, pkt);
+    return((nrd == 3) ? 0 : HBAERROR_NORECV);
+}
+
+
+/* perrs_done() : The FPGA error count is in.  Log any errors.
+ */
+static void perrs_done(
+    void         *trans,        // our context (==*SERPORT)
+    int           nrd,          // number of bytes received
+    uint8_t      *pkt)          // the response
+{
+    SERPORT      *pctx;         // our local info
+
+    pctx = (SERPORT *) trans;
+    // We sent header + one byte so the sendrecv return value should be 3.
+    // The count is only of interest in posted mode.
+    if ((nrd != 3) || (pkt[2] == 0) || (pctx->posted == 0)) {
+        return;
+    }
+    pctx->perrs += pkt[2];
+    edlog("%d bus errors in the FPGA while in posted write mode", pkt[2]);
+}
+
+
+/* bench_run() : Start timing reads or writes of the FPGA link.  The
+ * argument is "mode rw len count core reg" where mode is single,
+ * batch, or pipe, and rw is r or w.  Each of the count transactions
+ * reads or writes len registers of core starting at reg.  Single mode
+ * waits for each response before sending the next packet.  Batch mode
+ * sends MX_INFLIGHT packets at a time.  Pipe mode keeps the queue
+ * full but for room for the other plug-ins.  Writes put back the
+ * values read at the start so the core is left as it was.  The run
+ * goes on from the completion callbacks.  Returns 0 once it has
+ * started, -1 on a bad argument or if a run is under way, and a
+ * negative HBAERROR code if the registers can not be read.
+ */
+static int bench_run(
+    SERPORT      *pctx,         // our local info
+    char         *args)         // what to run
+{
+    SLOT         *pslot;        // our SLOT
+    BENCHRUN     *prun;         // the new run
+    char          mode[8];      // single, batch, or pipe
+    char          rw;           // r or w
+    int           len;          // registers per transaction
+    int           count;        // number of transactions
+    int           core;
+    int           reg;
+    int           hdr;          // bytes in the response header
+    uint8_t       data[HBA_MXBURST]; // register values to write back
+    uint8_t       pkt[HBA_MXPKT];
+    int           plen;         // bytes in pkt
+    int           ret;
+    int           i;
+
+    pslot = (SLOT *) pctx->pslot;
+    ret = sscanf(args, "%7s %c %d %d %d %d", mode, &rw, &len, &count, &core, &reg);
+    if ((ret != 6) || ((rw != 'r') && (rw != 'w')) || (len < 1) ||
+        (len > HBA_MXBURST) || (count < 1) || (count > MX_BENCH) ||
+        (core < 0) || (core >= NCORE) || (reg < 0) || (reg > 255) ||
+        ((strcmp(mode, "single") != 0) && (strcmp(mode, "batch") != 0) &&
+         (strcmp(mode, "pipe") != 0)) ||
+        ((len > 8) && (pctx->protorev < HBA_PROTO_EXT)) ||
+        (pctx->pbench != (BENCHRUN *) 0)) {
+        return(-1);
+    }
+    hdr = (len <= 8) ? 2 : 4;
+
+    // Get the values to write back
+    plen = rw_pkt(1, core, reg, len, (uint8_t *) 0, pkt);
+    ret = sendrecv_pkt(pslot->slot_id, plen, pkt);
+    if (ret != hdr + len) {
+        return((ret < 0) ? ret : HBAERROR_NORECV);
+    }
+    memcpy(data, &(pkt[hdr]), len);
+
+    prun = (BENCHRUN *) malloc(sizeof(BENCHRUN));
+    if (prun != (BENCHRUN *) 0) {
+        prun->px = (BENCHX *) malloc(count * sizeof(BENCHX));
+    }
+    if ((prun == (BENCHRUN *) 0) || (prun->px == (BENCHX *) 0)) {
+        edlog("memory allocation failure in serial_fpga bench");
+        free(prun);
+        return(-1);
+    }
+    prun->pctx = (void *) pctx;
+    prun->mode = (strcmp(mode, "single") == 0) ? BENCH_SINGLE :
+                 (strcmp(mode, "batch") == 0) ? BENCH_BATCH : BENCH_PIPE;
+    prun->rw = rw;
+    prun->len = len;
+    prun->hdr = hdr;
+    prun->count = count;
+    prun->nsent = 0;
+    prun->ndone = 0;
+    prun->busy = 0;
+    prun->tlen = rw_pkt((rw == 'r'), core, reg, len, data, prun->tmpl);
+    for (i = 0; i < count; i++) {
+        prun->px[i].ret = HBAERROR_NOSEND;
+        prun->px[i].us = 0;
+        prun->px[i].ack = 0;
+        prun->px[i].prun = (void *) prun;
+    }
+
+    pctx->pbench = prun;
+    prun->t0 = now_us();
+    bench_next(prun);
+    return(0);
+}
+
+
+/* bench_next() : Queue the next benchmark transactions the mode
+ * allows and end the run once all are done.  Completions that come
+ * in while queueing, say on a write error, are picked up by the loop
+ * here and not by a call from bench_done().
+ */
+static void bench_next(
+    BENCHRUN     *prun)         // the run
+{
+    SERPORT      *pctx;         // our local info
+    BENCHX       *px;           // the next transaction
+    int           nq;           // transactions queued this pass
+
+    pctx = (SERPORT *) prun->pctx;
+    if (prun->busy) {
+        return;
+    }
+    prun->busy = 1;
+    do {
+        nq = 0;
+        while ((prun->nsent < prun->count) &&
+               (((prun->mode == BENCH_PIPE) && (pctx->nxact < (MX_XACT - MX_INFLIGHT))) ||
+                ((prun->mode != BENCH_PIPE) && (prun->ndone == (prun->nsent - nq)) &&
+                 (nq < ((prun->mode == BENCH_BATCH) ? MX_INFLIGHT : 1))))) {
+            px = &(prun->px[prun->nsent]);
+            px->t0 = now_us();
+            if ((pctx->spfd < 0) ||
+                (queue_xact(pctx, prun->tlen, prun->tmpl, bench_done, (void *) px) < 0)) {
+                // The rest can not be sent
+                prun->ndone += prun->count - prun->nsent;
+                prun->nsent = prun->count;
+                break;
+            }
+            prun->nsent++;
+            nq++;
+        }
+        if (nq > 0) {
+            send_xacts(pctx);
+        }
+    } while (nq > 0);
+    prun->busy = 0;
+
+    if (prun->ndone == prun->count) {
+        bench_end(prun);
+    }
+}
+
+
+/* bench_done() : Completion callback for one benchmark transaction.
+ * Record the round trip time and the result then send more.
+ */
+static void bench_done(
+    void         *trans,        // the transaction's BENCHX
+    int           ret,          // number of bytes or error code
+    uint8_t      *rsp)          // the response bytes
+{
+    BENCHX       *px;
+    BENCHRUN     *prun;
+
+    px = (BENCHX *) trans;
+    prun = (BENCHRUN *) px->prun;
+    px->us = (int) (now_us() - px->t0);
+    px->ret = ret;
+    if (ret > 0) {
+        px->ack = rsp[ret - 1];
+    }
+    prun->ndone++;
+    bench_next(prun);
+}
+
+
+/* bench_end() : Put the result of a finished run in benchres and
+ * broadcast it.  The result line is "baud mode rw len count errors
+ * tps p50 p99 max" with the round trip times in us.
+ */
+static void bench_end(
+    BENCHRUN     *prun)         // the finished run
+{
+    SERPORT      *pctx;         // our local info
+    SLOT         *pslot;        // our SLOT
+    RSC          *prsc;         // the bench resource
+    char         *modes[] = { "single", "batch", "pipe" };
+    int          *us;           // sorted round trip times
+    int           nus;          // number of good transactions
+    long long     t1;           // end of the run
+    int           slen;
+    int           i;
+
+    pctx = (SERPORT *) prun->pctx;
+    pslot = (SLOT *) pctx->pslot;
+    prsc = &(pslot->rsc[RSC_BENCH]);
+    t1 = now_us();
+
+    // Sort the round trip times of the good transactions
+    nus = 0;
+    us = (int *) malloc(prun->count * sizeof(int));
+    for (i = 0; (us != (int *) 0) && (i < prun->count); i++) {
+        if ((prun->px[i].ret > 0) &&
+            ((prun->rw == 'r') ? (prun->px[i].ret == prun->hdr + prun->len) :
+                                 (prun->px[i].ack == HBA_ACK))) {
+            us[nus++] = prun->px[i].us;
+        }
+    }
+    if (nus > 0) {
+        qsort(us, nus, sizeof(int), bench_cmp);
+    }
+    slen = snprintf(pctx->benchres, MX_BENCHRES, "%d %s %c %d %d %d %lld %d %d %d\n",
+             pctx->baud, modes[prun->mode], prun->rw, prun->len, prun->count,
+             prun->count - nus,
+             (t1 > prun->t0) ? ((long long) prun->count * 1000000) / (t1 - prun->t0) : 0,
+             (nus) ? us[(nus - 1) / 2] : 0, (nus) ? us[((nus - 1) * 99) / 100] : 0,
+             (nus) ? us[nus - 1] : 0);
+    free(us);
+    free(prun->px);
+    free(prun);
+    pctx->pbench = (BENCHRUN *) 0;
+
+    if (prsc->bkey != 0) {
+        bcst_ui(pctx->benchres, slen, &(prsc->bkey));
+    }
+}
+
+
+/* bench_cmp() : Compare two round trip times for qsort() */
+static int bench_cmp(
+    const void   *a,
+    const void   *b)
+{
+    return(*((int *) a) - *((int *) b));
+}
+
+
+/* now_us() : Monotonic time in us */
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(((long long) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+
+/* epoch_us() : Wall clock time in us since the epoch */
+static long long epoch_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return(((long long) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+
+/* stat_xact() : Count a completed or failed transaction in the link
+ * statistics.  ret is the number of response bytes or the error code.
+ */
+static void stat_xact(
+    SERPORT      *pctx,         // our local info
+    XACT         *px,           // the transaction
+    int           ret)          // response bytes or HBAERROR_xxx
+{
+    CORESTAT     *pcs;          // the core's statistics
+    long long     us;           // round trip time
+    int           b;            // histogram bucket
+
+    pcs = &(pctx->stats.core[px->core]);
+    pcs->xacts++;
+    pcs->txbytes += px->count;
+    if (ret > 0) {
+        pcs->rxbytes += ret;
+        // A single byte response is the ACK for a write
+        if ((ret == 1) && (px->pkt[0] == HBA_NACK)) {
+            pcs->nacks++;
+        }
+        us = (px->tsent) ? (now_us() - px->tsent) : 0;
+        for (b = 0; (us >= 2) && (b < STAT_NBUCKET - 1); b++) {
+            us = us >> 1;
+        }
+        pctx->stats.hist[b]++;
+    }
+    else if ((ret == HBAERROR_NORECV) && (px->rdsofar > 0)) {
+        pcs->shorts++;
+    }
+    else if (ret == HBAERROR_NORECV) {
+        pcs->timeouts++;
+    }
+}
+
+
+/* stat_print() : Print the link statistics into buf.  The first line
+ * has the seconds since the last reset and the bytes sent and received
+ * with the percent of the link each used.  Then a line for each core
+ * with traffic, and the round trip time histogram.  Returns the number
+ * of characters in buf.
+ */
+static int stat_print(
+    SERPORT      *pctx,         // our local info
+    char         *buf,          // where to print
+    int           len)          // size of buf
+{
+    LINKSTAT     *pls;
+    CORESTAT     *pcs;
+    long long     ms;           // ms since the reset
+    long long     maxb;         // bytes the link could carry in ms
+    int           n;
+    int           i;
+
+    pls = &(pctx->stats);
+    ms = (now_us() - pls->t0) / 1000;
+    maxb = (((long long) pctx->baud / 10) * ms) / 1000;
+    maxb = (maxb > 0) ? maxb : 1;
+    n = snprintf(buf, len, "secs %lld tx %lu %lld%% rx %lu %lld%%\n", ms / 1000,
+                 pls->txbytes, (pls->txbytes * 100LL) / maxb,
+                 pls->rxbytes, (pls->rxbytes * 100LL) / maxb);
+    if (n < len) {
+        n += snprintf(&(buf[n]), len - n,
+                      "core xacts txbytes rxbytes timeouts nacks short skipped\n");
+    }
+    for (i = 0; (i < NCORE) && (n < len); i++) {
+        pcs = &(pls->core[i]);
+        if ((pcs->xacts == 0) && (pcs->skipped == 0)) {
+            continue;
+        }
+        n += snprintf(&(buf[n]), len - n, "%d %lu %lu %lu %lu %lu %lu %lu\n", i,
+                      pcs->xacts, pcs->txbytes, pcs->rxbytes, pcs->timeouts,
+                      pcs->nacks, pcs->shorts, pcs->skipped);
+    }
+    if (n < len) {
+        n += snprintf(&(buf[n]), len - n, "us");
+    }
+    for (i = 0; (i < STAT_NBUCKET) && (n < len); i++) {
+        n += snprintf(&(buf[n]), len - n, " %d", (i == 0) ? 0 : (1 << i));
+    }
+    if (n < len) {
+        n += snprintf(&(buf[n]), len - n, "\nn ");
+    }
+    for (i = 0; (i < STAT_NBUCKET) && (n < len); i++) {
+        n += snprintf(&(buf[n]), len - n, " %lu", pls->hist[i]);
+    }
+    if (n < len) {
+        n += snprintf(&(buf[n]), len - n, "\n");
+    }
+    return((n < len) ? n : len - 1);
+}
+
+
+/* stat_bcst() : Broadcast the traffic since the last broadcast to any
+ * UI monitoring the stats.  The line has the ms in the period, the
+ * transactions, the bytes sent and received with the percent of the
+ * link each used, and the timeouts, NACKs, and short responses.
+ */
+static void stat_bcst(
+    void         *timer,        // handle of the timer that expired
+    void         *cb_data)      // callback data (==*SERPORT)
+{
+    SERPORT      *pctx;         // our local info
+    SLOT         *pslot;        // our SLOT
+    RSC          *prsc;         // the stats resource
+    LINKSTAT     *pls;          // stats now
+    LINKSTAT     *plast;        // stats at the last broadcast
+    unsigned long sum[6];       // xacts, timeouts, nacks, shorts, tx, rx
+    long long     maxb;         // bytes the link could carry
+    char          msg[MX_MSGLEN];
+    int           slen;
+    int           i;
+
+    pctx = (SERPORT *) cb_data;
+    pslot = (SLOT *) pctx->pslot;
+    prsc = &(pslot->rsc[RSC_STATS]);
+    pls = &(pctx->stats);
+    plast = &(pctx->statlast);
+    if (prsc->bkey != 0) {
+        memset(sum, 0, sizeof(sum));
+        for (i = 0; i < NCORE; i++) {
+            sum[0] += pls->core[i].xacts - plast->core[i].xacts;
+            sum[1] += pls->core[i].timeouts - plast->core[i].timeouts;
+            sum[2] += pls->core[i].nacks - plast->core[i].nacks;
+            sum[3] += pls->core[i].shorts - plast->core[i].shorts;
+        }
+        sum[4] = pls->txbytes - plast->txbytes;
+        sum[5] = pls->rxbytes - plast->rxbytes;
+        maxb = (((long long) pctx->baud / 10) * pctx->statms) / 1000;
+        maxb = (maxb > 0) ? maxb : 1;
+        slen = snprintf(msg, (MX_MSGLEN -1), "%d %lu %lu %lld%% %lu %lld%% %lu %lu %lu\n",
+                        pctx->statms, sum[0], sum[4], (sum[4] * 100LL) / maxb,
+                        sum[5], (sum[5] * 100LL) / maxb, sum[1], sum[2], sum[3]);
+        bcst_ui(msg, slen, &(prsc->bkey));
+    }
+    pctx->statlast = pctx->stats;
+}
+
+
+/* stat_reset() : Zero the link statistics */
+static void stat_reset(
+    SERPORT      *pctx)         // our local info
+{
+    memset(&(pctx->stats), 0, sizeof(LINKSTAT));
+    pctx->stats.t0 = now_us();
+    pctx->statlast = pctx->stats;
+}
+
+
+/* rate_config() : Set the ms between interrupts in the FPGA rate
+ * register.  Return 0 on success and -1 if the FPGA did not ACK the
+ * write.
+ */
+static int rate_config(
+    SERPORT      *pctx,         // our local info
+    int           ms)           // new rate in ms, 0 to 255
+{
+    SLOT         *pslot;        // our SLOT
+    uint8_t       pkt[HBA_MXPKT];
+    int           nsd;          // number of bytes sent to FPGA
+
+    pslot = (SLOT *) pctx->pslot;
+    pctx->ratems = ms;
+
+    pkt[0] = HBA_WRITE_CMD | ((1 -1) << 4) | HBA_SERIAL_FPGA_COREID;
+    pkt[1] = HBA_SF_REG_RATE;
+    pkt[2] = ms;                            // new value
+    pkt[3] = 0;                             // dummy for the ack
+
+    nsd = sendrecv_pkt(pslot->slot_id, 4, pkt);
+    // We did a write so the sendrecv return value should be 1
+    // and the returned byte should be an ACK
+    if ((nsd != 1) || (pkt[0] != HBA_ACK)) {
+        return(-1);
+    }
+    return(0);
+}
+
+
+/* gov_start() : Turn on the interrupt rate governor.  The counts it
+ * measures from start now so the first period sees only new traffic.
+ */
+static void gov_start(
+    SERPORT      *pctx)         // our local info
+{
+    int           i;
+
+    pctx->gvtx = pctx->stats.txbytes;
+    pctx->gvrx = pctx->stats.rxbytes;
+    for (i = 0; i < NCORE; i++) {
+        pctx->coreinfo[i].gvintr = pctx->coreinfo[i].nintr;
+        pctx->gvcore[i] = 0;
+    }
+    pctx->gvbusy = 0;
+    pctx->gvirate = 0;
+    pctx->gvon = 1;
+    if (pctx->gvtimer == (void *) 0) {
+        pctx->gvtimer = add_timer(ED_PERIODIC, GOV_PERIOD, gov_tick, (void *) pctx);
+    }
+}
+
+
+/* gov_tick() : Measure the link and the interrupts over the last
+ * period and move the interrupt rate to keep the headroom free.  The
+ * busy fraction is the busier direction of the link.  When it is over
+ * target the rate drops in proportion, starting from the rate actually
+ * seen if that is below the limit.  When it is well under target the
+ * rate goes up about a quarter, but not if the interrupts are held at
+ * the limit and the faster rate would put the link over target.  The
+ * FPGA keeps the rate in whole ms so the steps are made in ms.  Each
+ * change is logged and broadcast to any UI monitoring intrr_rate.
+ */
+static void gov_tick(
+    void         *timer,        // handle of the timer that expired
+    void         *cb_data)      // callback data (==*SERPORT)
+{
+    SERPORT      *pctx;         // our local info
+    SLOT         *pslot;        // our SLOT
+    RSC          *prsc;         // the intrr_rate resource
+    GOVREC       *pgr;          // log record of a rate change
+    COREINFO     *pci;
+    unsigned long dtx;          // bytes sent this period
+    unsigned long drx;          // bytes received this period
+    long long     maxb;         // bytes the link could carry
+    int           target;       // highest busy percent wanted
+    int           ohz;          // rate now in hz, 0 if unlimited
+    int           ms;           // rate now in ms, at least 1
+    int           nms;          // new rate in ms
+    int           want;         // rate in hz that fits the target
+    char          msg[MX_MSGLEN];
+    int           slen;
+    int           i;
+
+    pctx = (SERPORT *) cb_data;
+    pslot = (SLOT *) pctx->pslot;
+    prsc = &(pslot->rsc[RSC_INTRRT]);
+
+    // A stats reset moves the byte counts back.  Start over.
+    if ((pctx->stats.txbytes < pctx->gvtx) || (pctx->stats.rxbytes < pctx->gvrx)) {
+        gov_start(pctx);
+        return;
+    }
+    dtx = pctx->stats.txbytes - pctx->gvtx;
+    drx = pctx->stats.rxbytes - pctx->gvrx;
+    pctx->gvtx = pctx->stats.txbytes;
+    pctx->gvrx = pctx->stats.rxbytes;
+    maxb = (((long long) pctx->baud / 10) * GOV_PERIOD) / 1000;
+    maxb = (maxb > 0) ? maxb : 1;
+    pctx->gvbusy = (int) ((((dtx > drx) ? dtx : drx) * 100LL) / maxb);
+
+    pctx->gvirate = 0;
+    for (i = 0; i < NCORE; i++) {
+        pci = &(pctx->coreinfo[i]);
+        pctx->gvcore[i] = (int) (((pci->nintr - pci->gvintr) * 1000) / GOV_PERIOD);
+        pci->gvintr = pci->nintr;
+        pctx->gvirate += pctx->gvcore[i];
+    }
 
-    pctx = (SERPORT *) Slots[parent].priv;
-    pslot = pctx->pslot;
+    // Nothing to set on an old FPGA or a closed port
+    if ((pctx->spfd < 0) || (pctx->protorev == 0)) {
+        return;
+    }
 
-    if (strncmp(PLUGIN_NAME, pslot->name, strlen(PLUGIN_NAME)) != 0) {
-        edlog("Wanted %s in Slot %i.  Exiting...\n", PLUGIN_NAME, parent);
-        exit(1);
+    target = 100 - pctx->gvroom;
+    ohz = pctx->intrrt;
+    ms = (pctx->ratems > 0) ? pctx->ratems : 1;
+    nms = ms;
+    if ((pctx->gvbusy > target) && (pctx->gvirate > 0)) {
+        want = (pctx->gvirate < 1000 / ms) ? pctx->gvirate : 1000 / ms;
+        want = (want * target) / pctx->gvbusy;
+        nms = (want > 0) ? (1000 + want - 1) / want : GOV_MXMS;
+        nms = (nms > ms) ? nms : ms + 1;
+        nms = (nms < GOV_MXMS) ? nms : GOV_MXMS;
     }
+    else if ((pctx->gvbusy < target - GOV_SLACK) && (ms > 1)) {
+        nms = (ms * 4) / 5;
+        nms = (nms < ms) ? nms : ms - 1;
+        nms = (nms > 0) ? nms : 1;
+        // Interrupts at the limit load the link in proportion to it
+        if ((pctx->gvirate >= (750 / ms)) &&
+            ((pctx->gvbusy * ms) / nms > target)) {
+            nms = ms;
+        }
+    }
+    if (nms == ms) {
+        return;
+    }
+    if (rate_config(pctx, nms) < 0) {
+        edlog("Interrupt rate governor unable to set %d ms", nms);
+        return;
+    }
+    pctx->intrrt = 1000 / nms;
 
-    // Sanity check. Valid count.  Non-null buffer.  Port open.
-    if ((count <= 0) || (buff == (uint8_t *) 0) || (pctx->spfd < 0)) {
-        return(HBAERROR_NOSEND);
+    pgr = &(pctx->gvlog[pctx->gvnext]);
+    pgr->us = epoch_us();
+    pgr->busy = pctx->gvbusy;
+    pgr->irate = pctx->gvirate;
+    pgr->from = ohz;
+    pgr->to = pctx->intrrt;
+    pctx->gvnext = (pctx->gvnext + 1) % GOV_NLOG;
+    if (pctx->gvcount < GOV_NLOG) {
+        pctx->gvcount++;
     }
 
-    // Print pkt if debug mode and running in foreground
-    if ((DebugMode != 0) && (ForegroundMode != 0)) {
-        printf(">> ");
-        for (i = 0; i < count; i++)
-            printf("%02x ", buff[i]);
-        printf("\n");
+    if (prsc->bkey != 0) {
+        slen = snprintf(msg, (MX_MSGLEN -1), "%d%% %d %d %d\n",
+                        pgr->busy, pgr->irate, pgr->from, pgr->to);
+        bcst_ui(msg, slen, &(prsc->bkey));
     }
+}
 
-    // send data out the serial port 
-    sntcount1 = write(pctx->spfd, buff, count);
-    if (sntcount1 != count) {
-        if ((sntcount1 < 0) && (errno != EAGAIN) && (errno != EINTR)) {
-            edlog("error writing to serial port in serial_fpga");
-            return(HBAERROR_NOSEND);
-        }
 
-        // Partial send or need to try again.  Pause then try again.
-        usleep(1000);
-        // sntcount1 is offset into xmit buffer.  No negative sntcount1
-        sntcount1 = (sntcount1 < 0) ? 0 : sntcount1;
-        sntcount2 = write(pctx->spfd, &buff[sntcount1], (count - sntcount1));
-        if (sntcount2 != (count - sntcount1)) {
-            // no retry on second failure
-            edlog("error writing to serial port in serial_fpga");
-            return(HBAERROR_NOSEND);
+/* gov_print() : Print the governor state into buf.  The first line
+ * has "auto", the headroom, and the rate in hz.  Then the busy percent
+ * and interrupts per second of the last period, the interrupts per
+ * second of each core that had any, and the recent rate changes with
+ * their age in ms, oldest first.  Return the number of characters.
+ */
+static int gov_print(
+    SERPORT      *pctx,         // our local info
+    char         *buf,          // where to put the text
+    int           len)          // size of buf
+{
+    GOVREC       *pgr;
+    long long     now;
+    int           n;
+    int           i;
+
+    n = snprintf(buf, len, "auto %d %d\nbusy %d%% intr %d\n", pctx->gvroom,
+                 pctx->intrrt, pctx->gvbusy, pctx->gvirate);
+    for (i = 0; (i < NCORE) && (n < len); i++) {
+        if (pctx->gvcore[i] != 0) {
+            n += snprintf(&(buf[n]), len - n, "%d %d\n", i, pctx->gvcore[i]);
         }
     }
+    now = epoch_us();
+    for (i = 0; (i < pctx->gvcount) && (n < len); i++) {
+        pgr = &(pctx->gvlog[(pctx->gvnext - pctx->gvcount + i + GOV_NLOG) % GOV_NLOG]);
+        n += snprintf(&(buf[n]), len - n, "-%lld %d%% %d %d %d\n",
+                      (now - pgr->us) / 1000, pgr->busy, pgr->irate,
+                      pgr->from, pgr->to);
+    }
+    return((n < len) ? n : len - 1);
+}
 
-    // Read characters from the serial port.  Use a select() loop
-    // so we can detect a timeout error.
-    // Expect response to have one byte for a write and two less than the
-    // write count for a read.
-    expectrd = (HBA_READ_CMD & buff[0]) ? (count -2) : 1 ;
-
-    // We loop as long as we are reading bytes within the timeout period.
-    // Bytes might dripple in especially on a slow link
-    while (1) {
-        select_tv.tv_sec = 0;
-        select_tv.tv_usec = (useconds_t) 1000000;   // 0.1 seconds for a timeout
-        FD_ZERO(&rdfs);
-        FD_SET(pctx->spfd, &rdfs);
-        sret = select((pctx->spfd + 1), &rdfs, (fd_set *) 0, (fd_set *) 0, &select_tv);
-        if (sret < 0) {
-            // select error -- bail out on all but EINTR
-            if (errno != EINTR) {
-                edlog("Failure in select() call");
-                exit(-1);
-            }
-        }
-        else if (sret == 0) {
-            // timeout waiting for the response
-            edlog("timeout reading from serial port in serial_fpga");
-            return(HBAERROR_NORECV);
-        }
-        else if ((pctx->spfd >= 0) && FD_ISSET(pctx->spfd, &rdfs)) {
-            // read bytes from serial port
-            rdcount = read(pctx->spfd, &(buff[rdsofar]), (expectrd - rdsofar));
-            if ((rdcount < 0) && (errno != EINTR)) {
-                edlog("error writing to serial port in serial_fpga");
-                return(HBAERROR_NORECV);
-            }
-            if (rdcount > 0) {
-                rdsofar += rdcount;
-                if (rdsofar == expectrd) {   // done?
-                    // Print pkt if debug mode and running in foreground
-                    if ((DebugMode != 0) && (ForegroundMode != 0)) {
-                        printf("<< ");
-                        for (i = 0; i < expectrd; i++)
-                            printf("%02x ", buff[i]);
-                        printf("\n");
-                    }
-                    return(expectrd);
-                }
-                // else more to read, drop back into select() to wait
-            }
+
+/* trace_add() : Record a link event in the trace ring.  The oldest
+ * record is overwritten when the ring is full.  Only the first
+ * TRACE_MXDATA bytes are kept.  This is on the hot path so it only
+ * copies the bytes and reads the clock.
+ */
+static void trace_add(
+    SERPORT      *pctx,         // our local info
+    int           type,         // TR_xxx
+    uint8_t      *data,         // bytes of the event, may be null
+    int           len)          // number of bytes
+{
+    trace_at(pctx, type, data, len, 0);
+}
+
+
+/* trace_at() : Record a link event that happened at the time given
+ * in us since the epoch, or now if the time is zero.
+ */
+static void trace_at(
+    SERPORT      *pctx,         // our local info
+    int           type,         // TR_xxx
+    uint8_t      *data,         // bytes of the event, may be null
+    int           len,          // number of bytes
+    long long     us)           // time of the event
+{
+    TRACEREC     *ptr;          // record to fill
+    struct timespec ts;
+
+    ptr = &(pctx->trace[pctx->trnext]);
+    pctx->trnext = (pctx->trnext + 1) % TRACE_NREC;
+    if (pctx->trcount < TRACE_NREC) {
+        pctx->trcount++;
+    }
+    if (us == 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        us = ((long long) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+    }
+    ptr->us = us;
+    ptr->type = type;
+    ptr->len = len;
+    if (len > 0) {
+        memcpy(ptr->data, data, (len < TRACE_MXDATA) ? len : TRACE_MXDATA);
+    }
+}
+
+
+/* trace_write() : Write the trace ring to a file in pcapng format,
+ * oldest record first.  The link type is LINKTYPE_USER0.  Each packet
+ * is a TR_xxx type byte followed by the bytes of the event.  TX and
+ * RX packets also have their direction in the packet flags.  Returns
+ * 0 on success and -1 if the file can not be written.
+ */
+static int trace_write(
+    SERPORT      *pctx,         // our local info
+    char         *path)         // file to write
+{
+    FILE         *fp;
+    TRACEREC     *ptr;
+    uint32_t      blk[8 + ((1 + TRACE_MXDATA + 3) / 4) + 3];
+    int           caplen;       // bytes of the event kept
+    int           padlen;       // caplen rounded up to 32 bits
+    int           nw;           // number of words in the block
+    int           i;
+    int           ret;
+
+    while (*path == ' ') {
+        path++;
+    }
+    fp = fopen(path, "w");
+    if (fp == (FILE *) 0) {
+        edlog("Unable to open %s", path);
+        return(-1);
+    }
+
+    // Section header block then an interface description block
+    blk[0] = 0x0A0D0D0A;
+    blk[1] = 28;
+    blk[2] = 0x1A2B3C4D;        // byte order magic
+    blk[3] = 1;                 // version 1.0
+    blk[4] = 0xFFFFFFFF;        // section length unknown
+    blk[5] = 0xFFFFFFFF;
+    blk[6] = 28;
+    ret = fwrite(blk, 4, 7, fp);
+    blk[0] = 0x00000001;
+    blk[1] = 20;
+    blk[2] = TRACE_LINKTYPE;    // link type and reserved
+    blk[3] = 1 + TRACE_MXDATA;  // snap length
+    blk[4] = 20;
+    ret += fwrite(blk, 4, 5, fp);
+
+    // An enhanced packet block for each record.  Time in us.
+    for (i = 0; i < pctx->trcount; i++) {
+        ptr = &(pctx->trace[(pctx->trnext + TRACE_NREC - pctx->trcount + i) %
+                            TRACE_NREC]);
+        caplen = 1 + ((ptr->len < TRACE_MXDATA) ? ptr->len : TRACE_MXDATA);
+        padlen = (caplen + 3) & ~3;
+        nw = 7 + (padlen / 4) + 1;
+        if ((ptr->type == TR_TX) || (ptr->type == TR_RX)) {
+            nw += 3;            // epb_flags option and end of options
         }
+        memset(blk, 0, sizeof(blk));
+        blk[0] = 0x00000006;
+        blk[1] = nw * 4;
+        blk[2] = 0;             // interface 0
+        blk[3] = (uint32_t) (ptr->us >> 32);
+        blk[4] = (uint32_t) ptr->us;
+        blk[5] = caplen;
+        blk[6] = 1 + ptr->len;
+        ((uint8_t *) &(blk[7]))[0] = ptr->type;
+        memcpy(&(((uint8_t *) &(blk[7]))[1]), ptr->data, caplen - 1);
+        if ((ptr->type == TR_TX) || (ptr->type == TR_RX)) {
+            blk[7 + (padlen / 4)] = (4 << 16) | 2;  // epb_flags, length 4
+            blk[8 + (padlen / 4)] = (ptr->type == TR_RX) ? 1 : 2;
+            blk[9 + (padlen / 4)] = 0;              // opt_endofopt
+        }
+        blk[nw - 1] = nw * 4;
+        ret += fwrite(blk, 4, nw, fp);
+    }
+    if ((fclose(fp) != 0) || (ret == 0)) {
+        return(-1);
+    }
+    return(0);
+}
+
+
+/* batch_done() : Completion callback for sendrecv_batch().  Copy the
+ * response to the transfer's packet buffer.
+ */
+static void batch_done(
+    void         *trans,        // the caller's HBA_XFER
+    int           ret,          // number of bytes or error code
+    uint8_t      *rsp)          // the response bytes
+{
+    HBA_XFER     *pxfer;
+
+    pxfer = (HBA_XFER *) trans;
+    if (ret > 0) {
+        memcpy(pxfer->pkt, rsp, ret);
     }
+    pxfer->ret = ret;
 }
 
 
@@ -735,41 +4017,462 @@ void register_interrupt_handler(
 }
 
 
+/* register_push_window() : Plug-in modules use this routine to give
+ * the registers the FPGA should send with the core's interrupts in
+ * push mode.  When a pushed interrupt arrives the done routine is
+ * invoked as
+ *     done(trans, nreg + 2, rsp)
+ * with trans from register_interrupt_handler().  The rsp bytes look
+ * like the response to a read: two header bytes then the registers.
+ * Without a window, or when not in push mode, the interrupt handler
+ * is invoked as usual.
+ */
+void register_push_window(
+    int           parent,       // Slot number of parent,
+    int           coreid,       // core ID.
+    int           reg,          // first register to push
+    int           nreg,         // number of registers to push
+    void        (*done)())      // routine to get the registers
+{
+    SERPORT      *pctx;         // our local info
+    SLOT         *pslot;        // our SLOT
+
+    pctx  = (SERPORT *) Slots[parent].priv;
+    pslot = pctx->pslot;
+
+    if (strncmp(PLUGIN_NAME, pslot->name, strlen(PLUGIN_NAME)) != 0) {
+        edlog("Wanted %s in Slot %i.  Exiting...\n", PLUGIN_NAME, parent);
+        exit(1);
+    }
+
+    // Sanity check the coreid, window, and done address
+    if ((coreid <= 0) || (coreid >= NCORE) || (reg < 0) || (reg > 0xff) ||
+        (nreg < 0) || (nreg > HBA_PUSH_MXWIN) || (done == 0)) {
+        edlog("Bad calling values to register_push_window()");
+        return;
+    }
+
+    pctx->coreinfo[coreid].push_done = done;
+    pctx->coreinfo[coreid].push_reg  = reg;
+    pctx->coreinfo[coreid].push_nreg = nreg;
+    pctx->coreinfo[coreid].push_map  = 0;
+
+    // Tell the FPGA now if we are already in push mode
+    if (pctx->push && (win_config(pctx, coreid) < 0)) {
+        edlog("Error setting push window for core %d", coreid);
+    }
+}
+
+
+/* register_push_dirty() : Plug-in modules with a dirty map register
+ * use this routine after register_push_window() to have the FPGA
+ * push only the window registers that have changed.  Bit N of the
+ * map is set when register N changes and reading the map clears it.
+ * The window must be within registers 0 to 7.  The done routine
+ * still gets the whole window.  The registers not sent are filled
+ * in from the last push.  FPGAs before revision 10 push the whole
+ * window as before.
+ */
+void register_push_dirty(
+    int           parent,       // Slot number of parent,
+    int           coreid,       // core ID.
+    int           mapreg)       // register with the dirty map
+{
+    SERPORT      *pctx;         // our local info
+    COREINFO     *pci;          // the core's window
+
+    pctx = (SERPORT *) Slots[parent].priv;
+
+    // Sanity check the coreid, map, and window
+    if ((coreid <= 0) || (coreid >= NCORE) || (mapreg <= 0) ||
+        (mapreg > 0xff)) {
+        edlog("Bad calling values to register_push_dirty()");
+        return;
+    }
+    pci = &(pctx->coreinfo[coreid]);
+    if ((pci->push_done == 0) || (pci->push_reg + pci->push_nreg > 8)) {
+        edlog("No push window in registers 0 to 7 for core %d", coreid);
+        return;
+    }
+    pci->push_map = mapreg;
+
+    if (pctx->push && (win_config(pctx, coreid) < 0)) {
+        edlog("Error setting dirty push window for core %d", coreid);
+    }
+}
+
+
+/* register_shadow_restore() : Plug-in modules use this routine to
+ * mark nreg registers of a core, starting at reg, as safe to write
+ * again when the port is opened.  Only registers written through
+ * sendrecv_shadow() are restored, with the last value written.  Mark
+ * only setup registers.  Outputs that move things should be set again
+ * by a command.
+ */
+void register_shadow_restore(
+    int           parent,       // Slot number of parent,
+    int           coreid,       // core ID.
+    int           reg,          // first register to restore
+    int           nreg)         // number of registers to restore
+{
+    SERPORT      *pctx;         // our local info
+    COREINFO     *pci;          // the core's shadow
+    int           i;
+
+    pctx = (SERPORT *) Slots[parent].priv;
+
+    // Sanity check the coreid and registers
+    if ((coreid < 0) || (coreid >= NCORE) || (reg < 0) || (nreg <= 0) ||
+        (reg + nreg > SHADOW_NREG)) {
+        edlog("Bad calling values to register_shadow_restore()");
+        return;
+    }
+    pci = &(pctx->coreinfo[coreid]);
+    for (i = reg; i < reg + nreg; i++) {
+        pci->shflags[i] |= SH_RESTORE;
+    }
+}
+
+
+/* intr_coalesce() : Have the FPGA hold the interrupts of a core until
+ * count of them have come in or until us microseconds after the first,
+ * whichever comes first.  A count of 0 uses only the time and a time
+ * of 0 only the count.  Both 0 lets each interrupt through.  The
+ * setting is kept and sent again when the port is opened.  Returns 0,
+ * or HBAERROR_NOSEND if the values are bad or the FPGA can not
+ * coalesce, or the error from the write.
+ */
+int intr_coalesce(
+    int           parent,       // Slot number of parent
+    int           core,         // core ID
+    int           count,        // interrupts to hold
+    int           us)           // longest to hold them
+{
+    SERPORT      *pctx;         // our local info
+
+    pctx = (SERPORT *) Slots[parent].priv;
+    if ((core <= 0) || (core >= NCORE) || (count < 0) || (count > 0xff) ||
+        (us < 0) || (us > 0xffff) ||
+        ((pctx->protorev < HBA_PROTO_COALESCE) && (count || us))) {
+        return(HBAERROR_NOSEND);
+    }
+    pctx->coreinfo[core].coalcnt = count;
+    pctx->coreinfo[core].coalus = us;
+    if (pctx->protorev < HBA_PROTO_COALESCE) {
+        return(0);
+    }
+    return(coal_config(pctx, core));
+}
+
+
+/* coal_config() : Write the interrupt coalescing of one core to the
+ * FPGA.  The write of the last register sets it.  Returns 0 or an
+ * HBAERROR code.
+ */
+static int coal_config(
+    SERPORT      *pctx,         // our local info
+    int           core)         // core ID
+{
+    SLOT         *pslot;        // our SLOT
+    COREINFO     *pci;          // the core's settings
+    uint8_t       pkt[HBA_MXPKT];
+    int           ret;
+
+    pslot = pctx->pslot;
+    pci = &(pctx->coreinfo[core]);
+    pkt[0] = HBA_WRITE_CMD | ((4 -1) << 4) | HBA_SERIAL_FPGA_COREID;
+    pkt[1] = HBA_SF_REG_COALSEL;
+    pkt[2] = core;
+    pkt[3] = pci->coalcnt;
+    pkt[4] = pci->coalus & 0xff;
+    pkt[5] = (pci->coalus >> 8) & 0xff;
+    pkt[6] = 0;                     // dummy for the ack
+    ret = sendrecv_pkt(pslot->slot_id, 7, pkt);
+    if (ret < 0) {
+        return(ret);
+    }
+    if ((ret != 1) || (pkt[0] != HBA_ACK)) {
+        edlog("Error setting interrupt coalescing for core %d", core);
+        return(HBAERROR_NACK);
+    }
+    return(0);
+}
+
+
+/* intr_inband() : Boards on a USB serial port have no interrupt pin.
+ * If the default pin can not be had and the FPGA can push, have it
+ * send the interrupts over the serial link.  A pin or file given by
+ * the user is left alone.
+ */
+static void intr_inband(
+    SERPORT      *pctx)         // our local info
+{
+    if ((pctx->irfd >= 0) || pctx->push || pctx->intrpath[0] ||
+        pctx->intrchip[0] || (pctx->intrrp != HBA_DEF_INTR) ||
+        (pctx->protorev < HBA_PROTO_PUSH)) {
+        return;
+    }
+    if (push_config(pctx, 1) == 0) {
+        edlog("No interrupt pin for %s.  Using push mode.", pctx->port);
+    }
+}
+
+
+/* push_config() : Turn push mode on or off in the FPGA.  The windows
+ * for the cores are sent before push mode is turned on.  Returns 0
+ * on success and -1 on error.
+ */
+static int push_config(
+    SERPORT      *pctx,         // our local info
+    int           on)           // ==1 to turn push mode on
+{
+    int           i;
+
+    for (i = 1; on && (i < NCORE); i++) {
+        if (win_config(pctx, i) < 0) {
+            return(-1);
+        }
+    }
+
+    // Look for frames as soon as the FPGA might send one.  Frames can
+    // only start where a response would so it is safe to look early.
+    if (on) {
+        pctx->push = 1;
+    }
+    if (link_ctl(pctx, ((on) ? HBA_SF_LINK_PUSH : 0) |
+                       ((pctx->framed) ? HBA_SF_LINK_FRAMED : 0)) < 0) {
+        pctx->push = 0;
+        return(-1);
+    }
+    pctx->push = on;
+    return(0);
+}
+
+
+/* win_config() : Write the push window of one core to the FPGA.  A
+ * dirty window also gets its map register and then a read of the
+ * window so the registers the FPGA leaves out can be filled in.
+ * Returns 0 on success and -1 on error.
+ */
+static int win_config(
+    SERPORT      *pctx,         // our local info
+    int           core)         // core ID
+{
+    SLOT         *pslot;        // our SLOT
+    COREINFO     *pci;          // the core's window
+    uint8_t       pkt[HBA_MXPKT];
+    int           nreg;
+
+    pslot = pctx->pslot;
+    pci = &(pctx->coreinfo[core]);
+    nreg = (pci->push_done) ? pci->push_nreg : 0;
+
+    pkt[0] = HBA_WRITE_CMD | ((2 -1) << 4) | HBA_SERIAL_FPGA_COREID;
+    pkt[1] = HBA_SF_REG_WINSEL;
+    pkt[2] = (core << 4) | nreg;
+    pkt[3] = pci->push_reg;
+    pkt[4] = 0;                         // dummy for the ack
+    if ((sendrecv_pkt(pslot->slot_id, 5, pkt) != 1) || (pkt[0] != HBA_ACK)) {
+        return(-1);
+    }
+    if ((nreg == 0) || (pci->push_map == 0) ||
+        (pctx->protorev < HBA_PROTO_DIRTY)) {
+        return(0);
+    }
+
+    pkt[0] = HBA_WRITE_CMD | ((1 -1) << 4) | HBA_SERIAL_FPGA_COREID;
+    pkt[1] = HBA_SF_REG_DIRTY;
+    pkt[2] = pci->push_map;
+    pkt[3] = 0;                         // dummy for the ack
+    if ((sendrecv_pkt(pslot->slot_id, 4, pkt) != 1) || (pkt[0] != HBA_ACK)) {
+        return(-1);
+    }
+
+    // Registers that change after this read are in the next map
+    pkt[0] = HBA_READ_CMD | ((nreg -1) << 4) | core;
+    pkt[1] = pci->push_reg;
+    memset(&(pkt[2]), 0, nreg + 2);
+    if (sendrecv_pkt(pslot->slot_id, nreg + 4, pkt) != nreg + 2) {
+        return(-1);
+    }
+    memcpy(pci->push_last, &(pkt[2]), nreg);
+    return(0);
+}
+
+
+/* link_ctl() : Write the link control register in the FPGA.  The
+ * FPGA changes framing after the write so framing changes here only
+ * once the write is ACKed.  Returns 0 on success and -1 on error.
+ */
+static int link_ctl(
+    SERPORT      *pctx,         // our local info
+    int           link)         // new value for the link control
+{
+    SLOT         *pslot;        // our SLOT
+    uint8_t       pkt[HBA_MXPKT];
+
+    pslot = pctx->pslot;
+    pkt[0] = HBA_WRITE_CMD | ((1 -1) << 4) | HBA_SERIAL_FPGA_COREID;
+    pkt[1] = HBA_SF_REG_LINK;
+    pkt[2] = link;
+    pkt[3] = 0;                         // dummy for the ack
+    if ((sendrecv_pkt(pslot->slot_id, 4, pkt) != 1) || (pkt[0] != HBA_ACK)) {
+        return(-1);
+    }
+    pctx->framed = (link & HBA_SF_LINK_FRAMED) ? 1 : 0;
+    return(0);
+}
+
+
+/* push_frame() : Hand a pushed interrupt to the core's plug-in.  The
+ * frame is the marker, core, length, and the registers.  A dirty
+ * frame has the dirty map in place of the first register and then
+ * only the registers named in the map.  These are merged into the
+ * last window so the plug-in always gets the whole window.
+ */
+static void push_frame(
+    SERPORT      *pctx,         // our local info
+    uint8_t      *frame)        // the frame from the FPGA
+{
+    COREINFO     *pci;          // the interrupting core
+    uint8_t       pkt[2 + HBA_PUSH_MXWIN];
+    int           core;
+    int           len;
+    int           nset;         // registers sent in a dirty frame
+    int           i;
+
+    core = frame[1] & 0x0f;
+    len = frame[2];
+    pci = &(pctx->coreinfo[core]);
+    pctx->tedge = epoch_us();
+    pci->nintr++;
+    trace_add(pctx, TR_PUSH, frame, len + 3);
+
+    if ((frame[1] & HBA_PUSH_DIRTY) && (pci->push_done != 0) &&
+        (pci->push_map != 0) && (len > 0)) {
+        nset = 0;
+        for (i = 0; i < pci->push_nreg; i++) {
+            if ((frame[3] & (1 << (pci->push_reg + i))) && (nset < len - 1)) {
+                pci->push_last[i] = frame[4 + nset++];
+            }
+        }
+        if (nset == len - 1) {
+            pkt[0] = HBA_READ_CMD | core;
+            pkt[1] = pci->push_reg;
+            memcpy(&(pkt[2]), pci->push_last, pci->push_nreg);
+            (pci->push_done) (pci->trans, pci->push_nreg + 2, pkt);
+            return;
+        }
+        edlog("Bad dirty push frame from core %d", core);
+    }
+    else if ((pci->push_done != 0) && (len > 0) && (len == pci->push_nreg)) {
+        memcpy(pci->push_last, &(frame[3]), len);
+        pkt[0] = HBA_READ_CMD | core;
+        pkt[1] = pci->push_reg;
+        memcpy(&(pkt[2]), &(frame[3]), len);
+        (pci->push_done) (pci->trans, len + 2, pkt);
+        return;
+    }
+    if (pci->intr_hndlr != 0) {
+        (pci->intr_hndlr) (pci->trans);
+    }
+    else {
+        edlog("Received unhandled interrupt in core %d", core);
+    }
+}
+
+
 /***************************************************************************
- * do_interrupt(): - Handle an interrupt request.  Read the interrupt
- * pending registers in serial_fpga peripheral and invoke the appropriate
- * interrupt handlers if one is registered.  Log interrupts that do not
- * have a handler.
+ * do_interrupt(): - Handle an interrupt request.  Start a read of the
+ * interrupt pending registers in serial_fpga peripheral.  The handlers
+ * are invoked from intr_done() when the read completes.
  ***************************************************************************/
 static void do_interrupt(
     int       fd_in,         // FD with data to read,
     void     *cb_data)       // callback date (==*SERPORT)
 {
     SERPORT  *pctx;          // our context
-    SLOT     *pslot;         // out SLOT
-    int       nrc;           // number of bytes recieved
-    int       intpending;    // a set bit means and interrupt is pending
     int       ret;           // generic return value from a system call
-    int       i;             // to walk the cores
+    struct gpio_v2_line_event ev[MX_GPIOEV]; // edges from a gpiochip
+    long long rt;            // wall and monotonic time now in us
+    long long mono;
+    int       nev;           // number of edges in ev
+    int       i;
     uint8_t   pkt[HBA_MXPKT];  
 
     pctx = (SERPORT *) cb_data;
-    pslot = pctx->pslot;
 
-    // We need to read the GPIO value to clear the interrupt
-    (void) lseek(pctx->irfd, (off_t) 0, SEEK_SET);
-    ret = read(pctx->irfd, pkt, HBA_MXPKT);
-    if (ret <= 0) {
-        edlog("Error reading interrupt GPIO pin");
-        return;
+    if (pctx->ircdev) {
+        // Take all of the queued edges.  They all ask for the same
+        // read of the pending registers.  Edges that come while that
+        // read is out set intrpend below like the sysfs ones do.
+        ret = read(pctx->irfd, ev, sizeof(ev));
+        nev = (ret > 0) ? (ret / (int) sizeof(ev[0])) : 0;
+        if (nev == 0) {
+            if ((ret < 0) && (errno != EAGAIN)) {
+                edlog("Error reading interrupt GPIO line");
+            }
+            return;
+        }
+        // The timestamps are on the monotonic clock
+        rt = epoch_us();
+        mono = now_us();
+        for (i = 0; i < nev; i++) {
+            pctx->tedge = rt - (mono - (long long) (ev[i].timestamp_ns / 1000));
+            trace_at(pctx, TR_INTR, (uint8_t *) 0, 0, pctx->tedge);
+        }
+        if (pctx->push) {
+            return;
+        }
+    }
+    else {
+        // The FPGA sends the interrupts itself in push mode
+        if (pctx->push) {
+            return;
+        }
+
+        // We need to read the GPIO value to clear the interrupt
+        (void) lseek(pctx->irfd, (off_t) 0, SEEK_SET);
+        ret = read(pctx->irfd, pkt, HBA_MXPKT);
+        if (ret <= 0) {
+            edlog("Error reading interrupt GPIO pin");
+            return;
+        }
+
+        // Noise on the interrupt line can trigger a rising edge.
+        // Verify that the interrupt pin really is high
+        if (pkt[0] != '1') {
+            return;
+        }
+        pctx->tedge = epoch_us();
+        trace_add(pctx, TR_INTR, (uint8_t *) 0, 0);
     }
 
-    // Noise on the interrupt line can trigger a rising edge.
-    // Verify that the interrupt pin really is high
-    if (pkt[0] != '1') {
+    // If a read of the pending registers is on its way this edge may
+    // have come after the FPGA answered it.  Read them again when it
+    // is in, since the pin stays high and gives no new edge.
+    if (pctx->intrbusy) {
+        pctx->intrpend = 1;
         return;
     }
 
+    intr_read(pctx);
+}
+
+
+/***************************************************************************
+ * intr_read(): - Queue a read of the two interrupt pending registers in
+ * serial_fpga.  intr_done() gets the response.
+ ***************************************************************************/
+static void intr_read(
+    SERPORT  *pctx)          // our context
+{
+    SLOT     *pslot;         // out SLOT
+    int       ret;
+    uint8_t   pkt[HBA_MXPKT];
+
+    pslot = pctx->pslot;
+
     // Read the two interrupt registers in serial_fpga
     //  (2-1) is # byte to read -1
     pkt[0] = HBA_READ_CMD | ((2 -1) << 4) | HBA_SERIAL_FPGA_COREID;
@@ -778,7 +4481,39 @@ static void do_interrupt(
     pkt[3] = 0;                     // dummy byte
     pkt[4] = 0;                     // dummy byte
     pkt[5] = 0;                     // dummy byte
-    nrc = sendrecv_pkt(pslot->slot_id, 6, pkt);
+    ret = sendrecv_async(pslot->slot_id, 6, pkt, intr_done, (void *) pctx);
+    if (ret < 0) {
+        edlog("Error reading interrupt pending register from FPGA");
+        return;
+    }
+    pctx->intrbusy = 1;
+}
+
+
+/***************************************************************************
+ * intr_done(): - The interrupt pending registers are in.  Invoke the
+ * appropriate interrupt handlers if one is registered.  Log interrupts
+ * that do not have a handler.
+ ***************************************************************************/
+static void intr_done(
+    void     *trans,         // our context (==*SERPORT)
+    int       nrc,           // number of bytes recieved
+    uint8_t  *pkt)           // the response
+{
+    SERPORT  *pctx;          // our context
+    int       intpending;    // a set bit means and interrupt is pending
+    int       i;             // to walk the cores
+
+    pctx = (SERPORT *) trans;
+    pctx->intrbusy = 0;
+
+    // An edge came in while the read was out.  Read again, even if
+    // this one failed, so the edge is not lost.
+    if (pctx->intrpend && (pctx->spfd >= 0)) {
+        pctx->intrpend = 0;
+        intr_read(pctx);
+    }
+
     // We sent header + two bytes so the sendrecv return value should be 4
     if (nrc != 4) {
         // error reading value from GPIO port
@@ -799,6 +4534,7 @@ static void do_interrupt(
         intpending = intpending >> 1;
         if ((intpending & 0x01) == 1) {
             // interrupt is pending on this core.  Invoke its handler
+            pctx->coreinfo[i].nintr++;
             if (pctx->coreinfo[i].intr_hndlr == 0) {
                 edlog("Received unhandled interrupt in core %d", i);
                 continue;
@@ -0,0 +1,619 @@
+/*
+ *  Name: cosim.cpp
+ *
+ *  Description: Run the RTL of projects/main_project/hba_system.v under
+ *               Verilator and connect its serial port to a pseudo-terminal
+ *               so that serial_fpga.so and the peripheral plug-ins talk
+ *               to the real design instead of a board.
+ *
+ *               The UART pins are driven and sampled bit by bit at the
+ *               baud rate the host set on its side of the pty, so a
+ *               host and design that disagree on the rate see garbage
+ *               as they would on a board.  The interrupt pin is
+ *               written as '1' or '0' to a fake GPIO value file.  Simple
+ *               models of the QTR sensors, the sonars, and the encoders
+ *               are on the other pins.  The motors turn the encoders.
+ *
+ *               Simulated time is held to wall clock time when the
+ *               simulation is faster than real time.  Each burst of
+ *               serial traffic is timed in clock cycles from the start
+ *               bit of its first byte to the stop bit of its last.  This
+ *               gives the cycles per transaction of the RTL.
+ *
+ *  Usage: cosim [-l link] [-g gpiofile] [-v] [-q]
+ *    -l link     : make a symlink to the pty, eg /tmp/ttyFPGA
+ *    -g gpiofile : write the interrupt pin to this file
+ *    -v          : print each burst of serial traffic with its cycles
+ *    -q          : do not hold the simulation to wall clock time
+ *  A pty can not carry a break.  If the host goes quiet for 5 ms after
+ *  bytes that got no reply the line is held low as a break.  There is
+ *  no long break so restart cosim to put the design back at the baud
+ *  rate it was built for.
+ *  A summary of the bursts is printed on exit.
+ */
+
+/*
+ * Copyright:   Copyright (C) 2019 by Demand Peripherals, Inc.
+ *              All rights reserved.
+ *
+ * License:     This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the Version 2 of the GNU General
+ *              Public License as published by the Free Software Foundation.
+ *              GPL2.txt in the top level directory is a copy of this license.
+ *              This program is distributed in the hope that it will be useful,
+ *              but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *              MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *              GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include "verilated.h"
+#include "Vhba_system.h"
+
+
+/**************************************************************
+ *  - Limits and defines
+ **************************************************************/
+        // These must match the parameters given to Verilator
+#ifndef CLK_FREQUENCY
+#define CLK_FREQUENCY      50000000
+#endif
+#ifndef BAUD
+#define BAUD               115200
+#endif
+#define CLKS_PER_MS        (CLK_FREQUENCY / 1000)
+        // Clock cycles to the start of bit n of a character
+#define BIT_CLKS(n)        ((uint64_t) (n) * CLK_FREQUENCY / baud)
+        // The design sees a break after 20 bit times low
+#define BREAK_BITS         24
+        // A quiet line this long after an unanswered byte gives a break
+#define BREAK_MS           5
+        // A burst ends when both lines are quiet this many bit times
+#define BURST_GAP_BITS     20
+        // Host to FPGA buffer
+#define MX_TXQ             4096
+        // Reset is held this many cycles at start
+#define RESET_CLKS         16
+        // QTR discharge and sonar echo times change this often
+#define WORLD_MS           20
+        // Encoder edges per ms at full motor power
+#define EDGES_PER_MS       2
+
+
+/**************************************************************
+ *  - Data structures
+ **************************************************************/
+        // The kernel termios with the baud rate as a number.  Used to
+        // read the rate the host set on its side of the pty.
+#ifndef BOTHER
+struct termios2
+{
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t     c_line;
+    cc_t     c_cc[19];
+    speed_t  c_ispeed;
+    speed_t  c_ospeed;
+};
+#endif
+
+typedef struct
+{
+    uint8_t  q[MX_TXQ]; // bytes from the host not yet sent
+    int      head;      // next byte to send
+    int      n;         // number of bytes in q
+    int      bit;       // bit being sent, -1 if idle
+    uint8_t  c;         // character being sent
+    uint64_t t0;        // cycle at the start bit
+    int      brk;       // ==1 while sending a break
+} UART_OUT;             // host to FPGA
+
+typedef struct
+{
+    int      busy;      // ==1 while receiving a character
+    uint64_t t0;        // cycle at the falling edge of the start bit
+    int      bit;       // next bit to sample
+    uint8_t  c;         // character being received
+    int      last;      // txd on the previous cycle
+} UART_IN;              // FPGA to host
+
+typedef struct
+{
+    int      open;      // ==1 while a burst is in progress
+    uint64_t t0;        // cycle the burst started
+    uint64_t tlast;     // cycle of the last line activity
+    int      nin;       // bytes to the FPGA in this burst
+    int      nout;      // bytes from the FPGA in this burst
+    long     count;     // number of bursts
+    uint64_t cycles;    // total cycles in bursts
+    long     bytes;     // total bytes in bursts
+} BURSTS;
+
+
+/**************************************************************
+ *  - Function prototypes
+ **************************************************************/
+static void     uart_out(Vhba_system *, UART_OUT *, uint64_t);
+static int      uart_in(Vhba_system *, UART_IN *, uint64_t);
+static void     burst(BURSTS *, uint64_t, int, int, int);
+static void     world(Vhba_system *, uint64_t);
+static void     gpio_pin(int);
+static void     summary(void);
+static void     on_signal(int);
+static long long now_us(void);
+static int      host_baud(int);
+
+
+/**************************************************************
+ *  - Globals
+ **************************************************************/
+static char     *gpiofile = (char *) 0;
+static int       gpioval = -1;
+static int       verbose = 0;
+static BURSTS    bursts;
+static uint64_t  cycle = 0;
+static long long tstart;
+static volatile int done = 0;
+static int       baud = BAUD;
+
+
+int main(int argc, char *argv[])
+{
+    Vhba_system *top;
+    UART_OUT uo;
+    UART_IN  ui;
+    int      mfd;       // pty master
+    int      sfd;       // pty slave, to see the host's baud rate
+    char    *link = (char *) 0;
+    int      realtime = 1;
+    uint8_t  buf[256];
+    int      nrd;
+    int      opt;
+    int      i;
+    int      c;
+    int      unanswered = 0;  // ==1 if host bytes have had no reply
+    long long lastrx;         // wall time of the last byte from host
+    long long ahead;
+    fd_set   rfds;
+    struct timeval tv;
+
+    Verilated::commandArgs(argc, argv);
+    while ((opt = getopt(argc, argv, "l:g:vq")) != -1) {
+        switch (opt) {
+            case 'l' : link = optarg; break;
+            case 'g' : gpiofile = optarg; break;
+            case 'v' : verbose = 1; break;
+            case 'q' : realtime = 0; break;
+            default :
+                fprintf(stderr, "usage: %s [-l link] [-g gpiofile] [-v] [-q]\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
+
+    mfd = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((mfd < 0) || (grantpt(mfd) < 0) || (unlockpt(mfd) < 0)) {
+        perror("pty");
+        exit(1);
+    }
+    if (link) {
+        (void) unlink(link);
+        if (symlink(ptsname(mfd), link) < 0) {
+            perror("symlink");
+            exit(1);
+        }
+    }
+    printf("%s  %d Hz clock, %d baud\n", ptsname(mfd), CLK_FREQUENCY, BAUD);
+    fflush(stdout);
+    // Keep the slave open to read the host's baud rate.  Only the
+    // host reads from it.
+    sfd = open(ptsname(mfd), O_RDWR | O_NOCTTY);
+    if (sfd < 0) {
+        perror("pty slave");
+        exit(1);
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    memset(&uo, 0, sizeof(uo));
+    memset(&ui, 0, sizeof(ui));
+    memset(&bursts, 0, sizeof(bursts));
+    uo.bit = -1;
+    ui.last = 1;
+
+    top = new Vhba_system;
+    top->clk = 0;
+    top->reset = 1;
+    top->rxd = 1;
+    top->basicio_button = 0;
+    top->qtr_in_sig = 0;
+    top->sonar_echo = 0;
+    top->quad_enc_a = 0;
+    top->quad_enc_b = 0;
+    top->eval();
+
+    tstart = now_us();
+    lastrx = tstart;
+    while (!done) {
+        // One clock cycle.  Inputs change on the falling edge.
+        top->reset = (cycle < RESET_CLKS);
+        top->clk = 1;
+        top->eval();
+        top->clk = 0;
+        uart_out(top, &uo, cycle);
+        world(top, cycle);
+        top->eval();
+        c = uart_in(top, &ui, cycle);
+        if (c >= 0) {
+            unanswered = 0;
+            buf[0] = (uint8_t) c;
+            while (write(mfd, buf, 1) != 1) {
+                usleep(100);
+            }
+        }
+        burst(&bursts, cycle, (uo.bit >= 0), ui.busy,
+              (uo.n > 0) || (uo.bit >= 0));
+        gpio_pin(top->intr);
+        cycle++;
+
+        // Once a ms of simulated time look for bytes from the host.
+        // Wait for them here if ahead of the wall clock.
+        if ((cycle % CLKS_PER_MS) != 0) {
+            continue;
+        }
+        // Follow the host's baud rate between characters
+        if ((uo.n == 0) && (uo.bit < 0) && !uo.brk && !ui.busy &&
+            (host_baud(sfd) > 0) && (host_baud(sfd) != baud)) {
+            baud = host_baud(sfd);
+            if (verbose) {
+                printf("%d baud\n", baud);
+            }
+        }
+        ahead = (long long) (cycle / CLKS_PER_MS) * 1000 - (now_us() - tstart);
+        FD_ZERO(&rfds);
+        FD_SET(mfd, &rfds);
+        tv.tv_sec = 0;
+        tv.tv_usec = (realtime && (ahead > 0)) ? ahead : 0;
+        if (select(mfd + 1, &rfds, 0, 0, &tv) <= 0) {
+            if (unanswered && (uo.n == 0) && (uo.bit < 0) &&
+                (now_us() - lastrx >= BREAK_MS * 1000)) {
+                unanswered = 0;
+                uo.brk = 1;
+                uo.t0 = cycle;
+                if (verbose) {
+                    printf("break\n");
+                }
+            }
+            continue;
+        }
+        nrd = read(mfd, buf, (MX_TXQ - uo.n < (int) sizeof(buf)) ?
+                   MX_TXQ - uo.n : (int) sizeof(buf));
+        if (nrd <= 0) {
+            // EIO until the other side opens the pty
+            if ((nrd < 0) && (errno != EINTR) && (errno != EAGAIN)) {
+                usleep(10000);
+            }
+            continue;
+        }
+        lastrx = now_us();
+        unanswered = 1;
+        for (i = 0; i < nrd; i++) {
+            uo.q[(uo.head + uo.n) % MX_TXQ] = buf[i];
+            uo.n++;
+        }
+    }
+
+    top->final();
+    delete top;
+    summary();
+    return(0);
+}
+
+
+/* uart_out() : Drive rxd of the design with the bytes from the host.
+ * One start bit, eight data bits LSB first, and one stop bit.
+ */
+static void uart_out(
+    Vhba_system *top,
+    UART_OUT *puo,
+    uint64_t  now)
+{
+    int       bit;
+
+    if (puo->brk) {
+        top->rxd = 0;
+        if (now - puo->t0 >= BIT_CLKS(BREAK_BITS)) {
+            // back to a high line for a character time
+            top->rxd = 1;
+            if (now - puo->t0 >= BIT_CLKS(BREAK_BITS + 10)) {
+                puo->brk = 0;
+            }
+        }
+        return;
+    }
+    if (puo->bit < 0) {
+        if (puo->n == 0) {
+            top->rxd = 1;
+            return;
+        }
+        puo->c = puo->q[puo->head];
+        puo->head = (puo->head + 1) % MX_TXQ;
+        puo->n--;
+        puo->bit = 0;
+        puo->t0 = now;
+        if (verbose) {
+            printf("rx %02x\n", puo->c);
+        }
+    }
+    bit = 0;
+    while ((bit < 10) && (now - puo->t0 >= BIT_CLKS(bit + 1))) {
+        bit++;
+    }
+    if (bit == 10) {
+        puo->bit = -1;
+        top->rxd = 1;
+        return;
+    }
+    puo->bit = bit;
+    if (bit == 0) {
+        top->rxd = 0;
+    }
+    else if (bit == 9) {
+        top->rxd = 1;
+    }
+    else {
+        top->rxd = (puo->c >> (bit - 1)) & 1;
+    }
+}
+
+
+/* uart_in() : Sample txd of the design.  Returns the character
+ * at the middle of its stop bit or -1 if none.
+ */
+static int uart_in(
+    Vhba_system *top,
+    UART_IN  *pui,
+    uint64_t  now)
+{
+    int       txd = top->txd;
+    int       c = -1;
+
+    if (!pui->busy) {
+        if (pui->last && !txd) {
+            pui->busy = 1;
+            pui->t0 = now;
+            pui->bit = 0;
+            pui->c = 0;
+        }
+    }
+    else if (now - pui->t0 == BIT_CLKS(pui->bit) + BIT_CLKS(1) / 2) {
+        // middle of bit
+        if ((pui->bit >= 1) && (pui->bit <= 8)) {
+            pui->c |= (txd << (pui->bit - 1));
+        }
+        else if (pui->bit == 0 && txd) {
+            pui->busy = 0;   // a glitch, not a start bit
+        }
+        else if (pui->bit == 9) {
+            pui->busy = 0;
+            if (txd) {
+                c = pui->c;
+                if (verbose) {
+                    printf("tx %02x\n", c);
+                }
+            }
+            else if (verbose) {
+                printf("framing error from FPGA\n");
+            }
+        }
+        pui->bit++;
+    }
+    pui->last = txd;
+    return(c);
+}
+
+
+/* burst() : Time the bursts of serial traffic.  A burst ends when both
+ * lines have been quiet for BURST_GAP_BITS bit times.
+ */
+static void burst(
+    BURSTS   *pb,
+    uint64_t  now,
+    int       rxbusy,   // ==1 if sending to the design
+    int       txbusy,   // ==1 if receiving from the design
+    int       pending)  // ==1 if host bytes are waiting
+{
+    static int lastrx = 0;
+    static int lasttx = 0;
+
+    if (rxbusy || txbusy || pending) {
+        if (!pb->open) {
+            pb->open = 1;
+            pb->t0 = now;
+            pb->nin = 0;
+            pb->nout = 0;
+        }
+        pb->tlast = now;
+        // count characters at their start
+        if (rxbusy && !lastrx) {
+            pb->nin++;
+        }
+        if (txbusy && !lasttx) {
+            pb->nout++;
+        }
+    }
+    else if (pb->open && (now - pb->tlast >= BIT_CLKS(BURST_GAP_BITS))) {
+        pb->open = 0;
+        pb->count++;
+        pb->cycles += pb->tlast - pb->t0;
+        pb->bytes += pb->nin + pb->nout;
+        if (verbose) {
+            printf("burst: %d in, %d out, %llu cycles, %llu on the wire\n",
+                   pb->nin, pb->nout, (unsigned long long) (pb->tlast - pb->t0),
+                   (unsigned long long) BIT_CLKS(10 * (pb->nin + pb->nout)));
+            fflush(stdout);
+        }
+    }
+    lastrx = rxbusy;
+    lasttx = txbusy;
+}
+
+
+/* world() : Drive the sensor and encoder pins.  QTR sensors discharge
+ * and sonar echoes return after times that change slowly.  Motor PWM
+ * turns the encoders.
+ */
+static void world(
+    Vhba_system *top,
+    uint64_t  now)
+{
+    static uint64_t qtrt0[2];     // cycle QTR went to input
+    static int      qtren[2];
+    static uint64_t trigt0[2];    // cycle the sonar trigger ended
+    static int      trig[2];
+    static int      phase[2];     // encoder gray code position
+    static uint64_t pwmhigh[2];   // PWM high cycles toward next edge
+    static const uint8_t grayA[4] = { 0, 1, 1, 0 };
+    static const uint8_t grayB[4] = { 0, 0, 1, 1 };
+    uint64_t  ms = now / CLKS_PER_MS;
+    uint64_t  decay;    // QTR discharge time in cycles
+    uint64_t  echo;     // sonar echo time in cycles
+    int       qtrin = 0;
+    int       sonar = 0;
+    int       a = 0;
+    int       b = 0;
+    int       i;
+
+    // 100 us to 2.5 ms discharge, 20 to 120 cm distance
+    decay = (100 + ((ms / WORLD_MS) * 10) % 2400) * (CLKS_PER_MS / 1000);
+    echo = (20 + ((ms / WORLD_MS) % 100)) * 58 * (CLKS_PER_MS / 1000);
+
+    for (i = 0; i < 2; i++) {
+        // QTR: the pin follows the output while driven then reads
+        // high until the capacitor discharges
+        if ((top->qtr_out_en >> i) & 1) {
+            qtren[i] = 1;
+            qtrin |= ((top->qtr_out_sig >> i) & 1) << i;
+        }
+        else {
+            if (qtren[i]) {
+                qtren[i] = 0;
+                qtrt0[i] = now;
+            }
+            qtrin |= ((now - qtrt0[i]) < decay) << i;
+        }
+
+        // Sonar: echo high for 58 us per cm starting 100 us after
+        // the end of the trigger
+        if ((top->sonar_trig >> i) & 1) {
+            trig[i] = 1;
+        }
+        else if (trig[i]) {
+            trig[i] = 0;
+            trigt0[i] = now;
+        }
+        if ((trigt0[i] != 0) && (now - trigt0[i] >= (CLKS_PER_MS / 10)) &&
+            (now - trigt0[i] < (CLKS_PER_MS / 10) + echo)) {
+            sonar |= 1 << i;
+        }
+
+        // Encoders: an edge for every so many cycles of PWM high
+        if ((top->motor_pwm >> i) & 1) {
+            pwmhigh[i]++;
+            if (pwmhigh[i] >= CLKS_PER_MS / EDGES_PER_MS) {
+                pwmhigh[i] = 0;
+                phase[i] = (phase[i] + (((top->motor_dir >> i) & 1) ? 3 : 1)) % 4;
+            }
+        }
+        a |= grayA[phase[i]] << i;
+        b |= grayB[phase[i]] << i;
+    }
+    top->qtr_in_sig = qtrin;
+    top->sonar_echo = sonar;
+    top->quad_enc_a = a;
+    top->quad_enc_b = b;
+}
+
+
+/* host_baud() : Return the baud rate of the host's side of the pty */
+static int host_baud(
+    int       sfd)
+{
+    struct termios2 tios2;
+
+    if (ioctl(sfd, TCGETS2, &tios2) < 0) {
+        return(0);
+    }
+    return(tios2.c_ospeed);
+}
+
+
+/* gpio_pin() : Write the interrupt pin to the fake GPIO value file */
+static void gpio_pin(
+    int       val)
+{
+    int       fd;
+
+    if ((gpiofile == (char *) 0) || (val == gpioval)) {
+        return;
+    }
+    gpioval = val;
+    fd = open(gpiofile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(gpiofile);
+        exit(1);
+    }
+    if (write(fd, (val) ? "1\n" : "0\n", 2) != 2) {
+        perror(gpiofile);
+    }
+    close(fd);
+}
+
+
+/* summary() : Print the burst totals and the simulation speed */
+static void summary(void)
+{
+    long long wall = now_us() - tstart;
+
+    printf("%ld bursts, %ld bytes, %llu cycles", bursts.count, bursts.bytes,
+           (unsigned long long) bursts.cycles);
+    if (bursts.count) {
+        printf(", %llu cycles per burst",
+               (unsigned long long) (bursts.cycles / bursts.count));
+    }
+    printf("\n%llu cycles in %lld ms, %.2f times real time\n",
+           (unsigned long long) cycle, wall / 1000,
+           (wall) ? ((double) cycle / CLK_FREQUENCY * 1e6) / wall : 0.0);
+}
+
+
+/* on_signal() : Stop at the end of this cycle */
+static void on_signal(int sig)
+{
+    done = 1;
+}
+
+
+/* now_us() : Return the time in us */
+static long long now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return(tv.tv_sec * 1000000LL + tv.tv_usec);
+}
+
+// end of cosim.cpp
@@ -0,0 +1,1260 @@
+/*
+ *  Name: fpga_emu.c
+ *
+ *  Description: Emulate the HomeBrew Automation FPGA on a pseudo-terminal
+ *               so that serial_fpga.so and the peripheral plug-ins can be
+ *               run, tested, and timed without a board.
+ *
+ *               The serial side follows doc/serial_interface.md up to the
+ *               protocol revision given.  The cores are at their fixed
+ *               core IDs and have the register maps in their README.md
+ *               files:
+ *                   0 serial_fpga   1 hba_basicio   2 hba_qtr
+ *                   3 hba_motor     4 hba_sonar     5 hba_quad
+ *                   6 hba_gpio
+ *               The motors turn the wheels that the quadrature encoders
+ *               count.  The QTR and sonar sensors see a slowly changing
+ *               world.  Interrupts set the flags in serial_fpga reg0 and
+ *               reg1 at the rate in reg2, after any coalescing set in
+ *               reg12 to reg15, and are sent as push frames or written
+ *               as '1' or '0' to a fake GPIO value file.  A gpiofile
+ *               ending in /pull is taken to be a gpio-sim line and is
+ *               written as 'pull-up' or 'pull-down'.  The QTR,
+ *               sonar, and quad cores keep a dirty map of the registers
+ *               they have changed for dirty push windows, and copy those
+ *               registers to regN+8 when the host writes reg17.
+ *
+ *  Usage: fpga_emu [-l link] [-g gpiofile] [-c coremask] [-p coremask]
+ *                  [-r rev] [-b baud] [-i coremask] [-d n] [-e n] [-t n] [-v]
+ *    -l link     : make a symlink to the pty, eg /tmp/ttyFPGA
+ *    -g gpiofile : write the interrupt pin to this file or gpio-sim pull
+ *    -c coremask : hex mask of cores that answer on the bus (default 7f)
+ *    -p coremask : hex mask of cores that are plain registers with no model
+ *    -r rev      : protocol revision to report in reg3 (default 12)
+ *    -b baud     : baudrate the FPGA is built for (default 115200)
+ *    -i coremask : hex mask of cores that also interrupt every 20 ms
+ *    -d n        : drop the nth byte from the host
+ *    -e n        : flip a bit in the nth byte from the host
+ *    -t n        : flip a bit in the nth byte to the host
+ *    -v          : print the bytes sent and received
+ *  A pty can not carry a break so from revision 6 a quiet line of
+ *  5 ms in the middle of a packet stands in for one.  Bytes sent while
+ *  the host's side of the pty is not at the emulator's baudrate are
+ *  lost, and a quiet line of 100 ms then stands in for a long break.
+ */
+
+/*
+ * Copyright:   Copyright (C) 2019 by Demand Peripherals, Inc.
+ *              All rights reserved.
+ *
+ * License:     This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the Version 2 of the GNU General
+ *              Public License as published by the Free Software Foundation.
+ *              GPL2.txt in the top level directory is a copy of this license.
+ *              This program is distributed in the hope that it will be useful,
+ *              but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *              MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *              GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+
+/**************************************************************
+ *  - Limits and defines
+ **************************************************************/
+#define NCORE              16
+#define NREG               256
+#define ACK_CHAR           0xAC
+#define NACK_CHAR          0x56
+#define EXT_COREID         0x0F
+#define EXT_OP_BURST       0
+#define EXT_OP_POSTED      1
+#define EXT_OP_EXCHANGE    2
+#define EXT_OP_GATHER      3
+#define PROTOCOL_REV       12
+#define PUSH_MARK          0x50
+#define PUSH_DIRTY         0x80
+#define FRAME_ERR          0x5E
+        // Framed responses kept to answer packets sent again
+#define RLOG_SLOTS         4
+        // Forced interrupts from -i come this often
+#define INTR_MS            20
+        // A quiet line this long in a packet is taken as a break
+#define BREAK_MS           5
+        // A quiet line this long at the wrong baudrate is a long break
+#define LONG_BREAK_MS      100
+        // Default baudrate
+#define DEFBAUD            115200
+        // Core IDs.  These are fixed in common/include/hba.h
+#define SERIAL_FPGA_COREID 0
+#define BASICIO_COREID     1
+#define QTR_COREID         2
+#define MOTOR_COREID       3
+#define SONAR_COREID       4
+#define QUAD_COREID        5
+#define GPIO_COREID        6
+        // serial_fpga registers
+#define SF_REG_INTR0       0
+#define SF_REG_INTR1       1
+#define SF_REG_RATE        2
+#define SF_REG_PROTO       3
+#define SF_REG_ERRORS      4
+#define SF_REG_LINK        5
+#define SF_REG_WINSEL      6
+#define SF_REG_WINREG      7
+#define SF_REG_BAUD0       8
+#define SF_REG_BAUDSW      11
+#define SF_REG_COALSEL     12
+#define SF_REG_COALUS1     15
+#define SF_REG_DIRTY       16
+#define SF_REG_SNAP        17
+        // Encoder edges per ms at full motor power
+#define EDGES_PER_MS       2
+        // Parser states.  These follow serial_fpga.v
+#define ST_IDLE            0
+#define ST_EXT_CORE        1
+#define ST_REG_ADDR        2
+#define ST_EXT_LEN         3
+#define ST_READ            4
+#define ST_WRITE           5
+#define ST_ACK             6
+#define ST_NACK            7
+#define ST_XCHG_RAD        8
+#define ST_XCHG_LEN        9
+#define ST_GATHER_CORE     10
+#define ST_GATHER_RAD      11
+#define ST_GATHER_LEN      12
+#define ST_FSEQ            13
+#define ST_FCRC            14
+#define ST_RSEQ            15
+#define ST_RCRC            16
+#define ST_LOST            17
+
+
+/**************************************************************
+ *  - Data structures
+ **************************************************************/
+        // The kernel termios with the baudrate as a number.  Used to
+        // read the rate the host set on its side of the pty.
+#ifndef BOTHER
+struct termios2
+{
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t     c_line;
+    cc_t     c_cc[19];
+    speed_t  c_ispeed;
+    speed_t  c_ospeed;
+};
+#endif
+
+typedef struct
+{
+    uint8_t  regs[NCORE][NREG];  // register values
+    int      coremask;  // bit set for each core on the bus
+    int      plainmask; // bit set for each core with no model
+    int      rev;       // protocol revision reported in reg3
+    int      basebaud;  // baudrate the FPGA is built for
+    int      baud;      // baudrate now
+    int      baudpend;  // ==1 to switch baudrate once idle
+    int      verbose;   // ==1 to print bytes
+    char    *gpiofile;  // fake GPIO value file, null if none
+    int      gpioval;   // value last written to gpiofile
+    int      gpiosim;   // ==1 if gpiofile is the pull of a gpio-sim line
+    long long now;      // time in ms of the last model tick
+    long long lastintr; // time in ms the interrupt pin last went high
+    int      intrmask;  // cores that are forced to interrupt
+    int      pend;      // interrupts read but not yet pushed
+    uint8_t  winreg[NCORE]; // push window first register
+    uint8_t  winlen[NCORE]; // push window length
+    uint8_t  winmap[NCORE]; // dirty map register, 0 if a full window
+    uint8_t  dirty[NCORE];  // registers changed since the map was read
+    uint8_t  seen[NCORE][8]; // registers as of the last dirty check
+    int      coalcnt[NCORE]; // interrupts to hold, 0 for no count
+    int      coalms[NCORE];  // longest to hold them in ms, 0 for no time
+    int      coalevs[NCORE]; // interrupts held
+    long long coaldue[NCORE]; // time in ms the held interrupts go out
+    int      npush;     // number of frames pushed
+    int      state;     // parser state
+    uint8_t  cmd;       // command byte
+    uint8_t  core;      // core being accessed
+    uint8_t  reg;       // next register
+    int      nxfer;     // bytes left to transfer
+    int      xerr;      // ==1 if a bus error in this transaction
+    int      ndesc;     // gather descriptors still to read
+    int      drop;      // drop this byte from the host (1 based)
+    int      corrupt;   // flip a bit in this byte from the host
+    int      tcorrupt;  // flip a bit in this byte to the host
+    int      nrx;       // number of bytes from the host
+    int      ntx;       // number of bytes to the host
+    int      framed;    // ==1 if this packet is framed
+    int      fnext;     // state after a good CRC
+    int      rdoff;     // where read data goes in out, -1 if a write
+    uint8_t  seq;       // sequence number of this packet
+    uint8_t  rxcrc;     // CRC of the packet
+    uint8_t  txcrc;     // CRC of the response
+    uint8_t  wbuf[NREG]; // write data held for the CRC
+    uint8_t  logseq[RLOG_SLOTS]; // sequence numbers of the logged packets
+    int      logok[RLOG_SLOTS]; // ==1 if the logged packet ran
+    int      logerr[RLOG_SLOTS]; // ==1 if the logged packet was NACKed
+    uint8_t  logdata[RLOG_SLOTS][NREG]; // logged read data
+    int      nwbuf;     // bytes in wbuf
+    uint8_t  out[NREG + 8]; // bytes to send for a read
+    int      nout;      // number of bytes in out
+    int      outidx;    // next byte in out to send
+    int      qtrms;     // ms into the QTR period
+    int      sonarms;   // ms into the sonar period
+    int      quadms;    // ms into the encoder speed period
+    int      wheel[2];  // encoder edges owed in 1/100ths
+    int      speed[2];  // edges counted in this speed period
+    uint8_t  pins;      // hba_gpio pins last time
+} EMU;
+
+        // Registers each core drives itself and so keeps dirty bits
+        // for, and the register with its dirty map.  See the README.md
+        // of each core.
+static const uint8_t dirtymask[NCORE] = {
+    0x00,       // serial_fpga
+    0x00,       // basicio
+    0x06,       // qtr: both sensors, map in reg5
+    0x00,       // motor
+    0x06,       // sonar: both sonars, map in reg7
+    0x7e,       // quad: encoders and speeds, map in reg8
+    0x00,       // gpio
+};
+static const int mapreg[NCORE] = { 0, 0, 5, 0, 7, 8, 0 };
+
+
+/**************************************************************
+ *  - Function prototypes
+ **************************************************************/
+static void    rx_byte(EMU *, int, uint8_t);
+static int     bus_read(EMU *, int, int, uint8_t *);
+static int     bus_write(EMU *, int, int, uint8_t);
+static void    bus_error(EMU *);
+static void    tx_byte(EMU *, int, uint8_t);
+static void    push(EMU *, int);
+static uint8_t crc8(uint8_t, uint8_t);
+static void    frame_start(EMU *, int, int);
+static void    model_tick(EMU *);
+static void    model_snap(EMU *);
+static void    model_write(EMU *, int, int);
+static void    model_dirty(EMU *);
+static void    core_intr(EMU *, int);
+static void    intr_flag(EMU *, int);
+static void    coal_tick(EMU *);
+static void    gpio_pin(EMU *);
+static long long now_ms(void);
+static int     host_baud(int);
+
+
+int main(int argc, char *argv[])
+{
+    EMU      emu;
+    int      mfd;       // pty master
+    int      sfd;       // pty slave, to see the host's baudrate
+    char    *link = (char *) 0;
+    uint8_t  buf[256];
+    int      nrd;
+    int      opt;
+    int      i;
+    long long lastforce = 0;
+    long long lastrx;
+    fd_set   rfds;
+    struct timeval tv;
+
+    memset(&emu, 0, sizeof(emu));
+    emu.coremask = 0x7f;
+    emu.rev = PROTOCOL_REV;
+    emu.basebaud = DEFBAUD;
+    emu.state = ST_IDLE;
+    emu.gpioval = -1;
+
+    while ((opt = getopt(argc, argv, "l:g:c:p:r:b:i:d:e:t:v")) != -1) {
+        switch (opt) {
+            case 'l' : link = optarg; break;
+            case 'g' : emu.gpiofile = optarg;
+                       emu.gpiosim = (strlen(optarg) >= 5) &&
+                           !strcmp(&optarg[strlen(optarg) - 5], "/pull");
+                       break;
+            case 'c' : emu.coremask = (int) strtol(optarg, (char **) 0, 16); break;
+            case 'p' : emu.plainmask = (int) strtol(optarg, (char **) 0, 16); break;
+            case 'r' : emu.rev = atoi(optarg); break;
+            case 'b' : emu.basebaud = atoi(optarg); break;
+            case 'i' : emu.intrmask = (int) strtol(optarg, (char **) 0, 16); break;
+            case 'd' : emu.drop = atoi(optarg); break;
+            case 'e' : emu.corrupt = atoi(optarg); break;
+            case 't' : emu.tcorrupt = atoi(optarg); break;
+            case 'v' : emu.verbose = 1; break;
+            default :
+                fprintf(stderr, "usage: %s [-l link] [-g gpiofile] [-c coremask] "
+                        "[-p coremask] [-r rev] [-b baud] [-i coremask] [-d n] "
+                        "[-e n] [-t n] [-v]\n", argv[0]);
+                exit(1);
+        }
+    }
+    // serial_fpga is always there and always has its model
+    emu.coremask |= 0x01;
+    emu.plainmask &= ~0x01;
+    emu.baud = emu.basebaud;
+
+    mfd = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((mfd < 0) || (grantpt(mfd) < 0) || (unlockpt(mfd) < 0)) {
+        perror("pty");
+        exit(1);
+    }
+    if (link) {
+        (void) unlink(link);
+        if (symlink(ptsname(mfd), link) < 0) {
+            perror("symlink");
+            exit(1);
+        }
+    }
+    printf("%s\n", ptsname(mfd));
+    fflush(stdout);
+    // Keep the slave open to read the host's baudrate.  Only the
+    // host reads from it.
+    sfd = open(ptsname(mfd), O_RDWR | O_NOCTTY);
+    if (sfd < 0) {
+        perror("pty slave");
+        exit(1);
+    }
+
+    emu.now = now_ms();
+    lastrx = emu.now;
+    gpio_pin(&emu);
+    while (1) {
+        // Run the cores up to now
+        while (emu.now < now_ms()) {
+            emu.now++;
+            model_tick(&emu);
+            coal_tick(&emu);
+        }
+        if (emu.now - lastforce >= INTR_MS) {
+            lastforce = emu.now;
+            for (i = 1; i < NCORE; i++) {
+                if (emu.intrmask & (1 << i)) {
+                    core_intr(&emu, i);
+                }
+            }
+        }
+        gpio_pin(&emu);
+        push(&emu, mfd);
+
+        FD_ZERO(&rfds);
+        FD_SET(mfd, &rfds);
+        tv.tv_sec = 0;
+        tv.tv_usec = 1000;
+        if (select(mfd + 1, &rfds, 0, 0, &tv) <= 0) {
+            if ((emu.state != ST_IDLE) && (emu.rev >= 6) &&
+                (now_ms() - lastrx >= BREAK_MS)) {
+                emu.state = ST_IDLE;
+                if (emu.verbose) {
+                    printf("break\n");
+                }
+            }
+            if ((emu.baud != emu.basebaud) && (emu.rev >= 8) &&
+                (host_baud(sfd) != emu.baud) &&
+                (now_ms() - lastrx >= LONG_BREAK_MS)) {
+                emu.baud = emu.basebaud;
+                emu.state = ST_IDLE;
+                if (emu.verbose) {
+                    printf("long break, %d baud\n", emu.baud);
+                }
+            }
+            continue;
+        }
+        nrd = read(mfd, buf, sizeof(buf));
+        if (nrd < 0) {
+            if ((errno == EINTR) || (errno == EAGAIN)) {
+                continue;
+            }
+            // EIO until the other side opens the pty
+            usleep(10000);
+            continue;
+        }
+        lastrx = now_ms();
+        if (host_baud(sfd) != emu.baud) {
+            // Garbage at the wrong rate
+            if (emu.verbose) {
+                printf("lost %d bytes at %d baud\n", nrd, host_baud(sfd));
+            }
+            continue;
+        }
+        for (i = 0; i < nrd; i++) {
+            if (emu.verbose) {
+                printf("rx %02x\n", buf[i]);
+            }
+            if (++emu.nrx == emu.drop) {
+                continue;
+            }
+            if (emu.nrx == emu.corrupt) {
+                buf[i] ^= 0x10;
+            }
+            rx_byte(&emu, mfd, buf[i]);
+        }
+        // Switch baudrate once the ACK for the write of reg11 is out
+        if (emu.baudpend && (emu.state == ST_IDLE)) {
+            emu.baudpend = 0;
+            i = emu.regs[0][SF_REG_BAUD0] | (emu.regs[0][SF_REG_BAUD0 + 1] << 8) |
+                (emu.regs[0][SF_REG_BAUD0 + 2] << 16);
+            if (emu.regs[0][SF_REG_BAUDSW] == 0) {
+                emu.baud = emu.basebaud;
+            }
+            else if (i != 0) {
+                emu.baud = i;
+            }
+            if (emu.verbose) {
+                printf("%d baud\n", emu.baud);
+            }
+        }
+    }
+}
+
+
+/* host_baud() : Return the baudrate of the host's side of the pty */
+static int host_baud(
+    int      sfd)
+{
+    struct termios2 tios2;
+
+    if (ioctl(sfd, TCGETS2, &tios2) < 0) {
+        return(0);
+    }
+    return(tios2.c_ospeed);
+}
+
+
+/* now_ms() : Return the time in ms */
+static long long now_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return(tv.tv_sec * 1000LL + tv.tv_usec / 1000);
+}
+
+
+/* push() : Send a push frame if push mode is on, the parser is idle,
+ * and no bytes are waiting from the host.  One core per call.
+ */
+static void push(
+    EMU     *pemu,
+    int      fd)
+{
+    fd_set   rfds;
+    struct timeval tv;
+    uint8_t  data[NREG];
+    uint8_t  map;       // dirty registers in the window
+    int      nset;      // number of bits set in map
+    int      core;
+    int      i;
+
+    if ((pemu->rev < 5) || ((pemu->regs[0][SF_REG_LINK] & 1) == 0) ||
+        (pemu->state != ST_IDLE)) {
+        return;
+    }
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    if (select(fd + 1, &rfds, 0, 0, &tv) > 0) {
+        return;
+    }
+    if ((pemu->pend == 0) &&
+        ((pemu->now - pemu->lastintr) >= pemu->regs[0][SF_REG_RATE])) {
+        // read and clear the interrupt registers
+        pemu->pend = (pemu->regs[0][SF_REG_INTR1] << 8) | pemu->regs[0][SF_REG_INTR0];
+        pemu->regs[0][SF_REG_INTR0] = 0;
+        pemu->regs[0][SF_REG_INTR1] = 0;
+        pemu->pend &= 0xfffe;
+        if (pemu->pend) {
+            pemu->lastintr = pemu->now;
+        }
+    }
+    if (pemu->pend == 0) {
+        return;
+    }
+    for (core = 1; (pemu->pend & (1 << core)) == 0; core++)
+        ;
+    pemu->pend &= ~(1 << core);
+    pemu->core = core;
+    if (pemu->winmap[core]) {
+        // Dirty window.  The map then only the registers it names.
+        (void) bus_read(pemu, pemu->winmap[core], 1, &map);
+        map &= (uint8_t) ((~(0xff << pemu->winlen[core])) << pemu->winreg[core]);
+        nset = 0;
+        for (i = 0; i < pemu->winlen[core]; i++) {
+            if (map & (1 << ((pemu->winreg[core] + i) & 7))) {
+                (void) bus_read(pemu, pemu->winreg[core] + i, 1, &(data[nset++]));
+            }
+        }
+        tx_byte(pemu, fd, PUSH_MARK);
+        tx_byte(pemu, fd, PUSH_DIRTY | core);
+        tx_byte(pemu, fd, 1 + nset);
+        tx_byte(pemu, fd, map);
+        for (i = 0; i < nset; i++) {
+            tx_byte(pemu, fd, data[i]);
+        }
+        pemu->npush++;
+        return;
+    }
+    (void) bus_read(pemu, pemu->winreg[core], pemu->winlen[core], data);
+    tx_byte(pemu, fd, PUSH_MARK);
+    tx_byte(pemu, fd, core);
+    tx_byte(pemu, fd, pemu->winlen[core]);
+    for (i = 0; i < pemu->winlen[core]; i++) {
+        tx_byte(pemu, fd, data[i]);
+    }
+    pemu->npush++;
+}
+
+
+/* gpio_pin() : Write the interrupt pin to the fake GPIO value file.
+ * The pin goes high when a core has interrupted and the rate in reg2
+ * allows it, and low when the flags are read.  The pin is not used in
+ * push mode.
+ */
+static void gpio_pin(
+    EMU     *pemu)
+{
+    int      val;
+    int      fd;
+    char    *pull;      // what to write to the file
+
+    if (pemu->gpiofile == (char *) 0) {
+        return;
+    }
+    val = ((pemu->regs[0][SF_REG_INTR0] | pemu->regs[0][SF_REG_INTR1]) != 0) &&
+          ((pemu->regs[0][SF_REG_LINK] & 1) == 0);
+    if (val && (pemu->gpioval == 0) &&
+        ((pemu->now - pemu->lastintr) < pemu->regs[0][SF_REG_RATE])) {
+        return;
+    }
+    if (val == pemu->gpioval) {
+        return;
+    }
+    if (val) {
+        pemu->lastintr = pemu->now;
+    }
+    pemu->gpioval = val;
+    fd = open(pemu->gpiofile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(pemu->gpiofile);
+        exit(1);
+    }
+    // A gpio-sim line is driven by the pull of its input.  The kernel
+    // then gives serial_fpga a real gpiochip edge.
+    if (pemu->gpiosim) {
+        pull = (val) ? "pull-up\n" : "pull-down\n";
+    }
+    else {
+        pull = (val) ? "1\n" : "0\n";
+    }
+    if (write(fd, pull, strlen(pull)) != (ssize_t) strlen(pull)) {
+        perror(pemu->gpiofile);
+    }
+    close(fd);
+}
+
+
+/* core_intr() : A core raises its interrupt.  It shows in the
+ * serial_fpga interrupt flags once the coalescing lets it through.
+ */
+static void core_intr(
+    EMU     *pemu,
+    int      core)
+{
+    int      cnt;
+
+    if ((pemu->coremask & (1 << core)) == 0) {
+        return;
+    }
+    cnt = pemu->coalcnt[core];
+    if (((cnt <= 1) && (pemu->coalms[core] == 0)) ||
+        ((cnt != 0) && (pemu->coalevs[core] + 1 >= cnt))) {
+        pemu->coalevs[core] = 0;
+        intr_flag(pemu, core);
+        return;
+    }
+    if (pemu->coalevs[core] == 0) {
+        pemu->coaldue[core] = pemu->now + pemu->coalms[core];
+    }
+    pemu->coalevs[core]++;
+}
+
+
+/* coal_tick() : Let go of held interrupts whose time is up */
+static void coal_tick(
+    EMU     *pemu)
+{
+    int      i;
+
+    for (i = 1; i < NCORE; i++) {
+        if (pemu->coalevs[i] && pemu->coalms[i] &&
+            (pemu->now >= pemu->coaldue[i])) {
+            pemu->coalevs[i] = 0;
+            intr_flag(pemu, i);
+        }
+    }
+}
+
+
+/* intr_flag() : Set a core's flag in reg0 or reg1 */
+static void intr_flag(
+    EMU     *pemu,
+    int      core)
+{
+    if (core < 8) {
+        pemu->regs[0][SF_REG_INTR0] |= (1 << core);
+    }
+    else {
+        pemu->regs[0][SF_REG_INTR1] |= (1 << (core - 8));
+    }
+}
+
+
+/* is_model() : Return 1 if core is on the bus and has a model */
+static int is_model(
+    EMU     *pemu,
+    int      core)
+{
+    return(((pemu->coremask & (1 << core)) != 0) &&
+           ((pemu->plainmask & (1 << core)) == 0));
+}
+
+
+/* model_tick() : Advance the cores by one ms */
+static void model_tick(
+    EMU     *pemu)
+{
+    uint8_t *r;
+    int      period;
+    int      side;
+    int      i;
+    int      duty;
+    int      dir;
+    int      count;
+    int      reg;
+
+    // QTR: read both sensors every (reg3 * 50) + 50 ms when enabled.
+    // Interrupt on each reading or on a threshold crossing.
+    r = pemu->regs[QTR_COREID];
+    if (is_model(pemu, QTR_COREID) && (r[0] & 0x01)) {
+        period = (r[3] * 50) + 50;
+        if (++pemu->qtrms >= period) {
+            pemu->qtrms = 0;
+            side = (r[1] > r[4]) | ((r[2] > r[4]) << 1);
+            r[1] = (pemu->now / 20) & 0xff;
+            r[2] = 0xff - r[1];
+            if ((r[0] & 0x02) && (((r[0] & 0x04) == 0) ||
+                (side != ((r[1] > r[4]) | ((r[2] > r[4]) << 1))))) {
+                core_intr(pemu, QTR_COREID);
+            }
+        }
+    }
+
+    // Sonar: a new distance from each enabled sonar every 100 ms.
+    // Each new distance is an interrupt.
+    r = pemu->regs[SONAR_COREID];
+    if (is_model(pemu, SONAR_COREID) && (r[0] & 0x03) &&
+        (++pemu->sonarms >= 100)) {
+        pemu->sonarms = 0;
+        if (r[0] & 0x01) {
+            r[1] = 20 + ((pemu->now / 100) % 100);
+        }
+        if (r[0] & 0x02) {
+            r[2] = 120 - ((pemu->now / 100) % 100);
+        }
+        core_intr(pemu, SONAR_COREID);
+    }
+
+    // Motors turn the wheels.  The encoders count both edges so each
+    // edge counts.  Speed is the count over reg7 ms.
+    r = pemu->regs[QUAD_COREID];
+    for (i = 0; is_model(pemu, MOTOR_COREID) && (i < 2); i++) {
+        duty = pemu->regs[MOTOR_COREID][1 + i];
+        if (((pemu->regs[MOTOR_COREID][0] & (1 << i)) == 0) || (duty > 100) ||
+            (pemu->regs[MOTOR_COREID][0] & (0x10 << i))) {
+            continue;
+        }
+        dir = (pemu->regs[MOTOR_COREID][0] & (0x04 << i)) ? -1 : 1;
+        pemu->wheel[i] += duty * EDGES_PER_MS;
+        while (pemu->wheel[i] >= 100) {
+            pemu->wheel[i] -= 100;
+            if (!is_model(pemu, QUAD_COREID) || ((r[0] & (1 << i)) == 0)) {
+                continue;
+            }
+            reg = 1 + (2 * i);
+            count = (r[reg + 1] << 8) | r[reg];
+            count = (count + dir) & 0xffff;
+            r[reg] = count & 0xff;
+            r[reg + 1] = count >> 8;
+            pemu->speed[i] += dir;
+            if (r[0] & 0x04) {
+                core_intr(pemu, QUAD_COREID);
+            }
+        }
+    }
+    if (is_model(pemu, QUAD_COREID) && (r[7] != 0) && (++pemu->quadms >= r[7])) {
+        pemu->quadms = 0;
+        r[5] = pemu->speed[0] & 0xff;
+        r[6] = pemu->speed[1] & 0xff;
+        pemu->speed[0] = 0;
+        pemu->speed[1] = 0;
+    }
+    model_dirty(pemu);
+}
+
+
+/* model_dirty() : Set the dirty bit of each register a core has
+ * changed.  Only the registers a core drives itself are tracked, as
+ * in hba_reg_bank.v.  The bits clear when the host reads the map.
+ */
+static void model_dirty(
+    EMU     *pemu)
+{
+    int      core;
+    int      reg;
+
+    for (core = 1; core < NCORE; core++) {
+        if ((dirtymask[core] == 0) || !is_model(pemu, core)) {
+            continue;
+        }
+        for (reg = 0; reg < 8; reg++) {
+            if ((dirtymask[core] & (1 << reg)) &&
+                (pemu->regs[core][reg] != pemu->seen[core][reg])) {
+                pemu->dirty[core] |= (1 << reg);
+                pemu->seen[core][reg] = pemu->regs[core][reg];
+            }
+        }
+    }
+}
+
+
+/* model_snap() : Copy the registers each core drives itself to
+ * regN+8, all at once, as hba_snapshot does.
+ */
+static void model_snap(
+    EMU     *pemu)
+{
+    int      core;
+    int      reg;
+
+    for (core = 1; core < NCORE; core++) {
+        if ((dirtymask[core] == 0) || !is_model(pemu, core)) {
+            continue;
+        }
+        for (reg = 0; reg < 8; reg++) {
+            if (dirtymask[core] & (1 << reg)) {
+                pemu->regs[core][reg + 8] = pemu->regs[core][reg];
+            }
+        }
+    }
+}
+
+
+/* model_write() : A register of a core was written by the host.
+ * Update the model.
+ */
+static void model_write(
+    EMU     *pemu,
+    int      core,
+    int      reg)
+{
+    uint8_t *r;
+    uint8_t  pins;
+
+    r = pemu->regs[core];
+    if ((core == QUAD_COREID) && (reg == 0) && (r[0] & 0x08)) {
+        // Reset both encoders.  Not auto-cleared.
+        memset(&r[1], 0, 6);
+        pemu->speed[0] = 0;
+        pemu->speed[1] = 0;
+        model_dirty(pemu);
+    }
+    if ((core == GPIO_COREID) && (reg <= 1)) {
+        // Inputs read low.  A change on an enabled pin interrupts.
+        pins = r[1] & r[0] & 0x0f;
+        r[1] = pins;
+        if ((pins ^ pemu->pins) & r[2]) {
+            core_intr(pemu, GPIO_COREID);
+        }
+        pemu->pins = pins;
+    }
+    if ((core == BASICIO_COREID) && (reg == 0) && r[2]) {
+        // An LED change interrupts.  See hba_basicio.v.
+        core_intr(pemu, BASICIO_COREID);
+    }
+}
+
+
+/* rx_byte() : Process one byte from the host.  Replies are paced by
+ * the host the same way the FPGA does it.  Each byte of a read
+ * response is sent on receipt of a dummy byte.
+ */
+static void rx_byte(
+    EMU     *pemu,
+    int      fd,
+    uint8_t  c)
+{
+    int      op;
+    int      slot;      // log slot of a framed packet
+    int      i;
+
+    // The CRC covers the bytes of the packet but not the dummies
+    if ((pemu->state == ST_IDLE) || (pemu->state == ST_EXT_CORE) ||
+        (pemu->state == ST_REG_ADDR) || (pemu->state == ST_EXT_LEN) ||
+        (pemu->state == ST_WRITE) || (pemu->state == ST_FSEQ) ||
+        (pemu->state == ST_FCRC)) {
+        pemu->rxcrc = crc8((pemu->state == ST_IDLE) ? 0 : pemu->rxcrc, c);
+    }
+
+    switch (pemu->state) {
+        case ST_IDLE :
+            pemu->cmd = c;
+            pemu->xerr = 0;
+            pemu->framed = (pemu->rev >= 7) && (pemu->regs[0][SF_REG_LINK] & 2);
+            pemu->txcrc = 0;
+            pemu->nwbuf = 0;
+            if ((c & 0x0f) == EXT_COREID) {
+                pemu->state = (pemu->rev >= 1) ? ST_EXT_CORE : ST_REG_ADDR;
+                pemu->core = c & 0x0f;
+            }
+            else {
+                pemu->core = c & 0x0f;
+                pemu->state = ST_REG_ADDR;
+            }
+            break;
+        case ST_EXT_CORE :
+            pemu->core = c & 0x0f;
+            op = (pemu->cmd >> 4) & 0x07;
+            if (pemu->framed && ((op == EXT_OP_GATHER) || (op == EXT_OP_EXCHANGE) ||
+                ((op == EXT_OP_POSTED) && (pemu->cmd & 0x80)) || (op > EXT_OP_GATHER))) {
+                // not framed or unknown.  Drop everything until a break.
+                bus_error(pemu);
+                tx_byte(pemu, fd, FRAME_ERR);
+                pemu->state = ST_LOST;
+            }
+            else if ((op == EXT_OP_GATHER) && (pemu->cmd & 0x80) && (pemu->rev >= 4)) {
+                // number of descriptors in place of the core
+                pemu->ndesc = c;
+                pemu->state = (c == 0) ? ST_ACK : ST_GATHER_CORE;
+                if (pemu->rev >= 5) {
+                    // echo the command byte on the next dummy
+                    pemu->out[0] = pemu->cmd;
+                    pemu->nout = 1;
+                    pemu->outidx = 0;
+                    pemu->state = ST_READ;
+                }
+            }
+            else if ((op == EXT_OP_BURST) ||
+                ((op == EXT_OP_POSTED) && ((pemu->cmd & 0x80) == 0) &&
+                 (pemu->rev >= 2)) ||
+                ((op == EXT_OP_EXCHANGE) && (pemu->cmd & 0x80) &&
+                 (pemu->rev >= 3))) {
+                pemu->state = ST_REG_ADDR;
+            }
+            else {
+                bus_error(pemu);
+                pemu->state = ST_NACK;
+            }
+            break;
+        case ST_REG_ADDR :
+            pemu->reg = c;
+            if (((pemu->cmd & 0x0f) == EXT_COREID) && (pemu->rev >= 1)) {
+                pemu->state = ST_EXT_LEN;
+                break;
+            }
+            pemu->nxfer = ((pemu->cmd >> 4) & 0x07) + 1;
+            if (pemu->cmd & 0x80) {
+                pemu->out[0] = pemu->cmd;
+                pemu->out[1] = pemu->reg;
+                pemu->outidx = 0;
+                if (pemu->framed) {
+                    pemu->nout = 2 + pemu->nxfer;
+                    frame_start(pemu, ST_READ, 2);
+                    break;
+                }
+                pemu->nout = 2 + bus_read(pemu, pemu->reg, pemu->nxfer, &(pemu->out[2]));
+                pemu->state = ST_READ;
+            }
+            else {
+                pemu->state = ST_WRITE;
+            }
+            break;
+        case ST_EXT_LEN :
+            pemu->nxfer = c;
+            if (((pemu->cmd >> 4) & 0x07) == EXT_OP_EXCHANGE) {
+                // write half of an exchange
+                pemu->state = (c == 0) ? ST_XCHG_RAD : ST_WRITE;
+            }
+            else if (pemu->cmd & 0x80) {
+                pemu->out[0] = pemu->cmd;
+                pemu->out[1] = pemu->core;
+                pemu->out[2] = pemu->reg;
+                pemu->out[3] = c;
+                pemu->outidx = 0;
+                if (pemu->framed) {
+                    pemu->nout = 4 + pemu->nxfer;
+                    frame_start(pemu, ST_READ, 4);
+                    break;
+                }
+                pemu->nout = 4 + bus_read(pemu, pemu->reg, pemu->nxfer, &(pemu->out[4]));
+                pemu->state = ST_READ;
+            }
+            else if (pemu->nxfer == 0) {
+                pemu->state = (((pemu->cmd >> 4) & 0x07) == EXT_OP_POSTED) ? ST_IDLE : ST_ACK;
+                if (pemu->framed) {
+                    frame_start(pemu, pemu->state, -1);
+                }
+            }
+            else {
+                pemu->state = ST_WRITE;
+            }
+            break;
+        case ST_READ :
+            // dummy byte.  Send the next byte of the response
+            tx_byte(pemu, fd, pemu->out[pemu->outidx++]);
+            if (pemu->outidx == pemu->nout) {
+                pemu->state = (pemu->framed) ? ST_RSEQ : ST_IDLE;
+                if (((pemu->cmd & 0x0f) == EXT_COREID) &&
+                    (((pemu->cmd >> 4) & 0x07) == EXT_OP_GATHER)) {
+                    pemu->state = (pemu->ndesc == 0) ? ST_ACK : ST_GATHER_CORE;
+                }
+            }
+            break;
+        case ST_WRITE :
+            if (pemu->framed) {
+                pemu->wbuf[pemu->nwbuf++] = c;
+            }
+            else {
+                (void) bus_write(pemu, pemu->core, pemu->reg, c);
+                pemu->reg++;
+            }
+            pemu->nxfer--;
+            if ((pemu->nxfer == 0) && pemu->framed) {
+                op = (pemu->cmd >> 4) & 0x07;
+                frame_start(pemu, (((pemu->cmd & 0x0f) == EXT_COREID) &&
+                    (op == EXT_OP_POSTED)) ? ST_IDLE : ST_ACK, -1);
+            }
+            else if (pemu->nxfer == 0) {
+                if (((pemu->cmd & 0x0f) == EXT_COREID) &&
+                    (((pemu->cmd >> 4) & 0x07) == EXT_OP_POSTED)) {
+                    pemu->state = ST_IDLE;
+                }
+                else if (((pemu->cmd & 0x0f) == EXT_COREID) &&
+                    (((pemu->cmd >> 4) & 0x07) == EXT_OP_EXCHANGE)) {
+                    pemu->state = ST_XCHG_RAD;
+                }
+                else {
+                    pemu->state = ST_ACK;
+                }
+            }
+            break;
+        case ST_XCHG_RAD :
+            pemu->reg = c;
+            pemu->state = ST_XCHG_LEN;
+            break;
+        case ST_XCHG_LEN :
+            // ACK for the writes then the read data
+            pemu->out[0] = (pemu->xerr) ? NACK_CHAR : ACK_CHAR;
+            pemu->nout = 1 + bus_read(pemu, pemu->reg, c, &(pemu->out[1]));
+            pemu->outidx = 0;
+            pemu->state = ST_READ;
+            break;
+        case ST_GATHER_CORE :
+            pemu->core = c & 0x0f;
+            pemu->ndesc--;
+            pemu->state = ST_GATHER_RAD;
+            break;
+        case ST_GATHER_RAD :
+            pemu->reg = c;
+            pemu->state = ST_GATHER_LEN;
+            break;
+        case ST_GATHER_LEN :
+            pemu->nout = bus_read(pemu, pemu->reg, c, pemu->out);
+            pemu->outidx = 0;
+            if (c != 0) {
+                pemu->state = ST_READ;
+            }
+            else {
+                pemu->state = (pemu->ndesc == 0) ? ST_ACK : ST_GATHER_CORE;
+            }
+            break;
+        case ST_ACK :
+            tx_byte(pemu, fd, (pemu->xerr) ? NACK_CHAR : ACK_CHAR);
+            pemu->state = (pemu->framed) ? ST_RSEQ : ST_IDLE;
+            break;
+        case ST_NACK :
+            // unknown command.  Drop the rest of it until a break.
+            tx_byte(pemu, fd, NACK_CHAR);
+            pemu->state = (pemu->rev >= 6) ? ST_LOST : ST_IDLE;
+            break;
+        case ST_FSEQ :
+            pemu->seq = c;
+            pemu->state = ST_FCRC;
+            break;
+        case ST_FCRC :
+            if (pemu->rxcrc != 0) {
+                // drop everything until a break
+                bus_error(pemu);
+                tx_byte(pemu, fd, FRAME_ERR);
+                pemu->state = ST_LOST;
+                break;
+            }
+            // A packet sent again with bit 7 set in its sequence
+            // number is answered from the log if it ran before
+            slot = pemu->seq % RLOG_SLOTS;
+            if ((pemu->rev >= 12) && (pemu->seq & 0x80) && pemu->logok[slot] &&
+                (pemu->logseq[slot] == (pemu->seq & 0x7f))) {
+                if (pemu->rdoff >= 0) {
+                    memcpy(&(pemu->out[pemu->rdoff]), pemu->logdata[slot], pemu->nxfer);
+                }
+                pemu->xerr = pemu->logerr[slot];
+                pemu->state = pemu->fnext;
+                break;
+            }
+            if (pemu->rdoff >= 0) {
+                (void) bus_read(pemu, pemu->reg, pemu->nxfer, &(pemu->out[pemu->rdoff]));
+            }
+            for (i = 0; i < pemu->nwbuf; i++) {
+                (void) bus_write(pemu, pemu->core, pemu->reg + i, pemu->wbuf[i]);
+            }
+            if (pemu->rev >= 12) {
+                pemu->logseq[slot] = pemu->seq & 0x7f;
+                pemu->logok[slot] = 1;
+                pemu->logerr[slot] = pemu->xerr;
+                if (pemu->rdoff >= 0) {
+                    memcpy(pemu->logdata[slot], &(pemu->out[pemu->rdoff]), pemu->nxfer);
+                }
+            }
+            pemu->state = pemu->fnext;
+            break;
+        case ST_RSEQ :
+            tx_byte(pemu, fd, pemu->seq);
+            pemu->state = ST_RCRC;
+            break;
+        case ST_RCRC :
+            tx_byte(pemu, fd, pemu->txcrc);
+            pemu->state = ST_IDLE;
+            break;
+        case ST_LOST :
+            break;
+        default :
+            pemu->state = ST_IDLE;
+            break;
+    }
+}
+
+
+/* frame_start() : The packet is in.  Get its sequence number and
+ * CRC then go to next.  Read data goes at rdoff in out.
+ */
+static void frame_start(
+    EMU     *pemu,
+    int      next,
+    int      rdoff)
+{
+    pemu->fnext = next;
+    pemu->rdoff = rdoff;
+    pemu->state = ST_FSEQ;
+}
+
+
+/* crc8() : CRC-8 with polynomial 0x07, MSB first */
+static uint8_t crc8(
+    uint8_t  crc,
+    uint8_t  c)
+{
+    int      b;
+
+    crc ^= c;
+    for (b = 0; b < 8; b++) {
+        crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+    }
+    return(crc);
+}
+
+
+/* bus_read() : Read n registers from the current core into buf.
+ * Returns n.  Reads of a missing core return zero.
+ */
+static int bus_read(
+    EMU     *pemu,
+    int      reg,
+    int      n,
+    uint8_t *buf)
+{
+    int      i;
+    int      r;
+
+    for (i = 0; i < n; i++) {
+        r = (reg + i) & 0xff;
+        if ((pemu->coremask & (1 << pemu->core)) == 0) {
+            bus_error(pemu);
+            buf[i] = 0;
+            continue;
+        }
+        buf[i] = pemu->regs[pemu->core][r];
+        if (mapreg[pemu->core] && (r == mapreg[pemu->core]) &&
+            is_model(pemu, pemu->core)) {
+            // Dirty map.  Cleared by the read.
+            buf[i] = pemu->dirty[pemu->core];
+            pemu->dirty[pemu->core] = 0;
+        }
+        if (pemu->core == SERIAL_FPGA_COREID) {
+            if (r == SF_REG_PROTO) {
+                buf[i] = pemu->rev;
+            }
+            if ((r == SF_REG_INTR0) || (r == SF_REG_INTR1) || (r == SF_REG_ERRORS)) {
+                pemu->regs[0][r] = 0;  // autoclear
+            }
+            if (((r > SF_REG_ERRORS) && (r < 8) && (pemu->rev < 2)) ||
+                ((r >= 8) && ((r >= 20) || (pemu->rev < 8))) ||
+                ((r >= 12) && (pemu->rev < 9)) ||
+                ((r >= 16) && (pemu->rev < 10)) ||
+                ((r >= 17) && (pemu->rev < 11))) {
+                bus_error(pemu);
+                buf[i] = 0;
+            }
+        }
+    }
+    return(n);
+}
+
+
+/* bus_write() : Write one register.  Returns 0 or -1 on bus error.
+ * Registers a core drives itself can not be written.
+ */
+static int bus_write(
+    EMU     *pemu,
+    int      core,
+    int      reg,
+    uint8_t  val)
+{
+    int      i;
+    static const uint8_t wrmask[NCORE] = {
+        0xe4,       // serial_fpga: rate, link, and window
+        0x05,       // basicio: leds and interrupt enable
+        0x19,       // qtr: control, period, and threshold
+        0x07,       // motor: mode and power
+        0x01,       // sonar: control
+        0x81,       // quad: control and speed period
+        0x07,       // gpio: direction, pins, and interrupt enable
+    };
+
+    reg &= 0xff;
+    if ((pemu->coremask & (1 << core)) == 0) {
+        bus_error(pemu);
+        return(-1);
+    }
+    if ((core == SERIAL_FPGA_COREID) &&
+        (((reg > SF_REG_ERRORS) && (reg < 8) && (pemu->rev < 5)) ||
+         ((reg >= 8) && ((reg >= 20) || (pemu->rev < 8))) ||
+         ((reg >= 12) && (pemu->rev < 9)) ||
+         ((reg >= 16) && (pemu->rev < 10)) ||
+         ((reg >= 17) && (pemu->rev < 11)))) {
+        bus_error(pemu);
+        return(-1);
+    }
+    if ((core == SERIAL_FPGA_COREID) && (reg >= SF_REG_DIRTY)) {
+        // A write of the map register makes the window in reg6 a
+        // dirty window.
+        pemu->regs[core][reg] = val;
+        if (reg == SF_REG_DIRTY) {
+            pemu->winmap[pemu->regs[0][SF_REG_WINSEL] >> 4] = val;
+        }
+        if (reg == SF_REG_SNAP) {
+            model_snap(pemu);
+        }
+        return(0);
+    }
+    if ((core == SERIAL_FPGA_COREID) && (reg >= SF_REG_COALSEL)) {
+        // Interrupt coalescing.  The write of the last register sets
+        // it and lets go of any interrupts held.
+        pemu->regs[core][reg] = val;
+        if (reg == SF_REG_COALUS1) {
+            i = pemu->regs[0][SF_REG_COALSEL] & 0x0f;
+            pemu->coalcnt[i] = pemu->regs[0][SF_REG_COALSEL + 1];
+            pemu->coalms[i] = ((pemu->regs[0][SF_REG_COALSEL + 2] | (val << 8)) + 999) / 1000;
+            if (pemu->coalevs[i]) {
+                pemu->coalevs[i] = 0;
+                intr_flag(pemu, i);
+            }
+        }
+        return(0);
+    }
+    if ((core == SERIAL_FPGA_COREID) && (reg >= 8)) {
+        // Baudrate switch.  Done once the ACK is out.
+        pemu->regs[core][reg] = val;
+        pemu->baudpend |= (reg == SF_REG_BAUDSW);
+        return(0);
+    }
+    if ((pemu->plainmask & (1 << core)) == 0) {
+        // A model.  Writes outside the register bank are dropped.
+        if ((reg >= 8) || ((wrmask[core] & (1 << reg)) == 0)) {
+            return(0);
+        }
+    }
+    pemu->regs[core][reg] = val;
+    if ((core == SERIAL_FPGA_COREID) && (reg == SF_REG_LINK)) {
+        // A new run of sequence numbers
+        memset(pemu->logok, 0, sizeof(pemu->logok));
+    }
+    if ((core == SERIAL_FPGA_COREID) && (reg == SF_REG_WINREG)) {
+        pemu->winreg[pemu->regs[0][SF_REG_WINSEL] >> 4] = val;
+        pemu->winlen[pemu->regs[0][SF_REG_WINSEL] >> 4] = pemu->regs[0][SF_REG_WINSEL] & 0x0f;
+        pemu->winmap[pemu->regs[0][SF_REG_WINSEL] >> 4] = 0;
+    }
+    if ((pemu->plainmask & (1 << core)) == 0) {
+        model_write(pemu, core, reg);
+    }
+    return(0);
+}
+
+
+/* bus_error() : Count a bus error in reg4 */
+static void bus_error(
+    EMU     *pemu)
+{
+    pemu->xerr = 1;
+    if (pemu->regs[0][SF_REG_ERRORS] != 0xff) {
+        pemu->regs[0][SF_REG_ERRORS]++;
+    }
+}
+
+
+/* tx_byte() : Send a byte to the host */
+static void tx_byte(
+    EMU     *pemu,
+    int      fd,
+    uint8_t  c)
+{
+    pemu->txcrc = crc8(pemu->txcrc, c);
+    if (++pemu->ntx == pemu->tcorrupt) {
+        c ^= 0x10;
+    }
+    if (pemu->verbose) {
+        printf("tx %02x\n", c);
+    }
+    while (write(fd, &c, 1) != 1) {
+        usleep(100);
+    }
+}
+
+// end of fpga_emu.c